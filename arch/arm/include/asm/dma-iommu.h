@@ -8,6 +8,9 @@
 #include <linux/dma-debug.h>
 #include <linux/kmemcheck.h>
 #include <linux/kref.h>
+#include <linux/rbtree.h>
+
+struct dma_iova_cache;
 
 struct dma_iommu_mapping {
 	/* iommu specific data */
@@ -22,6 +25,12 @@ struct dma_iommu_mapping {
 	spinlock_t		lock;
 	struct kref		kref;
 	struct list_head	list;
+
+	/* free ranges of bitmap, indexed by start, see __alloc_iova() */
+	struct rb_root		extents;
+	bool			extents_stale;
+	/* per-CPU magazines of recently freed small ranges */
+	struct dma_iova_cache	*iova_cache;
 };
 
 struct dma_iommu_mapping *
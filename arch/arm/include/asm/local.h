@@ -0,0 +1,83 @@
+/*
+ *  arch/arm/include/asm/local.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __ASM_ARM_LOCAL_H
+#define __ASM_ARM_LOCAL_H
+
+#include <asm-generic/local.h>
+
+#if __LINUX_ARM_ARCH__ >= 6
+
+/*
+ * local_t only needs to be atomic with respect to the CPU that owns
+ * it. The generic version maps the value returning operations onto
+ * atomic_long_*_return() and atomic_long_cmpxchg(), which on ARMv6+
+ * wrap the ldrex/strex loop in a pair of smp_mb(). Those barriers are
+ * the bulk of the cost of a ring buffer reservation, so provide
+ * unordered versions here. Users that need ordering against other
+ * CPUs (the ring buffer reader, perf's user page) already issue their
+ * own barriers.
+ */
+#undef local_add_return
+#undef local_sub_return
+#undef local_inc_return
+#undef local_cmpxchg
+#undef local_sub_and_test
+#undef local_dec_and_test
+#undef local_inc_and_test
+#undef local_add_negative
+
+static inline long local_add_return(long i, local_t *l)
+{
+	unsigned long tmp;
+	long result;
+
+	__asm__ __volatile__("@ local_add_return\n"
+"1:	ldrex	%0, [%3]\n"
+"	add	%0, %0, %4\n"
+"	strex	%1, %0, [%3]\n"
+"	teq	%1, #0\n"
+"	bne	1b"
+	: "=&r" (result), "=&r" (tmp), "+Qo" (l->a.counter)
+	: "r" (&l->a.counter), "Ir" (i)
+	: "cc");
+
+	return result;
+}
+
+static inline long local_sub_return(long i, local_t *l)
+{
+	unsigned long tmp;
+	long result;
+
+	__asm__ __volatile__("@ local_sub_return\n"
+"1:	ldrex	%0, [%3]\n"
+"	sub	%0, %0, %4\n"
+"	strex	%1, %0, [%3]\n"
+"	teq	%1, #0\n"
+"	bne	1b"
+	: "=&r" (result), "=&r" (tmp), "+Qo" (l->a.counter)
+	: "r" (&l->a.counter), "Ir" (i)
+	: "cc");
+
+	return result;
+}
+
+static inline long local_cmpxchg(local_t *l, long old, long new)
+{
+	return cmpxchg_local(&l->a.counter, old, new);
+}
+
+#define local_inc_return(l)		local_add_return(1, l)
+#define local_sub_and_test(i, l)	(local_sub_return(i, l) == 0)
+#define local_dec_and_test(l)		(local_sub_return(1, l) == 0)
+#define local_inc_and_test(l)		(local_add_return(1, l) == 0)
+#define local_add_negative(i, l)	(local_add_return(i, l) < 0)
+
+#endif /* __LINUX_ARM_ARCH__ >= 6 */
+
+#endif /* __ASM_ARM_LOCAL_H */
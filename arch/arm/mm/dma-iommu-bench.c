@@ -0,0 +1,217 @@
+/*
+ * Microbenchmark for the ARM DMA-IOMMU map/unmap path.
+ *
+ * Maps and unmaps scatterlists of typical sizes through the DMA API of an
+ * IOMMU-backed device and reports operations per second, optionally from
+ * several threads at once to exercise the per-CPU IOVA caches.
+ *
+ *   insmod dma-iommu-bench.ko dev=<platform device> [threads=N]
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#define pr_fmt(fmt) "dma-iommu-bench: " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+
+#include <asm/dma-iommu.h>
+
+#define BENCH_MAX_SIZES		8
+#define BENCH_MAX_THREADS	8
+
+static char *dev;
+module_param(dev, charp, S_IRUGO);
+MODULE_PARM_DESC(dev, "name of the IOMMU-backed platform device to use");
+
+static unsigned int iterations = 10000;
+module_param(iterations, uint, S_IRUGO);
+MODULE_PARM_DESC(iterations, "map/unmap pairs per size and thread");
+
+static unsigned int threads = 1;
+module_param(threads, uint, S_IRUGO);
+MODULE_PARM_DESC(threads, "number of concurrent mapping threads");
+
+static unsigned int sizes[BENCH_MAX_SIZES] = { 1, 4, 16, 64, 256 };
+static unsigned int nr_sizes = 5;
+module_param_array(sizes, uint, &nr_sizes, S_IRUGO);
+MODULE_PARM_DESC(sizes, "scatterlist sizes to test, in pages");
+
+struct bench_thread {
+	struct device		*dev;
+	struct sg_table		sgt;
+	unsigned int		nents;
+	u64			ns;
+	int			err;
+	struct completion	done;
+};
+
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *bt = data;
+	struct scatterlist *sgl = bt->sgt.sgl;
+	DEFINE_DMA_ATTRS(attrs);
+	ktime_t start;
+	unsigned int i;
+
+	/* measure the IOVA and IOMMU work, not cache maintenance */
+	dma_set_attr(DMA_ATTR_SKIP_CPU_SYNC, &attrs);
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		if (!dma_map_sg_attrs(bt->dev, sgl, bt->nents,
+				      DMA_BIDIRECTIONAL, &attrs)) {
+			bt->err = -ENOMEM;
+			break;
+		}
+		dma_unmap_sg_attrs(bt->dev, sgl, bt->nents,
+				   DMA_BIDIRECTIONAL, &attrs);
+	}
+	bt->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&bt->done);
+	return 0;
+}
+
+static void bench_free_sgt(struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i)
+		if (sg_page(sg))
+			__free_page(sg_page(sg));
+	sg_free_table(sgt);
+}
+
+static int bench_alloc_sgt(struct sg_table *sgt, unsigned int nents)
+{
+	struct scatterlist *sg;
+	struct page *page;
+	unsigned int i;
+	int err;
+
+	err = sg_alloc_table(sgt, nents, GFP_KERNEL);
+	if (err)
+		return err;
+
+	/* one page per entry so the IOMMU path has to build the mapping */
+	for_each_sg(sgt->sgl, sg, nents, i) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			bench_free_sgt(sgt);
+			return -ENOMEM;
+		}
+		sg_set_page(sg, page, PAGE_SIZE, 0);
+	}
+	return 0;
+}
+
+static int bench_run(struct device *dev, unsigned int nents)
+{
+	struct bench_thread *bt;
+	struct task_struct *task;
+	unsigned int i, started = 0;
+	u64 ops, ns = 0;
+	int err = 0;
+
+	bt = kcalloc(threads, sizeof(*bt), GFP_KERNEL);
+	if (!bt)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		bt[i].dev = dev;
+		bt[i].nents = nents;
+		init_completion(&bt[i].done);
+		err = bench_alloc_sgt(&bt[i].sgt, nents);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < threads; i++) {
+		task = kthread_run(bench_thread_fn, &bt[i], "dma-bench/%u", i);
+		if (IS_ERR(task)) {
+			err = PTR_ERR(task);
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&bt[i].done);
+		if (bt[i].err)
+			err = bt[i].err;
+		ns = max(ns, bt[i].ns);
+	}
+
+	if (!err && ns) {
+		ops = (u64)iterations * threads * NSEC_PER_SEC;
+		do_div(ops, ns);
+		pr_info("%4u pages x %u threads: %llu map+unmap/s\n",
+			nents, threads, ops);
+	}
+out:
+	for (i = 0; i < threads; i++)
+		if (bt[i].sgt.sgl)
+			bench_free_sgt(&bt[i].sgt);
+	kfree(bt);
+	return err;
+}
+
+static int __init dma_iommu_bench_init(void)
+{
+	struct device *d;
+	unsigned int i;
+	int err = 0;
+
+	if (!dev) {
+		pr_err("no device given, use dev=<name>\n");
+		return -EINVAL;
+	}
+
+	d = bus_find_device_by_name(&platform_bus_type, NULL, dev);
+	if (!d) {
+		pr_err("device %s not found\n", dev);
+		return -ENODEV;
+	}
+
+	if (!to_dma_iommu_mapping(d)) {
+		pr_err("%s is not attached to an IOMMU mapping\n", dev);
+		err = -EINVAL;
+		goto out;
+	}
+
+	threads = clamp_t(unsigned int, threads, 1, BENCH_MAX_THREADS);
+	for (i = 0; i < nr_sizes && !err; i++)
+		if (sizes[i])
+			err = bench_run(d, sizes[i]);
+out:
+	put_device(d);
+	return err;
+}
+
+static void __exit dma_iommu_bench_exit(void)
+{
+}
+
+module_init(dma_iommu_bench_init);
+module_exit(dma_iommu_bench_exit);
+
+MODULE_DESCRIPTION("ARM DMA-IOMMU map/unmap microbenchmark");
+MODULE_LICENSE("GPL v2");
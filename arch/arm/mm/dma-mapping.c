@@ -27,6 +27,9 @@
 #include <linux/sizes.h>
 #include <linux/seq_file.h>
 #include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/workqueue.h>
 
 #include <asm/memory.h>
 #include <asm/highmem.h>
@@ -1022,6 +1025,680 @@ int arm_dma_set_mask(struct device *dev, u64 dma_mask)
 static LIST_HEAD(iommu_mapping_list);
 static DEFINE_SPINLOCK(iommu_mapping_list_lock);
 
+/*
+ * IOVA allocation.
+ *
+ * mapping->bitmap stays the authoritative record of which IO addresses
+ * are in use. Two structures sit on top of it so that allocation does
+ * not have to scan the bitmap:
+ *
+ * - mapping->extents is an rbtree of the free runs of the bitmap, keyed
+ *   by start and augmented with the largest run in each subtree, which
+ *   turns the first-fit search into a walk down the tree. Nodes come
+ *   from a small per-mapping pool refilled outside of mapping->lock; if
+ *   the pool runs dry the tree is marked stale, allocations fall back to
+ *   the bitmap and a worker rebuilds it.
+ *
+ * - small ranges, up to IOVA_RCACHE_MAX_COUNT bitmap units including the
+ *   gap pages, are recycled through per-CPU magazines with a per-size
+ *   depot behind them. A cached range keeps its bits set, so it is never
+ *   visible to the tree; the caches are drained back when an allocation
+ *   would otherwise fail and when the mapping is released.
+ */
+#define IOVA_NONE		(~0UL)
+#define IOVA_RCACHE_MAX_COUNT	16
+#define IOVA_MAG_SIZE		15
+#define IOVA_DEPOT_MAX		8
+#define IOVA_EXTENT_POOL_MIN	4
+#define IOVA_EXTENT_POOL_MAX	32
+
+static u32 iova_rcache_enabled = 1;
+
+struct iova_extent {
+	struct rb_node		rb;
+	struct list_head	pool;
+	unsigned long		start;
+	unsigned long		size;
+	unsigned long		subtree_max;
+};
+
+struct iova_magazine {
+	unsigned long		size;
+	unsigned long		starts[IOVA_MAG_SIZE];
+};
+
+struct iova_cpu_rcache {
+	spinlock_t		lock;
+	struct iova_magazine	*loaded;
+	struct iova_magazine	*prev;
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+struct iova_cpu_rcaches {
+	struct iova_cpu_rcache	cls[IOVA_RCACHE_MAX_COUNT];
+};
+
+struct iova_depot {
+	spinlock_t		lock;
+	unsigned int		size;
+	struct iova_magazine	*mags[IOVA_DEPOT_MAX];
+};
+
+struct dma_iova_cache {
+	struct dma_iommu_mapping	*mapping;
+	struct iova_cpu_rcaches __percpu *cpu;
+	struct iova_depot		depot[IOVA_RCACHE_MAX_COUNT];
+	struct work_struct		rebuild_work;
+
+	/* protected by mapping->lock */
+	struct list_head		pool;
+	unsigned int			pool_cnt;
+	unsigned long			tree_allocs;
+	unsigned long			bitmap_allocs;
+	unsigned long			rebuilds;
+	atomic_t			flushes;
+};
+
+static inline unsigned long iova_extent_compute_max(struct iova_extent *e)
+{
+	unsigned long max = e->size, sub;
+
+	if (e->rb.rb_left) {
+		sub = rb_entry(e->rb.rb_left, struct iova_extent,
+			       rb)->subtree_max;
+		if (sub > max)
+			max = sub;
+	}
+	if (e->rb.rb_right) {
+		sub = rb_entry(e->rb.rb_right, struct iova_extent,
+			       rb)->subtree_max;
+		if (sub > max)
+			max = sub;
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, iova_extent_cb, struct iova_extent, rb,
+		     unsigned long, subtree_max, iova_extent_compute_max)
+
+static struct iova_extent *iova_extent_get(struct dma_iova_cache *c)
+{
+	struct iova_extent *e;
+
+	if (list_empty(&c->pool))
+		return NULL;
+
+	e = list_first_entry(&c->pool, struct iova_extent, pool);
+	list_del(&e->pool);
+	c->pool_cnt--;
+	return e;
+}
+
+static void iova_extent_put(struct dma_iova_cache *c, struct iova_extent *e)
+{
+	if (c->pool_cnt >= IOVA_EXTENT_POOL_MAX) {
+		kfree(e);
+		return;
+	}
+	list_add(&e->pool, &c->pool);
+	c->pool_cnt++;
+}
+
+/* Top up the node pool; called without mapping->lock held. */
+static void iova_extent_refill(struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_extent *e;
+	unsigned long flags;
+
+	while (ACCESS_ONCE(c->pool_cnt) < IOVA_EXTENT_POOL_MIN) {
+		e = kmalloc(sizeof(*e), GFP_ATOMIC | __GFP_NOWARN);
+		if (!e)
+			return;
+
+		spin_lock_irqsave(&mapping->lock, flags);
+		iova_extent_put(c, e);
+		spin_unlock_irqrestore(&mapping->lock, flags);
+	}
+}
+
+static void iova_extent_insert(struct rb_root *root, struct iova_extent *e)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct iova_extent *p;
+
+	e->subtree_max = e->size;
+	while (*link) {
+		parent = *link;
+		p = rb_entry(parent, struct iova_extent, rb);
+		if (p->subtree_max < e->size)
+			p->subtree_max = e->size;
+		if (e->start < p->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&e->rb, parent, link);
+	rb_insert_augmented(&e->rb, root, &iova_extent_cb);
+}
+
+/* Last extent starting at or below @pos, and the first one above it. */
+static void iova_extent_neighbours(struct rb_root *root, unsigned long pos,
+				   struct iova_extent **prev,
+				   struct iova_extent **next)
+{
+	struct rb_node *node = root->rb_node;
+	struct iova_extent *e;
+
+	*prev = *next = NULL;
+	while (node) {
+		e = rb_entry(node, struct iova_extent, rb);
+		if (e->start <= pos) {
+			*prev = e;
+			node = node->rb_right;
+		} else {
+			*next = e;
+			node = node->rb_left;
+		}
+	}
+}
+
+/*
+ * Lowest extent holding @count units at an offset aligned to @align + 1,
+ * which is what bitmap_find_next_zero_area() would have returned.
+ */
+static struct iova_extent *iova_extent_search(struct rb_node *node,
+					      unsigned long count,
+					      unsigned long align,
+					      unsigned long *pos)
+{
+	struct iova_extent *e, *found;
+	unsigned long start;
+
+	if (!node)
+		return NULL;
+
+	e = rb_entry(node, struct iova_extent, rb);
+	if (e->subtree_max < count)
+		return NULL;
+
+	found = iova_extent_search(node->rb_left, count, align, pos);
+	if (found)
+		return found;
+
+	start = (e->start + align) & ~align;
+	if (e->size >= count && start + count <= e->start + e->size) {
+		*pos = start;
+		return e;
+	}
+
+	return iova_extent_search(node->rb_right, count, align, pos);
+}
+
+/* Take [@pos, @pos + @count) out of @e. */
+static int iova_extent_carve(struct dma_iommu_mapping *mapping,
+			     struct iova_extent *e, unsigned long pos,
+			     unsigned long count)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	unsigned long end = e->start + e->size;
+	struct iova_extent *tail;
+
+	if (pos == e->start && count == e->size) {
+		rb_erase_augmented(&e->rb, &mapping->extents, &iova_extent_cb);
+		iova_extent_put(c, e);
+	} else if (pos == e->start) {
+		e->start += count;
+		e->size -= count;
+		iova_extent_cb_propagate(&e->rb, NULL);
+	} else if (pos + count == end) {
+		e->size -= count;
+		iova_extent_cb_propagate(&e->rb, NULL);
+	} else {
+		tail = iova_extent_get(c);
+		if (!tail)
+			return -ENOMEM;
+		e->size = pos - e->start;
+		iova_extent_cb_propagate(&e->rb, NULL);
+		tail->start = pos + count;
+		tail->size = end - tail->start;
+		iova_extent_insert(&mapping->extents, tail);
+	}
+	return 0;
+}
+
+/* Give [@pos, @pos + @count) back, merging with adjacent extents. */
+static int iova_extent_release(struct dma_iommu_mapping *mapping,
+			       unsigned long pos, unsigned long count)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_extent *prev, *next, *e;
+
+	iova_extent_neighbours(&mapping->extents, pos, &prev, &next);
+	if (prev && prev->start + prev->size != pos)
+		prev = NULL;
+	if (next && pos + count != next->start)
+		next = NULL;
+
+	if (prev && next) {
+		/* propagate first, erase rotations copy prev's value */
+		prev->size += count + next->size;
+		iova_extent_cb_propagate(&prev->rb, NULL);
+		rb_erase_augmented(&next->rb, &mapping->extents,
+				   &iova_extent_cb);
+		iova_extent_put(c, next);
+	} else if (prev) {
+		prev->size += count;
+		iova_extent_cb_propagate(&prev->rb, NULL);
+	} else if (next) {
+		next->start = pos;
+		next->size += count;
+		iova_extent_cb_propagate(&next->rb, NULL);
+	} else {
+		e = iova_extent_get(c);
+		if (!e)
+			return -ENOMEM;
+		e->start = pos;
+		e->size = count;
+		iova_extent_insert(&mapping->extents, e);
+	}
+	return 0;
+}
+
+static void iova_extents_invalidate(struct dma_iommu_mapping *mapping)
+{
+	mapping->extents_stale = true;
+	schedule_work(&mapping->iova_cache->rebuild_work);
+}
+
+static unsigned long iova_count_free_runs(struct dma_iommu_mapping *mapping)
+{
+	unsigned long pos = 0, end, runs = 0;
+
+	while (1) {
+		pos = find_next_zero_bit(mapping->bitmap, mapping->bits, pos);
+		if (pos >= mapping->bits)
+			break;
+		end = find_next_bit(mapping->bitmap, mapping->bits, pos);
+		runs++;
+		pos = end;
+	}
+	return runs;
+}
+
+static void iova_extents_rebuild_locked(struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct rb_node *node;
+	struct iova_extent *e;
+	unsigned long pos = 0, end;
+
+	while ((node = rb_first(&mapping->extents))) {
+		rb_erase(node, &mapping->extents);
+		e = rb_entry(node, struct iova_extent, rb);
+		list_add(&e->pool, &c->pool);
+		c->pool_cnt++;
+	}
+
+	while (1) {
+		pos = find_next_zero_bit(mapping->bitmap, mapping->bits, pos);
+		if (pos >= mapping->bits)
+			break;
+		end = find_next_bit(mapping->bitmap, mapping->bits, pos);
+		e = iova_extent_get(c);
+		e->start = pos;
+		e->size = end - pos;
+		iova_extent_insert(&mapping->extents, e);
+		pos = end;
+	}
+}
+
+static void iova_extents_rebuild(struct work_struct *work)
+{
+	struct dma_iova_cache *c =
+		container_of(work, struct dma_iova_cache, rebuild_work);
+	struct dma_iommu_mapping *mapping = c->mapping;
+	unsigned int nr, added = 0;
+	struct iova_extent *e, *tmp;
+	unsigned long flags, need;
+	struct rb_node *node;
+	LIST_HEAD(nodes);
+
+	while (1) {
+		spin_lock_irqsave(&mapping->lock, flags);
+		list_splice_init(&nodes, &c->pool);
+		c->pool_cnt += added;
+		added = 0;
+		if (!mapping->extents_stale)
+			break;
+
+		/* nodes currently in the tree are recycled by the rebuild */
+		need = iova_count_free_runs(mapping) + IOVA_EXTENT_POOL_MIN;
+		nr = c->pool_cnt;
+		for (node = rb_first(&mapping->extents); node && nr < need;
+		     node = rb_next(node))
+			nr++;
+
+		if (nr >= need) {
+			iova_extents_rebuild_locked(mapping);
+			mapping->extents_stale = false;
+			c->rebuilds++;
+			break;
+		}
+		spin_unlock_irqrestore(&mapping->lock, flags);
+
+		for (; nr < need; nr++, added++) {
+			e = kmalloc(sizeof(*e), GFP_KERNEL);
+			if (!e)
+				goto out;
+			list_add(&e->pool, &nodes);
+		}
+	}
+
+	/* trim the pool back, the rebuild may have left it oversized */
+	while (c->pool_cnt > IOVA_EXTENT_POOL_MAX) {
+		e = iova_extent_get(c);
+		list_add(&e->pool, &nodes);
+	}
+	spin_unlock_irqrestore(&mapping->lock, flags);
+out:
+	list_for_each_entry_safe(e, tmp, &nodes, pool)
+		kfree(e);
+}
+
+/* Claim @count units at a free offset aligned to @align + 1. */
+static unsigned long iova_range_alloc_locked(struct dma_iommu_mapping *mapping,
+					     unsigned long count,
+					     unsigned long align)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	unsigned long start;
+	struct iova_extent *e;
+
+	if (!mapping->extents_stale) {
+		e = iova_extent_search(mapping->extents.rb_node, count, align,
+				       &start);
+		if (!e)
+			return IOVA_NONE;
+		if (iova_extent_carve(mapping, e, start, count))
+			iova_extents_invalidate(mapping);
+		c->tree_allocs++;
+	} else {
+		start = bitmap_find_next_zero_area(mapping->bitmap,
+						   mapping->bits, 0, count,
+						   align);
+		if (start > mapping->bits)
+			return IOVA_NONE;
+		schedule_work(&c->rebuild_work);
+		c->bitmap_allocs++;
+	}
+
+	bitmap_set(mapping->bitmap, start, count);
+	return start;
+}
+
+/* Claim exactly [@start, @start + @count), if it is free. */
+static int iova_range_reserve_locked(struct dma_iommu_mapping *mapping,
+				     unsigned long start, unsigned long count)
+{
+	struct iova_extent *e, *next;
+	unsigned long pos;
+
+	if (!mapping->extents_stale) {
+		iova_extent_neighbours(&mapping->extents, start, &e, &next);
+		if (!e || start + count > e->start + e->size)
+			return -EINVAL;
+		if (iova_extent_carve(mapping, e, start, count))
+			iova_extents_invalidate(mapping);
+	} else {
+		pos = bitmap_find_next_zero_area(mapping->bitmap,
+						 mapping->bits, start, count,
+						 0);
+		if (pos > mapping->bits || pos != start)
+			return -EINVAL;
+	}
+
+	bitmap_set(mapping->bitmap, start, count);
+	return 0;
+}
+
+static void iova_range_free_locked(struct dma_iommu_mapping *mapping,
+				   unsigned long start, unsigned long count)
+{
+	bitmap_clear(mapping->bitmap, start, count);
+	if (!mapping->extents_stale &&
+	    iova_extent_release(mapping, start, count))
+		iova_extents_invalidate(mapping);
+}
+
+static inline bool iova_magazine_full(struct iova_magazine *mag)
+{
+	return !mag || mag->size == IOVA_MAG_SIZE;
+}
+
+static inline bool iova_magazine_empty(struct iova_magazine *mag)
+{
+	return !mag || !mag->size;
+}
+
+static void iova_magazine_free(struct dma_iommu_mapping *mapping,
+			       struct iova_magazine *mag, unsigned long count)
+{
+	unsigned long flags;
+
+	if (!mag)
+		return;
+
+	spin_lock_irqsave(&mapping->lock, flags);
+	while (mag->size)
+		iova_range_free_locked(mapping, mag->starts[--mag->size],
+				       count);
+	spin_unlock_irqrestore(&mapping->lock, flags);
+	kfree(mag);
+}
+
+/* Stash a freed range in this CPU's magazine for @count units. */
+static bool iova_rcache_insert(struct dma_iommu_mapping *mapping,
+			       unsigned long start, unsigned long count)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_magazine *spill = NULL, *mag;
+	struct iova_cpu_rcache *rc;
+	struct iova_depot *d;
+	unsigned long flags;
+	bool cached = true;
+
+	if (!iova_rcache_enabled || !count || count > IOVA_RCACHE_MAX_COUNT)
+		return false;
+
+	rc = &get_cpu_ptr(c->cpu)->cls[count - 1];
+	spin_lock_irqsave(&rc->lock, flags);
+
+	if (!iova_magazine_full(rc->loaded))
+		goto push;
+
+	if (!iova_magazine_full(rc->prev)) {
+		swap(rc->loaded, rc->prev);
+		goto push;
+	}
+
+	mag = kzalloc(sizeof(*mag), GFP_ATOMIC | __GFP_NOWARN);
+	if (!mag) {
+		cached = false;
+		goto out;
+	}
+
+	if (!rc->prev) {
+		rc->prev = rc->loaded;
+	} else if (rc->loaded) {
+		d = &c->depot[count - 1];
+		spin_lock(&d->lock);
+		if (d->size < IOVA_DEPOT_MAX)
+			d->mags[d->size++] = rc->loaded;
+		else
+			spill = rc->loaded;
+		spin_unlock(&d->lock);
+	}
+	rc->loaded = mag;
+push:
+	rc->loaded->starts[rc->loaded->size++] = start;
+out:
+	spin_unlock_irqrestore(&rc->lock, flags);
+	put_cpu_ptr(c->cpu);
+
+	iova_magazine_free(mapping, spill, count);
+	return cached;
+}
+
+/* Pop a cached range of @count units whose start satisfies @align. */
+static unsigned long iova_rcache_get(struct dma_iommu_mapping *mapping,
+				     unsigned long count, unsigned long align)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_magazine *empty = NULL, *mag;
+	unsigned long start = IOVA_NONE;
+	struct iova_cpu_rcache *rc;
+	struct iova_depot *d;
+	unsigned long flags;
+
+	if (!iova_rcache_enabled || !count || count > IOVA_RCACHE_MAX_COUNT)
+		return IOVA_NONE;
+
+	rc = &get_cpu_ptr(c->cpu)->cls[count - 1];
+	spin_lock_irqsave(&rc->lock, flags);
+
+	if (iova_magazine_empty(rc->loaded)) {
+		if (!iova_magazine_empty(rc->prev)) {
+			swap(rc->loaded, rc->prev);
+		} else {
+			d = &c->depot[count - 1];
+			mag = NULL;
+			spin_lock(&d->lock);
+			if (d->size)
+				mag = d->mags[--d->size];
+			spin_unlock(&d->lock);
+			if (mag) {
+				empty = rc->loaded;
+				rc->loaded = mag;
+			}
+		}
+	}
+
+	mag = rc->loaded;
+	if (!iova_magazine_empty(mag) &&
+	    !(mag->starts[mag->size - 1] & align)) {
+		start = mag->starts[--mag->size];
+		rc->hits++;
+	} else {
+		rc->misses++;
+	}
+
+	spin_unlock_irqrestore(&rc->lock, flags);
+	put_cpu_ptr(c->cpu);
+
+	kfree(empty);
+	return start;
+}
+
+/* Return every cached range to the bitmap and the extent tree. */
+static void iova_rcache_flush(struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_magazine *mags[IOVA_DEPOT_MAX];
+	struct iova_magazine *loaded, *prev;
+	struct iova_cpu_rcache *rc;
+	struct iova_depot *d;
+	unsigned long flags;
+	unsigned int i, n;
+	int cpu;
+
+	atomic_inc(&c->flushes);
+	for (i = 0; i < IOVA_RCACHE_MAX_COUNT; i++) {
+		for_each_possible_cpu(cpu) {
+			rc = &per_cpu_ptr(c->cpu, cpu)->cls[i];
+			spin_lock_irqsave(&rc->lock, flags);
+			loaded = rc->loaded;
+			prev = rc->prev;
+			rc->loaded = rc->prev = NULL;
+			spin_unlock_irqrestore(&rc->lock, flags);
+
+			iova_magazine_free(mapping, loaded, i + 1);
+			iova_magazine_free(mapping, prev, i + 1);
+		}
+
+		d = &c->depot[i];
+		spin_lock_irqsave(&d->lock, flags);
+		n = d->size;
+		memcpy(mags, d->mags, n * sizeof(mags[0]));
+		d->size = 0;
+		spin_unlock_irqrestore(&d->lock, flags);
+
+		while (n)
+			iova_magazine_free(mapping, mags[--n], i + 1);
+	}
+}
+
+static int iova_cache_init(struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c;
+	struct iova_extent *e;
+	unsigned int i;
+	int cpu;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	c->cpu = alloc_percpu(struct iova_cpu_rcaches);
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+	if (!c->cpu || !e) {
+		kfree(e);
+		free_percpu(c->cpu);
+		kfree(c);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < IOVA_RCACHE_MAX_COUNT; i++)
+			spin_lock_init(&per_cpu_ptr(c->cpu, cpu)->cls[i].lock);
+	for (i = 0; i < IOVA_RCACHE_MAX_COUNT; i++)
+		spin_lock_init(&c->depot[i].lock);
+
+	c->mapping = mapping;
+	INIT_LIST_HEAD(&c->pool);
+	INIT_WORK(&c->rebuild_work, iova_extents_rebuild);
+	atomic_set(&c->flushes, 0);
+	mapping->iova_cache = c;
+
+	mapping->extents = RB_ROOT;
+	e->start = 0;
+	e->size = mapping->bits;
+	iova_extent_insert(&mapping->extents, e);
+	return 0;
+}
+
+static void iova_cache_destroy(struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_extent *e, *tmp;
+	struct rb_node *node;
+
+	iova_rcache_flush(mapping);
+	cancel_work_sync(&c->rebuild_work);
+
+	while ((node = rb_first(&mapping->extents))) {
+		rb_erase(node, &mapping->extents);
+		kfree(rb_entry(node, struct iova_extent, rb));
+	}
+	list_for_each_entry_safe(e, tmp, &c->pool, pool)
+		kfree(e);
+
+	free_percpu(c->cpu);
+	kfree(c);
+	mapping->iova_cache = NULL;
+}
+
 #if defined(CONFIG_DEBUG_FS)
 static dma_addr_t bit_to_addr(size_t pos, dma_addr_t base, size_t order)
 {
@@ -1056,6 +1733,33 @@ static void seq_print_mapping(struct seq_file *s,
 			    mapping->order);
 }
 
+static void seq_print_iova_stats(struct seq_file *s,
+				 struct dma_iommu_mapping *mapping)
+{
+	struct dma_iova_cache *c = mapping->iova_cache;
+	struct iova_cpu_rcache *rc;
+	unsigned long hits, misses;
+	unsigned int i;
+	int cpu;
+
+	seq_printf(s, "  tree: %s allocs=%lu bitmap_allocs=%lu rebuilds=%lu "
+		   "flushes=%d\n", mapping->extents_stale ? "stale" : "valid",
+		   c->tree_allocs, c->bitmap_allocs, c->rebuilds,
+		   atomic_read(&c->flushes));
+
+	for (i = 0; i < IOVA_RCACHE_MAX_COUNT; i++) {
+		hits = misses = 0;
+		for_each_possible_cpu(cpu) {
+			rc = &per_cpu_ptr(c->cpu, cpu)->cls[i];
+			hits += rc->hits;
+			misses += rc->misses;
+		}
+		if (hits || misses)
+			seq_printf(s, "  rcache[%u]: hits=%lu misses=%lu depot=%u\n",
+				   i + 1, hits, misses, c->depot[i].size);
+	}
+}
+
 static void debug_dma_seq_print_mappings(struct seq_file *s)
 {
 	struct dma_iommu_mapping *mapping;
@@ -1068,6 +1772,34 @@ static void debug_dma_seq_print_mappings(struct seq_file *s)
 	}
 }
 
+static int dump_iova_stats(struct seq_file *s, void *data)
+{
+	struct dma_iommu_mapping *mapping;
+	unsigned long flags;
+	int i = 0;
+
+	spin_lock_irqsave(&iommu_mapping_list_lock, flags);
+	list_for_each_entry(mapping, &iommu_mapping_list, list) {
+		seq_printf(s, "Map %d (%p):\n", i, mapping);
+		seq_print_iova_stats(s, mapping);
+		i++;
+	}
+	spin_unlock_irqrestore(&iommu_mapping_list_lock, flags);
+	return 0;
+}
+
+static int dump_iova_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dump_iova_stats, NULL);
+}
+
+static const struct file_operations dump_iova_stats_fops = {
+	.open           = dump_iova_stats_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
 static int dump_iommu_mappings(struct seq_file *s, void *data)
 {
 	debug_dma_seq_print_mappings(s);
@@ -1092,6 +1824,10 @@ void dma_debugfs_platform_info(struct dentry *dent)
 {
 	debugfs_create_file("dump_mappings", S_IRUGO, dent, NULL,
 			    &dump_iommu_mappings_fops);
+	debugfs_create_file("iova_stats", S_IRUGO, dent, NULL,
+			    &dump_iova_stats_fops);
+	debugfs_create_bool("iova_rcache", S_IRUGO | S_IWUSR, dent,
+			    &iova_rcache_enabled);
 }
 
 #else /* !CONFIG_ARM_DMA_USE_IOMMU */
@@ -1262,11 +1998,21 @@ static size_t arm_iommu_iova_get_free_total(struct device *dev)
 	unsigned long flags;
 	size_t size = 0;
 	unsigned long start = 0;
+	struct rb_node *node;
 
 	BUG_ON(!dev);
 	BUG_ON(!mapping);
 
+	iova_rcache_flush(mapping);
+
 	spin_lock_irqsave(&mapping->lock, flags);
+	if (!mapping->extents_stale) {
+		for (node = rb_first(&mapping->extents); node;
+		     node = rb_next(node))
+			size += rb_entry(node, struct iova_extent, rb)->size;
+		goto out;
+	}
+
 	while (1) {
 		unsigned long end;
 
@@ -1279,6 +2025,7 @@ static size_t arm_iommu_iova_get_free_total(struct device *dev)
 		size += end - start;
 		start = end;
 	}
+out:
 	spin_unlock_irqrestore(&mapping->lock, flags);
 	return size << (mapping->order + PAGE_SHIFT);
 }
@@ -1290,7 +2037,17 @@ static size_t arm_iommu_iova_get_free_max(struct device *dev)
 	size_t max_free = 0;
 	unsigned long start = 0;
 
+	iova_rcache_flush(mapping);
+
 	spin_lock_irqsave(&mapping->lock, flags);
+	if (!mapping->extents_stale) {
+		if (mapping->extents.rb_node)
+			max_free = rb_entry(mapping->extents.rb_node,
+					    struct iova_extent,
+					    rb)->subtree_max;
+		goto out;
+	}
+
 	while (1) {
 		unsigned long end;
 
@@ -1303,6 +2060,7 @@ static size_t arm_iommu_iova_get_free_max(struct device *dev)
 		max_free = max_t(size_t, max_free, end - start);
 		start = end;
 	}
+out:
 	spin_unlock_irqrestore(&mapping->lock, flags);
 	return max_free << (mapping->order + PAGE_SHIFT);
 }
@@ -1312,8 +2070,9 @@ static inline dma_addr_t __alloc_iova(struct dma_iommu_mapping *mapping,
 {
 	unsigned int order = get_order(size);
 	unsigned int align = 0;
-	unsigned int count, start;
+	unsigned long count, start;
 	unsigned long flags;
+	bool flushed = false;
 
 	if (order > CONFIG_ARM_DMA_IOMMU_ALIGNMENT)
 		order = CONFIG_ARM_DMA_IOMMU_ALIGNMENT;
@@ -1327,17 +2086,24 @@ static inline dma_addr_t __alloc_iova(struct dma_iommu_mapping *mapping,
 	if (order > mapping->order)
 		align = (1 << (order - mapping->order)) - 1;
 
-	spin_lock_irqsave(&mapping->lock, flags);
-	start = bitmap_find_next_zero_area(mapping->bitmap, mapping->bits, 0,
-					   count, align);
-	if (start > mapping->bits) {
-		spin_unlock_irqrestore(&mapping->lock, flags);
-		return DMA_ERROR_CODE;
-	}
+	start = iova_rcache_get(mapping, count, align);
+	if (start != IOVA_NONE)
+		goto out;
 
-	bitmap_set(mapping->bitmap, start, count);
+	iova_extent_refill(mapping);
+retry:
+	spin_lock_irqsave(&mapping->lock, flags);
+	start = iova_range_alloc_locked(mapping, count, align);
 	spin_unlock_irqrestore(&mapping->lock, flags);
 
+	if (start == IOVA_NONE) {
+		if (flushed)
+			return DMA_ERROR_CODE;
+		iova_rcache_flush(mapping);
+		flushed = true;
+		goto retry;
+	}
+out:
 	return mapping->base + (start << (mapping->order + PAGE_SHIFT));
 }
 
@@ -1345,8 +2111,9 @@ static dma_addr_t __alloc_iova_at(struct dma_iommu_mapping *mapping,
 				  dma_addr_t *iova, size_t size,
 				  struct dma_attrs *attrs)
 {
-	unsigned int count, start, orig;
+	unsigned int count, start;
 	unsigned long flags;
+	bool flushed = false;
 	size_t bytes;
 
 	count = ((PAGE_ALIGN(size) >> PAGE_SHIFT) +
@@ -1357,30 +2124,30 @@ static dma_addr_t __alloc_iova_at(struct dma_iommu_mapping *mapping,
 
 	bytes = count << (mapping->order + PAGE_SHIFT);
 
-	spin_lock_irqsave(&mapping->lock, flags);
-
 	if ((*iova < mapping->base) || (bytes > mapping->end - *iova)) {
 		*iova = -ENXIO;
-		goto err_out;
+		return DMA_ERROR_CODE;
 	}
 
-	orig = (*iova - mapping->base) >> (mapping->order + PAGE_SHIFT);
-	start = bitmap_find_next_zero_area(mapping->bitmap, mapping->bits,
-					   orig, count, 0);
+	start = (*iova - mapping->base) >> (mapping->order + PAGE_SHIFT);
 
-	if ((start > mapping->bits) || (orig != start)) {
+	iova_extent_refill(mapping);
+retry:
+	spin_lock_irqsave(&mapping->lock, flags);
+	if (iova_range_reserve_locked(mapping, start, count)) {
+		spin_unlock_irqrestore(&mapping->lock, flags);
+		/* the range may only be held by a cached free */
+		if (!flushed) {
+			iova_rcache_flush(mapping);
+			flushed = true;
+			goto retry;
+		}
 		*iova = -EINVAL;
-		goto err_out;
+		return DMA_ERROR_CODE;
 	}
-
-	bitmap_set(mapping->bitmap, start, count);
 	spin_unlock_irqrestore(&mapping->lock, flags);
 
 	return mapping->base + (start << (mapping->order + PAGE_SHIFT));
-
-err_out:
-	spin_unlock_irqrestore(&mapping->lock, flags);
-	return DMA_ERROR_CODE;
 }
 
 static dma_addr_t arm_iommu_iova_alloc_at(struct device *dev, dma_addr_t *iova,
@@ -1399,9 +2166,8 @@ static dma_addr_t arm_iommu_iova_alloc(struct device *dev, size_t size,
 	return __alloc_iova(mapping, size, attrs);
 }
 
-static inline void __free_iova(struct dma_iommu_mapping *mapping,
-			       dma_addr_t addr, size_t size,
-			       struct dma_attrs *attrs)
+static inline void __free_iova_gap(struct dma_iommu_mapping *mapping,
+				   dma_addr_t addr, size_t size, bool gap)
 {
 	unsigned int start = (addr - mapping->base) >>
 			     (mapping->order + PAGE_SHIFT);
@@ -1409,14 +2175,59 @@ static inline void __free_iova(struct dma_iommu_mapping *mapping,
 			      (1 << mapping->order) - 1) >> mapping->order;
 	unsigned long flags;
 
-	if (!dma_get_attr(DMA_ATTR_SKIP_IOVA_GAP, attrs))
+	if (gap)
 		count += PG_PAGES;
 
+	if (iova_rcache_insert(mapping, start, count))
+		return;
+
+	iova_extent_refill(mapping);
 	spin_lock_irqsave(&mapping->lock, flags);
-	bitmap_clear(mapping->bitmap, start, count);
+	iova_range_free_locked(mapping, start, count);
 	spin_unlock_irqrestore(&mapping->lock, flags);
 }
 
+static inline void __free_iova(struct dma_iommu_mapping *mapping,
+			       dma_addr_t addr, size_t size,
+			       struct dma_attrs *attrs)
+{
+	__free_iova_gap(mapping, addr, size,
+			!dma_get_attr(DMA_ATTR_SKIP_IOVA_GAP, attrs));
+}
+
+static void __release_iova(void *data, unsigned long iova, size_t size)
+{
+	__free_iova_gap(data, iova, size, false);
+}
+
+static void __release_iova_gap(void *data, unsigned long iova, size_t size)
+{
+	__free_iova_gap(data, iova, size - PF_PAGES_SIZE, true);
+}
+
+/*
+ * pg_iommu_unmap_free - unmap a buffer and free its IOVA. The IOMMU driver
+ * may defer the TLB invalidation; the IOVA then stays allocated until it
+ * is done, so that it cannot be handed out while stale entries remain.
+ */
+static void pg_iommu_unmap_free(struct dma_iommu_mapping *mapping,
+				dma_addr_t iova, size_t len,
+				struct dma_attrs *attrs)
+{
+	phys_addr_t phys_addr;
+
+	if (dma_get_attr(DMA_ATTR_SKIP_IOVA_GAP, attrs)) {
+		iommu_unmap_deferred(mapping->domain, iova, len,
+				     __release_iova, mapping);
+		return;
+	}
+
+	phys_addr = iommu_iova_to_phys(mapping->domain, iova + len);
+	BUG_ON(phys_addr != iova_gap_phys);
+	iommu_unmap_deferred(mapping->domain, iova, len + PF_PAGES_SIZE,
+			     __release_iova_gap, mapping);
+}
+
 static void arm_iommu_iova_free(struct device *dev, dma_addr_t addr,
 				size_t size, struct dma_attrs *attrs)
 {
@@ -1619,8 +2430,7 @@ static int __iommu_remove_mapping(struct device *dev, dma_addr_t iova,
 	size = PAGE_ALIGN((iova & ~PAGE_MASK) + size);
 	iova &= PAGE_MASK;
 
-	pg_iommu_unmap(mapping->domain, iova, size, (int)attrs);
-	__free_iova(mapping, iova, size, attrs);
+	pg_iommu_unmap_free(mapping, iova, size, attrs);
 	return 0;
 }
 
@@ -2143,9 +2953,10 @@ static void arm_coherent_iommu_unmap_page(struct device *dev, dma_addr_t handle,
 
 	trace_dmadebug_unmap_page(dev, handle, size,
 		  phys_to_page(iommu_iova_to_phys(mapping->domain, handle)));
-	pg_iommu_unmap(mapping->domain, iova, len, (int)attrs);
-	if (!dma_get_attr(DMA_ATTR_SKIP_FREE_IOVA, attrs))
-		__free_iova(mapping, iova, len, attrs);
+	if (dma_get_attr(DMA_ATTR_SKIP_FREE_IOVA, attrs))
+		pg_iommu_unmap(mapping->domain, iova, len, (int)attrs);
+	else
+		pg_iommu_unmap_free(mapping, iova, len, attrs);
 }
 
 /**
@@ -2175,9 +2986,10 @@ static void arm_iommu_unmap_page(struct device *dev, dma_addr_t handle,
 
 	trace_dmadebug_unmap_page(dev, handle, size,
 		  phys_to_page(iommu_iova_to_phys(mapping->domain, handle)));
-	pg_iommu_unmap(mapping->domain, iova, len, (int)attrs);
-	if (!dma_get_attr(DMA_ATTR_SKIP_FREE_IOVA, attrs))
-		__free_iova(mapping, iova, len, attrs);
+	if (dma_get_attr(DMA_ATTR_SKIP_FREE_IOVA, attrs))
+		pg_iommu_unmap(mapping->domain, iova, len, (int)attrs);
+	else
+		pg_iommu_unmap_free(mapping, iova, len, attrs);
 }
 
 static void arm_iommu_sync_single_for_cpu(struct device *dev,
@@ -2303,14 +3115,19 @@ arm_iommu_create_mapping(struct bus_type *bus, dma_addr_t base, size_t size,
 	mapping->order = order;
 	spin_lock_init(&mapping->lock);
 
+	if (iova_cache_init(mapping))
+		goto err3;
+
 	mapping->domain = iommu_domain_alloc(bus);
 	if (!mapping->domain)
-		goto err3;
+		goto err4;
 
 	kref_init(&mapping->kref);
 
 	iommu_mapping_list_add(mapping);
 	return mapping;
+err4:
+	iova_cache_destroy(mapping);
 err3:
 	kfree(mapping->bitmap);
 err2:
@@ -2327,6 +3144,7 @@ static void release_iommu_mapping(struct kref *kref)
 
 	iommu_mapping_list_del(mapping);
 	iommu_domain_free(mapping->domain);
+	iova_cache_destroy(mapping);
 	kfree(mapping->bitmap);
 	kfree(mapping);
 }
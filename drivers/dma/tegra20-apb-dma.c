@@ -18,6 +18,7 @@
 
 #include <linux/bitops.h>
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
@@ -33,7 +34,9 @@
 #include <linux/platform_device.h>
 #include <linux/pm.h>
 #include <linux/pm_runtime.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 #include <linux/clk/tegra.h>
 #include <linux/tegra_pm_domains.h>
 
@@ -120,6 +123,20 @@
 /* Channel base address offset from APBDMA base address */
 #define TEGRA_APBDMA_CHANNEL_BASE_ADD_OFFSET	0x1000
 
+/* Descriptors and sub-requests preallocated when a channel is requested */
+#define TEGRA_APBDMA_PREALLOC_DESC		8
+#define TEGRA_APBDMA_PREALLOC_SG_REQ		32
+
+/*
+ * Run cyclic transfers with an even number of periods in double buffered
+ * (ping-pong) mode: each request covers two periods, the controller
+ * interrupts at the end of each one and wraps on its own, so the ISR
+ * reprograms at most once per pair and never for a two period buffer.
+ */
+static bool cyclic_ping_pong = true;
+module_param(cyclic_ping_pong, bool, 0644);
+MODULE_PARM_DESC(cyclic_ping_pong, "Use double buffering for cyclic DMA");
+
 struct tegra_dma;
 
 /*
@@ -162,6 +179,7 @@ struct tegra_dma_sg_req {
 	bool				configured;
 	bool				skipped;
 	bool				last_sg;
+	bool				dbl_buf;
 	bool				half_done;
 	struct list_head		node;
 	struct tegra_dma_desc		*dma_desc;
@@ -188,6 +206,21 @@ struct tegra_dma_channel;
 typedef void (*dma_isr_handler)(struct tegra_dma_channel *tdc,
 				bool to_terminate);
 
+/* tegra_dma_channel_stats: interrupt load of a channel, under its lock */
+struct tegra_dma_channel_stats {
+	u64	since_ns;	/* when the counters were last cleared */
+	u64	irqs;
+	u64	half_irqs;	/* first half interrupts in ping-pong mode */
+	u64	reprogram;	/* next request written while running */
+	u64	isr_ns;		/* total and worst time spent in the ISR */
+	u64	isr_max_ns;
+	u64	cb_runs;	/* tasklet runs, and their delay from the irq */
+	u64	cb_latency_ns;
+	u64	cb_latency_max_ns;
+	u64	desc_alloc;	/* allocations beyond the preallocated pools */
+	u64	sg_req_alloc;
+};
+
 /* tegra_dma_channel: Channel specific information */
 struct tegra_dma_channel {
 	struct dma_chan		dma_chan;
@@ -217,6 +250,10 @@ struct tegra_dma_channel {
 	unsigned int slave_id;
 	struct dma_slave_config dma_sconfig;
 	struct tegra_dma_channel_regs	channel_reg;
+
+	/* Time of the oldest irq not yet seen by the tasklet, or zero */
+	u64				irq_ns;
+	struct tegra_dma_channel_stats	stats;
 };
 
 /* tegra_dma: Tegra DMA specific information */
@@ -231,6 +268,8 @@ struct tegra_dma {
 	/* Some register need to be cache before suspend */
 	u32				reg_gen;
 
+	struct dentry			*debugfs;
+
 	/* Last member of the structure */
 	struct tegra_dma_channel channels[0];
 };
@@ -295,9 +334,10 @@ static struct tegra_dma_desc *tegra_dma_desc_get(
 		}
 	}
 
+	tdc->stats.desc_alloc++;
 	spin_unlock_irqrestore(&tdc->lock, flags);
 
-	/* Allocate DMA desc */
+	/* Preallocated pool exhausted, allocate DMA desc */
 	dma_desc = kzalloc(sizeof(*dma_desc), GFP_ATOMIC);
 	if (!dma_desc) {
 		dev_err(tdc2dev(tdc), "dma_desc alloc failed\n");
@@ -336,6 +376,7 @@ static struct tegra_dma_sg_req *tegra_dma_sg_req_get(
 		spin_unlock_irqrestore(&tdc->lock, flags);
 		return sg_req;
 	}
+	tdc->stats.sg_req_alloc++;
 	spin_unlock_irqrestore(&tdc->lock, flags);
 
 	sg_req = kzalloc(sizeof(struct tegra_dma_sg_req), GFP_ATOMIC);
@@ -490,6 +531,7 @@ static void tegra_dma_configure_for_next(struct tegra_dma_channel *tdc,
 				nsg_req->ch_regs.csr | TEGRA_APBDMA_CSR_ENB);
 	nsg_req->configured = true;
 	nsg_req->skipped = false;
+	tdc->stats.reprogram++;
 
 	tegra_dma_resume(tdc);
 }
@@ -528,7 +570,46 @@ static void tdc_configure_next_head_desc(struct tegra_dma_channel *tdc)
 static inline int get_current_xferred_count(struct tegra_dma_channel *tdc,
 	struct tegra_dma_sg_req *sg_req, unsigned long status)
 {
-	return sg_req->req_len - (status & TEGRA_APBDMA_STATUS_COUNT_MASK) - 4;
+	/* in ping-pong mode the count is for the half in flight */
+	int len = sg_req->dbl_buf ? sg_req->req_len / 2 : sg_req->req_len;
+
+	return len - (status & TEGRA_APBDMA_STATUS_COUNT_MASK) - 4;
+}
+
+/*
+ * Bytes moved by the running head request that the ISR has not added to
+ * bytes_transferred yet, so that the residue of a cyclic transfer can be
+ * polled with word rather than period granularity. A period that has
+ * ended but whose interrupt is still pending counts as done, which keeps
+ * the reported position monotonic. Called with tdc->lock held.
+ */
+static int tegra_dma_inflight_bytes(struct tegra_dma_channel *tdc,
+	struct tegra_dma_sg_req *sg_req)
+{
+	int len = sg_req->dbl_buf ? sg_req->req_len / 2 : sg_req->req_len;
+	unsigned long status, wcount;
+	int done;
+
+	if (!tdc->busy || !sg_req->configured ||
+	    sg_req != list_first_entry(&tdc->pending_sg_req,
+					typeof(*sg_req), node))
+		return 0;
+
+	status = tdc_read(tdc, TEGRA_APBDMA_CHAN_STATUS);
+	if (status & TEGRA_APBDMA_STATUS_ISE_EOC)
+		return len;
+
+	wcount = status;
+	if (tdc->tdma->chip_data->support_separate_wcount_reg) {
+		wcount = tdc_read(tdc, TEGRA_APBDMA_CHAN_WORD_TRANSFER);
+		/* the count may have been reloaded between the two reads */
+		status = tdc_read(tdc, TEGRA_APBDMA_CHAN_STATUS);
+		if (status & TEGRA_APBDMA_STATUS_ISE_EOC)
+			return len;
+	}
+
+	done = get_current_xferred_count(tdc, sg_req, wcount);
+	return clamp(done, 0, len);
 }
 
 static void tegra_dma_abort_all(struct tegra_dma_channel *tdc)
@@ -629,19 +710,37 @@ static void handle_cont_sngl_cycle_dma_done(struct tegra_dma_channel *tdc,
 
 	sgreq = list_first_entry(&tdc->pending_sg_req, typeof(*sgreq), node);
 	dma_desc = sgreq->dma_desc;
-	dma_desc->bytes_transferred += sgreq->req_len;
+	dma_desc->bytes_transferred += sgreq->dbl_buf ? sgreq->req_len / 2 :
+							sgreq->req_len;
 
 	/* Callback need to be call */
 	if (!dma_desc->cb_count)
 		list_add_tail(&dma_desc->cb_node, &tdc->cb_desc);
 	dma_desc->cb_count++;
 
+	if (sgreq->dbl_buf) {
+		sgreq->half_done = !sgreq->half_done;
+		if (sgreq->half_done) {
+			/*
+			 * The controller goes on into the second half by
+			 * itself; queue what follows it, to be loaded at the
+			 * wrap.
+			 */
+			tdc->stats.half_irqs++;
+			if (!to_terminate)
+				tdc_configure_next_head_desc(tdc);
+			return;
+		}
+	}
+
 	/* If not last req then put at end of pending list */
 	if (!list_is_last(&sgreq->node, &tdc->pending_sg_req)) {
 		list_move_tail(&sgreq->node, &tdc->pending_sg_req);
 		sgreq->configured = false;
 		sgreq->skipped = false;
-		st = handle_continuous_head_request(tdc, sgreq, to_terminate);
+		/* a ping-pong head is followed up from its half interrupt */
+		st = handle_continuous_head_request(tdc, sgreq,
+				to_terminate || sgreq->dbl_buf);
 		if (!st)
 			dma_desc->dma_status = DMA_ERROR;
 	}
@@ -656,8 +755,17 @@ static void tegra_dma_tasklet(unsigned long data)
 	struct tegra_dma_desc *dma_desc;
 	unsigned long flags;
 	int cb_count;
+	u64 latency;
 
 	spin_lock_irqsave(&tdc->lock, flags);
+	if (tdc->irq_ns) {
+		latency = ktime_to_ns(ktime_get()) - tdc->irq_ns;
+		tdc->irq_ns = 0;
+		tdc->stats.cb_runs++;
+		tdc->stats.cb_latency_ns += latency;
+		if (latency > tdc->stats.cb_latency_max_ns)
+			tdc->stats.cb_latency_max_ns = latency;
+	}
 	while (!list_empty(&tdc->cb_desc)) {
 		dma_desc  = list_first_entry(&tdc->cb_desc,
 					typeof(*dma_desc), cb_node);
@@ -679,15 +787,25 @@ static irqreturn_t tegra_dma_isr(int irq, void *dev_id)
 	struct tegra_dma_channel *tdc = dev_id;
 	unsigned long status;
 	unsigned long flags;
+	u64 t0, dt;
 
 	spin_lock_irqsave(&tdc->lock, flags);
 
 	status = tdc_read(tdc, TEGRA_APBDMA_CHAN_STATUS);
 	if (status & TEGRA_APBDMA_STATUS_ISE_EOC) {
+		t0 = ktime_to_ns(ktime_get());
 		tdc_write(tdc, TEGRA_APBDMA_CHAN_STATUS, status);
 		tdc_write(tdc, TEGRA_APBDMA_CHAN_STATUS, TEGRA_APBDMA_STATUS_ISE_EOC);
 		tdc->isr_handler(tdc, false);
 		tasklet_schedule(&tdc->tasklet);
+
+		if (!tdc->irq_ns)
+			tdc->irq_ns = t0;
+		dt = ktime_to_ns(ktime_get()) - t0;
+		tdc->stats.irqs++;
+		tdc->stats.isr_ns += dt;
+		if (dt > tdc->stats.isr_max_ns)
+			tdc->stats.isr_max_ns = dt;
 		spin_unlock_irqrestore(&tdc->lock, flags);
 		return IRQ_HANDLED;
 	}
@@ -735,8 +853,12 @@ static void tegra_dma_issue_pending(struct dma_chan *dc)
 	if (!tdc->busy) {
 		tdc_start_head_req(tdc);
 
-		/* Continuous single mode: Configure next req */
-		if (tdc->cyclic) {
+		/*
+		 * Continuous single mode: Configure next req. In ping-pong
+		 * mode that waits for the head's half interrupt.
+		 */
+		if (tdc->cyclic && !list_first_entry(&tdc->pending_sg_req,
+				struct tegra_dma_sg_req, node)->dbl_buf) {
 			/*
 			 * Wait for 1 burst time for configure DMA for
 			 * next transfer.
@@ -819,6 +941,7 @@ static enum dma_status tegra_dma_tx_status(struct dma_chan *dc,
 	enum dma_status ret;
 	unsigned long flags;
 	unsigned int residual;
+	unsigned int done;
 
 	spin_lock_irqsave(&tdc->lock, flags);
 
@@ -845,9 +968,10 @@ static enum dma_status tegra_dma_tx_status(struct dma_chan *dc,
 	list_for_each_entry(sg_req, &tdc->pending_sg_req, node) {
 		dma_desc = sg_req->dma_desc;
 		if (dma_desc->txd.cookie == cookie) {
+			done = dma_desc->bytes_transferred +
+					tegra_dma_inflight_bytes(tdc, sg_req);
 			residual =  dma_desc->bytes_requested -
-					(dma_desc->bytes_transferred %
-						dma_desc->bytes_requested);
+					(done % dma_desc->bytes_requested);
 			dma_set_residue(txstate, residual);
 			ret = dma_desc->dma_status;
 			spin_unlock_irqrestore(&tdc->lock, flags);
@@ -860,6 +984,32 @@ static enum dma_status tegra_dma_tx_status(struct dma_chan *dc,
 	return ret;
 }
 
+/*
+ * Pausing through the global enable would hold the global lock across two
+ * calls, so client pause/resume is only offered with per-channel pause.
+ * Pause does not wait for the burst in flight; it completes within
+ * TEGRA_APBDMA_BURST_COMPLETE_TIME and clients that need the data in
+ * memory allow for that themselves.
+ */
+static int tegra_dma_channel_pause(struct dma_chan *dc, bool pause)
+{
+	struct tegra_dma_channel *tdc = to_tegra_dma_chan(dc);
+	unsigned long flags;
+
+	if (!tdc->tdma->chip_data->support_channel_pause)
+		return -ENXIO;
+
+	spin_lock_irqsave(&tdc->lock, flags);
+	if (tdc->busy) {
+		if (pause)
+			tegra_dma_pause(tdc, false);
+		else
+			tegra_dma_resume(tdc);
+	}
+	spin_unlock_irqrestore(&tdc->lock, flags);
+	return 0;
+}
+
 static int tegra_dma_device_control(struct dma_chan *dc, enum dma_ctrl_cmd cmd,
 			unsigned long arg)
 {
@@ -872,6 +1022,12 @@ static int tegra_dma_device_control(struct dma_chan *dc, enum dma_ctrl_cmd cmd,
 		tegra_dma_terminate_all(dc);
 		return 0;
 
+	case DMA_PAUSE:
+		return tegra_dma_channel_pause(dc, true);
+
+	case DMA_RESUME:
+		return tegra_dma_channel_pause(dc, false);
+
 	default:
 		break;
 	}
@@ -1052,6 +1208,8 @@ static struct dma_async_tx_descriptor *tegra_dma_prep_slave_sg(
 		sg_req->configured = false;
 		sg_req->skipped = false;
 		sg_req->last_sg = false;
+		sg_req->dbl_buf = false;
+		sg_req->half_done = false;
 		sg_req->dma_desc = dma_desc;
 		sg_req->req_len = len;
 
@@ -1093,6 +1251,8 @@ struct dma_async_tx_descriptor *tegra_dma_prep_dma_cyclic(
 	dma_addr_t mem = buf_addr;
 	u32 burst_size;
 	enum dma_slave_buswidth slave_bw;
+	bool dbl_buf;
+	int req_len;
 	int ret;
 
 	if (!buf_len || !period_len) {
@@ -1150,6 +1310,17 @@ struct dma_async_tx_descriptor *tegra_dma_prep_dma_cyclic(
 
 	apb_seq |= TEGRA_APBDMA_APBSEQ_WRAP_WORD_1;
 
+	/*
+	 * Pair up the periods: the word count stays one period and the
+	 * controller interrupts at the end of each half of the request.
+	 */
+	dbl_buf = cyclic_ping_pong && !((buf_len / period_len) & 1);
+	req_len = len;
+	if (dbl_buf) {
+		ahb_seq |= TEGRA_APBDMA_AHBSEQ_DBL_BUF;
+		req_len = 2 * len;
+	}
+
 	dma_desc = tegra_dma_desc_get(tdc);
 	if (!dma_desc) {
 		dev_err(tdc2dev(tdc), "not enough descriptors available\n");
@@ -1187,13 +1358,14 @@ struct dma_async_tx_descriptor *tegra_dma_prep_dma_cyclic(
 		sg_req->configured = false;
 		sg_req->skipped = false;
 		sg_req->half_done = false;
+		sg_req->dbl_buf = dbl_buf;
 		sg_req->last_sg = false;
 		sg_req->dma_desc = dma_desc;
-		sg_req->req_len = len;
+		sg_req->req_len = req_len;
 
 		list_add_tail(&sg_req->node, &dma_desc->tx_list);
-		remain_len -= len;
-		mem += len;
+		remain_len -= req_len;
+		mem += req_len;
 	}
 	sg_req->last_sg = true;
 	if (flags & DMA_CTRL_ACK)
@@ -1217,6 +1389,43 @@ struct dma_async_tx_descriptor *tegra_dma_prep_dma_cyclic(
 	return &dma_desc->txd;
 }
 
+/*
+ * Fill the channel's free lists up front, so that preparing a transfer
+ * from atomic context does not have to allocate.
+ */
+static void tegra_dma_prealloc(struct tegra_dma_channel *tdc)
+{
+	struct tegra_dma_desc *dma_desc;
+	struct tegra_dma_sg_req *sg_req;
+	unsigned long flags;
+	LIST_HEAD(desc_list);
+	LIST_HEAD(sg_req_list);
+	int i;
+
+	for (i = 0; i < TEGRA_APBDMA_PREALLOC_DESC; i++) {
+		dma_desc = kzalloc(sizeof(*dma_desc), GFP_KERNEL);
+		if (!dma_desc)
+			break;
+		dma_async_tx_descriptor_init(&dma_desc->txd, &tdc->dma_chan);
+		dma_desc->txd.tx_submit = tegra_dma_tx_submit;
+		dma_desc->txd.flags = DMA_CTRL_ACK;
+		INIT_LIST_HEAD(&dma_desc->tx_list);
+		list_add_tail(&dma_desc->node, &desc_list);
+	}
+
+	for (i = 0; i < TEGRA_APBDMA_PREALLOC_SG_REQ; i++) {
+		sg_req = kzalloc(sizeof(*sg_req), GFP_KERNEL);
+		if (!sg_req)
+			break;
+		list_add_tail(&sg_req->node, &sg_req_list);
+	}
+
+	spin_lock_irqsave(&tdc->lock, flags);
+	list_splice_tail(&desc_list, &tdc->free_dma_desc);
+	list_splice_tail(&sg_req_list, &tdc->free_sg_req);
+	spin_unlock_irqrestore(&tdc->lock, flags);
+}
+
 static int tegra_dma_alloc_chan_resources(struct dma_chan *dc)
 {
 	struct tegra_dma_channel *tdc = to_tegra_dma_chan(dc);
@@ -1224,6 +1433,7 @@ static int tegra_dma_alloc_chan_resources(struct dma_chan *dc)
 	clk_prepare(tdc->tdma->dma_clk);
 	dma_cookie_init(&tdc->dma_chan);
 	tdc->config_init = false;
+	tegra_dma_prealloc(tdc);
 	return 0;
 }
 
@@ -1285,6 +1495,94 @@ static struct dma_chan *tegra_dma_of_xlate(struct of_phandle_args *dma_spec,
 	return chan;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int tegra_dma_stats_show(struct seq_file *s, void *data)
+{
+	struct tegra_dma *tdma = s->private;
+	struct tegra_dma_channel_stats st;
+	struct tegra_dma_channel *tdc;
+	unsigned long flags;
+	u64 now, secs;
+	int i;
+
+	seq_puts(s, "chan       irqs  irqs/s  half_irqs  reprogram  isr_avg_us "
+		 "isr_max_us  cb_avg_us  cb_max_us  desc_alloc  "
+		 "sg_req_alloc\n");
+	for (i = 0; i < tdma->chip_data->nr_channels; i++) {
+		tdc = &tdma->channels[i];
+
+		spin_lock_irqsave(&tdc->lock, flags);
+		st = tdc->stats;
+		spin_unlock_irqrestore(&tdc->lock, flags);
+
+		if (!st.irqs)
+			continue;
+
+		now = ktime_to_ns(ktime_get());
+		secs = div64_u64(now - st.since_ns, NSEC_PER_SEC) ? : 1;
+		seq_printf(s, "%4d %10llu %7llu %10llu %10llu %11llu %10llu "
+			   "%10llu %10llu %11llu %13llu\n",
+			   i, st.irqs, div64_u64(st.irqs, secs), st.half_irqs,
+			   st.reprogram,
+			   div64_u64(st.isr_ns, st.irqs * NSEC_PER_USEC),
+			   div_u64(st.isr_max_ns, NSEC_PER_USEC),
+			   st.cb_runs ? div64_u64(st.cb_latency_ns,
+					st.cb_runs * NSEC_PER_USEC) : 0,
+			   div_u64(st.cb_latency_max_ns, NSEC_PER_USEC),
+			   st.desc_alloc, st.sg_req_alloc);
+	}
+	return 0;
+}
+
+static int tegra_dma_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_dma_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters of all channels */
+static ssize_t tegra_dma_stats_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct tegra_dma *tdma = s->private;
+	struct tegra_dma_channel *tdc;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < tdma->chip_data->nr_channels; i++) {
+		tdc = &tdma->channels[i];
+		spin_lock_irqsave(&tdc->lock, flags);
+		memset(&tdc->stats, 0, sizeof(tdc->stats));
+		tdc->stats.since_ns = ktime_to_ns(ktime_get());
+		spin_unlock_irqrestore(&tdc->lock, flags);
+	}
+	return count;
+}
+
+static const struct file_operations tegra_dma_stats_fops = {
+	.open		= tegra_dma_stats_open,
+	.read		= seq_read,
+	.write		= tegra_dma_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_dma_debugfs_init(struct tegra_dma *tdma)
+{
+	tdma->debugfs = debugfs_create_dir(dev_name(tdma->dev), NULL);
+	if (IS_ERR_OR_NULL(tdma->debugfs))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, tdma->debugfs, tdma,
+			    &tegra_dma_stats_fops);
+}
+#else
+static inline void tegra_dma_debugfs_init(struct tegra_dma *tdma)
+{
+}
+#endif
+
 /* Tegra20 specific DMA controller information */
 static const struct tegra_dma_chip_data tegra20_dma_chip_data = {
 	.nr_channels		= 16,
@@ -1499,6 +1797,7 @@ static int tegra_dma_probe(struct platform_device *pdev)
 		INIT_LIST_HEAD(&tdc->free_sg_req);
 		INIT_LIST_HEAD(&tdc->free_dma_desc);
 		INIT_LIST_HEAD(&tdc->cb_desc);
+		tdc->stats.since_ns = ktime_to_ns(ktime_get());
 	}
 
 	dma_cap_set(DMA_SLAVE, tdma->dma_dev.cap_mask);
@@ -1531,6 +1830,8 @@ static int tegra_dma_probe(struct platform_device *pdev)
 		goto err_unregister_dma_dev;
 	}
 
+	tegra_dma_debugfs_init(tdma);
+
 	dev_info(&pdev->dev, "Tegra20 APB DMA driver register %d channels\n",
 			cdata->nr_channels);
 	return 0;
@@ -1557,6 +1858,7 @@ static int tegra_dma_remove(struct platform_device *pdev)
 	int i;
 	struct tegra_dma_channel *tdc;
 
+	debugfs_remove_recursive(tdma->debugfs);
 	dma_async_device_unregister(&tdma->dma_dev);
 
 	for (i = 0; i < tdma->chip_data->nr_channels; ++i) {
@@ -41,6 +41,14 @@
 #include <linux/clk/tegra.h>
 #include <linux/tegra-pm.h>
 #include <linux/pinctrl/consumer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/rt.h>
+#include <linux/ktime.h>
 
 #include <asm/unaligned.h>
 
@@ -62,6 +70,8 @@
 #define I2C_TX_FIFO				0x050
 #define I2C_RX_FIFO				0x054
 #define I2C_PACKET_TRANSFER_STATUS		0x058
+#define I2C_PACKET_TRANSFER_PKT_ID_SHIFT	16
+#define I2C_PACKET_TRANSFER_PKT_ID_MASK		(0xff << 16)
 #define I2C_FIFO_CONTROL			0x05c
 #define I2C_FIFO_CONTROL_TX_FLUSH		(1<<1)
 #define I2C_FIFO_CONTROL_RX_FLUSH		(1<<0)
@@ -137,6 +147,20 @@
 #define SL_ADDR2(addr) ((addr >> 8) & 0xff)
 
 #define MAX_BUSCLEAR_CLOCK			(9 * 8 + 1)
+
+/* Async batches: bounce buffer per direction, packet ids are 8 bit */
+#define I2C_FIFO_DEPTH_WORDS			8
+#define I2C_MAX_PAYLOAD				4096
+#define I2C_PACKET_HEADER_WORDS			3
+#define TEGRA_I2C_BATCH_BUF_SIZE		PAGE_SIZE
+#define TEGRA_I2C_BATCH_MAX_MSGS		64
+
+/* tegra_i2c_async_req.flags */
+#define TEGRA_I2C_REQ_PENDING			0
+
+static bool batch_dma = true;
+module_param(batch_dma, bool, 0644);
+MODULE_PARM_DESC(batch_dma, "use APB DMA for batches larger than the FIFO");
 /*
  * msg_end_type: The bus control which need to be send at end of transfer.
  * @MSG_END_STOP: Send stop pulse at end of transfer.
@@ -164,6 +188,57 @@ struct tegra_i2c_chipdata {
 	bool has_config_load_reg;
 };
 
+/**
+ * struct tegra_i2c_batch - async requests chained into one packet stream
+ * @tx_buf: packet headers and write payloads, in FIFO words
+ * @rx_buf: read payloads, each packet starting on a word boundary
+ * @tx_words: number of valid words in @tx_buf
+ * @rx_words: number of words expected in @rx_buf
+ * @tx_pos: next word of @tx_buf to push into the TX FIFO
+ * @rx_pos: next word of @rx_buf to fill from the RX FIFO
+ * @msgs: number of packets in the batch
+ * @last_io_header: index of the last packet's I/O header in @tx_buf
+ * @failed: index of the packet that failed, when the batch failed
+ * @dma: payloads are moved by APB DMA rather than by the ISR
+ */
+struct tegra_i2c_batch {
+	u32 *tx_buf;
+	dma_addr_t tx_phys;
+	u32 *rx_buf;
+	dma_addr_t rx_phys;
+	size_t tx_words;
+	size_t rx_words;
+	size_t tx_pos;
+	size_t rx_pos;
+	int msgs;
+	size_t last_io_header;
+	int failed;
+	bool dma;
+};
+
+/*
+ * struct tegra_i2c_stats - bus usage counters, cleared by writing to the
+ * debugfs stats file.  @irqs is bumped by the ISR without the async lock.
+ */
+struct tegra_i2c_stats {
+	u64 since_ns;
+	u64 busy_ns;
+	u64 sync_xfers;
+	u64 batches;
+	u64 dma_batches;
+	u64 batch_msgs;
+	u32 batch_max_msgs;
+	u64 async_reqs;
+	u64 async_done;
+	u64 async_errors;
+	u64 requeued;
+	u64 oversized;
+	u64 overruns;
+	u64 latency_ns;
+	u64 latency_max_ns;
+	u64 irqs;
+};
+
 /**
  * struct tegra_i2c_dev	- per device i2c context
  * @dev: device reference for power management
@@ -181,6 +256,14 @@ struct tegra_i2c_chipdata {
  * @msg_read: identifies read transfers
  * @bus_clk_rate: current i2c bus clock rate
  * @is_suspended: prevents i2c controller accesses after suspend is called
+ * @async_lock: protects @async_queue and @stats
+ * @async_queue: submitted async requests not yet on the bus
+ * @async_worker: RT thread draining @async_queue in batches
+ * @batch: batch currently on the bus, serviced by the ISR; NULL otherwise
+ * @batch_ctx: bounce buffers and state of the async batch
+ * @tx_dma_chan: APB DMA channel feeding the TX FIFO for large batches
+ * @rx_dma_chan: APB DMA channel draining the RX FIFO for large batches
+ * @stats: bus utilisation and async latency counters
  */
 struct tegra_i2c_dev {
 	struct device *dev;
@@ -232,6 +315,23 @@ struct tegra_i2c_dev {
 	bool bit_banging_xfer_after_shutdown;
 	bool is_shutdown;
 	struct notifier_block pm_nb;
+	phys_addr_t phys;
+	spinlock_t async_lock;
+	struct list_head async_queue;
+	struct kthread_worker async_worker;
+	struct kthread_work async_work;
+	struct task_struct *async_task;
+	struct work_struct async_start_work;
+	struct tegra_i2c_batch *batch;
+	struct tegra_i2c_batch batch_ctx;
+	bool batch_dma_probed;
+	struct dma_chan *tx_dma_chan;
+	struct dma_chan *rx_dma_chan;
+	dma_cookie_t rx_dma_cookie;
+	struct completion tx_dma_complete;
+	struct completion rx_dma_complete;
+	struct tegra_i2c_stats stats;
+	struct dentry *debugfs;
 };
 
 static void dvc_writel(struct tegra_i2c_dev *i2c_dev, u32 val, unsigned long reg)
@@ -436,6 +536,24 @@ static int tegra_i2c_flush_fifos(struct tegra_i2c_dev *i2c_dev)
 	return 0;
 }
 
+static int tegra_i2c_load_config(struct tegra_i2c_dev *i2c_dev)
+{
+	unsigned long timeout = jiffies + HZ;
+
+	if (!i2c_dev->chipdata->has_config_load_reg)
+		return 0;
+
+	i2c_writel(i2c_dev, I2C_MSTR_CONFIG_LOAD, I2C_CONFIG_LOAD);
+	while (i2c_readl(i2c_dev, I2C_CONFIG_LOAD) != 0) {
+		if (time_after(jiffies, timeout)) {
+			dev_warn(i2c_dev->dev, "timeout config_load");
+			return -ETIMEDOUT;
+		}
+		udelay(2);
+	}
+	return 0;
+}
+
 static int tegra_i2c_empty_rx_fifo(struct tegra_i2c_dev *i2c_dev)
 {
 	u32 val;
@@ -736,6 +854,60 @@ static int tegra_i2c_copy_next_to_current(struct tegra_i2c_dev *i2c_dev)
 	return 0;
 }
 
+static void tegra_i2c_batch_fill_tx(struct tegra_i2c_dev *i2c_dev,
+	struct tegra_i2c_batch *b)
+{
+	size_t pos = b->tx_pos;
+	int words;
+
+	words = (i2c_readl(i2c_dev, I2C_FIFO_STATUS) &
+		 I2C_FIFO_STATUS_TX_MASK) >> I2C_FIFO_STATUS_TX_SHIFT;
+	words = min_t(size_t, words, b->tx_words - pos);
+
+	/* Same as tegra_i2c_fill_tx_fifo(): account before the FIFO write */
+	b->tx_pos = pos + words;
+	barrier();
+
+	i2c_writesl(i2c_dev, b->tx_buf + pos, I2C_TX_FIFO, words);
+}
+
+static void tegra_i2c_batch_drain_rx(struct tegra_i2c_dev *i2c_dev,
+	struct tegra_i2c_batch *b)
+{
+	int words;
+
+	words = (i2c_readl(i2c_dev, I2C_FIFO_STATUS) &
+		 I2C_FIFO_STATUS_RX_MASK) >> I2C_FIFO_STATUS_RX_SHIFT;
+	words = min_t(size_t, words, b->rx_words - b->rx_pos);
+
+	i2c_readsl(i2c_dev, b->rx_buf + b->rx_pos, I2C_RX_FIFO, words);
+	b->rx_pos += words;
+}
+
+/*
+ * FIFO service for a PIO batch.  The whole batch is one word stream in each
+ * direction, so there is no per message state to switch in here.
+ */
+static void tegra_i2c_batch_pio(struct tegra_i2c_dev *i2c_dev, u32 status)
+{
+	struct tegra_i2c_batch *b = i2c_dev->batch;
+
+	if (b->dma)
+		return;
+
+	if (status & I2C_INT_RX_FIFO_DATA_REQ)
+		tegra_i2c_batch_drain_rx(i2c_dev, b);
+
+	if (status & I2C_INT_TX_FIFO_DATA_REQ) {
+		spin_lock(&i2c_dev->fifo_lock);
+		if (b->tx_pos < b->tx_words)
+			tegra_i2c_batch_fill_tx(i2c_dev, b);
+		else
+			tegra_i2c_mask_irq(i2c_dev, I2C_INT_TX_FIFO_DATA_REQ);
+		spin_unlock(&i2c_dev->fifo_lock);
+	}
+}
+
 static irqreturn_t tegra_i2c_isr(int irq, void *dev_id)
 {
 	u32 status;
@@ -747,6 +919,7 @@ static irqreturn_t tegra_i2c_isr(int irq, void *dev_id)
 	u32 mask;
 
 	status = i2c_readl(i2c_dev, I2C_INT_STATUS);
+	i2c_dev->stats.irqs++;
 
 	if (status == 0) {
 		dev_dbg(i2c_dev->dev, "unknown interrupt Add 0x%02x\n",
@@ -792,6 +965,11 @@ static irqreturn_t tegra_i2c_isr(int irq, void *dev_id)
 			(status & I2C_INT_BUS_CLEAR_DONE))
 		goto err;
 
+	if (i2c_dev->batch) {
+		tegra_i2c_batch_pio(i2c_dev, status);
+		goto ack;
+	}
+
 	if (unlikely((i2c_readl(i2c_dev, I2C_STATUS) & I2C_STATUS_BUSY)
 				&& (status == I2C_INT_TX_FIFO_DATA_REQ)
 				&& i2c_dev->msg_read
@@ -828,6 +1006,7 @@ static irqreturn_t tegra_i2c_isr(int irq, void *dev_id)
 			tegra_i2c_mask_irq(i2c_dev, I2C_INT_TX_FIFO_DATA_REQ);
 	}
 
+ack:
 	i2c_writel(i2c_dev, status, I2C_INT_STATUS);
 
 	if (i2c_dev->is_dvc)
@@ -896,6 +1075,33 @@ err:
 	return IRQ_HANDLED;
 }
 
+static u32 tegra_i2c_io_header(struct tegra_i2c_dev *i2c_dev,
+	struct i2c_msg *msg, enum msg_end_type end_state)
+{
+	u32 io_header = 0;
+
+	if (end_state == MSG_END_CONTINUE)
+		io_header |= I2C_HEADER_CONTINUE_XFER;
+	else if (end_state == MSG_END_REPEAT_START)
+		io_header |= I2C_HEADER_REPEAT_START;
+	if (msg->flags & I2C_M_TEN) {
+		io_header |= msg->addr;
+		io_header |= I2C_HEADER_10BIT_ADDR;
+	} else {
+		io_header |= msg->addr << I2C_HEADER_SLAVE_ADDR_SHIFT;
+	}
+	if (msg->flags & I2C_M_IGNORE_NAK)
+		io_header |= I2C_HEADER_CONT_ON_NAK;
+	if (msg->flags & I2C_M_RD)
+		io_header |= I2C_HEADER_READ;
+	if (i2c_dev->is_high_speed_enable) {
+		io_header |= I2C_HEADER_HIGHSPEED_MODE;
+		io_header |= ((i2c_dev->hs_master_code & 0x7)
+					<<  I2C_HEADER_MASTER_ADDR_SHIFT);
+	}
+	return io_header;
+}
+
 static int tegra_i2c_send_next_read_msg_pkt_header(struct tegra_i2c_dev *i2c_dev, struct i2c_msg *next_msg, enum msg_end_type end_state)
 {
 	i2c_dev->next_msg_buf = next_msg->buf;
@@ -913,29 +1119,8 @@ static int tegra_i2c_send_next_read_msg_pkt_header(struct tegra_i2c_dev *i2c_dev
 	i2c_dev->next_payload_size = next_msg->len - 1;
 	i2c_writel(i2c_dev, i2c_dev->next_payload_size, I2C_TX_FIFO);
 
-	i2c_dev->next_io_header = I2C_HEADER_IE_ENABLE;
-
-	if (end_state == MSG_END_CONTINUE)
-		i2c_dev->next_io_header |= I2C_HEADER_CONTINUE_XFER;
-	else if (end_state == MSG_END_REPEAT_START)
-		i2c_dev->next_io_header |= I2C_HEADER_REPEAT_START;
-
-	if (next_msg->flags & I2C_M_TEN) {
-		i2c_dev->next_io_header |= next_msg->addr;
-		i2c_dev->next_io_header |= I2C_HEADER_10BIT_ADDR;
-	} else {
-		i2c_dev->next_io_header |= (next_msg->addr << I2C_HEADER_SLAVE_ADDR_SHIFT);
-	}
-	if (next_msg->flags & I2C_M_IGNORE_NAK)
-		i2c_dev->next_io_header |= I2C_HEADER_CONT_ON_NAK;
-
-	i2c_dev->next_io_header |= I2C_HEADER_READ;
-
-	if (i2c_dev->is_high_speed_enable) {
-		i2c_dev->next_io_header |= I2C_HEADER_HIGHSPEED_MODE;
-		i2c_dev->next_io_header |= ((i2c_dev->hs_master_code & 0x7)
-					<<  I2C_HEADER_MASTER_ADDR_SHIFT);
-	}
+	i2c_dev->next_io_header = I2C_HEADER_IE_ENABLE | I2C_HEADER_READ |
+		tegra_i2c_io_header(i2c_dev, next_msg, end_state);
 	i2c_writel(i2c_dev, i2c_dev->next_io_header, I2C_TX_FIFO);
 
 	return 0;
@@ -1000,29 +1185,9 @@ static int tegra_i2c_xfer_msg(struct tegra_i2c_dev *i2c_dev,
 	i2c_writel(i2c_dev, i2c_dev->payload_size, I2C_TX_FIFO);
 
 	i2c_dev->use_single_xfer_complete = true;
-	i2c_dev->io_header = 0;
+	i2c_dev->io_header = tegra_i2c_io_header(i2c_dev, msg, end_state);
 	if (next_msg == NULL)
-		i2c_dev->io_header = I2C_HEADER_IE_ENABLE;
-
-	if (end_state == MSG_END_CONTINUE)
-		i2c_dev->io_header |= I2C_HEADER_CONTINUE_XFER;
-	else if (end_state == MSG_END_REPEAT_START)
-		i2c_dev->io_header |= I2C_HEADER_REPEAT_START;
-	if (msg->flags & I2C_M_TEN) {
-		i2c_dev->io_header |= msg->addr;
-		i2c_dev->io_header |= I2C_HEADER_10BIT_ADDR;
-	} else {
-		i2c_dev->io_header |= msg->addr << I2C_HEADER_SLAVE_ADDR_SHIFT;
-	}
-	if (msg->flags & I2C_M_IGNORE_NAK)
-		i2c_dev->io_header |= I2C_HEADER_CONT_ON_NAK;
-	if (msg->flags & I2C_M_RD)
-		i2c_dev->io_header |= I2C_HEADER_READ;
-	if (i2c_dev->is_high_speed_enable) {
-		i2c_dev->io_header |= I2C_HEADER_HIGHSPEED_MODE;
-		i2c_dev->io_header |= ((i2c_dev->hs_master_code & 0x7)
-					<<  I2C_HEADER_MASTER_ADDR_SHIFT);
-	}
+		i2c_dev->io_header |= I2C_HEADER_IE_ENABLE;
 	i2c_writel(i2c_dev, i2c_dev->io_header, I2C_TX_FIFO);
 
 	if (!(msg->flags & I2C_M_RD))
@@ -1234,6 +1399,8 @@ static int tegra_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg msgs[],
 	int num)
 {
 	struct tegra_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
+	unsigned long flags;
+	ktime_t start;
 	int i;
 	int ret = 0;
 	BUG_ON(!rt_mutex_is_locked(&(adap->bus_lock)));
@@ -1258,6 +1425,7 @@ static int tegra_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg msgs[],
 		return ret;
 	}
 
+	start = ktime_get();
 	for (i = 0; i < num; i++) {
 		enum msg_end_type end_type = MSG_END_STOP;
 		enum msg_end_type next_msg_end_type = MSG_END_STOP;
@@ -1291,6 +1459,11 @@ static int tegra_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg msgs[],
 		}
 	}
 
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	i2c_dev->stats.sync_xfers++;
+	i2c_dev->stats.busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
 	tegra_i2c_clock_disable(i2c_dev);
 	pm_runtime_put(&adap->dev);
 
@@ -1316,6 +1489,865 @@ static const struct i2c_algorithm tegra_i2c_algo = {
 	.functionality	= tegra_i2c_func,
 };
 
+/*
+ * Asynchronous transfer queue.
+ *
+ * Requests are queued by tegra_i2c_async_submit() from any context and
+ * drained by a per adapter RT kthread.  Everything that is queued when the
+ * thread runs is chained into one packet mode stream: each message becomes
+ * a packet with its own id, only the last packet asks for an interrupt and
+ * write payloads follow their headers through the TX FIFO.  Batches that
+ * fit in the FIFOs are loaded by the CPU and finish with one interrupt,
+ * larger ones are moved by APB DMA so the controller only interrupts on
+ * completion or error.
+ */
+static void tegra_i2c_batch_dma_complete(void *args)
+{
+	struct completion *dma_complete = args;
+
+	complete(dma_complete);
+}
+
+static struct dma_chan *tegra_i2c_batch_request_dma(
+	struct tegra_i2c_dev *i2c_dev, bool dma_to_memory)
+{
+	struct dma_slave_config dma_sconfig;
+	struct dma_chan *dma_chan;
+	int ret;
+
+	dma_chan = dma_request_slave_channel_reason(i2c_dev->dev,
+					dma_to_memory ? "rx" : "tx");
+	if (IS_ERR(dma_chan))
+		return dma_chan;
+
+	/* FIFO triggers are one word in DMA mode, see tegra_i2c_batch_xfer */
+	memset(&dma_sconfig, 0, sizeof(dma_sconfig));
+	if (dma_to_memory) {
+		dma_sconfig.src_addr = i2c_dev->phys + I2C_RX_FIFO;
+		dma_sconfig.src_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+		dma_sconfig.src_maxburst = 1;
+	} else {
+		dma_sconfig.dst_addr = i2c_dev->phys + I2C_TX_FIFO;
+		dma_sconfig.dst_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+		dma_sconfig.dst_maxburst = 1;
+	}
+
+	ret = dmaengine_slave_config(dma_chan, &dma_sconfig);
+	if (ret) {
+		dma_release_channel(dma_chan);
+		return ERR_PTR(ret);
+	}
+	return dma_chan;
+}
+
+static void tegra_i2c_batch_release_dma(struct tegra_i2c_dev *i2c_dev)
+{
+	if (i2c_dev->tx_dma_chan)
+		dma_release_channel(i2c_dev->tx_dma_chan);
+	if (i2c_dev->rx_dma_chan)
+		dma_release_channel(i2c_dev->rx_dma_chan);
+	i2c_dev->tx_dma_chan = NULL;
+	i2c_dev->rx_dma_chan = NULL;
+}
+
+static void tegra_i2c_batch_free(struct tegra_i2c_dev *i2c_dev)
+{
+	struct tegra_i2c_batch *b = &i2c_dev->batch_ctx;
+
+	tegra_i2c_batch_release_dma(i2c_dev);
+	if (b->tx_buf)
+		dma_free_coherent(i2c_dev->dev, TEGRA_I2C_BATCH_BUF_SIZE,
+				  b->tx_buf, b->tx_phys);
+	if (b->rx_buf)
+		dma_free_coherent(i2c_dev->dev, TEGRA_I2C_BATCH_BUF_SIZE,
+				  b->rx_buf, b->rx_phys);
+	b->tx_buf = NULL;
+	b->rx_buf = NULL;
+}
+
+/*
+ * Bounce buffers are allocated on first use so that controllers which never
+ * see an async request pay nothing.  Without DMA channels batches use PIO.
+ */
+static int tegra_i2c_batch_init(struct tegra_i2c_dev *i2c_dev)
+{
+	struct tegra_i2c_batch *b = &i2c_dev->batch_ctx;
+	struct dma_chan *dma_chan;
+
+	if (!b->tx_buf) {
+		b->tx_buf = dma_alloc_coherent(i2c_dev->dev,
+				TEGRA_I2C_BATCH_BUF_SIZE, &b->tx_phys,
+				GFP_KERNEL);
+		b->rx_buf = dma_alloc_coherent(i2c_dev->dev,
+				TEGRA_I2C_BATCH_BUF_SIZE, &b->rx_phys,
+				GFP_KERNEL);
+		if (!b->tx_buf || !b->rx_buf) {
+			tegra_i2c_batch_free(i2c_dev);
+			return -ENOMEM;
+		}
+	}
+
+	if (i2c_dev->batch_dma_probed || i2c_dev->is_dvc)
+		return 0;
+
+	dma_chan = tegra_i2c_batch_request_dma(i2c_dev, false);
+	if (!IS_ERR(dma_chan)) {
+		i2c_dev->tx_dma_chan = dma_chan;
+		dma_chan = tegra_i2c_batch_request_dma(i2c_dev, true);
+		if (!IS_ERR(dma_chan))
+			i2c_dev->rx_dma_chan = dma_chan;
+	}
+
+	if (IS_ERR(dma_chan)) {
+		tegra_i2c_batch_release_dma(i2c_dev);
+		/* APB DMA may not have probed yet, ask again next time */
+		if (PTR_ERR(dma_chan) == -EPROBE_DEFER)
+			return 0;
+		dev_info(i2c_dev->dev, "no DMA for async batches, using PIO\n");
+	}
+	i2c_dev->batch_dma_probed = true;
+	return 0;
+}
+
+static void tegra_i2c_req_words(struct tegra_i2c_async_req *req,
+	size_t *tx_words, size_t *rx_words)
+{
+	int i;
+
+	for (i = 0; i < req->num; i++) {
+		size_t words = DIV_ROUND_UP(req->msgs[i].len,
+					    BYTES_PER_FIFO_WORD);
+
+		*tx_words += I2C_PACKET_HEADER_WORDS;
+		if (req->msgs[i].flags & I2C_M_RD)
+			*rx_words += words;
+		else
+			*tx_words += words;
+	}
+}
+
+/*
+ * Moves as many queued requests as fit the bounce buffers onto @batch.  A
+ * request that cannot fit even on its own is taken off the queue and
+ * returned so the caller can push it through tegra_i2c_xfer().
+ */
+static struct tegra_i2c_async_req *tegra_i2c_batch_collect(
+	struct tegra_i2c_dev *i2c_dev, struct list_head *batch)
+{
+	const size_t max_words = TEGRA_I2C_BATCH_BUF_SIZE / BYTES_PER_FIFO_WORD;
+	struct tegra_i2c_async_req *req, *tmp, *oversized = NULL;
+	size_t tx_words = 0, rx_words = 0;
+	unsigned long flags;
+	int msgs = 0;
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	list_for_each_entry_safe(req, tmp, &i2c_dev->async_queue, node) {
+		size_t req_tx = 0, req_rx = 0;
+
+		tegra_i2c_req_words(req, &req_tx, &req_rx);
+		if (!i2c_dev->batch_ctx.tx_buf ||
+		    tx_words + req_tx > max_words ||
+		    rx_words + req_rx > max_words ||
+		    msgs + req->num > TEGRA_I2C_BATCH_MAX_MSGS) {
+			if (list_empty(batch)) {
+				oversized = req;
+				list_del(&req->node);
+				i2c_dev->stats.oversized++;
+			}
+			break;
+		}
+
+		tx_words += req_tx;
+		rx_words += req_rx;
+		msgs += req->num;
+		list_move_tail(&req->node, batch);
+	}
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
+	return oversized;
+}
+
+static void tegra_i2c_batch_build(struct tegra_i2c_dev *i2c_dev,
+	struct list_head *batch)
+{
+	struct tegra_i2c_batch *b = &i2c_dev->batch_ctx;
+	struct tegra_i2c_async_req *req;
+	int i;
+
+	b->tx_words = 0;
+	b->rx_words = 0;
+	b->msgs = 0;
+
+	list_for_each_entry(req, batch, node) {
+		for (i = 0; i < req->num; i++) {
+			struct i2c_msg *msg = &req->msgs[i];
+			enum msg_end_type end_state = MSG_END_STOP;
+			size_t words = DIV_ROUND_UP(msg->len,
+						    BYTES_PER_FIFO_WORD);
+
+			if (i < req->num - 1) {
+				if (req->msgs[i + 1].flags & I2C_M_NOSTART)
+					end_state = MSG_END_CONTINUE;
+				else
+					end_state = MSG_END_REPEAT_START;
+			}
+
+			/* packet ids start at 1 and index the batch */
+			b->msgs++;
+			b->tx_buf[b->tx_words++] = PACKET_HEADER0_PROTOCOL_I2C |
+			    (i2c_dev->cont_id << PACKET_HEADER0_CONT_ID_SHIFT) |
+			    (b->msgs << PACKET_HEADER0_PACKET_ID_SHIFT);
+			b->tx_buf[b->tx_words++] = msg->len - 1;
+			b->last_io_header = b->tx_words;
+			b->tx_buf[b->tx_words++] =
+				tegra_i2c_io_header(i2c_dev, msg, end_state);
+
+			if (msg->flags & I2C_M_RD) {
+				b->rx_words += words;
+				continue;
+			}
+			memcpy(b->tx_buf + b->tx_words, msg->buf, msg->len);
+			b->tx_words += words;
+		}
+	}
+
+	b->tx_buf[b->last_io_header] |= I2C_HEADER_IE_ENABLE;
+}
+
+static int tegra_i2c_batch_start_dma(struct tegra_i2c_dev *i2c_dev,
+	struct tegra_i2c_batch *b)
+{
+	struct dma_async_tx_descriptor *desc;
+
+	if (b->rx_words) {
+		INIT_COMPLETION(i2c_dev->rx_dma_complete);
+		desc = dmaengine_prep_slave_single(i2c_dev->rx_dma_chan,
+				b->rx_phys, b->rx_words * BYTES_PER_FIFO_WORD,
+				DMA_DEV_TO_MEM,
+				DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+		if (!desc) {
+			dev_err(i2c_dev->dev, "Not able to get desc for Rx\n");
+			return -EIO;
+		}
+		desc->callback = tegra_i2c_batch_dma_complete;
+		desc->callback_param = &i2c_dev->rx_dma_complete;
+		i2c_dev->rx_dma_cookie = dmaengine_submit(desc);
+		dma_async_issue_pending(i2c_dev->rx_dma_chan);
+	}
+
+	INIT_COMPLETION(i2c_dev->tx_dma_complete);
+	desc = dmaengine_prep_slave_single(i2c_dev->tx_dma_chan,
+			b->tx_phys, b->tx_words * BYTES_PER_FIFO_WORD,
+			DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc) {
+		dev_err(i2c_dev->dev, "Not able to get desc for Tx\n");
+		if (b->rx_words)
+			dmaengine_terminate_all(i2c_dev->rx_dma_chan);
+		return -EIO;
+	}
+	desc->callback = tegra_i2c_batch_dma_complete;
+	desc->callback_param = &i2c_dev->tx_dma_complete;
+	dmaengine_submit(desc);
+	dma_async_issue_pending(i2c_dev->tx_dma_chan);
+	return 0;
+}
+
+/*
+ * The controller interrupt can beat the DMA callbacks, so wait for them on
+ * success.  On failure account what reached @rx_buf and stop the channels.
+ */
+static int tegra_i2c_batch_stop_dma(struct tegra_i2c_dev *i2c_dev,
+	struct tegra_i2c_batch *b, int ret)
+{
+	struct dma_tx_state state;
+
+	if (!ret && !wait_for_completion_timeout(&i2c_dev->tx_dma_complete,
+						 TEGRA_I2C_TIMEOUT))
+		ret = -ETIMEDOUT;
+	if (!ret && b->rx_words &&
+	    !wait_for_completion_timeout(&i2c_dev->rx_dma_complete,
+					 TEGRA_I2C_TIMEOUT))
+		ret = -ETIMEDOUT;
+
+	if (!ret) {
+		b->rx_pos = b->rx_words;
+		return 0;
+	}
+
+	if (b->rx_words) {
+		dmaengine_tx_status(i2c_dev->rx_dma_chan,
+				    i2c_dev->rx_dma_cookie, &state);
+		b->rx_pos = b->rx_words -
+			DIV_ROUND_UP(state.residue, BYTES_PER_FIFO_WORD);
+		dmaengine_terminate_all(i2c_dev->rx_dma_chan);
+	}
+	dmaengine_terminate_all(i2c_dev->tx_dma_chan);
+	return ret;
+}
+
+static int tegra_i2c_batch_xfer(struct tegra_i2c_dev *i2c_dev,
+	struct tegra_i2c_batch *b)
+{
+	unsigned long flags;
+	u32 int_mask, cnfg, val;
+	u32 pkt;
+	int ret;
+
+	/* PIO is cheaper as long as the FIFOs never need a refill */
+	b->dma = batch_dma && i2c_dev->tx_dma_chan &&
+		(b->tx_words > I2C_FIFO_DEPTH_WORDS ||
+		 b->rx_words > I2C_FIFO_DEPTH_WORDS);
+	b->tx_pos = 0;
+	b->rx_pos = 0;
+	b->failed = 0;
+
+	tegra_i2c_flush_fifos(i2c_dev);
+
+	i2c_dev->msg_buf_remaining = 0;
+	i2c_dev->msg_err = I2C_ERR_NONE;
+	i2c_dev->msg_read = 0;
+	/* a single packet may complete on PACKET_XFER_COMPLETE */
+	i2c_dev->use_single_xfer_complete = b->msgs == 1;
+	INIT_COMPLETION(i2c_dev->msg_complete);
+
+	cnfg = I2C_CNFG_NEW_MASTER_FSM | I2C_CNFG_PACKET_MODE_EN
+		| (0x2 << I2C_CNFG_DEBOUNCE_CNT_SHIFT);
+	i2c_writel(i2c_dev, cnfg, I2C_CNFG);
+	ret = tegra_i2c_load_config(i2c_dev);
+	if (ret)
+		return ret;
+	i2c_writel(i2c_dev, 0, I2C_INT_MASK);
+
+	/* DMA moves single words, so request it for every free/full word */
+	if (b->dma)
+		val = 0;
+	else
+		val = 7 << I2C_FIFO_CONTROL_TX_TRIG_SHIFT |
+			0 << I2C_FIFO_CONTROL_RX_TRIG_SHIFT;
+	i2c_writel(i2c_dev, val, I2C_FIFO_CONTROL);
+
+	int_mask = I2C_INT_NO_ACK | I2C_INT_ARBITRATION_LOST
+					| I2C_INT_TX_FIFO_OVERFLOW;
+	if (i2c_dev->chipdata->has_xfer_complete_interrupt)
+		int_mask |= I2C_INT_PACKET_XFER_COMPLETE |
+			I2C_INT_ALL_PACKETS_XFER_COMPLETE;
+
+	if (!(i2c_dev->use_single_xfer_complete &&
+			i2c_dev->chipdata->has_xfer_complete_interrupt))
+		int_mask |= I2C_INT_ALL_PACKETS_XFER_COMPLETE;
+
+	spin_lock_irqsave(&i2c_dev->fifo_lock, flags);
+	i2c_dev->batch = b;
+	if (!b->dma) {
+		tegra_i2c_batch_fill_tx(i2c_dev, b);
+		if (b->tx_pos < b->tx_words)
+			int_mask |= I2C_INT_TX_FIFO_DATA_REQ;
+		if (b->rx_words)
+			int_mask |= I2C_INT_RX_FIFO_DATA_REQ;
+	}
+	spin_unlock_irqrestore(&i2c_dev->fifo_lock, flags);
+
+	if (b->dma) {
+		ret = tegra_i2c_batch_start_dma(i2c_dev, b);
+		if (ret) {
+			b->dma = false;
+			goto out;
+		}
+	}
+
+	if (i2c_dev->is_dvc)
+		dvc_i2c_unmask_irq(i2c_dev, DVC_CTRL_REG3_I2C_DONE_INTR_EN);
+	tegra_i2c_unmask_irq(i2c_dev, int_mask);
+
+	if (!wait_for_completion_timeout(&i2c_dev->msg_complete,
+					 TEGRA_I2C_TIMEOUT)) {
+		dev_err(i2c_dev->dev, "async batch of %d msgs timed out\n",
+			b->msgs);
+		ret = -ETIMEDOUT;
+	}
+
+	tegra_i2c_mask_irq(i2c_dev, int_mask);
+	if (i2c_dev->is_dvc)
+		dvc_i2c_mask_irq(i2c_dev, DVC_CTRL_REG3_I2C_DONE_INTR_EN);
+
+	if (!ret && i2c_dev->msg_err != I2C_ERR_NONE) {
+		if (i2c_dev->msg_err == I2C_ERR_NO_ACK)
+			ret = -EREMOTEIO;
+		else if (i2c_dev->msg_err & (I2C_ERR_ARBITRATION_LOST |
+					     I2C_ERR_UNEXPECTED_STATUS))
+			ret = -EAGAIN;
+		else
+			ret = -EIO;
+	}
+
+	if (b->dma)
+		ret = tegra_i2c_batch_stop_dma(i2c_dev, b, ret);
+	else
+		tegra_i2c_batch_drain_rx(i2c_dev, b);
+
+	if (ret) {
+		/* packets ahead of the one on the bus have completed */
+		pkt = (i2c_readl(i2c_dev, I2C_PACKET_TRANSFER_STATUS) &
+		       I2C_PACKET_TRANSFER_PKT_ID_MASK) >>
+			I2C_PACKET_TRANSFER_PKT_ID_SHIFT;
+		if (pkt && pkt <= b->msgs)
+			b->failed = pkt - 1;
+	}
+
+out:
+	spin_lock_irqsave(&i2c_dev->fifo_lock, flags);
+	i2c_dev->batch = NULL;
+	spin_unlock_irqrestore(&i2c_dev->fifo_lock, flags);
+
+	cnfg = i2c_readl(i2c_dev, I2C_CNFG);
+	i2c_writel(i2c_dev, cnfg & ~I2C_CNFG_PACKET_MODE_EN, I2C_CNFG);
+	tegra_i2c_load_config(i2c_dev);
+
+	if (ret) {
+		/* let the STOP after a NACK reach the bus before the reset */
+		if (i2c_dev->msg_err == I2C_ERR_NO_ACK)
+			udelay(DIV_ROUND_UP(2 * 1000000,
+					    i2c_dev->bus_clk_rate));
+		if (tegra_i2c_init(i2c_dev))
+			WARN_ON(1);
+	}
+	return ret;
+}
+
+/*
+ * Hands out results in queue order.  The request owning the failed packet
+ * gets the error, the ones behind it never reached the bus and go back to
+ * the head of the queue.
+ */
+static void tegra_i2c_batch_finish(struct tegra_i2c_dev *i2c_dev, int err,
+	struct list_head *batch, struct list_head *done)
+{
+	struct tegra_i2c_batch *b = &i2c_dev->batch_ctx;
+	struct tegra_i2c_async_req *req, *tmp;
+	size_t rx_off = 0;
+	unsigned long flags;
+	int pkt = 0, requeued = 0;
+	int i;
+
+	list_for_each_entry_safe(req, tmp, batch, node) {
+		size_t tx_words = 0, rx_words = 0;
+		u32 *rx = b->rx_buf + rx_off;
+
+		tegra_i2c_req_words(req, &tx_words, &rx_words);
+		if (err && pkt + req->num > b->failed) {
+			req->status = err;
+		} else if (rx_off + rx_words > b->rx_pos) {
+			err = -EIO;
+			req->status = err;
+		} else {
+			for (i = 0; i < req->num; i++) {
+				struct i2c_msg *msg = &req->msgs[i];
+
+				if (!(msg->flags & I2C_M_RD))
+					continue;
+				memcpy(msg->buf, rx, msg->len);
+				rx += DIV_ROUND_UP(msg->len,
+						   BYTES_PER_FIFO_WORD);
+			}
+			req->status = req->num;
+		}
+
+		rx_off += rx_words;
+		pkt += req->num;
+		list_move_tail(&req->node, done);
+		if (req->status < 0)
+			break;
+	}
+
+	if (list_empty(batch))
+		return;
+
+	list_for_each_entry(req, batch, node)
+		requeued++;
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	list_splice(batch, &i2c_dev->async_queue);
+	i2c_dev->stats.requeued += requeued;
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+}
+
+static void tegra_i2c_batch_run(struct tegra_i2c_dev *i2c_dev,
+	struct list_head *done)
+{
+	struct tegra_i2c_batch *b = &i2c_dev->batch_ctx;
+	struct i2c_adapter *adap = &i2c_dev->adapter;
+	struct tegra_i2c_async_req *req;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	ktime_t start;
+	u64 busy_ns;
+	int ret;
+
+	if (i2c_dev->is_suspended || i2c_dev->is_shutdown ||
+	    adap->atomic_xfer_only) {
+		spin_lock_irqsave(&i2c_dev->async_lock, flags);
+		list_splice_tail_init(&i2c_dev->async_queue, done);
+		spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+		list_for_each_entry(req, done, node)
+			req->status = -EBUSY;
+		return;
+	}
+
+	/* without bounce buffers every request takes the oversized path */
+	tegra_i2c_batch_init(i2c_dev);
+
+	req = tegra_i2c_batch_collect(i2c_dev, &batch);
+	if (req) {
+		req->status = tegra_i2c_xfer(adap, req->msgs, req->num);
+		list_add_tail(&req->node, done);
+		return;
+	}
+	if (list_empty(&batch))
+		return;
+
+	tegra_i2c_batch_build(i2c_dev, &batch);
+
+	pm_runtime_get_sync(&adap->dev);
+	ret = tegra_i2c_clock_enable(i2c_dev);
+	if (ret < 0) {
+		dev_err(i2c_dev->dev, "Clock enable failed %d\n", ret);
+		pm_runtime_put(&adap->dev);
+		list_for_each_entry(req, &batch, node)
+			req->status = ret;
+		list_splice_tail(&batch, done);
+		return;
+	}
+
+	start = ktime_get();
+	ret = tegra_i2c_batch_xfer(i2c_dev, b);
+	busy_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	tegra_i2c_clock_disable(i2c_dev);
+	pm_runtime_put(&adap->dev);
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	i2c_dev->stats.batches++;
+	if (b->dma)
+		i2c_dev->stats.dma_batches++;
+	i2c_dev->stats.batch_msgs += b->msgs;
+	i2c_dev->stats.batch_max_msgs = max_t(u32,
+			i2c_dev->stats.batch_max_msgs, b->msgs);
+	i2c_dev->stats.busy_ns += busy_ns;
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
+	tegra_i2c_batch_finish(i2c_dev, ret, &batch, done);
+}
+
+static void tegra_i2c_async_complete(struct tegra_i2c_dev *i2c_dev,
+	struct list_head *done)
+{
+	struct tegra_i2c_async_req *req, *tmp;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	list_for_each_entry(req, done, node) {
+		ns = ktime_to_ns(ktime_sub(now, req->queued));
+		i2c_dev->stats.async_done++;
+		i2c_dev->stats.latency_ns += ns;
+		i2c_dev->stats.latency_max_ns = max(
+				i2c_dev->stats.latency_max_ns, ns);
+		if (req->status < 0)
+			i2c_dev->stats.async_errors++;
+	}
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
+	list_for_each_entry_safe(req, tmp, done, node) {
+		list_del(&req->node);
+		/*
+		 * Clear before the callback so it can resubmit; a resubmitted
+		 * request is only picked up by this thread after it returns.
+		 */
+		clear_bit_unlock(TEGRA_I2C_REQ_PENDING, &req->flags);
+		req->complete(req);
+	}
+}
+
+static void tegra_i2c_async_work(struct kthread_work *work)
+{
+	struct tegra_i2c_dev *i2c_dev = container_of(work,
+					struct tegra_i2c_dev, async_work);
+	unsigned long flags;
+	LIST_HEAD(done);
+	bool empty;
+
+	for (;;) {
+		spin_lock_irqsave(&i2c_dev->async_lock, flags);
+		empty = list_empty(&i2c_dev->async_queue);
+		spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+		if (empty)
+			break;
+
+		i2c_lock_adapter(&i2c_dev->adapter);
+		tegra_i2c_batch_run(i2c_dev, &done);
+		i2c_unlock_adapter(&i2c_dev->adapter);
+
+		/* without the bus lock, callbacks may use i2c_transfer() */
+		tegra_i2c_async_complete(i2c_dev, &done);
+	}
+}
+
+/**
+ * tegra_i2c_async_submit - queue a transfer without waiting for it
+ * @adap: Tegra I2C adapter
+ * @req: transfer to queue, owned by the driver until @req->complete runs
+ *
+ * May be called from any context.  Returns -EBUSY if @req is still queued
+ * and -EINVAL for adapters of another driver or messages the packet engine
+ * cannot express.
+ */
+int tegra_i2c_async_submit(struct i2c_adapter *adap,
+	struct tegra_i2c_async_req *req)
+{
+	struct tegra_i2c_dev *i2c_dev;
+	unsigned long flags;
+	int i;
+
+	if (adap->algo != &tegra_i2c_algo || !req->complete || req->num <= 0)
+		return -EINVAL;
+	i2c_dev = i2c_get_adapdata(adap);
+
+	for (i = 0; i < req->num; i++) {
+		struct i2c_msg *msg = &req->msgs[i];
+
+		if (!msg->len || msg->len > I2C_MAX_PAYLOAD ||
+		    (msg->flags & I2C_M_RECV_LEN))
+			return -EINVAL;
+		if ((msg->flags & I2C_M_NOSTART) &&
+		    (!i || !i2c_dev->chipdata->has_continue_xfer_support))
+			return -EINVAL;
+	}
+
+	if (test_and_set_bit_lock(TEGRA_I2C_REQ_PENDING, &req->flags))
+		return -EBUSY;
+
+	req->queued = ktime_get();
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	list_add_tail(&req->node, &i2c_dev->async_queue);
+	i2c_dev->stats.async_reqs++;
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
+	/* the work stays queued until the worker thread is up */
+	queue_kthread_work(&i2c_dev->async_worker, &i2c_dev->async_work);
+	if (unlikely(!ACCESS_ONCE(i2c_dev->async_task)))
+		schedule_work(&i2c_dev->async_start_work);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(tegra_i2c_async_submit);
+
+/*
+ * Most adapters never see an async request, so the RT worker thread is
+ * only created once the first one is submitted.  Submission may happen in
+ * atomic context, hence the detour through the system workqueue.
+ */
+static void tegra_i2c_async_start(struct work_struct *work)
+{
+	struct tegra_i2c_dev *i2c_dev = container_of(work,
+					struct tegra_i2c_dev, async_start_work);
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+	struct tegra_i2c_async_req *req;
+	struct task_struct *task;
+	unsigned long flags;
+	LIST_HEAD(failed);
+
+	if (i2c_dev->async_task)
+		return;
+
+	task = kthread_create(kthread_worker_fn, &i2c_dev->async_worker,
+			      "%s", dev_name(i2c_dev->dev));
+	if (IS_ERR(task)) {
+		dev_err(i2c_dev->dev, "failed to create async thread\n");
+		/* nothing will run them; the next submit tries again */
+		spin_lock_irqsave(&i2c_dev->async_lock, flags);
+		list_splice_init(&i2c_dev->async_queue, &failed);
+		spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+		list_for_each_entry(req, &failed, node)
+			req->status = PTR_ERR(task);
+		tegra_i2c_async_complete(i2c_dev, &failed);
+		return;
+	}
+
+	/* sensor polling wants the bus as soon as its timer fires */
+	sched_setscheduler(task, SCHED_FIFO, &param);
+	i2c_dev->async_task = task;
+	wake_up_process(task);
+}
+
+static void tegra_i2c_async_flush(struct tegra_i2c_dev *i2c_dev)
+{
+	flush_work(&i2c_dev->async_start_work);
+	if (i2c_dev->async_task)
+		flush_kthread_worker(&i2c_dev->async_worker);
+}
+
+static enum hrtimer_restart tegra_i2c_periodic_fn(struct hrtimer *timer)
+{
+	struct tegra_i2c_periodic_job *job = container_of(timer,
+					struct tegra_i2c_periodic_job, timer);
+	struct tegra_i2c_dev *i2c_dev = i2c_get_adapdata(job->adap);
+
+	if (tegra_i2c_async_submit(job->adap, &job->req) == -EBUSY) {
+		job->overruns++;
+		spin_lock(&i2c_dev->async_lock);
+		i2c_dev->stats.overruns++;
+		spin_unlock(&i2c_dev->async_lock);
+	}
+
+	hrtimer_forward_now(timer, job->period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * tegra_i2c_periodic_start - submit @job->req every @job->period
+ * @adap: Tegra I2C adapter
+ * @job: job with req and period filled in
+ *
+ * A period that finds the previous run still queued is skipped and counted
+ * in @job->overruns.
+ */
+int tegra_i2c_periodic_start(struct i2c_adapter *adap,
+	struct tegra_i2c_periodic_job *job)
+{
+	s64 period = ktime_to_ns(job->period);
+	u64 first;
+
+	if (adap->algo != &tegra_i2c_algo || period <= 0 || !job->req.complete)
+		return -EINVAL;
+
+	job->adap = adap;
+	job->overruns = 0;
+	hrtimer_init(&job->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	job->timer.function = tegra_i2c_periodic_fn;
+
+	/* align to the period so that jobs with equal rates share batches */
+	first = div64_u64(ktime_to_ns(ktime_get()), period) + 1;
+	hrtimer_start(&job->timer, ns_to_ktime(first * period),
+		      HRTIMER_MODE_ABS);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(tegra_i2c_periodic_start);
+
+/**
+ * tegra_i2c_periodic_stop - stop a periodic job and wait for its last run
+ * @job: job started by tegra_i2c_periodic_start()
+ *
+ * Must not be called from @job->req.complete.
+ */
+void tegra_i2c_periodic_stop(struct tegra_i2c_periodic_job *job)
+{
+	struct tegra_i2c_dev *i2c_dev = i2c_get_adapdata(job->adap);
+
+	hrtimer_cancel(&job->timer);
+	tegra_i2c_async_flush(i2c_dev);
+}
+EXPORT_SYMBOL_GPL(tegra_i2c_periodic_stop);
+
+static void tegra_i2c_async_init(struct tegra_i2c_dev *i2c_dev)
+{
+	init_completion(&i2c_dev->tx_dma_complete);
+	init_completion(&i2c_dev->rx_dma_complete);
+	init_kthread_worker(&i2c_dev->async_worker);
+	init_kthread_work(&i2c_dev->async_work, tegra_i2c_async_work);
+	INIT_WORK(&i2c_dev->async_start_work, tegra_i2c_async_start);
+}
+
+static void tegra_i2c_async_deinit(struct tegra_i2c_dev *i2c_dev)
+{
+	tegra_i2c_async_flush(i2c_dev);
+	if (i2c_dev->async_task)
+		kthread_stop(i2c_dev->async_task);
+	tegra_i2c_batch_free(i2c_dev);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int tegra_i2c_stats_show(struct seq_file *s, void *data)
+{
+	struct tegra_i2c_dev *i2c_dev = s->private;
+	struct tegra_i2c_stats st;
+	unsigned long flags;
+	u64 elapsed, busy;
+	u32 busy_frac;
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	st = i2c_dev->stats;
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+
+	elapsed = ktime_to_ns(ktime_get()) - st.since_ns ? : 1;
+	busy = div_u64_rem(div64_u64(st.busy_ns * 1000, elapsed), 10,
+			   &busy_frac);
+
+	seq_printf(s, "bus_busy        %llu.%u%%\n", busy, busy_frac);
+	seq_printf(s, "irqs            %llu\n", st.irqs);
+	seq_printf(s, "sync_xfers      %llu\n", st.sync_xfers);
+	seq_printf(s, "async_reqs      %llu\n", st.async_reqs);
+	seq_printf(s, "async_done      %llu\n", st.async_done);
+	seq_printf(s, "async_errors    %llu\n", st.async_errors);
+	seq_printf(s, "batches         %llu\n", st.batches);
+	seq_printf(s, "dma_batches     %llu\n", st.dma_batches);
+	seq_printf(s, "msgs_per_batch  %llu (max %u)\n",
+		   st.batches ? div64_u64(st.batch_msgs, st.batches) : 0,
+		   st.batch_max_msgs);
+	seq_printf(s, "requeued        %llu\n", st.requeued);
+	seq_printf(s, "oversized       %llu\n", st.oversized);
+	seq_printf(s, "overruns        %llu\n", st.overruns);
+	seq_printf(s, "latency_avg_us  %llu\n",
+		   st.async_done ? div64_u64(st.latency_ns,
+				st.async_done * NSEC_PER_USEC) : 0);
+	seq_printf(s, "latency_max_us  %llu\n",
+		   div_u64(st.latency_max_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static int tegra_i2c_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_i2c_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t tegra_i2c_stats_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct tegra_i2c_dev *i2c_dev = s->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&i2c_dev->async_lock, flags);
+	memset(&i2c_dev->stats, 0, sizeof(i2c_dev->stats));
+	i2c_dev->stats.since_ns = ktime_to_ns(ktime_get());
+	spin_unlock_irqrestore(&i2c_dev->async_lock, flags);
+	return count;
+}
+
+static const struct file_operations tegra_i2c_stats_fops = {
+	.open		= tegra_i2c_stats_open,
+	.read		= seq_read,
+	.write		= tegra_i2c_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_i2c_debugfs_init(struct tegra_i2c_dev *i2c_dev)
+{
+	i2c_dev->debugfs = debugfs_create_dir(dev_name(i2c_dev->dev), NULL);
+	if (IS_ERR_OR_NULL(i2c_dev->debugfs))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, i2c_dev->debugfs,
+			    i2c_dev, &tegra_i2c_stats_fops);
+}
+#else
+static inline void tegra_i2c_debugfs_init(struct tegra_i2c_dev *i2c_dev)
+{
+}
+#endif
+
 static int __tegra_i2c_suspend_noirq(struct tegra_i2c_dev *i2c_dev);
 static int __tegra_i2c_resume_noirq(struct tegra_i2c_dev *i2c_dev);
 
@@ -1474,6 +2506,7 @@ static int tegra_i2c_probe(struct platform_device *pdev)
 	struct clk *dvfs_ref_clk = NULL;
 	struct clk *dvfs_soc_clk = NULL;
 	void __iomem *base;
+	phys_addr_t phys;
 	int irq;
 	int ret = 0;
 	const struct tegra_i2c_chipdata *chip_data = NULL;
@@ -1506,6 +2539,7 @@ static int tegra_i2c_probe(struct platform_device *pdev)
 		dev_err(&pdev->dev, "no mem resource\n");
 		return -EINVAL;
 	}
+	phys = res->start;
 
 	base = devm_ioremap_resource(&pdev->dev, res);
 	if (IS_ERR(base))
@@ -1577,6 +2611,7 @@ static int tegra_i2c_probe(struct platform_device *pdev)
 skip_pinctrl:
 
 	i2c_dev->base = base;
+	i2c_dev->phys = phys;
 	i2c_dev->div_clk = div_clk;
 	if (i2c_dev->chipdata->has_fast_clock)
 		i2c_dev->fast_clk = fast_clk;
@@ -1604,6 +2639,10 @@ skip_pinctrl:
 
 	spin_lock_init(&i2c_dev->mem_lock);
 
+	spin_lock_init(&i2c_dev->async_lock);
+	INIT_LIST_HEAD(&i2c_dev->async_queue);
+	i2c_dev->stats.since_ns = ktime_to_ns(ktime_get());
+
 	platform_set_drvdata(pdev, i2c_dev);
 
 	if (i2c_dev->is_clkon_always)
@@ -1645,9 +2684,12 @@ skip_pinctrl:
 	if (pdata->timeout)
 		i2c_dev->adapter.timeout = pdata->timeout;
 
+	tegra_i2c_async_init(i2c_dev);
+
 	ret = i2c_add_numbered_adapter(&i2c_dev->adapter);
 	if (ret) {
 		dev_err(&pdev->dev, "Failed to add I2C adapter\n");
+		tegra_i2c_async_deinit(i2c_dev);
 		return ret;
 	}
 
@@ -1658,6 +2700,7 @@ skip_pinctrl:
 	of_i2c_register_devices(&i2c_dev->adapter);
 	pm_runtime_enable(&i2c_dev->adapter.dev);
 	tegra_i2c_gpio_init(i2c_dev);
+	tegra_i2c_debugfs_init(i2c_dev);
 
 	return 0;
 }
@@ -1666,8 +2709,10 @@ static int tegra_i2c_remove(struct platform_device *pdev)
 {
 	struct tegra_i2c_dev *i2c_dev = platform_get_drvdata(pdev);
 
+	debugfs_remove_recursive(i2c_dev->debugfs);
 	tegra_unregister_pm_notifier(&i2c_dev->pm_nb);
 	i2c_del_adapter(&i2c_dev->adapter);
+	tegra_i2c_async_deinit(i2c_dev);
 	pm_runtime_disable(&i2c_dev->adapter.dev);
 
 	if (i2c_dev->is_clkon_always)
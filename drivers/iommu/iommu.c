@@ -827,6 +827,8 @@ int iommu_map(struct iommu_domain *domain, unsigned long iova,
 	/* unroll mapping in case something went wrong */
 	if (ret)
 		iommu_unmap(domain, orig_iova, orig_size - size);
+	else if (domain->ops->iotlb_sync)
+		domain->ops->iotlb_sync(domain);
 
 	return ret;
 }
@@ -857,7 +859,8 @@ int iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 	return err;
 }
 
-size_t iommu_unmap(struct iommu_domain *domain, unsigned long iova, size_t size)
+static size_t __iommu_unmap(struct iommu_domain *domain, unsigned long iova,
+			    size_t size)
 {
 	size_t unmapped_page, unmapped = 0;
 	unsigned int min_pagesz;
@@ -903,8 +906,51 @@ size_t iommu_unmap(struct iommu_domain *domain, unsigned long iova, size_t size)
 
 	return unmapped;
 }
+
+size_t iommu_unmap(struct iommu_domain *domain, unsigned long iova, size_t size)
+{
+	size_t unmapped;
+
+	unmapped = __iommu_unmap(domain, iova, size);
+	if (domain->ops->iotlb_sync)
+		domain->ops->iotlb_sync(domain);
+
+	return unmapped;
+}
 EXPORT_SYMBOL_GPL(iommu_unmap);
 
+/**
+ * iommu_unmap_deferred - unmap a range without waiting for the IOTLB
+ * @domain: the domain to unmap from
+ * @iova: start of the range
+ * @size: size of the range
+ * @release: called once the IOTLB no longer holds the range, may be NULL
+ * @data: passed to @release
+ *
+ * The range must not be mapped again before @release is called. Drivers
+ * without @iotlb_defer get a plain iommu_unmap() and @release is called
+ * before returning.
+ */
+size_t iommu_unmap_deferred(struct iommu_domain *domain, unsigned long iova,
+			    size_t size, iommu_iova_release_t release,
+			    void *data)
+{
+	size_t unmapped;
+
+	if (!domain->ops->iotlb_defer) {
+		unmapped = iommu_unmap(domain, iova, size);
+		if (release)
+			release(data, iova, size);
+		return unmapped;
+	}
+
+	unmapped = __iommu_unmap(domain, iova, size);
+	domain->ops->iotlb_defer(domain, iova, size, release, data);
+
+	return unmapped;
+}
+EXPORT_SYMBOL_GPL(iommu_unmap_deferred);
+
 
 int iommu_domain_window_enable(struct iommu_domain *domain, u32 wnd_nr,
 			       phys_addr_t paddr, u64 size, int prot)
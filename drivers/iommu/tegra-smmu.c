@@ -39,6 +39,7 @@
 #include <linux/dma-mapping.h>
 #include <linux/bitops.h>
 #include <linux/tegra-soc.h>
+#include <linux/timer.h>
 
 #include <asm/page.h>
 #include <asm/cacheflush.h>
@@ -228,6 +229,12 @@ static struct device *save_smmu_device;
 
 static size_t smmu_flush_all_th_pages = SZ_512; /* number of threshold pages */
 
+/* Queue the invalidations of DMA API unmaps instead of waiting for them */
+static u32 smmu_defer_unmap = 1;
+
+/* Map physically contiguous, 4MB aligned runs of map_sg as sections */
+static u32 smmu_map_sections = 1;
+
 static const u32 smmu_asid_security_ofs[] = {
 	SMMU_ASID_SECURITY,
 	SMMU_ASID_SECURITY_1,
@@ -266,6 +273,36 @@ struct smmu_client {
 	u64			swgids;
 };
 
+/*
+ * Unmapped range whose IOVA is held back until the TLB and PTC no longer
+ * hold it.
+ */
+struct smmu_fq_entry {
+	unsigned long		iova;
+	size_t			size;
+	iommu_iova_release_t	release;
+	void			*data;
+};
+
+#define SMMU_FQ_SIZE		32
+#define SMMU_FQ_TIMEOUT_MS	10
+#define SMMU_FQ_SYNC_DRAIN	(SMMU_FQ_SIZE / 2)
+
+struct smmu_flush_stats {
+	u64	range;		/* ranged invalidations */
+	u64	range_pages;	/* pages covered by ranged invalidations */
+	u64	all;		/* whole AS invalidations */
+	u64	deferred;	/* unmaps put on the flush queue */
+	u64	fq_drain;	/* flush queue drains */
+	u64	time_ns;	/* time spent invalidating */
+};
+
+struct smmu_map_stats {
+	u64	sections;	/* 4MB section PDEs written */
+	u64	pages;		/* 4KB PTEs written */
+	u64	ptbls;		/* page tables allocated */
+};
+
 /*
  * Per address space
  */
@@ -279,6 +316,24 @@ struct smmu_as {
 	u32			pte_attr;
 	unsigned int		*pte_count;
 
+	/*
+	 * Invalidations left pending by map and unmap, and the page tables
+	 * that can only be freed once they are done. Protected by lock.
+	 */
+	dma_addr_t		dirty_start;
+	dma_addr_t		dirty_end;
+	struct list_head	ptbl_free;
+
+	/* Flush queue of deferred unmaps, protected by lock */
+	struct smmu_fq_entry	fq[SMMU_FQ_SIZE];
+	unsigned int		fq_count;
+	dma_addr_t		fq_start;
+	dma_addr_t		fq_end;
+	struct timer_list	fq_timer;
+
+	struct smmu_flush_stats	stats;
+	struct smmu_map_stats	map_stats;
+
 	struct list_head	client;
 	spinlock_t		client_lock; /* for client list */
 };
@@ -629,10 +684,10 @@ static void ____smmu_flush_tlb_range(struct smmu_device *smmu, dma_addr_t iova,
 }
 #endif
 
-static void flush_ptc_and_tlb_range(struct smmu_device *smmu,
-				    struct smmu_as *as, dma_addr_t iova,
-				    u32 *pte, struct page *page,
-				    size_t count)
+static void __flush_ptc_and_tlb_range(struct smmu_device *smmu,
+				      struct smmu_as *as, dma_addr_t iova,
+				      u32 *pte, struct page *page,
+				      size_t count)
 {
 	size_t unit = SZ_16K;
 	dma_addr_t end = iova + count * PAGE_SIZE;
@@ -652,8 +707,6 @@ static void flush_ptc_and_tlb_range(struct smmu_device *smmu,
 			iova += unit;
 		}
 	}
-
-	FLUSH_SMMU_REGS(smmu);
 }
 
 static inline void flush_ptc_and_tlb_all(struct smmu_device *smmu,
@@ -668,16 +721,29 @@ static void free_ptbl(struct smmu_as *as, dma_addr_t iova, bool flush)
 	u32 *pdir = (u32 *)page_address(as->pdir_page);
 
 	if (pdir[pdn] != _PDE_VACANT(pdn)) {
+		struct page *page = SMMU_EX_PTBL_PAGE(pdir[pdn]);
+		bool section = !(pdir[pdn] & _PDE_NEXT);
+
 		dev_dbg(as->smmu->dev, "pdn: %x\n", pdn);
 
-		__free_page(SMMU_EX_PTBL_PAGE(pdir[pdn]));
 		pdir[pdn] = _PDE_VACANT(pdn);
 		FLUSH_CPU_DCACHE(&pdir[pdn], as->pdir_page, sizeof pdir[pdn]);
-		if (!flush)
+		if (section) {
+			/* maps memory directly, there is no table to free */
+			if (flush)
+				flush_ptc_and_tlb(as->smmu, as, iova,
+						  &pdir[pdn], as->pdir_page, 1);
+			return;
+		}
+		if (!flush) {
+			/* the PTC may still point at it until invalidated */
+			list_add(&page->lru, &as->ptbl_free);
 			return;
+		}
 
 		flush_ptc_and_tlb(as->smmu, as, iova, &pdir[pdn],
 				  as->pdir_page, 1);
+		__free_page(page);
 	}
 }
 
@@ -744,6 +810,132 @@ static void flush_ptc_and_tlb_as(struct smmu_as *as, dma_addr_t start,
 	FLUSH_SMMU_REGS(smmu);
 }
 
+/*
+ * Invalidate the PDEs, PTEs and TLB entries of [start, end) with a single
+ * register read-back, or the whole AS if the range is large.
+ * Caller must hold as->lock.
+ */
+static void smmu_flush_range(struct smmu_as *as, dma_addr_t start,
+			     dma_addr_t end)
+{
+	struct smmu_device *smmu = as->smmu;
+	u32 *pdir = page_address(as->pdir_page);
+	size_t pages = (end - start) >> PAGE_SHIFT;
+	dma_addr_t iova = start;
+	u64 t0 = local_clock();
+
+	if (pages > smmu_flush_all_th_pages) {
+		flush_ptc_and_tlb_as(as, start, end);
+		as->stats.all++;
+		goto out;
+	}
+
+	while (iova < end) {
+		int pdn = SMMU_ADDR_TO_PDN(iova);
+		dma_addr_t next = min_t(dma_addr_t, end,
+					SMMU_PDN_TO_ADDR(pdn + 1));
+
+		__smmu_flush_ptc(smmu, &pdir[pdn], as->pdir_page);
+		if (pdir[pdn] & _PDE_NEXT) {
+			struct page *page = SMMU_EX_PTBL_PAGE(pdir[pdn]);
+			u32 *ptbl = page_address(page);
+
+			__flush_ptc_and_tlb_range(smmu, as, iova,
+						  &ptbl[SMMU_ADDR_TO_PTN(iova)],
+						  page,
+						  (next - iova) >> PAGE_SHIFT);
+		} else {
+			__smmu_flush_tlb_section(as, iova);
+		}
+
+		if (pdn == SMMU_PTBL_COUNT - 1)
+			break;
+		iova = next;
+	}
+	FLUSH_SMMU_REGS(smmu);
+	as->stats.range++;
+	as->stats.range_pages += pages;
+out:
+	as->stats.time_ns += local_clock() - t0;
+}
+
+static void smmu_mark_dirty(struct smmu_as *as, dma_addr_t iova, size_t bytes)
+{
+	if (as->dirty_start == as->dirty_end) {
+		as->dirty_start = iova;
+		as->dirty_end = iova + bytes;
+		return;
+	}
+
+	as->dirty_start = min_t(dma_addr_t, as->dirty_start, iova);
+	as->dirty_end = max_t(dma_addr_t, as->dirty_end, iova + bytes);
+}
+
+/*
+ * Do every invalidation pending on @as, then free the page tables waiting
+ * for it. The drained flush queue entries are moved to @done, to be
+ * released by the caller once as->lock is dropped.
+ * Caller must hold as->lock.
+ */
+static unsigned int smmu_flush_pending(struct smmu_as *as,
+				       struct smmu_fq_entry *done)
+{
+	dma_addr_t start = as->dirty_start, end = as->dirty_end;
+	unsigned int n = as->fq_count;
+	struct page *page, *tmp;
+
+	if (as->fq_start != as->fq_end) {
+		if (start == end) {
+			start = as->fq_start;
+			end = as->fq_end;
+		} else {
+			start = min_t(dma_addr_t, start, as->fq_start);
+			end = max_t(dma_addr_t, end, as->fq_end);
+		}
+	}
+
+	if (start != end)
+		smmu_flush_range(as, start, end);
+
+	list_for_each_entry_safe(page, tmp, &as->ptbl_free, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+
+	as->dirty_start = as->dirty_end = 0;
+	as->fq_start = as->fq_end = 0;
+	if (n) {
+		memcpy(done, as->fq, n * sizeof(*done));
+		as->fq_count = 0;
+		as->stats.fq_drain++;
+	}
+	return n;
+}
+
+static void smmu_fq_release(struct smmu_fq_entry *done, unsigned int n)
+{
+	while (n--) {
+		if (done->release)
+			done->release(done->data, done->iova, done->size);
+		done++;
+	}
+}
+
+static void smmu_fq_timeout(unsigned long data)
+{
+	struct smmu_as *as = (struct smmu_as *)data;
+	struct smmu_fq_entry done[SMMU_FQ_SIZE];
+	unsigned long flags;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&as->lock, flags);
+	if (as->pdir_page)
+		n = smmu_flush_pending(as, done);
+	spin_unlock_irqrestore(&as->lock, flags);
+
+	smmu_fq_release(done, n);
+}
+
 static void free_pdir(struct smmu_as *as)
 {
 	unsigned long addr;
@@ -787,6 +979,7 @@ static struct page *alloc_ptbl(struct smmu_as *as, dma_addr_t iova, bool flush)
 	page = alloc_page(gfp);
 	if (!page)
 		return NULL;
+	as->map_stats.ptbls++;
 
 	ptbl = (u32 *)page_address(page);
 	if (IS_ENABLED(CONFIG_TEGRA_IOMMU_SMMU_LINEAR)) {
@@ -825,7 +1018,7 @@ static u32 *locate_pte(struct smmu_as *as,
 	} else if (!allocate) {
 		return NULL;
 	} else {
-		*ptbl_page_p = alloc_ptbl(as, iova, 1);
+		*ptbl_page_p = alloc_ptbl(as, iova, false);
 		if (!*ptbl_page_p)
 			return NULL;
 	}
@@ -922,15 +1115,18 @@ err_out:
 	return err;
 }
 
+/*
+ * The invalidation is left pending, to be done by iotlb_sync or the flush
+ * queue. Caller must hold as->lock.
+ */
 static size_t __smmu_iommu_unmap_pages(struct smmu_as *as, dma_addr_t iova,
 				       size_t bytes)
 {
 	int total = bytes >> PAGE_SHIFT;
 	u32 *pdir = page_address(as->pdir_page);
-	struct smmu_device *smmu = as->smmu;
-	unsigned long iova_base = iova;
-	bool flush_all = (total > smmu_flush_all_th_pages) ? true : false;
+	dma_addr_t start = iova;
 
+	smmu_mark_dirty(as, iova, bytes);
 	while (total > 0) {
 		int ptn = SMMU_ADDR_TO_PTN(iova);
 		int pdn = SMMU_ADDR_TO_PDN(iova);
@@ -939,12 +1135,18 @@ static size_t __smmu_iommu_unmap_pages(struct smmu_as *as, dma_addr_t iova,
 		u32 *pte;
 		int count;
 
-		if (!pfn_valid(page_to_pfn(page))) {
-			total -= SMMU_PDN_TO_ADDR(pdn + 1) - iova;
+		if (pdir[pdn] == _PDE_VACANT(pdn) ||
+		    !pfn_valid(page_to_pfn(page))) {
+			total -= (SMMU_PDN_TO_ADDR(pdn + 1) - iova) >>
+				 PAGE_SHIFT;
 			iova = SMMU_PDN_TO_ADDR(pdn + 1);
 			continue;
 		}
 
+		/* a section from map_sg; leave it to the caller */
+		if (!(pdir[pdn] & _PDE_NEXT))
+			break;
+
 		ptbl = page_address(page);
 		pte = &ptbl[ptn];
 		count = min_t(int, SMMU_PTBL_COUNT - ptn, total);
@@ -960,22 +1162,14 @@ static size_t __smmu_iommu_unmap_pages(struct smmu_as *as, dma_addr_t iova,
 
 			*rest -= count;
 			if (!*rest)
-				free_ptbl(as, iova, !flush_all);
-
-			if (!flush_all)
-				flush_ptc_and_tlb_range(smmu, as, iova, pte,
-							page, count);
+				free_ptbl(as, iova, false);
 		}
 
 		iova += PAGE_SIZE * count;
 		total -= count;
 	}
 
-	if (flush_all)
-		flush_ptc_and_tlb_as(as, iova_base,
-				     iova_base + bytes);
-
-	return bytes;
+	return min_t(size_t, bytes, iova - start);
 }
 
 static size_t __smmu_iommu_unmap_largepage(struct smmu_as *as, dma_addr_t iova)
@@ -985,14 +1179,13 @@ static size_t __smmu_iommu_unmap_largepage(struct smmu_as *as, dma_addr_t iova)
 
 	pdir[pdn] = _PDE_VACANT(pdn);
 	FLUSH_CPU_DCACHE(&pdir[pdn], as->pdir_page, sizeof pdir[pdn]);
-	flush_ptc_and_tlb(as->smmu, as, iova, &pdir[pdn], as->pdir_page, 1);
+	smmu_mark_dirty(as, iova, SZ_4M);
 	return SZ_4M;
 }
 
 static int __smmu_iommu_map_pfn(struct smmu_as *as, dma_addr_t iova,
 				unsigned long pfn, unsigned long prot)
 {
-	struct smmu_device *smmu = as->smmu;
 	u32 *pte;
 	unsigned int *count;
 	struct page *page;
@@ -1012,7 +1205,8 @@ static int __smmu_iommu_map_pfn(struct smmu_as *as, dma_addr_t iova,
 
 	*pte = SMMU_PFN_TO_PTE(pfn, attrs);
 	FLUSH_CPU_DCACHE(pte, page, sizeof(*pte));
-	flush_ptc_and_tlb(smmu, as, iova, pte, page, 0);
+	smmu_mark_dirty(as, iova, PAGE_SIZE);
+	as->map_stats.pages++;
 	put_signature(as, iova, pfn);
 	return 0;
 }
@@ -1042,7 +1236,8 @@ static int __smmu_iommu_map_largepage(struct smmu_as *as, dma_addr_t iova,
 
 	pdir[pdn] = SMMU_ADDR_TO_PDN(pa) << 10 | attrs;
 	FLUSH_CPU_DCACHE(&pdir[pdn], as->pdir_page, sizeof pdir[pdn]);
-	flush_ptc_and_tlb(as->smmu, as, iova, &pdir[pdn], as->pdir_page, 1);
+	smmu_mark_dirty(as, iova, SZ_4M);
+	as->map_stats.sections++;
 
 	return 0;
 }
@@ -1076,15 +1271,30 @@ static int smmu_iommu_map(struct iommu_domain *domain, unsigned long iova,
 	return err;
 }
 
+/*
+ * The PTEs of a whole map_pages or map_sg call are written first and then
+ * invalidated with a single read-back, instead of once per page table.
+ */
+static void smmu_flush_mapped(struct smmu_as *as, dma_addr_t start,
+			      dma_addr_t end)
+{
+	unsigned long flags;
+
+	if (start == end)
+		return;
+
+	spin_lock_irqsave(&as->lock, flags);
+	smmu_flush_range(as, start, end);
+	spin_unlock_irqrestore(&as->lock, flags);
+}
+
 static int smmu_iommu_map_pages(struct iommu_domain *domain, unsigned long iova,
 				struct page **pages, size_t total, unsigned long prot)
 {
 	struct smmu_as *as = domain->priv;
-	struct smmu_device *smmu = as->smmu;
 	u32 *pdir = page_address(as->pdir_page);
 	int err = 0;
 	unsigned long iova_base = iova;
-	bool flush_all = (total > smmu_flush_all_th_pages) ? true : false;
 	int attrs = as->pte_attr;
 
 	if (dma_get_attr(DMA_ATTR_READ_ONLY, (struct dma_attrs *)prot))
@@ -1106,13 +1316,18 @@ static int smmu_iommu_map_pages(struct iommu_domain *domain, unsigned long iova,
 		spin_lock_irqsave(&as->lock, flags);
 
 		if (pdir[pdn] == _PDE_VACANT(pdn)) {
-			tbl_page = alloc_ptbl(as, iova, !flush_all);
+			tbl_page = alloc_ptbl(as, iova, false);
 			if (!tbl_page) {
 				err = -ENOMEM;
 				spin_unlock_irqrestore(&as->lock, flags);
 				goto out;
 			}
 
+		} else if (!(pdir[pdn] & _PDE_NEXT)) {
+			/* already covered by a section */
+			err = -EBUSY;
+			spin_unlock_irqrestore(&as->lock, flags);
+			goto out;
 		} else {
 			tbl_page = SMMU_EX_PTBL_PAGE(pdir[pdn]);
 		}
@@ -1129,10 +1344,8 @@ static int smmu_iommu_map_pages(struct iommu_domain *domain, unsigned long iova,
 
 		pte = &ptbl[ptn];
 		FLUSH_CPU_DCACHE(pte, tbl_page, count * sizeof(u32 *));
-		if (!flush_all)
-			flush_ptc_and_tlb_range(smmu, as, iova, pte, tbl_page,
-						count);
 
+		as->map_stats.pages += count;
 		iova += PAGE_SIZE * count;
 		total -= count;
 		pages += count;
@@ -1141,24 +1354,70 @@ static int smmu_iommu_map_pages(struct iommu_domain *domain, unsigned long iova,
 	}
 
 out:
-	if (flush_all)
-		flush_ptc_and_tlb_as(as, iova_base,
-				     iova_base + total * PAGE_SIZE);
+	smmu_flush_mapped(as, iova_base, iova);
 	return err;
 }
 
 #define sg_num_pages(sg)					\
 	(PAGE_ALIGN((sg)->offset + (sg)->length) >> PAGE_SHIFT)
 
+/*
+ * Whether the SMMU_PTBL_COUNT pages map_sg would map next, starting at
+ * @pfn with @remaining pages left in @sg, are one 4MB aligned physical
+ * run that a single section PDE can cover.
+ */
+static bool smmu_sg_is_section(struct scatterlist *sg, unsigned long pfn,
+			       size_t remaining)
+{
+	unsigned long want = pfn;
+	size_t left = SMMU_PTBL_COUNT;
+
+	if (pfn & (SMMU_PTBL_COUNT - 1))
+		return false;
+
+	while (pfn == want) {
+		if (remaining >= left)
+			return true;
+
+		left -= remaining;
+		want += remaining;
+		sg = sg_next(sg);
+		if (!sg)
+			break;
+		pfn = page_to_pfn(sg_page(sg));
+		remaining = sg_num_pages(sg);
+	}
+	return false;
+}
+
+/* Move the map_sg cursor forward by @n pages */
+static struct scatterlist *smmu_sg_advance(struct scatterlist *sg,
+					   unsigned long *pfn,
+					   size_t *remaining, size_t n)
+{
+	while (sg && n >= *remaining) {
+		n -= *remaining;
+		sg = sg_next(sg);
+		if (sg) {
+			*pfn = page_to_pfn(sg_page(sg));
+			*remaining = sg_num_pages(sg);
+		}
+	}
+
+	if (sg) {
+		*pfn += n;
+		*remaining -= n;
+	}
+	return sg;
+}
+
 static int smmu_iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 			     struct scatterlist *sgl, int npages, unsigned long prot)
 {
 	int err = 0;
 	unsigned long iova_base = iova;
-	bool flush_all = (npages > smmu_flush_all_th_pages) ? true : false;
 	struct smmu_as *as = domain->priv;
 	u32 *pdir = page_address(as->pdir_page);
-	struct smmu_device *smmu = as->smmu;
 	int attrs = as->pte_attr;
 	size_t total = npages;
 	size_t sg_remaining = sg_num_pages(sgl);
@@ -1182,14 +1441,42 @@ static int smmu_iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 
 		spin_lock_irqsave(&as->lock, flags);
 
+		/*
+		 * A whole, still vacant 4MB of IOVA backed by one aligned
+		 * physical run takes a section PDE: no page table to allocate
+		 * and one TLB entry instead of 1024.
+		 */
+		if (!ptn && count == SMMU_PTBL_COUNT &&
+		    ACCESS_ONCE(smmu_map_sections) &&
+		    pdir[pdn] == _PDE_VACANT(pdn) &&
+		    smmu_sg_is_section(sgl, sg_pfn, sg_remaining)) {
+			err = __smmu_iommu_map_largepage(as, iova,
+							 PFN_PHYS(sg_pfn),
+							 prot);
+			spin_unlock_irqrestore(&as->lock, flags);
+			if (err)
+				break;
+
+			sgl = smmu_sg_advance(sgl, &sg_pfn, &sg_remaining,
+					      SMMU_PTBL_COUNT);
+			iova += SZ_4M;
+			total -= SMMU_PTBL_COUNT;
+			continue;
+		}
+
 		if (pdir[pdn] == _PDE_VACANT(pdn)) {
-			tbl_page = alloc_ptbl(as, iova, !flush_all);
+			tbl_page = alloc_ptbl(as, iova, false);
 			if (!tbl_page) {
 				err = -ENOMEM;
 				spin_unlock_irqrestore(&as->lock, flags);
 				break;
 			}
 
+		} else if (!(pdir[pdn] & _PDE_NEXT)) {
+			/* already covered by a section */
+			err = -EBUSY;
+			spin_unlock_irqrestore(&as->lock, flags);
+			break;
 		} else {
 			tbl_page = SMMU_EX_PTBL_PAGE(pdir[pdn]);
 		}
@@ -1214,19 +1501,15 @@ static int smmu_iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 
 		pte = &ptbl[ptn];
 		FLUSH_CPU_DCACHE(pte, tbl_page, count * sizeof(u32 *));
-		if (!flush_all)
-			flush_ptc_and_tlb_range(smmu, as, iova, pte, tbl_page,
-						count);
 
+		as->map_stats.pages += count;
 		iova += PAGE_SIZE * count;
 		total -= count;
 
 		spin_unlock_irqrestore(&as->lock, flags);
 	}
 
-	if (flush_all)
-		flush_ptc_and_tlb_as(as, iova_base,
-				     iova_base + npages * PAGE_SIZE);
+	smmu_flush_mapped(as, iova_base, iova);
 
 	return err;
 }
@@ -1258,6 +1541,88 @@ static size_t smmu_iommu_unmap(struct iommu_domain *domain, unsigned long iova,
 	return unmapped;
 }
 
+/*
+ * Only the range touched since the last sync is invalidated. The flush
+ * queue is left to its timer, unless that range overlaps the queued one
+ * or the queue is at least SMMU_FQ_SYNC_DRAIN deep. Page tables freed
+ * meanwhile wait for the drain, as they may belong to a queued range.
+ */
+static void smmu_iommu_iotlb_sync(struct iommu_domain *domain)
+{
+	struct smmu_as *as = domain->priv;
+	struct smmu_fq_entry done[SMMU_FQ_SIZE];
+	dma_addr_t start, end;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&as->lock, flags);
+	start = as->dirty_start;
+	end = as->dirty_end;
+	if (!as->fq_count || as->fq_count >= SMMU_FQ_SYNC_DRAIN ||
+	    (start != end && start < as->fq_end && as->fq_start < end)) {
+		n = smmu_flush_pending(as, done);
+	} else if (start != end) {
+		smmu_flush_range(as, start, end);
+		as->dirty_start = as->dirty_end = 0;
+	}
+	spin_unlock_irqrestore(&as->lock, flags);
+
+	smmu_fq_release(done, n);
+}
+
+/*
+ * Queue the invalidation of an unmapped range. The IOVA is quarantined
+ * until the queue is drained: when it is full, when SMMU_FQ_TIMEOUT_MS
+ * has passed, or by an iotlb_sync, see smmu_iommu_iotlb_sync().
+ */
+static void smmu_iommu_iotlb_defer(struct iommu_domain *domain,
+				   unsigned long iova, size_t size,
+				   iommu_iova_release_t release, void *data)
+{
+	struct smmu_as *as = domain->priv;
+	struct smmu_fq_entry done[SMMU_FQ_SIZE], *e;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	if (!ACCESS_ONCE(smmu_defer_unmap)) {
+		smmu_iommu_iotlb_sync(domain);
+		if (release)
+			release(data, iova, size);
+		return;
+	}
+
+	spin_lock_irqsave(&as->lock, flags);
+	if (as->fq_count == SMMU_FQ_SIZE)
+		n = smmu_flush_pending(as, done);
+
+	if (as->dirty_start != as->dirty_end) {
+		if (as->fq_start == as->fq_end) {
+			as->fq_start = as->dirty_start;
+			as->fq_end = as->dirty_end;
+		} else {
+			as->fq_start = min_t(dma_addr_t, as->fq_start,
+					     as->dirty_start);
+			as->fq_end = max_t(dma_addr_t, as->fq_end,
+					   as->dirty_end);
+		}
+		as->dirty_start = as->dirty_end = 0;
+	}
+
+	e = &as->fq[as->fq_count++];
+	e->iova = iova;
+	e->size = size;
+	e->release = release;
+	e->data = data;
+	as->stats.deferred++;
+
+	if (!timer_pending(&as->fq_timer))
+		mod_timer(&as->fq_timer,
+			  jiffies + msecs_to_jiffies(SMMU_FQ_TIMEOUT_MS));
+	spin_unlock_irqrestore(&as->lock, flags);
+
+	smmu_fq_release(done, n);
+}
+
 static phys_addr_t smmu_iommu_iova_to_phys(struct iommu_domain *domain,
 					   dma_addr_t iova)
 {
@@ -1277,10 +1642,11 @@ static phys_addr_t smmu_iommu_iova_to_phys(struct iommu_domain *domain,
 		pte = locate_pte(as, iova, false, &page, &count);
 		if (pte) {
 			unsigned long pfn = *pte & SMMU_PFN_MASK;
-			pa = PFN_PHYS(pfn);
+			pa = PFN_PHYS(pfn) + (iova & ~PAGE_MASK);
 		}
-	} else {
-		pa = pdir[pdn] << SMMU_PDE_SHIFT;
+	} else if (pdir[pdn] != _PDE_VACANT(pdn)) {
+		/* 4MB section: the PDE only holds the section base */
+		pa = (pdir[pdn] << SMMU_PDE_SHIFT) + (iova & (SZ_4M - 1));
 	}
 
 	dev_dbg(as->smmu->dev, "iova:%pa pfn:%pa asid:%d\n",
@@ -1478,11 +1844,17 @@ static void smmu_iommu_domain_destroy(struct iommu_domain *domain)
 {
 	struct smmu_as *as = domain->priv;
 	struct smmu_device *smmu = as->smmu;
+	struct smmu_fq_entry done[SMMU_FQ_SIZE];
 	unsigned long flags;
+	unsigned int n = 0;
+
+	del_timer_sync(&as->fq_timer);
 
 	spin_lock_irqsave(&as->lock, flags);
 
 	if (as->pdir_page) {
+		n = smmu_flush_pending(as, done);
+
 		spin_lock(&smmu->lock);
 		smmu_write(smmu, SMMU_PTB_ASID_CUR(as->asid), SMMU_PTB_ASID);
 		smmu_write(smmu, SMMU_PTB_DATA_RESET_VAL, SMMU_PTB_DATA);
@@ -1504,6 +1876,8 @@ static void smmu_iommu_domain_destroy(struct iommu_domain *domain)
 
 	spin_unlock_irqrestore(&as->lock, flags);
 
+	smmu_fq_release(done, n);
+
 	domain->priv = NULL;
 	dev_dbg(smmu->dev, "smmu_as@%p\n", as);
 }
@@ -1517,6 +1891,8 @@ static struct iommu_ops smmu_iommu_ops = {
 	.map_pages	= smmu_iommu_map_pages,
 	.map_sg		= smmu_iommu_map_sg,
 	.unmap		= smmu_iommu_unmap,
+	.iotlb_sync	= smmu_iommu_iotlb_sync,
+	.iotlb_defer	= smmu_iommu_iotlb_defer,
 	.iova_to_phys	= smmu_iommu_iova_to_phys,
 	.domain_has_cap	= smmu_iommu_domain_has_cap,
 	.pgsize_bitmap	= SMMU_IOMMU_PGSIZES,
@@ -1628,6 +2004,85 @@ static const struct file_operations smmu_debugfs_stats_fops = {
 	.write		= smmu_debugfs_stats_write,
 };
 
+static int smmu_debugfs_flush_show(struct seq_file *s, void *v)
+{
+	struct smmu_device *smmu = s->private;
+	int i;
+
+	seq_puts(s, "asid       range range_pages         all    deferred"
+		 "    fq_drain     time_us\n");
+	for (i = 0; i < smmu->num_as; i++) {
+		struct smmu_as *as = &smmu->as[i];
+		struct smmu_flush_stats st;
+		unsigned long flags;
+
+		spin_lock_irqsave(&as->lock, flags);
+		st = as->stats;
+		spin_unlock_irqrestore(&as->lock, flags);
+
+		if (!st.range && !st.all && !st.deferred)
+			continue;
+
+		seq_printf(s, "%4d %11llu %11llu %11llu %11llu %11llu %11llu\n",
+			   i, st.range, st.range_pages, st.all, st.deferred,
+			   st.fq_drain, div_u64(st.time_ns, NSEC_PER_USEC));
+	}
+	return 0;
+}
+
+static int smmu_debugfs_flush_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smmu_debugfs_flush_show, inode->i_private);
+}
+
+static const struct file_operations smmu_debugfs_flush_fops = {
+	.open		= smmu_debugfs_flush_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int smmu_debugfs_map_show(struct seq_file *s, void *v)
+{
+	struct smmu_device *smmu = s->private;
+	int i;
+
+	seq_puts(s, "asid    sections       pages       ptbls  large%\n");
+	for (i = 0; i < smmu->num_as; i++) {
+		struct smmu_as *as = &smmu->as[i];
+		struct smmu_map_stats st;
+		unsigned long flags;
+		u64 large, all;
+
+		spin_lock_irqsave(&as->lock, flags);
+		st = as->map_stats;
+		spin_unlock_irqrestore(&as->lock, flags);
+
+		if (!st.sections && !st.pages)
+			continue;
+
+		/* share of the mapped bytes that went into sections */
+		large = st.sections * SMMU_PTBL_COUNT;
+		all = large + st.pages;
+		seq_printf(s, "%4d %11llu %11llu %11llu %6llu\n",
+			   i, st.sections, st.pages, st.ptbls,
+			   div64_u64(large * 100, all));
+	}
+	return 0;
+}
+
+static int smmu_debugfs_map_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smmu_debugfs_map_show, inode->i_private);
+}
+
+static const struct file_operations smmu_debugfs_map_fops = {
+	.open		= smmu_debugfs_map_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static void smmu_debugfs_delete(struct smmu_device *smmu)
 {
 	debugfs_remove_recursive(smmu->debugfs_root);
@@ -1820,6 +2275,14 @@ static void smmu_debugfs_create(struct smmu_device *smmu)
 
 	debugfs_create_size_t("flush_all_threshold_pages", S_IWUSR | S_IRUSR,
 			      root, &smmu_flush_all_th_pages);
+	debugfs_create_bool("defer_unmap", S_IWUSR | S_IRUSR, root,
+			    &smmu_defer_unmap);
+	debugfs_create_file("flush_stats", S_IRUSR, root, smmu,
+			    &smmu_debugfs_flush_fops);
+	debugfs_create_bool("map_sections", S_IWUSR | S_IRUSR, root,
+			    &smmu_map_sections);
+	debugfs_create_file("map_stats", S_IRUSR, root, smmu,
+			    &smmu_debugfs_map_fops);
 	return;
 
 err_out:
@@ -1957,6 +2420,8 @@ static int tegra_smmu_probe(struct platform_device *pdev)
 		spin_lock_init(&as->lock);
 		spin_lock_init(&as->client_lock);
 		INIT_LIST_HEAD(&as->client);
+		INIT_LIST_HEAD(&as->ptbl_free);
+		setup_timer(&as->fq_timer, smmu_fq_timeout, (unsigned long)as);
 	}
 	spin_lock_init(&smmu->lock);
 	spin_lock_init(&smmu->ptc_lock);
@@ -161,6 +161,8 @@
 
 #define SPI_DMA_TIMEOUT				(msecs_to_jiffies(10000))
 #define DEFAULT_SPI_DMA_BUF_LEN			(16*1024)
+/* caller-mapped chunks are bounded by the 16 bit DMA_BLK count */
+#define SPI_PREMAPPED_MAX_LEN			(64*1024)
 #define TX_FIFO_EMPTY_COUNT_MAX			SPI_TX_FIFO_EMPTY_COUNT(0x40)
 #define RX_FIFO_FULL_COUNT_ZERO			SPI_RX_FIFO_FULL_COUNT(0)
 #define MAX_HOLD_CYCLES				16
@@ -174,6 +176,15 @@
 #define SPI_DEFAULT_RX_TAP_DELAY 10
 #endif
 
+/* Geometry of one DMA/PIO chunk of a transfer */
+struct tegra_spi_chunk {
+	unsigned				dma_words;
+	unsigned				fifo_words;
+	unsigned				bytes_per_word;
+	unsigned				words_per_32bit;
+	bool					is_packed;
+};
+
 struct tegra_spi_data {
 	struct device				*dev;
 	struct spi_master			*master;
@@ -202,6 +213,8 @@ struct tegra_spi_data {
 	unsigned				max_buf_size;
 	bool					is_curr_dma_xfer;
 	bool					is_hw_based_cs;
+	bool					is_premapped;
+	bool					cur_msg_dma_mapped;
 
 	struct completion			rx_dma_complete;
 	struct completion			tx_dma_complete;
@@ -229,6 +242,14 @@ struct tegra_spi_data {
 	u32					*tx_dma_buf;
 	dma_addr_t				tx_dma_phys;
 	struct dma_async_tx_descriptor		*tx_dma_desc;
+
+	/* Spare Tx bounce buffer, filled while the other one is on the wire */
+	u32					*tx_dma_buf_next;
+	dma_addr_t				tx_dma_phys_next;
+	struct spi_message			*prefetched_msg;
+	struct spi_transfer			*prefetched_xfer;
+	unsigned				prefetched_pos;
+	unsigned				prefetched_words;
 };
 
 static int tegra_spi_runtime_suspend(struct device *dev);
@@ -265,39 +286,76 @@ static void tegra_spi_clear_status(struct tegra_spi_data *tspi)
 				SPI_FIFO_STATUS);
 }
 
-static unsigned tegra_spi_calculate_curr_xfer_param(
-	struct spi_device *spi, struct tegra_spi_data *tspi,
-	struct spi_transfer *t)
+static void tegra_spi_chunk_param(struct spi_device *spi,
+	struct spi_transfer *t, unsigned pos, unsigned max_buf_size,
+	struct tegra_spi_chunk *c)
 {
-	unsigned remain_len = t->len - tspi->cur_pos;
+	unsigned remain_len = t->len - pos;
 	unsigned max_word;
 	unsigned bits_per_word ;
 	unsigned max_len;
-	unsigned total_fifo_words;
 
 	bits_per_word = t->bits_per_word ? t->bits_per_word :
 						spi->bits_per_word;
-	tspi->bytes_per_word = (bits_per_word - 1) / 8 + 1;
+	c->bytes_per_word = (bits_per_word - 1) / 8 + 1;
 
 	if (bits_per_word == 8 || bits_per_word == 16) {
-		tspi->is_packed = 1;
-		tspi->words_per_32bit = 32/bits_per_word;
+		c->is_packed = 1;
+		c->words_per_32bit = 32/bits_per_word;
 	} else {
-		tspi->is_packed = 0;
-		tspi->words_per_32bit = 1;
+		c->is_packed = 0;
+		c->words_per_32bit = 1;
 	}
 
-	if (tspi->is_packed) {
-		max_len = min(remain_len, tspi->max_buf_size);
-		tspi->curr_dma_words = max_len/tspi->bytes_per_word;
-		total_fifo_words = (max_len + 3)/4;
+	if (c->is_packed) {
+		max_len = min(remain_len, max_buf_size);
+		c->dma_words = max_len/c->bytes_per_word;
+		c->fifo_words = (max_len + 3)/4;
 	} else {
-		max_word = (remain_len - 1) / tspi->bytes_per_word + 1;
-		max_word = min(max_word, tspi->max_buf_size/4);
-		tspi->curr_dma_words = max_word;
-		total_fifo_words = max_word;
+		max_word = (remain_len - 1) / c->bytes_per_word + 1;
+		max_word = min(max_word, max_buf_size/4);
+		c->dma_words = max_word;
+		c->fifo_words = max_word;
 	}
-	return total_fifo_words;
+}
+
+static unsigned tegra_spi_calculate_curr_xfer_param(
+	struct spi_device *spi, struct tegra_spi_data *tspi,
+	struct spi_transfer *t)
+{
+	struct tegra_spi_chunk c;
+
+	tegra_spi_chunk_param(spi, t, tspi->cur_pos, tspi->is_premapped ?
+			SPI_PREMAPPED_MAX_LEN : tspi->max_buf_size, &c);
+	tspi->bytes_per_word = c.bytes_per_word;
+	tspi->is_packed = c.is_packed;
+	tspi->words_per_32bit = c.words_per_32bit;
+	tspi->curr_dma_words = c.dma_words;
+	return c.fifo_words;
+}
+
+/*
+ * A caller-mapped transfer (spi_message.is_dma_mapped) is handed to DMA as
+ * is when the FIFO layout matches memory, i.e. packed or 32 bit words, and
+ * the word sized DMA cannot touch bytes outside the caller's buffers.
+ */
+static bool tegra_spi_xfer_premapped(struct tegra_spi_data *tspi,
+	struct spi_device *spi, struct spi_transfer *t)
+{
+	unsigned bits_per_word;
+
+	if (!tspi->cur_msg_dma_mapped)
+		return false;
+
+	bits_per_word = t->bits_per_word ? t->bits_per_word :
+						spi->bits_per_word;
+	if (bits_per_word != 8 && bits_per_word != 16 && bits_per_word != 32)
+		return false;
+
+	if ((t->len & 3) || (t->tx_buf && (t->tx_dma & 3)) ||
+	    (t->rx_buf && (t->rx_dma & 3)))
+		return false;
+	return true;
 }
 
 static unsigned tegra_spi_fill_tx_fifo_from_client_txbuf(
@@ -381,38 +439,97 @@ static unsigned int tegra_spi_read_rx_fifo_to_client_rxbuf(
 	return read_words;
 }
 
-static void tegra_spi_copy_client_txbuf_to_spi_txbuf(
-		struct tegra_spi_data *tspi, struct spi_transfer *t)
+static void tegra_spi_pack_tx(u32 *dma_buf, const u8 *tx_buf,
+		struct tegra_spi_chunk *c)
 {
-	unsigned len;
-
-	/* Make the dma buffer to read by cpu */
-	dma_sync_single_for_cpu(tspi->dev, tspi->tx_dma_phys,
-				tspi->dma_buf_size, DMA_TO_DEVICE);
-
-	if (tspi->is_packed) {
-		len = tspi->curr_dma_words * tspi->bytes_per_word;
-		memcpy(tspi->tx_dma_buf, t->tx_buf + tspi->cur_pos, len);
+	if (c->is_packed) {
+		memcpy(dma_buf, tx_buf, c->dma_words * c->bytes_per_word);
 	} else {
 		unsigned int i;
 		unsigned int count;
-		u8 *tx_buf = (u8 *)t->tx_buf + tspi->cur_tx_pos;
-		unsigned consume = tspi->curr_dma_words * tspi->bytes_per_word;
+		unsigned consume = c->dma_words * c->bytes_per_word;
 		unsigned int x;
 
-		for (count = 0; count < tspi->curr_dma_words; count++) {
+		for (count = 0; count < c->dma_words; count++) {
 			x = 0;
-			for (i = 0; consume && (i < tspi->bytes_per_word);
+			for (i = 0; consume && (i < c->bytes_per_word);
 							i++, consume--)
 				x |= ((*tx_buf++) << i * 8);
-			tspi->tx_dma_buf[count] = x;
+			dma_buf[count] = x;
 		}
 	}
+}
+
+/*
+ * The bounce buffers are coherent allocations, so no cache maintenance is
+ * needed around the copies in and out of them.
+ */
+static void tegra_spi_copy_client_txbuf_to_spi_txbuf(
+		struct tegra_spi_data *tspi, struct spi_transfer *t)
+{
+	struct tegra_spi_chunk c = {
+		.dma_words = tspi->curr_dma_words,
+		.bytes_per_word = tspi->bytes_per_word,
+		.is_packed = tspi->is_packed,
+	};
+
+	if (tspi->prefetched_xfer == t &&
+	    tspi->prefetched_pos == tspi->cur_tx_pos &&
+	    tspi->prefetched_words == tspi->curr_dma_words) {
+		/* Staged while the previous chunk was on the wire */
+		swap(tspi->tx_dma_buf, tspi->tx_dma_buf_next);
+		swap(tspi->tx_dma_phys, tspi->tx_dma_phys_next);
+	} else {
+		tegra_spi_pack_tx(tspi->tx_dma_buf,
+				(u8 *)t->tx_buf + tspi->cur_tx_pos, &c);
+	}
+	tspi->prefetched_xfer = NULL;
 	tspi->cur_tx_pos += tspi->curr_dma_words * tspi->bytes_per_word;
+}
 
-	/* Make the dma buffer to read by dma */
-	dma_sync_single_for_device(tspi->dev, tspi->tx_dma_phys,
-				tspi->dma_buf_size, DMA_TO_DEVICE);
+/*
+ * Packs the Tx data of the chunk that follows the one on the wire into the
+ * spare bounce buffer, so that the copy overlaps the current transfer.  The
+ * next chunk may be the rest of @t, the next transfer of @msg or the first
+ * transfer of the next queued message.
+ */
+static void tegra_spi_prefetch_next(struct tegra_spi_data *tspi,
+		struct spi_message *msg, struct spi_transfer *t)
+{
+	struct spi_transfer *next = t;
+	struct tegra_spi_chunk c;
+	unsigned pos;
+
+	if (!tspi->tx_dma_buf_next || tspi->prefetched_xfer)
+		return;
+
+	pos = tspi->cur_pos + tspi->curr_dma_words * tspi->bytes_per_word;
+	if (pos >= t->len) {
+		pos = 0;
+		if (!list_is_last(&t->transfer_list, &msg->transfers)) {
+			next = list_entry(t->transfer_list.next,
+					struct spi_transfer, transfer_list);
+		} else {
+			msg = spi_get_next_queued_message(tspi->master);
+			if (!msg || list_empty(&msg->transfers))
+				return;
+			next = list_first_entry(&msg->transfers,
+					struct spi_transfer, transfer_list);
+		}
+	}
+
+	/* premapped and PIO chunks do not use the bounce buffer */
+	if (!next->tx_buf || !next->len || msg->is_dma_mapped)
+		return;
+	tegra_spi_chunk_param(msg->spi, next, pos, tspi->max_buf_size, &c);
+	if (c.fifo_words <= SPI_FIFO_DEPTH)
+		return;
+
+	tegra_spi_pack_tx(tspi->tx_dma_buf_next, (u8 *)next->tx_buf + pos, &c);
+	tspi->prefetched_msg = msg;
+	tspi->prefetched_xfer = next;
+	tspi->prefetched_pos = pos;
+	tspi->prefetched_words = c.dma_words;
 }
 
 static void tegra_spi_copy_spi_rxbuf_to_client_rxbuf(
@@ -420,10 +537,6 @@ static void tegra_spi_copy_spi_rxbuf_to_client_rxbuf(
 {
 	unsigned len;
 
-	/* Make the dma buffer to read by cpu */
-	dma_sync_single_for_cpu(tspi->dev, tspi->rx_dma_phys,
-		tspi->dma_buf_size, DMA_FROM_DEVICE);
-
 	if (tspi->is_packed) {
 		len = tspi->curr_dma_words * tspi->bytes_per_word;
 		memcpy(t->rx_buf + tspi->cur_rx_pos, tspi->rx_dma_buf, len);
@@ -445,10 +558,6 @@ static void tegra_spi_copy_spi_rxbuf_to_client_rxbuf(
 		}
 	}
 	tspi->cur_rx_pos += tspi->curr_dma_words * tspi->bytes_per_word;
-
-	/* Make the dma buffer to read by dma */
-	dma_sync_single_for_device(tspi->dev, tspi->rx_dma_phys,
-		tspi->dma_buf_size, DMA_FROM_DEVICE);
 }
 
 static void tegra_spi_dma_complete(void *args)
@@ -458,11 +567,12 @@ static void tegra_spi_dma_complete(void *args)
 	complete(dma_complete);
 }
 
-static int tegra_spi_start_tx_dma(struct tegra_spi_data *tspi, int len)
+static int tegra_spi_start_tx_dma(struct tegra_spi_data *tspi,
+		dma_addr_t tx_phys, int len)
 {
 	INIT_COMPLETION(tspi->tx_dma_complete);
 	tspi->tx_dma_desc = dmaengine_prep_slave_single(tspi->tx_dma_chan,
-				tspi->tx_dma_phys, len, DMA_MEM_TO_DEV,
+				tx_phys, len, DMA_MEM_TO_DEV,
 				DMA_PREP_INTERRUPT |  DMA_CTRL_ACK);
 	if (!tspi->tx_dma_desc) {
 		dev_err(tspi->dev, "Not able to get desc for Tx\n");
@@ -477,11 +587,12 @@ static int tegra_spi_start_tx_dma(struct tegra_spi_data *tspi, int len)
 	return 0;
 }
 
-static int tegra_spi_start_rx_dma(struct tegra_spi_data *tspi, int len)
+static int tegra_spi_start_rx_dma(struct tegra_spi_data *tspi,
+		dma_addr_t rx_phys, int len)
 {
 	INIT_COMPLETION(tspi->rx_dma_complete);
 	tspi->rx_dma_desc = dmaengine_prep_slave_single(tspi->rx_dma_chan,
-				tspi->rx_dma_phys, len, DMA_DEV_TO_MEM,
+				rx_phys, len, DMA_DEV_TO_MEM,
 				DMA_PREP_INTERRUPT |  DMA_CTRL_ACK);
 	if (!tspi->rx_dma_desc) {
 		dev_err(tspi->dev, "Not able to get desc for Rx\n");
@@ -503,6 +614,7 @@ static int tegra_spi_start_dma_based_transfer(
 	unsigned int len;
 	int ret = 0;
 	unsigned long status;
+	dma_addr_t dma_phys;
 
 	/* Make sure that Rx and Tx fifo are empty */
 	status = tegra_spi_readl(tspi, SPI_FIFO_STATUS);
@@ -539,8 +651,15 @@ static int tegra_spi_start_dma_based_transfer(
 	tspi->dma_control_reg = val;
 
 	if (tspi->cur_direction & DATA_DIR_TX) {
-		tegra_spi_copy_client_txbuf_to_spi_txbuf(tspi, t);
-		ret = tegra_spi_start_tx_dma(tspi, len);
+		if (tspi->is_premapped) {
+			dma_phys = t->tx_dma + tspi->cur_tx_pos;
+			tspi->cur_tx_pos += tspi->curr_dma_words *
+						tspi->bytes_per_word;
+		} else {
+			tegra_spi_copy_client_txbuf_to_spi_txbuf(tspi, t);
+			dma_phys = tspi->tx_dma_phys;
+		}
+		ret = tegra_spi_start_tx_dma(tspi, dma_phys, len);
 		if (ret < 0) {
 			dev_err(tspi->dev,
 				"Starting tx dma failed, err %d\n", ret);
@@ -549,11 +668,12 @@ static int tegra_spi_start_dma_based_transfer(
 	}
 
 	if (tspi->cur_direction & DATA_DIR_RX) {
-		/* Make the dma buffer to read by dma */
-		dma_sync_single_for_device(tspi->dev, tspi->rx_dma_phys,
-				tspi->dma_buf_size, DMA_FROM_DEVICE);
+		if (tspi->is_premapped)
+			dma_phys = t->rx_dma + tspi->cur_rx_pos;
+		else
+			dma_phys = tspi->rx_dma_phys;
 
-		ret = tegra_spi_start_rx_dma(tspi, len);
+		ret = tegra_spi_start_rx_dma(tspi, dma_phys, len);
 		if (ret < 0) {
 			dev_err(tspi->dev,
 				"Starting rx dma failed, err %d\n", ret);
@@ -649,6 +769,11 @@ static int tegra_spi_init_dma_param(struct tegra_spi_data *tspi,
 		tspi->tx_dma_chan = dma_chan;
 		tspi->tx_dma_buf = dma_buf;
 		tspi->tx_dma_phys = dma_phys;
+
+		/* Without the spare buffer Tx data is simply not prefetched */
+		tspi->tx_dma_buf_next = dma_alloc_coherent(tspi->dev,
+				tspi->dma_buf_size, &tspi->tx_dma_phys_next,
+				GFP_KERNEL);
 	}
 	return 0;
 
@@ -677,6 +802,11 @@ static void tegra_spi_deinit_dma_param(struct tegra_spi_data *tspi,
 		dma_phys = tspi->tx_dma_phys;
 		tspi->tx_dma_buf = NULL;
 		tspi->tx_dma_chan = NULL;
+		if (tspi->tx_dma_buf_next)
+			dma_free_coherent(tspi->dev, tspi->dma_buf_size,
+				tspi->tx_dma_buf_next, tspi->tx_dma_phys_next);
+		tspi->tx_dma_buf_next = NULL;
+		tspi->prefetched_xfer = NULL;
 	}
 	if (!dma_chan)
 		return;
@@ -714,6 +844,7 @@ static int tegra_spi_start_transfer_one(struct spi_device *spi,
 	tspi->curr_xfer = t;
 	tspi->tx_status = 0;
 	tspi->rx_status = 0;
+	tspi->is_premapped = tegra_spi_xfer_premapped(tspi, spi, t);
 	total_fifo_words = tegra_spi_calculate_curr_xfer_param(spi, tspi, t);
 
 	if (is_first_of_msg) {
@@ -999,7 +1130,7 @@ static int tegra_spi_wait_on_message_xfer(struct tegra_spi_data *tspi)
 }
 
 static int tegra_spi_wait_remain_message(struct tegra_spi_data *tspi,
-		struct spi_transfer *xfer)
+		struct spi_message *msg, struct spi_transfer *xfer)
 {
 	unsigned total_fifo_words;
 	int ret = 0;
@@ -1018,6 +1149,8 @@ static int tegra_spi_wait_remain_message(struct tegra_spi_data *tspi,
 		tegra_spi_start_cpu_based_transfer(tspi, xfer);
 	}
 
+	if (!ret)
+		tegra_spi_prefetch_next(tspi, msg, xfer);
 	ret = tegra_spi_wait_on_message_xfer(tspi);
 
 	return ret;
@@ -1062,7 +1195,10 @@ static int tegra_spi_handle_message(struct tegra_spi_data *tspi,
 				return ret;
 			}
 		}
-		if (tspi->cur_direction & DATA_DIR_RX)
+		if ((tspi->cur_direction & DATA_DIR_RX) && tspi->is_premapped)
+			tspi->cur_rx_pos += tspi->curr_dma_words *
+						tspi->bytes_per_word;
+		else if (tspi->cur_direction & DATA_DIR_RX)
 			tegra_spi_copy_spi_rxbuf_to_client_rxbuf(tspi, xfer);
 
 		if (tspi->cur_direction & DATA_DIR_TX)
@@ -1087,6 +1223,9 @@ static int tegra_spi_transfer_one_message(struct spi_master *master,
 
 	msg->status = 0;
 	msg->actual_length = 0;
+	tspi->cur_msg_dma_mapped = msg->is_dma_mapped;
+	if (tspi->prefetched_msg != msg)
+		tspi->prefetched_xfer = NULL;
 
 	ret = pm_runtime_get_sync(tspi->dev);
 	if (ret < 0) {
@@ -1111,6 +1250,7 @@ static int tegra_spi_transfer_one_message(struct spi_master *master,
 				}
 				is_first_msg = false;
 				is_new_msg = false;
+				tegra_spi_prefetch_next(tspi, msg, xfer);
 				ret = tegra_spi_wait_on_message_xfer(tspi);
 				if (ret)
 					goto exit;
@@ -1122,7 +1262,8 @@ static int tegra_spi_transfer_one_message(struct spi_master *master,
 					break;
 				}
 			} else {
-				ret = tegra_spi_wait_remain_message(tspi, xfer);
+				ret = tegra_spi_wait_remain_message(tspi, msg,
+						xfer);
 				if (ret)
 					goto exit;
 				ret = tegra_spi_handle_message(tspi, xfer);
@@ -1248,6 +1389,9 @@ static struct tegra_spi_platform_data *tegra_spi_parse_dt(
 	if (of_find_property(np, "nvidia,clock-always-on", NULL))
 		pdata->is_clkon_always = true;
 
+	if (of_find_property(np, "nvidia,rt-message-pump", NULL))
+		pdata->rt_message_pump = true;
+
 	return pdata;
 }
 
@@ -1301,6 +1445,7 @@ static int tegra_spi_probe(struct platform_device *pdev)
 	master->num_chipselect = MAX_CHIP_SELECT;
 	master->bus_num = bus_num;
 	master->spi_cs_low  = tegra_spi_cs_low;
+	master->rt = pdata->rt_message_pump;
 
 	dev_set_drvdata(&pdev->dev, master);
 	tspi = spi_master_get_devdata(master);
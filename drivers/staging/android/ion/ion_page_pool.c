@@ -17,25 +17,71 @@
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/wait.h>
 #include "ion_priv.h"
 
-struct ion_page_pool_item {
-	struct page *page;
-	struct list_head list;
-};
+/*
+ * Zeroed memory kept ready per pool, see ion_page_pool_fill(). The default
+ * covers the bursts of small buffers a frame allocates, 1MB over the
+ * system heap pools; it is below one page of the order-8 pools, which
+ * are left alone.
+ */
+static unsigned int pool_fill_kb = 256;
+module_param(pool_fill_kb, uint, 0644);
+MODULE_PARM_DESC(pool_fill_kb, "Zeroed memory to prefill per pool, in KB");
+
+/* no prefilling for this long after the shrinker last took pages back */
+#define ION_PAGE_POOL_FILL_BACKOFF	(5 * HZ)
+static unsigned long ion_page_pool_shrunk_at =
+	INITIAL_JIFFIES - ION_PAGE_POOL_FILL_BACKOFF;
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+static LIST_HEAD(ion_page_pools);
+static DEFINE_MUTEX(ion_page_pools_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ion_page_pool_wait);
+static atomic_t ion_page_pool_kicked = ATOMIC_INIT(0);
+static struct task_struct *ion_page_pool_task;
+
+/* called on every alloc and free: stay off the shared line when set */
+static void ion_page_pool_kick(void)
 {
-	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
+	if (!atomic_read(&ion_page_pool_kicked) &&
+	    !atomic_xchg(&ion_page_pool_kicked, 1))
+		wake_up(&ion_page_pool_wait);
+}
 
-	if (!page)
-		return NULL;
+static int ion_page_pool_fill_target(struct ion_page_pool *pool)
+{
+	if (time_before(jiffies, ACCESS_ONCE(ion_page_pool_shrunk_at) +
+				 ION_PAGE_POOL_FILL_BACKOFF))
+		return 0;
+	return (ACCESS_ONCE(pool_fill_kb) * 1024UL) >>
+		(PAGE_SHIFT + pool->order);
+}
+
+static void ion_page_pool_sync(struct ion_page_pool *pool, struct page *page)
+{
 	ion_pages_sync_for_device(NULL, page, PAGE_SIZE << pool->order,
 						DMA_BIDIRECTIONAL);
+}
+
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+				       gfp_t gfp_mask)
+{
+	struct page *page = alloc_pages(gfp_mask | __GFP_ZERO, pool->order);
+
+	if (!page)
+		return NULL;
+	ion_page_pool_sync(pool, page);
+	atomic_long_inc(&pool->fresh);
 	return page;
 }
 
@@ -45,86 +91,195 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+/*
+ * Uncached pages are zeroed through a write-combined mapping so no
+ * cache maintenance is needed before they are handed out again. Cached
+ * pages are zeroed through a cached mapping and cleaned afterwards.
+ */
+static int ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
 {
-	struct ion_page_pool_item *item;
+	int ret;
+
+	if (!pool->cached)
+		return ion_heap_pages_zero(page, PAGE_SIZE << pool->order,
+					   pgprot_writecombine(PAGE_KERNEL));
 
-	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
-	if (!item)
-		return -ENOMEM;
+	ret = ion_heap_pages_zero(page, PAGE_SIZE << pool->order, PAGE_KERNEL);
+	if (!ret)
+		ion_page_pool_sync(pool, page);
+	return ret;
+}
 
-	mutex_lock(&pool->mutex);
-	item->page = page;
+/* called with pool->lock held */
+static void ion_page_pool_add_clean(struct ion_page_pool *pool,
+				    struct page *page)
+{
 	if (PageHighMem(page)) {
-		list_add_tail(&item->list, &pool->high_items);
+		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
 	} else {
-		list_add_tail(&item->list, &pool->low_items);
+		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
-	mutex_unlock(&pool->mutex);
-	return 0;
 }
 
+/* called with pool->lock held */
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
-	struct ion_page_pool_item *item;
 	struct page *page;
 
 	if (high) {
 		BUG_ON(!pool->high_count);
-		item = list_first_entry(&pool->high_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->high_items, struct page, lru);
 		pool->high_count--;
 	} else {
 		BUG_ON(!pool->low_count);
-		item = list_first_entry(&pool->low_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->low_items, struct page, lru);
 		pool->low_count--;
 	}
 
-	list_del(&item->list);
-	page = item->page;
-	kfree(item);
+	list_del(&page->lru);
+	return page;
+}
+
+/* called with pool->lock held */
+static struct page *ion_page_pool_remove_dirty(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	if (!pool->dirty_count)
+		return NULL;
+	page = list_first_entry(&pool->dirty_items, struct page, lru);
+	list_del(&page->lru);
+	pool->dirty_count--;
 	return page;
 }
 
+/* called with pool->lock held */
+static struct page *ion_page_pool_remove_clean(struct ion_page_pool *pool)
+{
+	if (pool->high_count)
+		return ion_page_pool_remove(pool, true);
+	if (pool->low_count)
+		return ion_page_pool_remove(pool, false);
+	return NULL;
+}
+
+/*
+ * Move up to ION_POOL_CACHE_BATCH zeroed pages from the shared lists into
+ * this cpu's cache, so the shared lock is taken once per batch rather
+ * than once per page.
+ */
+static void ion_page_pool_cache_refill(struct ion_page_pool *pool,
+				       struct ion_page_pool_cache *cache)
+{
+	spin_lock(&pool->lock);
+	while (cache->count < ION_POOL_CACHE_BATCH) {
+		struct page *page = ion_page_pool_remove_clean(pool);
+
+		if (!page)
+			break;
+		cache->pages[cache->count++] = page;
+	}
+	spin_unlock(&pool->lock);
+}
+
+static void ion_page_pool_account(struct ion_page_pool *pool, u64 start)
+{
+	u64 us = div_u64(local_clock() - start, NSEC_PER_USEC);
+	int bucket = us ? min(fls64(us), ION_POOL_LAT_BUCKETS - 1) : 0;
+
+	atomic_inc(&pool->lat_hist[bucket]);
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_cache *cache;
 	struct page *page = NULL;
+	u64 start = local_clock();
 
 	BUG_ON(!pool);
 
-	mutex_lock(&pool->mutex);
-	if (pool->high_count)
-		page = ion_page_pool_remove(pool, true);
-	else if (pool->low_count)
-		page = ion_page_pool_remove(pool, false);
-	mutex_unlock(&pool->mutex);
+	cache = get_cpu_ptr(pool->cache);
+	spin_lock(&cache->lock);
+	if (!cache->count) {
+		cache->misses++;
+		ion_page_pool_cache_refill(pool, cache);
+	} else {
+		cache->hits++;
+	}
+	if (cache->count)
+		page = cache->pages[--cache->count];
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(pool->cache);
+
+	if (!page) {
+		/* nothing zeroed; rather zero a freed page than allocate */
+		spin_lock(&pool->lock);
+		page = ion_page_pool_remove_dirty(pool);
+		spin_unlock(&pool->lock);
+		if (page && ion_page_pool_zero(pool, page)) {
+			ion_page_pool_free_pages(pool, page);
+			page = NULL;
+		}
+		if (page)
+			atomic_long_inc(&pool->zeroed_sync);
+	}
 
 	if (!page)
-		page = ion_page_pool_alloc_pages(pool);
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
 
+	/* unlocked peek, the fill thread rechecks under the lock */
+	if (pool->high_count + pool->low_count <
+	    ion_page_pool_fill_target(pool))
+		ion_page_pool_kick();
+	ion_page_pool_account(pool, start);
 	return page;
 }
 
+/*
+ * Freed pages still hold the previous owner's data; they are queued for
+ * the zeroing thread and never handed out before being cleared.
+ */
 void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 {
-	int ret;
+	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	spin_unlock(&pool->lock);
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+	ion_page_pool_kick();
 }
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
-	int total = 0;
+	int count = pool->low_count + pool->dirty_count;
+	int cpu;
+
+	if (high)
+		count += pool->high_count;
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(pool->cache, cpu)->count;
 
-	total += high ? (pool->high_count + pool->low_count) *
-		(1 << pool->order) :
-			pool->low_count * (1 << pool->order);
-	return total;
+	return count * (1 << pool->order);
+}
+
+/* give back what is sitting in the per-cpu caches */
+static void ion_page_pool_drain(struct ion_page_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache = per_cpu_ptr(pool->cache, cpu);
+
+		spin_lock(&cache->lock);
+		spin_lock(&pool->lock);
+		while (cache->count)
+			ion_page_pool_add_clean(pool,
+						cache->pages[--cache->count]);
+		spin_unlock(&pool->lock);
+		spin_unlock(&cache->lock);
+	}
 }
 
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
@@ -135,55 +290,190 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 
 	high = !!(gfp_mask & __GFP_HIGHMEM);
 
+	if (nr_to_scan > 0) {
+		ACCESS_ONCE(ion_page_pool_shrunk_at) = jiffies;
+		ion_page_pool_drain(pool);
+	}
+
 	for (i = 0; i < nr_to_scan; i++) {
 		struct page *page;
 
-		mutex_lock(&pool->mutex);
-		if (pool->low_count) {
+		spin_lock(&pool->lock);
+		/* dirty pages are the cheapest to give up */
+		page = ion_page_pool_remove_dirty(pool);
+		if (page && !high && PageHighMem(page)) {
+			list_add_tail(&page->lru, &pool->dirty_items);
+			pool->dirty_count++;
+			page = NULL;
+		}
+		if (!page && pool->low_count) {
 			page = ion_page_pool_remove(pool, false);
-		} else if (high && pool->high_count) {
+		} else if (!page && high && pool->high_count) {
 			page = ion_page_pool_remove(pool, true);
-		} else {
-			mutex_unlock(&pool->mutex);
+		} else if (!page) {
+			spin_unlock(&pool->lock);
 			break;
 		}
-		mutex_unlock(&pool->mutex);
+		spin_unlock(&pool->lock);
 		ion_page_pool_free_pages(pool, page);
 	}
 
 	return ion_page_pool_total(pool, high);
 }
 
-struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+/*
+ * Zero everything on the dirty list, then top the pool up to
+ * pool_fill_kb of zeroed memory. Returns true if there may be more to do.
+ *
+ * Prefilling never reclaims: it stops while the shrinker has recently
+ * taken pages back and only uses memory that is free right now.
+ */
+static bool ion_page_pool_fill(struct ion_page_pool *pool)
 {
-	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
+	int target = ion_page_pool_fill_target(pool);
+	struct page *page;
+	bool fresh = false;
+
+	spin_lock(&pool->lock);
+	page = ion_page_pool_remove_dirty(pool);
+	if (!page && pool->high_count + pool->low_count < target)
+		fresh = true;
+	spin_unlock(&pool->lock);
+
+	if (fresh) {
+		page = ion_page_pool_alloc_pages(pool,
+				(pool->gfp_mask & ~__GFP_WAIT) |
+				__GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			return false;
+	} else if (page) {
+		if (ion_page_pool_zero(pool, page)) {
+			ion_page_pool_free_pages(pool, page);
+			return true;
+		}
+		atomic_long_inc(&pool->zeroed_bg);
+	} else {
+		return false;
+	}
+
+	spin_lock(&pool->lock);
+	ion_page_pool_add_clean(pool, page);
+	spin_unlock(&pool->lock);
+	return true;
+}
+
+static int ion_page_pool_thread(void *data)
+{
+	struct ion_page_pool *pool;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		bool more = false;
+
+		wait_event_freezable(ion_page_pool_wait,
+				     atomic_xchg(&ion_page_pool_kicked, 0) ||
+				     kthread_should_stop());
+
+		do {
+			more = false;
+			mutex_lock(&ion_page_pools_lock);
+			list_for_each_entry(pool, &ion_page_pools, pools)
+				more |= ion_page_pool_fill(pool);
+			mutex_unlock(&ion_page_pools_lock);
+			cond_resched();
+		} while (more && !kthread_should_stop());
+	}
+
+	return 0;
+}
+
+void ion_page_pool_debug_show(struct ion_page_pool *pool, struct seq_file *s)
+{
+	unsigned long hits = 0, misses = 0;
+	int cached = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache = per_cpu_ptr(pool->cache, cpu);
+
+		hits += cache->hits;
+		misses += cache->misses;
+		cached += cache->count;
+	}
+
+	seq_printf(s, "%s pool order %u: %d highmem %d lowmem %d percpu zeroed, %d dirty\n",
+		   pool->cached ? "cached" : "uncached", pool->order,
+		   pool->high_count, pool->low_count, cached,
+		   pool->dirty_count);
+	seq_printf(s, "  percpu hits %lu misses %lu, zeroed bg %ld sync %ld, fresh %ld\n",
+		   hits, misses, atomic_long_read(&pool->zeroed_bg),
+		   atomic_long_read(&pool->zeroed_sync),
+		   atomic_long_read(&pool->fresh));
+	seq_puts(s, "  alloc latency (us):");
+	for (i = 0; i < ION_POOL_LAT_BUCKETS; i++)
+		seq_printf(s, " <%u:%d", 1U << i, atomic_read(&pool->lat_hist[i]));
+	seq_puts(s, "\n");
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   bool cached)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
-	pool->high_count = 0;
-	pool->low_count = 0;
+	pool->cache = alloc_percpu(struct ion_page_pool_cache);
+	if (!pool->cache) {
+		kfree(pool);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(pool->cache, cpu)->lock);
 	INIT_LIST_HEAD(&pool->low_items);
 	INIT_LIST_HEAD(&pool->high_items);
-	pool->gfp_mask = gfp_mask;
+	INIT_LIST_HEAD(&pool->dirty_items);
+	pool->gfp_mask = gfp_mask & ~__GFP_ZERO;
 	pool->order = order;
-	mutex_init(&pool->mutex);
+	pool->cached = cached;
+	spin_lock_init(&pool->lock);
 	plist_node_init(&pool->list, order);
 
+	mutex_lock(&ion_page_pools_lock);
+	list_add_tail(&pool->pools, &ion_page_pools);
+	mutex_unlock(&ion_page_pools_lock);
+	ion_page_pool_kick();
+
 	return pool;
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	mutex_lock(&ion_page_pools_lock);
+	list_del(&pool->pools);
+	mutex_unlock(&ion_page_pools_lock);
+
+	ion_page_pool_shrink(pool, __GFP_HIGHMEM, INT_MAX);
+	free_percpu(pool->cache);
 	kfree(pool);
 }
 
 static int __init ion_page_pool_init(void)
 {
+	ion_page_pool_task = kthread_run(ion_page_pool_thread, NULL,
+					 "ion_pool_zero");
+	if (IS_ERR(ion_page_pool_task)) {
+		pr_err("%s: creating thread for zeroing pools failed\n",
+		       __func__);
+		return PTR_ERR(ion_page_pool_task);
+	}
 	return 0;
 }
 
 static void __exit ion_page_pool_exit(void)
 {
+	kthread_stop(ion_page_pool_task);
 }
 
 module_init(ion_page_pool_init);
@@ -366,38 +366,80 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * invalidated from the cache, provides a significant peformance benefit on
  * many systems */
 
+#define ION_POOL_CACHE_SIZE	16
+#define ION_POOL_CACHE_BATCH	8
+#define ION_POOL_LAT_BUCKETS	12
+
+/**
+ * struct ion_page_pool_cache - per-cpu cache of ready pages
+ * @lock:		protects this cache; only contended by the shrinker
+ * @count:		number of pages in @pages
+ * @pages:		zeroed pages, ready for dma
+ * @hits:		allocations served from this cache
+ * @misses:		allocations that had to go to the shared lists
+ */
+struct ion_page_pool_cache {
+	spinlock_t lock;
+	int count;
+	struct page *pages[ION_POOL_CACHE_SIZE];
+	unsigned long hits;
+	unsigned long misses;
+};
+
 /**
  * struct ion_page_pool - pagepool struct
- * @high_count:		number of highmem items in the pool
- * @low_count:		number of lowmem items in the pool
- * @high_items:		list of highmem items
- * @low_items:		list of lowmem items
- * @mutex:		lock protecting this struct and especially the count
- *			item list
+ * @high_count:		number of zeroed highmem items in the pool
+ * @low_count:		number of zeroed lowmem items in the pool
+ * @dirty_count:	number of items waiting to be zeroed
+ * @high_items:		list of zeroed highmem items
+ * @low_items:		list of zeroed lowmem items
+ * @dirty_items:	list of freed items not yet zeroed
+ * @lock:		lock protecting the shared lists and counts
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
+ * @cached:		pages are handed out for cached buffers; zeroing goes
+ *			through a cached mapping and is flushed afterwards
+ * @cache:		per-cpu caches in front of the shared lists
+ * @pools:		entry on the zeroing thread's list of pools
  * @list:		plist node for list of pools
+ * @zeroed_bg:		items zeroed by the zeroing thread
+ * @zeroed_sync:	dirty items zeroed in the allocation path
+ * @fresh:		items allocated from the page allocator
+ * @lat_hist:		allocation latency, log2 of microseconds
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
- * on many systems
+ * on many systems.  Freed pages are zeroed by a background thread, so
+ * ion_page_pool_alloc() normally returns a page that only needs to be
+ * taken off a list.
  */
 struct ion_page_pool {
 	int high_count;
 	int low_count;
+	int dirty_count;
 	struct list_head high_items;
 	struct list_head low_items;
-	struct mutex mutex;
+	struct list_head dirty_items;
+	spinlock_t lock;
 	gfp_t gfp_mask;
 	unsigned int order;
+	bool cached;
+	struct ion_page_pool_cache __percpu *cache;
+	struct list_head pools;
 	struct plist_node list;
+	atomic_long_t zeroed_bg;
+	atomic_long_t zeroed_sync;
+	atomic_long_t fresh;
+	atomic_t lat_hist[ION_POOL_LAT_BUCKETS];
 };
 
-struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   bool cached);
 void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
+void ion_page_pool_debug_show(struct ion_page_pool *pool, struct seq_file *s);
 
 /** ion_page_pool_shrink - shrinks the size of the memory cached in the pool
  * @pool:		the pool
@@ -18,17 +18,23 @@
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/highmem.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ion.h"
 #include "ion_priv.h"
 
-static gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN |
+/*
+ * Pool pages are zeroed by the pool, in the background where possible,
+ * so __GFP_ZERO is only used for allocations that bypass the pools.
+ */
+static gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
 				     __GFP_NORETRY) & ~__GFP_WAIT;
-static gfp_t low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN);
+static gfp_t low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_NOWARN);
 static const unsigned int orders[] = {8, 4, 0};
 static const int num_orders = ARRAY_SIZE(orders);
 static int order_to_index(unsigned int order)
@@ -46,9 +52,13 @@ static unsigned int order_to_size(int order)
 	return PAGE_SIZE << order;
 }
 
+#define ION_ALLOC_LAT_BUCKETS	16
+
 struct ion_system_heap {
 	struct ion_heap heap;
-	struct ion_page_pool **pools;
+	struct ion_page_pool **uncached_pools;
+	struct ion_page_pool **cached_pools;
+	atomic_t alloc_lat_hist[ION_ALLOC_LAT_BUCKETS];
 };
 
 struct page_info {
@@ -62,26 +72,15 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 				      unsigned long order)
 {
 	bool cached = ion_buffer_cached(buffer);
-	struct ion_page_pool *pool = heap->pools[order_to_index(order)];
-	struct page *page;
-
-	if (!cached) {
-		page = ion_page_pool_alloc(pool);
-	} else {
-		gfp_t gfp_flags = low_order_gfp_flags;
+	int index = order_to_index(order);
+	struct ion_page_pool *pool;
 
-		if (order > 4)
-			gfp_flags = high_order_gfp_flags;
-		page = alloc_pages(gfp_flags, order);
-		if (!page)
-			return NULL;
-		ion_pages_sync_for_device(NULL, page, PAGE_SIZE << order,
-						DMA_BIDIRECTIONAL);
-	}
-	if (!page)
-		return NULL;
+	if (cached)
+		pool = heap->cached_pools[index];
+	else
+		pool = heap->uncached_pools[index];
 
-	return page;
+	return ion_page_pool_alloc(pool);
 }
 
 static void free_buffer_page(struct ion_system_heap *heap,
@@ -89,13 +88,14 @@ static void free_buffer_page(struct ion_system_heap *heap,
 			     unsigned int order)
 {
 	bool cached = ion_buffer_cached(buffer);
+	int index = order_to_index(order);
 
-	if (!cached && !(buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE)) {
-		struct ion_page_pool *pool = heap->pools[order_to_index(order)];
-		ion_page_pool_free(pool, page);
-	} else {
+	if (buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE)
 		__free_pages(page, order);
-	}
+	else if (cached)
+		ion_page_pool_free(heap->cached_pools[index], page);
+	else
+		ion_page_pool_free(heap->uncached_pools[index], page);
 }
 
 
@@ -148,6 +148,8 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	int i = 0;
 	unsigned long size_remaining = PAGE_ALIGN(size);
 	unsigned int max_order = orders[0];
+	u64 start = local_clock();
+	u64 us;
 
 	if (align > PAGE_SIZE)
 		return -EINVAL;
@@ -184,6 +186,10 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	}
 
 	buffer->priv_virt = table;
+
+	us = div_u64(local_clock() - start, NSEC_PER_USEC);
+	atomic_inc(&sys_heap->alloc_lat_hist[us ?
+		   min(fls64(us), ION_ALLOC_LAT_BUCKETS - 1) : 0]);
 	return 0;
 err1:
 	kfree(table);
@@ -202,16 +208,10 @@ static void ion_system_heap_free(struct ion_buffer *buffer)
 							struct ion_system_heap,
 							heap);
 	struct sg_table *table = buffer->sg_table;
-	bool cached = ion_buffer_cached(buffer);
 	struct scatterlist *sg;
-	LIST_HEAD(pages);
 	int i;
 
-	/* uncached pages come from the page pools, zero them before returning
-	   for security purposes (other allocations are zerod at alloc time */
-	if (!cached && !(buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE))
-		ion_heap_buffer_zero(buffer);
-
+	/* the pools zero freed pages before handing them out again */
 	for_each_sg(table->sgl, sg, table->nents, i)
 		free_buffer_page(sys_heap, buffer, sg_page(sg),
 				get_order(sg->length));
@@ -241,8 +241,10 @@ static int ion_system_heap_shrink(struct ion_heap *heap, gfp_t gfp_mask,
 	sys_heap = container_of(heap, struct ion_system_heap, heap);
 
 	for (i = 0; i < num_orders; i++) {
-		struct ion_page_pool *pool = sys_heap->pools[i];
-		nr_total += ion_page_pool_shrink(pool, gfp_mask, nr_to_scan);
+		nr_total += ion_page_pool_shrink(sys_heap->uncached_pools[i],
+						 gfp_mask, nr_to_scan);
+		nr_total += ion_page_pool_shrink(sys_heap->cached_pools[i],
+						 gfp_mask, nr_to_scan);
 	}
 
 	return nr_total;
@@ -268,21 +270,55 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 							heap);
 	int i;
 	for (i = 0; i < num_orders; i++) {
-		struct ion_page_pool *pool = sys_heap->pools[i];
-		seq_printf(s, "%d order %u highmem pages in pool = %lu total\n",
-			   pool->high_count, pool->order,
-			   (1 << pool->order) * PAGE_SIZE * pool->high_count);
-		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
-			   pool->low_count, pool->order,
-			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		ion_page_pool_debug_show(sys_heap->uncached_pools[i], s);
+		ion_page_pool_debug_show(sys_heap->cached_pools[i], s);
+	}
+	seq_puts(s, "buffer alloc latency (us):");
+	for (i = 0; i < ION_ALLOC_LAT_BUCKETS; i++)
+		seq_printf(s, " <%u:%d", 1U << i,
+			   atomic_read(&sys_heap->alloc_lat_hist[i]));
+	seq_puts(s, "\n");
+	return 0;
+}
+
+static void ion_system_heap_destroy_pools(struct ion_page_pool **pools)
+{
+	int i;
+
+	for (i = 0; i < num_orders; i++)
+		if (pools[i])
+			ion_page_pool_destroy(pools[i]);
+	kfree(pools);
+}
+
+static int ion_system_heap_create_pools(struct ion_page_pool ***ppools,
+					bool cached)
+{
+	struct ion_page_pool **pools;
+	int i;
+
+	pools = kzalloc(sizeof(struct ion_page_pool *) * num_orders,
+			GFP_KERNEL);
+	if (!pools)
+		return -ENOMEM;
+	for (i = 0; i < num_orders; i++) {
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i] > 4)
+			gfp_flags = high_order_gfp_flags;
+		pools[i] = ion_page_pool_create(gfp_flags, orders[i], cached);
+		if (!pools[i]) {
+			ion_system_heap_destroy_pools(pools);
+			return -ENOMEM;
+		}
 	}
+	*ppools = pools;
 	return 0;
 }
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
 	struct ion_system_heap *heap;
-	int i;
 
 	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
@@ -290,30 +326,16 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 	heap->heap.ops = &system_heap_ops;
 	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
 	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
-	heap->pools = kzalloc(sizeof(struct ion_page_pool *) * num_orders,
-			      GFP_KERNEL);
-	if (!heap->pools)
-		goto err_alloc_pools;
-	for (i = 0; i < num_orders; i++) {
-		struct ion_page_pool *pool;
-		gfp_t gfp_flags = low_order_gfp_flags;
-
-		if (orders[i] > 4)
-			gfp_flags = high_order_gfp_flags;
-		pool = ion_page_pool_create(gfp_flags, orders[i]);
-		if (!pool)
-			goto err_create_pool;
-		heap->pools[i] = pool;
-	}
+	if (ion_system_heap_create_pools(&heap->uncached_pools, false))
+		goto err_uncached_pools;
+	if (ion_system_heap_create_pools(&heap->cached_pools, true))
+		goto err_cached_pools;
 
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	return &heap->heap;
-err_create_pool:
-	for (i = 0; i < num_orders; i++)
-		if (heap->pools[i])
-			ion_page_pool_destroy(heap->pools[i]);
-	kfree(heap->pools);
-err_alloc_pools:
+err_cached_pools:
+	ion_system_heap_destroy_pools(heap->uncached_pools);
+err_uncached_pools:
 	kfree(heap);
 	return ERR_PTR(-ENOMEM);
 }
@@ -323,11 +345,9 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 	struct ion_system_heap *sys_heap = container_of(heap,
 							struct ion_system_heap,
 							heap);
-	int i;
 
-	for (i = 0; i < num_orders; i++)
-		ion_page_pool_destroy(sys_heap->pools[i]);
-	kfree(sys_heap->pools);
+	ion_system_heap_destroy_pools(sys_heap->uncached_pools);
+	ion_system_heap_destroy_pools(sys_heap->cached_pools);
 	kfree(sys_heap);
 }
 
@@ -346,7 +366,7 @@ static int ion_system_contig_heap_allocate(struct ion_heap *heap,
 	if (align > (PAGE_SIZE << order))
 		return -EINVAL;
 
-	page = alloc_pages(low_order_gfp_flags, order);
+	page = alloc_pages(low_order_gfp_flags | __GFP_ZERO, order);
 	if (!page)
 		return -ENOMEM;
 
@@ -29,48 +29,120 @@
 #include <linux/time.h>
 #include <linux/vmalloc.h>
 #include <linux/aio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * Each log is split into one ring per CPU. A writer reserves room in the
+ * ring of the CPU it runs on with preemption disabled, which is the only
+ * serialisation between writers, then copies its payload in and commits
+ * the record. Readers merge the rings by entry timestamp.
+ *
+ * Positions in a ring are free running byte counters; the offset into the
+ * ring is the position modulo its size. Records never wrap: if a record
+ * does not fit before the end of the ring, the space left is filled with
+ * a padding record.
+ */
+
+/* Record states, kept in logger_rec.state */
+#define LOGGER_REC_BUSY		0	/* reserved, payload being copied */
+#define LOGGER_REC_DATA		1	/* committed entry */
+#define LOGGER_REC_PAD		2	/* padding or abandoned entry */
+
+/*
+ * struct logger_rec - a record in a per-CPU ring
+ * @state:	One of the LOGGER_REC_* states
+ * @size:	Bytes the record takes in the ring, this header included
+ *
+ * For LOGGER_REC_DATA records, a struct logger_entry and the payload follow.
+ */
+struct logger_rec {
+	u32			state;
+	u32			size;
+};
+
+#define LOGGER_REC_ALIGN	8
+#define LOGGER_REC_MAX		ALIGN(sizeof(struct logger_rec) + \
+				      sizeof(struct logger_entry) + \
+				      LOGGER_ENTRY_MAX_PAYLOAD, LOGGER_REC_ALIGN)
+#define LOGGER_CPU_MIN_SIZE	(16 * 1024)
+
+/**
+ * struct logger_cpu_buf - the part of a log written from one CPU
+ * @buffer:	The ring buffer
+ * @head:	Position of the oldest record still in the ring
+ * @tail:	Position the next record will be reserved at
+ * @start:	Position new readers start at, moved by LOGGER_FLUSH_LOG
+ * @written:	Entries reserved by writers
+ * @dropped:	Entries dropped because the ring was full of busy records
+ * @overwritten: Entries overwritten by newer ones
+ *
+ * @head, @tail and the counters are only changed by the owning CPU with
+ * preemption disabled.
+ */
+struct logger_cpu_buf {
+	unsigned char		*buffer;
+	unsigned long		head;
+	unsigned long		tail;
+	unsigned long		start;
+	unsigned long		written;
+	unsigned long		dropped;
+	unsigned long		overwritten;
+};
+
 /**
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
- * @buffer:	The actual ring buffer
+ * @bufs:	The per-CPU rings
+ * @cpu_size:	The size of each per-CPU ring
  * @misc:	The "misc" device representing the log
  * @wq:		The wait queue for @readers
  * @readers:	This log's readers
- * @mutex:	The mutex that protects the @buffer
- * @w_off:	The current write head offset
- * @head:	The head, or location that readers start reading at.
+ * @mutex:	The mutex that protects @readers and their state
+ * @wake_timer:	Timer batching the wakeups of @wq
+ * @wake_pending: Bit 0 is set while @wake_timer is armed
  * @size:	The size of the log
  * @logs:	The list of log channels
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. Writers never take @mutex.
  */
 struct logger_log {
-	unsigned char		*buffer;
+	struct logger_cpu_buf __percpu *bufs;
+	size_t			cpu_size;
 	struct miscdevice	misc;
 	wait_queue_head_t	wq;
 	struct list_head	readers;
 	struct mutex		mutex;
-	size_t			w_off;
-	size_t			head;
+	struct timer_list	wake_timer;
+	unsigned long		wake_pending;
 	size_t			size;
 	struct list_head	logs;
 };
 
 static LIST_HEAD(log_list);
 
+/*
+ * Upper bound, in milliseconds, on how long a reader blocked on an empty log
+ * may sleep after an entry was committed. Writers arm one timer per log
+ * instead of waking the readers for every entry. Zero wakes them at once.
+ */
+static unsigned int wakeup_latency_ms = 5;
+module_param(wakeup_latency_ms, uint, 0644);
+MODULE_PARM_DESC(wakeup_latency_ms, "maximum reader wakeup delay in ms");
 
 /**
  * struct logger_reader - a logging device open for reading
  * @log:	The associated log
  * @list:	The associated entry in @logger_log's list
- * @r_off:	The current read head offset.
+ * @r_pos:	The read position in each per-CPU ring
  * @r_all:	Reader can read all entries
  * @r_ver:	Reader ABI version
+ * @overruns:	Times the reader was lapped by a writer and lost entries
  *
  * This object lives from open to release, so we don't need additional
  * reference counting. The structure is protected by log->mutex.
@@ -78,15 +150,33 @@ static LIST_HEAD(log_list);
 struct logger_reader {
 	struct logger_log	*log;
 	struct list_head	list;
-	size_t			r_off;
+	unsigned long		*r_pos;
 	bool			r_all;
 	int			r_ver;
+	unsigned long		overruns;
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
-static size_t logger_offset(struct logger_log *log, size_t n)
+/* logger_rec_at - returns the record at position 'pos' of 'cb' */
+static inline struct logger_rec *logger_rec_at(struct logger_log *log,
+		struct logger_cpu_buf *cb, unsigned long pos)
+{
+	return (struct logger_rec *)(cb->buffer + (pos & (log->cpu_size - 1)));
+}
+
+/* logger_lapped - has the record at 'pos' been overwritten? */
+static inline bool logger_lapped(struct logger_cpu_buf *cb, unsigned long pos)
 {
-	return n & (log->size - 1);
+	smp_rmb();
+	return (long)(ACCESS_ONCE(cb->head) - pos) > 0;
+}
+
+/* logger_first_pos - where a reader without a valid position starts */
+static unsigned long logger_first_pos(struct logger_cpu_buf *cb)
+{
+	unsigned long head = ACCESS_ONCE(cb->head);
+	unsigned long start = ACCESS_ONCE(cb->start);
+
+	return (long)(start - head) > 0 ? start : head;
 }
 
 
@@ -113,46 +203,6 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
-/*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
- */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
-{
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
-	}
-
-	return (struct logger_entry *) (log->buffer + off);
-}
-
-/*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
- *
- * Caller needs to hold log->mutex.
- */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
-{
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
-}
-
 static size_t get_user_hdr_len(int ver)
 {
 	if (ver < 2)
@@ -186,79 +236,122 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_peek - find the next entry 'reader' may see in the ring of 'cpu'
+ *
+ * Skips padding, entries filtered out by uid and, if the reader was lapped,
+ * the overwritten part of the ring. On success the reader's position points
+ * at the entry and its header is copied to 'hdr'.
  *
  * Caller must hold log->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static bool logger_peek(struct logger_log *log, struct logger_reader *reader,
+			int cpu, struct logger_entry *hdr)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
-	size_t msg_start;
+	struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+	unsigned long pos = reader->r_pos[cpu];
+	bool found = false;
+
+	for (;;) {
+		struct logger_rec *rec;
+		unsigned long tail;
+		u32 state, size;
+
+		if (logger_lapped(cb, pos)) {
+			pos = logger_first_pos(cb);
+			reader->overruns++;
+			continue;
+		}
 
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
+		tail = ACCESS_ONCE(cb->tail);
+		smp_rmb();
+		if (pos == tail)
+			break;
 
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
+		rec = logger_rec_at(log, cb, pos);
+		state = ACCESS_ONCE(rec->state);
+		size = ACCESS_ONCE(rec->size);
+		smp_rmb();
+		if (state == LOGGER_REC_DATA)
+			memcpy(hdr, rec + 1, sizeof(*hdr));
 
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+		/* everything read above is garbage if a writer lapped us */
+		if (logger_lapped(cb, pos))
+			continue;
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		if (state == LOGGER_REC_BUSY)
+			break;
+
+		if (state == LOGGER_REC_DATA &&
+		    (reader->r_all || uid_eq(hdr->euid, current_euid()))) {
+			found = true;
+			break;
+		}
+
+		pos += size;
+	}
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	reader->r_pos[cpu] = pos;
+	return found;
+}
+
+/*
+ * logger_next_entry - merge the per-CPU rings by timestamp
+ *
+ * Returns the CPU whose ring holds the oldest entry visible to 'reader', with
+ * its header in 'hdr', or -1 if there is nothing to read.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_next_entry(struct logger_log *log,
+			     struct logger_reader *reader,
+			     struct logger_entry *hdr)
+{
+	struct logger_entry cur;
+	int cpu, best = -1;
+
+	for_each_possible_cpu(cpu) {
+		if (!logger_peek(log, reader, cpu, &cur))
+			continue;
+		if (best >= 0 && (cur.sec > hdr->sec ||
+		    (cur.sec == hdr->sec && cur.nsec >= hdr->nsec)))
+			continue;
+		*hdr = cur;
+		best = cpu;
+	}
 
-	return count + get_user_hdr_len(reader->r_ver);
+	return best;
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * do_read_log_to_user - copies the entry at the read position of 'cpu',
+ * whose header is 'hdr', to the user-space buffer 'buf'. Returns the number
+ * of bytes copied, or -EAGAIN if a writer overwrote the entry meanwhile.
+ *
+ * Caller must hold log->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, kuid_t euid)
+static ssize_t do_read_log_to_user(struct logger_log *log,
+				   struct logger_reader *reader,
+				   int cpu, struct logger_entry *hdr,
+				   char __user *buf)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+	unsigned long pos = reader->r_pos[cpu];
+	struct logger_rec *rec = logger_rec_at(log, cb, pos);
+	struct logger_entry *entry = (struct logger_entry *)(rec + 1);
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+
+	if (copy_header_to_user(reader->r_ver, hdr, buf))
+		return -EFAULT;
 
-		entry = get_entry_header(log, off, &scratch);
+	if (copy_to_user(buf + hdr_len, entry->msg, hdr->len))
+		return -EFAULT;
 
-		if (uid_eq(entry->euid, euid))
-			return off;
+	if (logger_lapped(cb, pos))
+		return -EAGAIN;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
+	reader->r_pos[cpu] = pos + ACCESS_ONCE(rec->size);
 
-	return off;
+	return hdr_len + hdr->len;
 }
 
 /*
@@ -278,186 +371,127 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry hdr;
 	ssize_t ret;
+	int cpu;
 	DEFINE_WAIT(wait);
 
-start:
-	while (1) {
-		mutex_lock(&log->mutex);
-
+	mutex_lock(&log->mutex);
+	for (;;) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
-			break;
+		cpu = logger_next_entry(log, reader, &hdr);
+		if (cpu < 0) {
+			if (file->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				break;
+			}
 
-		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			break;
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+
+			mutex_unlock(&log->mutex);
+			schedule();
+			mutex_lock(&log->mutex);
+			continue;
 		}
+		finish_wait(&log->wq, &wait);
 
-		if (signal_pending(current)) {
-			ret = -EINTR;
+		/* get the size of the next entry */
+		ret = get_user_hdr_len(reader->r_ver) + hdr.len;
+		if (count < ret) {
+			ret = -EINVAL;
 			break;
 		}
 
-		schedule();
+		/* get exactly one entry from the log */
+		ret = do_read_log_to_user(log, reader, cpu, &hdr, buf);
+		if (ret != -EAGAIN)
+			break;
 	}
-
 	finish_wait(&log->wq, &wait);
-	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
+ * logger_reserve - reserve 'size' bytes at the tail of 'cb'
  *
- * |------- a xxxxxxxx b --------|
- *               c^
+ * Overwrites the oldest records if needed. Returns NULL if that would mean
+ * overwriting a record whose writer has not committed it yet.
  *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
+ * Must be called with preemption disabled, on the CPU owning 'cb'.
  */
-static inline int is_between(size_t a, size_t b, size_t c)
+static struct logger_rec *logger_reserve(struct logger_log *log,
+					 struct logger_cpu_buf *cb, u32 size)
 {
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+	unsigned long pos = cb->tail;
+	size_t off = pos & (log->cpu_size - 1);
+	u32 pad = off + size > log->cpu_size ? log->cpu_size - off : 0;
+	unsigned long head = cb->head;
+	struct logger_rec *rec;
+
+	while (pos + pad + size - head > log->cpu_size) {
+		rec = logger_rec_at(log, cb, head);
+		if (ACCESS_ONCE(rec->state) == LOGGER_REC_BUSY)
+			return NULL;
+		if (rec->state == LOGGER_REC_DATA)
+			cb->overwritten++;
+		head += rec->size;
 	}
 
-	return 0;
-}
+	/* readers must see the new head before the old records change */
+	ACCESS_ONCE(cb->head) = head;
+	smp_wmb();
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
+	if (pad) {
+		rec = logger_rec_at(log, cb, pos);
+		rec->state = LOGGER_REC_PAD;
+		rec->size = pad;
+		pos += pad;
+	}
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	rec = logger_rec_at(log, cb, pos);
+	rec->state = LOGGER_REC_BUSY;
+	rec->size = size;
+	smp_wmb();
+	ACCESS_ONCE(cb->tail) = pos + size;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return rec;
 }
 
-/*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
- */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_wake_timer(unsigned long data)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
+	struct logger_log *log = (struct logger_log *)data;
 
+	clear_bit(0, &log->wake_pending);
+	wake_up_interruptible(&log->wq);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_wake_readers - let blocked readers know an entry was committed,
+ * at most wakeup_latency_ms later.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void logger_wake_readers(struct logger_log *log)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	unsigned int delay = ACCESS_ONCE(wakeup_latency_ms);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
-			return -EFAULT;
+	/* pairs with the barrier in prepare_to_wait() */
+	smp_mb();
+	if (!waitqueue_active(&log->wq))
+		return;
 
-	log->w_off = logger_offset(log, log->w_off + count);
+	if (!delay) {
+		wake_up_interruptible(&log->wq);
+		return;
+	}
 
-	return count;
+	if (!test_bit(0, &log->wake_pending) &&
+	    !test_and_set_bit(0, &log->wake_pending))
+		mod_timer(&log->wake_timer, jiffies + msecs_to_jiffies(delay));
 }
 
 /*
@@ -469,64 +503,70 @@ static ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig;
-	struct logger_entry header;
+	struct logger_cpu_buf *cb;
+	struct logger_entry *entry;
+	struct logger_rec *rec;
 	struct timespec now;
-	ssize_t ret = 0;
+	size_t len, left;
+	char *msg;
 
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.euid = current_euid();
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-	header.hdr_size = sizeof(struct logger_entry);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	orig = log->w_off;
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Take the timestamp with the record reserved so that each ring stays
+	 * sorted by time, which the readers' merge relies on.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
+	preempt_disable();
+	cb = this_cpu_ptr(log->bufs);
+	rec = logger_reserve(log, cb, ALIGN(sizeof(struct logger_rec) +
+					    sizeof(struct logger_entry) + len,
+					    LOGGER_REC_ALIGN));
+	if (unlikely(!rec)) {
+		cb->dropped++;
+		preempt_enable();
+		return len;
+	}
+	cb->written++;
+	getnstimeofday(&now);
+	preempt_enable();
+
+	entry = (struct logger_entry *)(rec + 1);
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
+	entry->euid = current_euid();
+	entry->len = len;
+	entry->hdr_size = sizeof(struct logger_entry);
+
+	msg = entry->msg;
+	for (left = len; nr_segs-- > 0 && left; iov++) {
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		size_t n = min_t(size_t, iov->iov_len, left);
+
+		/*
+		 * A partially copied entry is abandoned rather than committed,
+		 * to avoid message corruption from missing fragments.
+		 */
+		if (copy_from_user(msg, iov->iov_base, n)) {
+			smp_wmb();
+			ACCESS_ONCE(rec->state) = LOGGER_REC_PAD;
+			return -EFAULT;
 		}
-
-		iov++;
-		ret += nr;
+		msg += n;
+		left -= n;
 	}
 
-	mutex_unlock(&log->mutex);
+	smp_wmb();
+	ACCESS_ONCE(rec->state) = LOGGER_REC_DATA;
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_wake_readers(log);
 
-	return ret;
+	return len;
 }
 
 static struct logger_log *get_log_from_minor(int minor)
@@ -560,10 +600,19 @@ static int logger_open(struct inode *inode, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
 
-		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
+		int cpu;
+
+		reader = kzalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
+		reader->r_pos = kcalloc(nr_cpu_ids, sizeof(*reader->r_pos),
+					GFP_KERNEL);
+		if (!reader->r_pos) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
@@ -572,7 +621,9 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		for_each_possible_cpu(cpu)
+			reader->r_pos[cpu] =
+				logger_first_pos(per_cpu_ptr(log->bufs, cpu));
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -598,6 +649,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+		kfree(reader->r_pos);
 		kfree(reader);
 	}
 
@@ -617,6 +669,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry hdr;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -628,11 +681,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (logger_next_entry(log, reader, &hdr) >= 0)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -652,12 +701,37 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_unread - bytes of the log 'reader' has not read yet
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t logger_unread(struct logger_log *log,
+			    struct logger_reader *reader)
+{
+	size_t len = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+		unsigned long pos = reader->r_pos[cpu];
+
+		if (logger_lapped(cb, pos))
+			pos = logger_first_pos(cb);
+		len += ACCESS_ONCE(cb->tail) - pos;
+	}
+
+	return len;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry hdr;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
+	int cpu;
 
 	mutex_lock(&log->mutex);
 
@@ -671,10 +745,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_unread(log, reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -683,13 +754,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (logger_next_entry(log, reader, &hdr) >= 0)
+			ret = get_user_hdr_len(reader->r_ver) + hdr.len;
 		else
 			ret = 0;
 		break;
@@ -703,9 +769,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		for_each_possible_cpu(cpu) {
+			struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+			unsigned long tail = ACCESS_ONCE(cb->tail);
+
+			list_for_each_entry(reader, &log->readers, list)
+				reader->r_pos[cpu] = tail;
+			cb->start = tail;
+		}
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -742,32 +813,116 @@ static const struct file_operations logger_fops = {
 	.release = logger_release,
 };
 
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *logger_debugfs_root;
+
+static int logger_stats_show(struct seq_file *m, void *unused)
+{
+	struct logger_log *log = m->private;
+	struct logger_reader *reader;
+	int cpu;
+
+	seq_printf(m, "cpu  written  dropped  overwritten\n");
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+
+		seq_printf(m, "%3d %8lu %8lu %12lu\n", cpu,
+			   ACCESS_ONCE(cb->written), ACCESS_ONCE(cb->dropped),
+			   ACCESS_ONCE(cb->overwritten));
+	}
+
+	mutex_lock(&log->mutex);
+	list_for_each_entry(reader, &log->readers, list)
+		seq_printf(m, "reader %p: overruns %lu\n", reader,
+			   reader->overruns);
+	mutex_unlock(&log->mutex);
+
+	return 0;
+}
+
+static int logger_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logger_stats_show, inode->i_private);
+}
+
+static const struct file_operations logger_stats_fops = {
+	.open = logger_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void __init logger_debugfs_add(struct logger_log *log)
+{
+	if (!logger_debugfs_root)
+		logger_debugfs_root = debugfs_create_dir("logger", NULL);
+	if (logger_debugfs_root)
+		debugfs_create_file(log->misc.name, S_IRUGO,
+				    logger_debugfs_root, log,
+				    &logger_stats_fops);
+}
+
+static void __exit logger_debugfs_remove(void)
+{
+	debugfs_remove_recursive(logger_debugfs_root);
+}
+#else
+static inline void logger_debugfs_add(struct logger_log *log)
+{
+}
+
+static inline void logger_debugfs_remove(void)
+{
+}
+#endif
+
+static void logger_free_bufs(struct logger_log *log)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(log->bufs, cpu)->buffer);
+	free_percpu(log->bufs);
+}
+
 /*
- * Log size must must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * Log size must must be a power of two. It is split evenly between the
+ * possible CPUs, each of which gets at least LOGGER_CPU_MIN_SIZE bytes.
  */
 static int __init create_log(char *log_name, int size)
 {
 	int ret = 0;
 	struct logger_log *log;
-	unsigned char *buffer;
+	int cpu;
 
-	buffer = vmalloc(size);
-	if (buffer == NULL)
-		return -ENOMEM;
+	BUILD_BUG_ON(LOGGER_CPU_MIN_SIZE < 2 * LOGGER_REC_MAX);
 
 	log = kzalloc(sizeof(struct logger_log), GFP_KERNEL);
-	if (log == NULL) {
+	if (log == NULL)
+		return -ENOMEM;
+
+	log->cpu_size = max_t(size_t, LOGGER_CPU_MIN_SIZE,
+			      rounddown_pow_of_two(size / num_possible_cpus()));
+	log->bufs = alloc_percpu(struct logger_cpu_buf);
+	if (log->bufs == NULL) {
 		ret = -ENOMEM;
-		goto out_free_buffer;
+		goto out_free_log;
+	}
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_buf *cb = per_cpu_ptr(log->bufs, cpu);
+
+		cb->buffer = vmalloc(log->cpu_size);
+		if (cb->buffer == NULL) {
+			ret = -ENOMEM;
+			goto out_free_buffer;
+		}
 	}
-	log->buffer = buffer;
 
 	log->misc.minor = MISC_DYNAMIC_MINOR;
 	log->misc.name = kstrdup(log_name, GFP_KERNEL);
 	if (log->misc.name == NULL) {
 		ret = -ENOMEM;
-		goto out_free_log;
+		goto out_free_buffer;
 	}
 
 	log->misc.fops = &logger_fops;
@@ -776,8 +931,7 @@ static int __init create_log(char *log_name, int size)
 	init_waitqueue_head(&log->wq);
 	INIT_LIST_HEAD(&log->readers);
 	mutex_init(&log->mutex);
-	log->w_off = 0;
-	log->head = 0;
+	setup_timer(&log->wake_timer, logger_wake_timer, (unsigned long)log);
 	log->size = size;
 
 	INIT_LIST_HEAD(&log->logs);
@@ -788,19 +942,23 @@ static int __init create_log(char *log_name, int size)
 	if (unlikely(ret)) {
 		pr_err("failed to register misc device for log '%s'!\n",
 				log->misc.name);
-		goto out_free_log;
+		list_del(&log->logs);
+		kfree(log->misc.name);
+		goto out_free_buffer;
 	}
 
+	logger_debugfs_add(log);
+
 	pr_info("created %luK log '%s'\n",
 		(unsigned long) log->size >> 10, log->misc.name);
 
 	return 0;
 
+out_free_buffer:
+	logger_free_bufs(log);
+
 out_free_log:
 	kfree(log);
-
-out_free_buffer:
-	vfree(buffer);
 	return ret;
 }
 
@@ -832,10 +990,13 @@ static void __exit logger_exit(void)
 {
 	struct logger_log *current_log, *next_log;
 
+	logger_debugfs_remove();
+
 	list_for_each_entry_safe(current_log, next_log, &log_list, logs) {
 		/* we have to delete all the entry inside log_list */
 		misc_deregister(&current_log->misc);
-		vfree(current_log->buffer);
+		del_timer_sync(&current_log->wake_timer);
+		logger_free_bufs(current_log);
 		kfree(current_log->misc.name);
 		list_del(&current_log->logs);
 		kfree(current_log);
@@ -17,6 +17,14 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Alternatively, writing 1 to /sys/module/lowmemorykiller/parameters/stall_mode
+ * drives the killer from memory pressure stall time (CONFIG_PSI) instead of
+ * free page counts. /sys/module/lowmemorykiller/parameters/stall holds the
+ * percentage of stall_window_ms spent stalled that selects the matching adj
+ * entry, in descending order. Victims then come from a list sorted by
+ * oom_score_adj that is kept up to date as adj values are written, rather
+ * than from a scan of every task.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -40,6 +48,11 @@
 #include <linux/swap.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/psi.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <trace/events/oom.h>
 #ifdef CONFIG_TEGRA_NVMAP
 #include <linux/nvmap.h>
 #endif
@@ -62,6 +75,16 @@ static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
 
+static bool lowmem_stall_mode;
+static uint lowmem_stall_window_ms = 1000;
+static int lowmem_stall[6] = {
+	70,
+	50,
+	30,
+	10,
+};
+static int lowmem_stall_size = 4;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -108,7 +131,8 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
 		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+	if (lowmem_stall_mode || sc->nr_to_scan <= 0 ||
+	    min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
 		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
@@ -179,6 +203,363 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	return rem;
 }
 
+#ifdef CONFIG_PSI
+/*
+ * Victim list for stall mode, one entry per thread group whose
+ * oom_score_adj was written, sorted by adj in descending order. Entries
+ * hold no reference; the task_free notifier drops them before the
+ * task_struct goes away. Updates come from the oom_score_adj_update
+ * tracepoint, which fires under task_lock and siglock, so the lock is
+ * irq-safe and never held while taking task_lock.
+ */
+struct lmk_victim {
+	struct rb_node rb_node;		/* by tsk */
+	struct list_head entry;		/* by adj, descending */
+	struct task_struct *tsk;
+	short adj;
+};
+
+#define LMK_VICTIM_BATCH	8
+
+static DEFINE_SPINLOCK(lmk_victims_lock);
+static struct rb_root lmk_victims_tree = RB_ROOT;
+static LIST_HEAD(lmk_victims);
+static DEFINE_MUTEX(lmk_stall_mutex);
+static struct psi_trigger lmk_stall_trigger;
+
+static struct lmk_victim *lmk_victim_find(struct task_struct *tsk)
+{
+	struct rb_node *n = lmk_victims_tree.rb_node;
+
+	while (n) {
+		struct lmk_victim *v = rb_entry(n, struct lmk_victim, rb_node);
+
+		if (tsk < v->tsk)
+			n = n->rb_left;
+		else if (tsk > v->tsk)
+			n = n->rb_right;
+		else
+			return v;
+	}
+	return NULL;
+}
+
+static void lmk_victim_insert_tree(struct lmk_victim *new)
+{
+	struct rb_node **p = &lmk_victims_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct lmk_victim *v;
+
+		parent = *p;
+		v = rb_entry(parent, struct lmk_victim, rb_node);
+		if (new->tsk < v->tsk)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->rb_node, parent, p);
+	rb_insert_color(&new->rb_node, &lmk_victims_tree);
+}
+
+static void lmk_victim_sort(struct lmk_victim *new)
+{
+	struct lmk_victim *v;
+
+	list_for_each_entry(v, &lmk_victims, entry) {
+		if (v->adj <= new->adj) {
+			list_add_tail(&new->entry, &v->entry);
+			return;
+		}
+	}
+	list_add_tail(&new->entry, &lmk_victims);
+}
+
+/* called with lmk_victims_lock held */
+static void lmk_victim_update(struct task_struct *tsk, short adj, gfp_t gfp)
+{
+	struct lmk_victim *v = lmk_victim_find(tsk);
+
+	if (v) {
+		if (v->adj == adj)
+			return;
+		list_del(&v->entry);
+	} else {
+		v = kmalloc(sizeof(*v), gfp);
+		if (!v)
+			return;
+		v->tsk = tsk;
+		lmk_victim_insert_tree(v);
+	}
+	v->adj = adj;
+	lmk_victim_sort(v);
+}
+
+static void lmk_adj_update_probe(void *ignore, struct task_struct *task)
+{
+	unsigned long flags;
+
+	if (task->flags & PF_KTHREAD)
+		return;
+
+	spin_lock_irqsave(&lmk_victims_lock, flags);
+	lmk_victim_update(task->group_leader, task->signal->oom_score_adj,
+			  GFP_ATOMIC);
+	spin_unlock_irqrestore(&lmk_victims_lock, flags);
+}
+
+static int lmk_task_free_notify(struct notifier_block *self,
+				unsigned long val, void *data)
+{
+	struct task_struct *tsk = data;
+	struct lmk_victim *v;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_victims_lock, flags);
+	v = lmk_victim_find(tsk);
+	if (v) {
+		rb_erase(&v->rb_node, &lmk_victims_tree);
+		list_del(&v->entry);
+	}
+	spin_unlock_irqrestore(&lmk_victims_lock, flags);
+	kfree(v);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lmk_task_free_nb = {
+	.notifier_call = lmk_task_free_notify,
+};
+
+static void lmk_victims_free(void)
+{
+	struct lmk_victim *v, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_victims_lock, flags);
+	list_for_each_entry_safe(v, tmp, &lmk_victims, entry) {
+		list_del(&v->entry);
+		kfree(v);
+	}
+	lmk_victims_tree = RB_ROOT;
+	spin_unlock_irqrestore(&lmk_victims_lock, flags);
+}
+
+/* full scan, used to seed the list and when it turned out stale */
+static void lmk_victims_seed(void)
+{
+	struct task_struct *tsk;
+	unsigned long flags;
+
+	rcu_read_lock();
+	spin_lock_irqsave(&lmk_victims_lock, flags);
+	for_each_process(tsk) {
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+		lmk_victim_update(tsk, tsk->signal->oom_score_adj, GFP_ATOMIC);
+	}
+	spin_unlock_irqrestore(&lmk_victims_lock, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * Kill the largest task among those sharing the highest oom_score_adj at
+ * or above @min_score_adj. Returns false if the list had no live
+ * candidate.
+ */
+static bool lmk_stall_kill(short min_score_adj, int pct)
+{
+	struct task_struct *cand[LMK_VICTIM_BATCH];
+	struct task_struct *selected = NULL;
+	struct lmk_victim *v;
+	unsigned long flags;
+	int selected_tasksize = 0;
+	short adj = OOM_SCORE_ADJ_MIN - 1;
+	int n = 0, i;
+
+	spin_lock_irqsave(&lmk_victims_lock, flags);
+	list_for_each_entry(v, &lmk_victims, entry) {
+		if (v->adj < min_score_adj || n == LMK_VICTIM_BATCH)
+			break;
+		if (n && v->adj != adj)
+			break;
+		/* the task may be on its way to the free notifier */
+		if (!atomic_inc_not_zero(&v->tsk->usage))
+			continue;
+		adj = v->adj;
+		cand[n++] = v->tsk;
+	}
+	spin_unlock_irqrestore(&lmk_victims_lock, flags);
+
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		struct task_struct *p;
+		int tasksize;
+
+		p = find_lock_task_mm(cand[i]);
+		if (!p)
+			continue;
+		tasksize = get_mm_rss(p->mm);
+		task_unlock(p);
+		if (tasksize > selected_tasksize) {
+			selected = cand[i];
+			selected_tasksize = tasksize;
+		}
+	}
+	rcu_read_unlock();
+
+	if (selected) {
+		lowmem_print(1, "Killing '%s' (%d), adj %hd,\n" \
+				"   to free %ldkB because memory stall is %d%%\n" \
+				"   of %ums for oom_score_adj %hd\n",
+			     selected->comm, selected->pid, adj,
+			     selected_tasksize * (long)(PAGE_SIZE / 1024),
+			     pct, lowmem_stall_window_ms, min_score_adj);
+		lowmem_deathpending_timeout = jiffies + HZ;
+		send_sig(SIGKILL, selected, 0);
+		set_tsk_thread_flag(selected, TIF_MEMDIE);
+	}
+
+	for (i = 0; i < n; i++)
+		put_task_struct(cand[i]);
+
+	return selected != NULL;
+}
+
+static bool lmk_death_pending(void)
+{
+	struct task_struct *tsk;
+	bool pending = false;
+
+	if (time_after(jiffies, lowmem_deathpending_timeout))
+		return false;
+
+	rcu_read_lock();
+	for_each_process(tsk) {
+		if (test_tsk_thread_flag(tsk, TIF_MEMDIE)) {
+			pending = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return pending;
+}
+
+static void lmk_stall_notify(struct psi_trigger *t, u64 growth)
+{
+	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int pct;
+	int i;
+
+	pct = div64_u64(growth * 100, t->window);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_stall_size < array_size)
+		array_size = lowmem_stall_size;
+	for (i = 0; i < array_size; i++) {
+		if (pct >= lowmem_stall[i]) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	lowmem_print(3, "lowmem_stall %d%%, ma %hd\n", pct, min_score_adj);
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1)
+		return;
+
+	if (lmk_death_pending())
+		return;
+
+	if (!lmk_stall_kill(min_score_adj, pct)) {
+		/* adj of tasks that never had it written is not tracked */
+		lmk_victims_seed();
+		lmk_stall_kill(min_score_adj, pct);
+	}
+}
+
+static int lmk_stall_start(void)
+{
+	int min_pct = 100;
+	int ret;
+	int i;
+
+	for (i = 0; i < lowmem_stall_size; i++)
+		if (lowmem_stall[i] > 0 && lowmem_stall[i] < min_pct)
+			min_pct = lowmem_stall[i];
+
+	/*
+	 * The task_free notifier goes first so that no task the probe
+	 * records can exit unseen.
+	 */
+	task_free_register(&lmk_task_free_nb);
+	ret = register_trace_oom_score_adj_update(lmk_adj_update_probe, NULL);
+	if (ret) {
+		task_free_unregister(&lmk_task_free_nb);
+		return ret;
+	}
+	lmk_victims_seed();
+
+	lmk_stall_trigger.res = PSI_MEM;
+	lmk_stall_trigger.window = (u64)lowmem_stall_window_ms * NSEC_PER_MSEC;
+	lmk_stall_trigger.threshold =
+		div_u64(lmk_stall_trigger.window * min_pct, 100);
+	lmk_stall_trigger.notify = lmk_stall_notify;
+	ret = psi_trigger_register(&lmk_stall_trigger);
+	if (ret) {
+		unregister_trace_oom_score_adj_update(lmk_adj_update_probe,
+						      NULL);
+		task_free_unregister(&lmk_task_free_nb);
+		tracepoint_synchronize_unregister();
+		lmk_victims_free();
+	}
+	return ret;
+}
+
+static void lmk_stall_stop(void)
+{
+	psi_trigger_unregister(&lmk_stall_trigger);
+	unregister_trace_oom_score_adj_update(lmk_adj_update_probe, NULL);
+	task_free_unregister(&lmk_task_free_nb);
+	tracepoint_synchronize_unregister();
+	lmk_victims_free();
+}
+
+static int lowmem_stall_mode_set(const char *val,
+				 const struct kernel_param *kp)
+{
+	bool enable;
+	int ret;
+
+	ret = strtobool(val, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&lmk_stall_mutex);
+	if (enable && !lowmem_stall_mode)
+		ret = lmk_stall_start();
+	else if (!enable && lowmem_stall_mode)
+		lmk_stall_stop();
+	if (!ret)
+		lowmem_stall_mode = enable;
+	mutex_unlock(&lmk_stall_mutex);
+
+	return ret;
+}
+#else
+static int lowmem_stall_mode_set(const char *val,
+				 const struct kernel_param *kp)
+{
+	return -ENOSYS;
+}
+#endif
+
+static struct kernel_param_ops lowmem_stall_mode_ops = {
+	.set = lowmem_stall_mode_set,
+	.get = param_get_bool,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -286,6 +667,12 @@ module_param_array_named(adj, lowmem_adj, short, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(stall_mode, &lowmem_stall_mode_ops, &lowmem_stall_mode,
+		S_IRUGO | S_IWUSR);
+module_param_named(stall_window_ms, lowmem_stall_window_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(stall, lowmem_stall, int, &lowmem_stall_size,
+			 S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
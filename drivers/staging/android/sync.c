@@ -32,7 +32,7 @@
 #include "trace/sync.h"
 
 static void sync_fence_signal_pt(struct sync_pt *pt);
-static int _sync_pt_has_signaled(struct sync_pt *pt);
+static int _sync_pt_has_signaled(struct sync_pt *pt, bool *fence_done);
 static void sync_fence_free(struct kref *kref);
 static void sync_fence_dump(struct sync_fence *fence);
 static void sync_dump(void);
@@ -43,6 +43,30 @@ static DEFINE_SPINLOCK(sync_timeline_list_lock);
 static LIST_HEAD(sync_fence_list_head);
 static DEFINE_SPINLOCK(sync_fence_list_lock);
 
+#define SYNC_STAT_BUCKETS	12
+
+static struct {
+	atomic_long_t	created;
+	atomic_long_t	merges;
+	atomic_long_t	merge_pts_in;
+	atomic_long_t	merge_pts_out;
+	atomic_long_t	merge_pts_signaled;	/* dropped, already signaled */
+	atomic_long_t	merge_pts_collapsed;	/* dropped, same timeline */
+	atomic_t	merge_size[SYNC_STAT_BUCKETS];	/* log2 pts */
+	atomic_t	signal_ms[SYNC_STAT_BUCKETS];	/* log2 ms to signal */
+	atomic_t	lifetime_ms[SYNC_STAT_BUCKETS];	/* log2 ms to release */
+} sync_stats;
+
+static void sync_stat_log2(atomic_t *hist, u64 val)
+{
+	atomic_inc(&hist[val ? min(fls64(val), SYNC_STAT_BUCKETS - 1) : 0]);
+}
+
+static u64 sync_fence_age_ms(struct sync_fence *fence)
+{
+	return ktime_to_ms(ktime_sub(ktime_get(), fence->timestamp));
+}
+
 struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 					   int size, const char *name)
 {
@@ -142,12 +166,20 @@ void sync_timeline_signal(struct sync_timeline *obj)
 
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
+	/*
+	 * Only fences whose last outstanding pt signaled in this update (or
+	 * that hit an error) are collected, so each one is walked and woken
+	 * once no matter how many of its pts are on this timeline.
+	 */
 	list_for_each_safe(pos, n, &obj->active_list_head) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, active_list);
+		bool fence_done = false;
 
-		if (_sync_pt_has_signaled(pt)) {
+		if (_sync_pt_has_signaled(pt, &fence_done)) {
 			list_del_init(pos);
+			if (!fence_done)
+				continue;
 			list_add(&pt->signaled_list, &signaled_pts);
 			kref_get(&pt->fence->kref);
 		}
@@ -198,8 +230,11 @@ void sync_pt_free(struct sync_pt *pt)
 }
 EXPORT_SYMBOL(sync_pt_free);
 
-/* call with pt->parent->active_list_lock held */
-static int _sync_pt_has_signaled(struct sync_pt *pt)
+/*
+ * call with pt->parent->active_list_lock held.  @fence_done is set when
+ * this call moved the pt's fence out of the active state.
+ */
+static int _sync_pt_has_signaled(struct sync_pt *pt, bool *fence_done)
 {
 	int old_status = pt->status;
 
@@ -209,8 +244,11 @@ static int _sync_pt_has_signaled(struct sync_pt *pt)
 	if (!pt->status && pt->parent->destroyed)
 		pt->status = -ENOENT;
 
-	if (pt->status != old_status)
+	if (pt->status != old_status) {
 		pt->timestamp = ktime_get();
+		*fence_done = pt->status < 0 ||
+			      atomic_dec_and_test(&pt->fence->pending);
+	}
 
 	return pt->status;
 }
@@ -225,11 +263,13 @@ static void sync_pt_activate(struct sync_pt *pt)
 {
 	struct sync_timeline *obj = pt->parent;
 	unsigned long flags;
+	bool fence_done;
 	int err;
 
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
-	err = _sync_pt_has_signaled(pt);
+	/* the caller signals the fence once all its pts are activated */
+	err = _sync_pt_has_signaled(pt, &fence_done);
 	if (err != 0)
 		goto out;
 
@@ -268,6 +308,7 @@ static struct sync_fence *sync_fence_alloc(const char *name)
 
 	kref_init(&fence->kref);
 	strlcpy(fence->name, name, sizeof(fence->name));
+	fence->timestamp = ktime_get();
 
 	INIT_LIST_HEAD(&fence->pt_list_head);
 	INIT_LIST_HEAD(&fence->waiter_list_head);
@@ -279,6 +320,7 @@ static struct sync_fence *sync_fence_alloc(const char *name)
 	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
 	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
 
+	atomic_long_inc(&sync_stats.created);
 	return fence;
 
 err:
@@ -300,6 +342,7 @@ struct sync_fence *sync_fence_create(const char *name, struct sync_pt *pt)
 
 	pt->fence = fence;
 	list_add(&pt->pt_list, &fence->pt_list_head);
+	atomic_set(&fence->pending, 1);
 	sync_pt_activate(pt);
 
 	/*
@@ -312,71 +355,72 @@ struct sync_fence *sync_fence_create(const char *name, struct sync_pt *pt)
 }
 EXPORT_SYMBOL(sync_fence_create);
 
-static int sync_fence_copy_pts(struct sync_fence *dst, struct sync_fence *src)
+/*
+ * Add a copy of @src_pt to @dst unless @dst already waits for the same or a
+ * later point on that timeline.  Returns 1 if a pt was added, 0 if @src_pt
+ * was collapsed into an existing one.
+ */
+static int sync_fence_add_pt(struct sync_fence *dst, struct sync_pt *src_pt)
 {
-	struct list_head *pos;
+	struct sync_pt *dst_pt, *new_pt;
 
-	list_for_each(pos, &src->pt_list_head) {
-		struct sync_pt *orig_pt =
-			container_of(pos, struct sync_pt, pt_list);
-		struct sync_pt *new_pt = sync_pt_dup(orig_pt);
+	list_for_each_entry(dst_pt, &dst->pt_list_head, pt_list) {
+		if (dst_pt->parent != src_pt->parent)
+			continue;
 
-		if (new_pt == NULL)
-			return -ENOMEM;
+		/* keep whichever of the two signals later */
+		if (dst_pt->parent->ops->compare(dst_pt, src_pt) == -1) {
+			new_pt = sync_pt_dup(src_pt);
+			if (new_pt == NULL)
+				return -ENOMEM;
 
-		new_pt->fence = dst;
-		list_add(&new_pt->pt_list, &dst->pt_list_head);
+			new_pt->fence = dst;
+			list_replace(&dst_pt->pt_list, &new_pt->pt_list);
+			sync_pt_free(dst_pt);
+		}
+		return 0;
 	}
 
-	return 0;
+	new_pt = sync_pt_dup(src_pt);
+	if (new_pt == NULL)
+		return -ENOMEM;
+
+	new_pt->fence = dst;
+	list_add_tail(&new_pt->pt_list, &dst->pt_list_head);
+	return 1;
 }
 
-static int sync_fence_merge_pts(struct sync_fence *dst, struct sync_fence *src)
+/*
+ * Copy the pts of @src into @dst, dropping pts that have already signaled
+ * successfully and collapsing pts that share a timeline, so that fences
+ * merged every frame do not keep growing.  Returns the number of pts
+ * added; @last is set to a signaled pt in case everything was dropped.
+ */
+static int sync_fence_merge_pts(struct sync_fence *dst, struct sync_fence *src,
+				struct sync_pt **last)
 {
-	struct list_head *src_pos, *dst_pos, *n;
-
-	list_for_each(src_pos, &src->pt_list_head) {
-		struct sync_pt *src_pt =
-			container_of(src_pos, struct sync_pt, pt_list);
-		bool collapsed = false;
-
-		list_for_each_safe(dst_pos, n, &dst->pt_list_head) {
-			struct sync_pt *dst_pt =
-				container_of(dst_pos, struct sync_pt, pt_list);
-			/* collapse two sync_pts on the same timeline
-			 * to a single sync_pt that will signal at
-			 * the later of the two
-			 */
-			if (dst_pt->parent == src_pt->parent) {
-				if (dst_pt->parent->ops->compare(dst_pt, src_pt)
-						 == -1) {
-					struct sync_pt *new_pt =
-						sync_pt_dup(src_pt);
-					if (new_pt == NULL)
-						return -ENOMEM;
-
-					new_pt->fence = dst;
-					list_replace(&dst_pt->pt_list,
-						     &new_pt->pt_list);
-					sync_pt_free(dst_pt);
-				}
-				collapsed = true;
-				break;
-			}
-		}
-
-		if (!collapsed) {
-			struct sync_pt *new_pt = sync_pt_dup(src_pt);
+	struct sync_pt *src_pt;
+	int added = 0;
+	int ret;
 
-			if (new_pt == NULL)
-				return -ENOMEM;
+	list_for_each_entry(src_pt, &src->pt_list_head, pt_list) {
+		atomic_long_inc(&sync_stats.merge_pts_in);
 
-			new_pt->fence = dst;
-			list_add(&new_pt->pt_list, &dst->pt_list_head);
+		if (ACCESS_ONCE(src_pt->status) > 0) {
+			atomic_long_inc(&sync_stats.merge_pts_signaled);
+			*last = src_pt;
+			continue;
 		}
+
+		ret = sync_fence_add_pt(dst, src_pt);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			atomic_long_inc(&sync_stats.merge_pts_collapsed);
+		added += ret;
 	}
 
-	return 0;
+	return added;
 }
 
 static void sync_fence_detach_pts(struct sync_fence *fence)
@@ -453,21 +497,38 @@ struct sync_fence *sync_fence_merge(const char *name,
 				    struct sync_fence *a, struct sync_fence *b)
 {
 	struct sync_fence *fence;
+	struct sync_pt *last = NULL;
 	struct list_head *pos;
+	int nr_pts = 0;
 	int err;
 
 	fence = sync_fence_alloc(name);
 	if (fence == NULL)
 		return NULL;
 
-	err = sync_fence_copy_pts(fence, a);
+	err = sync_fence_merge_pts(fence, a, &last);
 	if (err < 0)
 		goto err;
+	nr_pts += err;
 
-	err = sync_fence_merge_pts(fence, b);
+	err = sync_fence_merge_pts(fence, b, &last);
 	if (err < 0)
 		goto err;
+	nr_pts += err;
+
+	/* everything had signaled; a single signaled pt stands for it all */
+	if (!nr_pts) {
+		err = sync_fence_add_pt(fence, last);
+		if (err < 0)
+			goto err;
+		nr_pts = 1;
+	}
+
+	atomic_long_inc(&sync_stats.merges);
+	atomic_long_add(nr_pts, &sync_stats.merge_pts_out);
+	sync_stat_log2(sync_stats.merge_size, nr_pts);
 
+	atomic_set(&fence->pending, nr_pts);
 	list_for_each(pos, &fence->pt_list_head) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, pt_list);
@@ -510,6 +571,8 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 		list_for_each_safe(pos, n, &fence->waiter_list_head)
 			list_move(pos, &signaled_waiters);
 
+		/* pairs with the smp_rmb() in sync_fence_signaled() */
+		smp_wmb();
 		fence->status = status;
 	} else {
 		status = 0;
@@ -517,6 +580,7 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 	spin_unlock_irqrestore(&fence->waiter_list_lock, flags);
 
 	if (status) {
+		sync_stat_log2(sync_stats.signal_ms, sync_fence_age_ms(fence));
 		list_for_each_safe(pos, n, &signaled_waiters) {
 			struct sync_fence_waiter *waiter =
 				container_of(pos, struct sync_fence_waiter,
@@ -533,7 +597,11 @@ int sync_fence_wait_async(struct sync_fence *fence,
 			  struct sync_fence_waiter *waiter)
 {
 	unsigned long flags;
-	int err = 0;
+	int err;
+
+	err = sync_fence_signaled(fence);
+	if (err)
+		return err;
 
 	spin_lock_irqsave(&fence->waiter_list_lock, flags);
 
@@ -581,12 +649,7 @@ EXPORT_SYMBOL(sync_fence_cancel_async);
 
 static bool sync_fence_check(struct sync_fence *fence)
 {
-	/*
-	 * Make sure that reads to fence->status are ordered with the
-	 * wait queue event triggering
-	 */
-	smp_rmb();
-	return fence->status != 0;
+	return sync_fence_signaled(fence) != 0;
 }
 
 int sync_fence_wait(struct sync_fence *fence, long timeout)
@@ -594,6 +657,9 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 	int err = 0;
 	struct sync_pt *pt;
 
+	if (sync_fence_signaled(fence) > 0)
+		return 0;
+
 	trace_sync_wait(fence, 1);
 	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
 		trace_sync_pt(pt);
@@ -637,6 +703,7 @@ static void sync_fence_free(struct kref *kref)
 {
 	struct sync_fence *fence = container_of(kref, struct sync_fence, kref);
 
+	sync_stat_log2(sync_stats.lifetime_ms, sync_fence_age_ms(fence));
 	sync_fence_free_pts(fence);
 
 	kfree(fence);
@@ -671,18 +738,14 @@ static int sync_fence_release(struct inode *inode, struct file *file)
 static unsigned int sync_fence_poll(struct file *file, poll_table *wait)
 {
 	struct sync_fence *fence = file->private_data;
+	int status;
 
 	poll_wait(file, &fence->wq, wait);
 
-	/*
-	 * Make sure that reads to fence->status are ordered with the
-	 * wait queue event triggering
-	 */
-	smp_rmb();
-
-	if (fence->status == 1)
+	status = sync_fence_signaled(fence);
+	if (status == 1)
 		return POLLIN;
-	else if (fence->status < 0)
+	else if (status < 0)
 		return POLLERR;
 	else
 		return 0;
@@ -1010,9 +1073,50 @@ static const struct file_operations sync_debugfs_fops = {
 	.release        = single_release,
 };
 
+static void sync_print_hist(struct seq_file *s, const char *name,
+			    atomic_t *hist)
+{
+	int i;
+
+	seq_printf(s, "%s:", name);
+	for (i = 0; i < SYNC_STAT_BUCKETS; i++)
+		seq_printf(s, " <%u:%d", 1U << i, atomic_read(&hist[i]));
+	seq_printf(s, "\n");
+}
+
+static int sync_stats_show(struct seq_file *s, void *unused)
+{
+	seq_printf(s, "fences created: %ld\n",
+		   atomic_long_read(&sync_stats.created));
+	seq_printf(s, "merges: %ld, pts in %ld out %ld, dropped signaled %ld collapsed %ld\n",
+		   atomic_long_read(&sync_stats.merges),
+		   atomic_long_read(&sync_stats.merge_pts_in),
+		   atomic_long_read(&sync_stats.merge_pts_out),
+		   atomic_long_read(&sync_stats.merge_pts_signaled),
+		   atomic_long_read(&sync_stats.merge_pts_collapsed));
+	sync_print_hist(s, "merged pts", sync_stats.merge_size);
+	sync_print_hist(s, "create to signal (ms)", sync_stats.signal_ms);
+	sync_print_hist(s, "create to release (ms)", sync_stats.lifetime_ms);
+	return 0;
+}
+
+static int sync_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sync_stats_show, inode->i_private);
+}
+
+static const struct file_operations sync_stats_fops = {
+	.open           = sync_stats_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
 static __init int sync_debugfs_init(void)
 {
 	debugfs_create_file("sync", S_IRUGO, NULL, NULL, &sync_debugfs_fops);
+	debugfs_create_file("sync_stats", S_IRUGO, NULL, NULL,
+			    &sync_stats_fops);
 	return 0;
 }
 late_initcall(sync_debugfs_init);
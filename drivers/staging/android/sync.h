@@ -14,6 +14,7 @@
 #define _LINUX_SYNC_H
 
 #include <linux/types.h>
+#include <linux/atomic.h>
 #include <linux/kref.h>
 #include <linux/ktime.h>
 #include <linux/list.h>
@@ -156,6 +157,8 @@ struct sync_pt {
  * @waiter_list_head:	list of asynchronous waiters on this fence
  * @waiter_list_lock:	lock protecting @waiter_list_head and @status
  * @status:		1: signaled, 0:active, <0: error
+ * @pending:		number of sync_pts that have not signaled yet
+ * @timestamp:		time the fence was created, for statistics
  *
  * @wq:			wait queue for fence signaling
  * @sync_fence_list:	membership in global fence list
@@ -171,6 +174,8 @@ struct sync_fence {
 	struct list_head	waiter_list_head;
 	spinlock_t		waiter_list_lock; /* also protects status */
 	int			status;
+	atomic_t		pending;
+	ktime_t			timestamp;
 
 	wait_queue_head_t	wq;
 
@@ -335,6 +340,21 @@ int sync_fence_wait_async(struct sync_fence *fence,
 int sync_fence_cancel_async(struct sync_fence *fence,
 			    struct sync_fence_waiter *waiter);
 
+/**
+ * sync_fence_signaled() - check a fence without taking any lock
+ * @fence:		fence to check
+ *
+ * Returns 1 if @fence has signaled, <0 on error, 0 if it is still active.
+ * Reads issued after a non-zero return are ordered after the signal.
+ */
+static inline int sync_fence_signaled(struct sync_fence *fence)
+{
+	int status = ACCESS_ONCE(fence->status);
+
+	smp_rmb();
+	return status;
+}
+
 /**
  * sync_fence_wait() - wait on fence
  * @fence:	fence to wait on
@@ -0,0 +1,239 @@
+/*
+ * Compressed RAM block device - compression backend
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+
+#include "zcomp.h"
+
+static const char * const zcomp_names[ZCOMP_NR_BACKENDS] = {
+	[ZCOMP_LZO]	= "lzo",
+	[ZCOMP_LZ4]	= "lz4",
+	[ZCOMP_DEFLATE]	= "deflate",
+};
+
+/*
+ * Returns the backend index for @name, or -EINVAL if it is unknown or
+ * the crypto API cannot provide it.
+ */
+int zcomp_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		if (sysfs_streq(name, zcomp_names[i]))
+			return crypto_has_comp(zcomp_names[i], 0, 0) ?
+				i : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+ssize_t zcomp_available_show(enum zcomp_backend cur, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		if (i == cur)
+			sz += sprintf(buf + sz, "[%s] ", zcomp_names[i]);
+		else if (crypto_has_comp(zcomp_names[i], 0, 0))
+			sz += sprintf(buf + sz, "%s ", zcomp_names[i]);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+ssize_t zcomp_stats_show(struct zcomp_stats_set __percpu *stats, char *buf)
+{
+	ssize_t sz;
+	int i, cpu;
+
+	sz = sprintf(buf, "%-8s %10s %12s %12s %6s %10s %10s %10s %6s\n",
+		     "algo", "compress", "in_bytes", "out_bytes", "ratio",
+		     "comp_ns", "decompress", "decomp_ns", "failed");
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		struct zcomp_stats sum;
+
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			struct zcomp_stats *st =
+				&per_cpu_ptr(stats, cpu)->backend[i];
+
+			sum.compress += st->compress;
+			sum.compress_in += st->compress_in;
+			sum.compress_out += st->compress_out;
+			sum.compress_ns += st->compress_ns;
+			sum.decompress += st->decompress;
+			sum.decompress_ns += st->decompress_ns;
+			sum.failed += st->failed;
+		}
+
+		if (!sum.compress && !sum.decompress && !sum.failed)
+			continue;
+
+		/* ratio is output per input in percent, latencies are averages */
+		sz += sprintf(buf + sz,
+			      "%-8s %10llu %12llu %12llu %5llu%% %10llu %10llu %10llu %6llu\n",
+			      zcomp_names[i], sum.compress, sum.compress_in,
+			      sum.compress_out,
+			      sum.compress_in ?
+				div64_u64(sum.compress_out * 100,
+					  sum.compress_in) : 0,
+			      sum.compress ?
+				div64_u64(sum.compress_ns, sum.compress) : 0,
+			      sum.decompress,
+			      sum.decompress ?
+				div64_u64(sum.decompress_ns,
+					  sum.decompress) : 0,
+			      sum.failed);
+	}
+
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		zcomp_strm_free(per_cpu_ptr(comp->stream, cpu));
+	free_percpu(comp->stream);
+	kfree(comp);
+}
+
+struct zcomp *zcomp_create(enum zcomp_backend backend,
+		struct zcomp_stats_set __percpu *stats)
+{
+	struct zcomp *comp;
+	int cpu;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	comp->backend = backend;
+	comp->stats = stats;
+	comp->stream = alloc_percpu(struct zcomp_strm);
+	if (!comp->stream)
+		goto free_comp;
+
+	for_each_possible_cpu(cpu) {
+		struct zcomp_strm *zstrm = per_cpu_ptr(comp->stream, cpu);
+
+		mutex_init(&zstrm->lock);
+		zstrm->tfm = crypto_alloc_comp(zcomp_names[backend], 0, 0);
+		if (IS_ERR(zstrm->tfm)) {
+			pr_err("Error allocating %s compressor\n",
+			       zcomp_names[backend]);
+			goto free_streams;
+		}
+
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							 __GFP_ZERO, 1);
+		if (!zstrm->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			goto free_streams;
+		}
+	}
+
+	return comp;
+
+free_streams:
+	zcomp_destroy(comp);
+	return NULL;
+free_comp:
+	kfree(comp);
+	return NULL;
+}
+
+/* May sleep. The stream stays valid until zcomp_strm_put(). */
+struct zcomp_strm *zcomp_strm_get(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = per_cpu_ptr(comp->stream, raw_smp_processor_id());
+	mutex_lock(&zstrm->lock);
+
+	return zstrm;
+}
+
+void zcomp_strm_put(struct zcomp_strm *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+/* Compresses one page from @src into zstrm->buffer. */
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, unsigned int *dst_len)
+{
+	struct zcomp_stats *st;
+	u64 start = local_clock();
+	int ret;
+
+	*dst_len = PAGE_SIZE * 2;
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				   zstrm->buffer, dst_len);
+
+	st = &get_cpu_ptr(comp->stats)->backend[comp->backend];
+	if (likely(!ret)) {
+		st->compress++;
+		st->compress_in += PAGE_SIZE;
+		st->compress_out += *dst_len;
+		st->compress_ns += local_clock() - start;
+	} else {
+		st->failed++;
+	}
+	put_cpu_ptr(comp->stats);
+
+	return ret;
+}
+
+/* Decompresses @src into the page at @dst. */
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, unsigned int src_len,
+		unsigned char *dst)
+{
+	struct zcomp_stats *st;
+	unsigned int dst_len = PAGE_SIZE;
+	u64 start = local_clock();
+	int ret;
+
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dst_len);
+	if (!ret && dst_len != PAGE_SIZE)
+		ret = -EINVAL;
+
+	st = &get_cpu_ptr(comp->stats)->backend[comp->backend];
+	if (likely(!ret)) {
+		st->decompress++;
+		st->decompress_ns += local_clock() - start;
+	} else {
+		st->failed++;
+	}
+	put_cpu_ptr(comp->stats);
+
+	return ret;
+}
@@ -0,0 +1,78 @@
+/*
+ * Compressed RAM block device - compression backend
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+
+/* Compressors zram can use, looked up through the crypto API by name */
+enum zcomp_backend {
+	ZCOMP_LZO,
+	ZCOMP_LZ4,
+	ZCOMP_DEFLATE,
+	ZCOMP_NR_BACKENDS,
+};
+
+/*
+ * One compression stream per possible CPU. The stream is a mutex
+ * rather than a preempt-disabled section because the write path holds
+ * the output buffer across zs_malloc(), which may sleep. Writers pick
+ * the stream of the CPU they run on, so they only contend when they
+ * migrate or preempt each other.
+ */
+struct zcomp_strm {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	/* compression output, two pages in case the data expands */
+	void *buffer;
+};
+
+struct zcomp_stats {
+	u64 compress;		/* pages compressed */
+	u64 compress_in;	/* bytes fed to the compressor */
+	u64 compress_out;	/* bytes it produced */
+	u64 compress_ns;
+	u64 decompress;		/* pages decompressed */
+	u64 decompress_ns;
+	u64 failed;		/* compressor or decompressor errors */
+};
+
+/* per-CPU, indexed by backend, kept for the lifetime of the device */
+struct zcomp_stats_set {
+	struct zcomp_stats backend[ZCOMP_NR_BACKENDS];
+};
+
+struct zcomp {
+	enum zcomp_backend backend;
+	struct zcomp_strm __percpu *stream;
+	struct zcomp_stats_set __percpu *stats;
+};
+
+int zcomp_backend_find(const char *name);
+ssize_t zcomp_available_show(enum zcomp_backend cur, char *buf);
+ssize_t zcomp_stats_show(struct zcomp_stats_set __percpu *stats, char *buf);
+
+struct zcomp *zcomp_create(enum zcomp_backend backend,
+		struct zcomp_stats_set __percpu *stats);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_get(struct zcomp *comp);
+void zcomp_strm_put(struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, unsigned int *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, unsigned int src_len,
+		unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
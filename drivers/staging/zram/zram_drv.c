@@ -29,9 +29,9 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -61,22 +61,49 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * The flag and size helpers below must be called with the entry's
+ * ZRAM_ACCESS bit lock held.
+ */
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	return meta->table[index].flags & BIT(flag);
+	return meta->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags |= BIT(flag);
+	meta->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags &= ~BIT(flag);
+	meta->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram_meta *meta, u32 index)
+{
+	return meta->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram_meta *meta,
+			u32 index, size_t size)
+{
+	unsigned long flags = meta->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
+}
+
+static void zram_lock_entry(struct zram_meta *meta, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static void zram_unlock_entry(struct zram_meta *meta, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 }
 
 static int page_zero_filled(void *ptr)
@@ -94,11 +121,55 @@ static int page_zero_filled(void *ptr)
 	return 1;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* runs backing device I/O and writeback passes */
+static struct workqueue_struct *zram_wb_wq;
+
+/* Block 0 is never handed out, so that 0 can mean failure */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+
+retry:
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_blocks, blk_idx);
+	if (blk_idx >= zram->nr_blocks)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	return blk_idx;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	clear_bit(blk_idx, zram->bitmap);
+	zram_stat64_sub(zram, &zram->stats.bd_count, 1);
+}
+#else
+static inline void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+}
+#endif
+
+/* Called with the entry's ZRAM_ACCESS bit lock held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
-	u16 size = meta->table[index].size;
+	size_t size = zram_get_obj_size(meta, index);
+
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+
+	/* The data lives on the backing device, handle is its block */
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		zram_free_block(zram, handle);
+		meta->table[index].handle = 0;
+		return;
+	}
 
 	if (unlikely(!handle)) {
 		/*
@@ -107,25 +178,24 @@ static void zram_free_page(struct zram *zram, size_t index)
 		 */
 		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
 			zram_clear_flag(meta, index, ZRAM_ZERO);
-			zram->stats.pages_zero--;
+			atomic_dec(&zram->stats.pages_zero);
 		}
 		return;
 	}
 
 	if (unlikely(size > max_zpage_size))
-		zram->stats.bad_compress--;
+		atomic_dec(&zram->stats.bad_compress);
 
 	zs_free(meta->mem_pool, handle);
 
 	if (size <= PAGE_SIZE / 2)
-		zram->stats.good_compress--;
+		atomic_dec(&zram->stats.good_compress);
 
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			meta->table[index].size);
-	zram->stats.pages_stored--;
+	zram_stat64_sub(zram, &zram->stats.compr_size, size);
+	atomic_dec(&zram->stats.pages_stored);
 
 	meta->table[index].handle = 0;
-	meta->table[index].size = 0;
+	zram_set_obj_size(meta, index, 0);
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -145,29 +215,206 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int zram_bdev_rw(struct zram *zram, int rw, struct page *page,
+			unsigned long blk_idx)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk_idx * (PAGE_SIZE >> SECTOR_SHIFT);
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	ret = submit_bio_wait(rw, bio);
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_fn(struct work_struct *work)
+{
+	struct zram_bdev_read_work *rw =
+		container_of(work, struct zram_bdev_read_work, work);
+
+	rw->ret = zram_bdev_rw(rw->zram, READ, rw->page, rw->blk_idx);
+}
+
+/*
+ * Reads block @blk_idx of the backing device into @page. We run under
+ * generic_make_request(), which only issues the bios we submit once we
+ * return, so the read is done and waited for from a worker.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page,
+			  unsigned long blk_idx)
+{
+	struct zram_bdev_read_work rw;
+
+	rw.zram = zram;
+	rw.page = page;
+	rw.blk_idx = blk_idx;
+	INIT_WORK_ONSTACK(&rw.work, zram_bdev_read_fn);
+	queue_work(zram_wb_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	if (rw.ret)
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+		       rw.ret, blk_idx);
+	else
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return rw.ret;
+}
+
+/* Reads a written back page into the page sized buffer @mem */
+static int zram_bdev_read_buf(struct zram *zram, unsigned long blk_idx,
+			      void *mem)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read(zram, page, blk_idx);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+
+	return ret;
+}
+
+static int zram_bvec_read_bdev(struct zram *zram, struct bio_vec *bvec,
+			       unsigned long blk_idx, int offset)
+{
+	unsigned char *user_mem;
+	void *uncmem;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_bdev_read(zram, bvec->bv_page, blk_idx);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem)
+		return -ENOMEM;
+
+	ret = zram_bdev_read_buf(zram, blk_idx, uncmem);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+		       bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(bvec->bv_page);
+	}
+	kfree(uncmem);
+
+	return ret;
+}
+
+/*
+ * Incompressible pages go to the backing device in batches: a pass walks
+ * the whole table. The first page stored after a pass arms it to run
+ * within ZRAM_WB_HUGE_FLUSH, and it is pulled in to ZRAM_WB_HUGE_DELAY
+ * once ZRAM_WB_HUGE_BATCH pages are pending.
+ */
+static void zram_wb_kick_huge(struct zram *zram)
+{
+	int pending;
+
+	if (!zram->bdev)
+		return;
+
+	pending = atomic_inc_return(&zram->wb_huge_pending);
+	if (pending == 1)
+		queue_delayed_work(zram_wb_wq, &zram->wb_huge_work,
+				   ZRAM_WB_HUGE_FLUSH);
+	else if (pending == ZRAM_WB_HUGE_BATCH)
+		mod_delayed_work(zram_wb_wq, &zram->wb_huge_work,
+				 ZRAM_WB_HUGE_DELAY);
+}
+#else
+static inline int zram_bdev_read_buf(struct zram *zram,
+				     unsigned long blk_idx, void *mem)
+{
+	return -EIO;
+}
+
+static inline int zram_bvec_read_bdev(struct zram *zram,
+				      struct bio_vec *bvec,
+				      unsigned long blk_idx, int offset)
+{
+	return -EIO;
+}
+
+static inline void zram_wb_kick_huge(struct zram *zram)
+{
+}
+#endif
+
+/*
+ * Returns -EAGAIN and the block index in @blk_idx if the page has been
+ * written back; the caller must then read it from the backing device.
+ */
+static int zram_decompress_page(struct zram *zram, struct zcomp_strm *zstrm,
+				char *mem, u32 index, unsigned long *blk_idx)
 {
-	int ret = LZO_E_OK;
-	size_t clen = PAGE_SIZE;
+	int ret = 0;
 	unsigned char *cmem;
 	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
+	unsigned long handle;
+	size_t size;
+
+	zram_lock_entry(meta, index);
+	handle = meta->table[index].handle;
+	size = zram_get_obj_size(meta, index);
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_unlock_entry(meta, index);
+		*blk_idx = handle;
+		return -EAGAIN;
+	}
 
 	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+		zram_unlock_entry(meta, index);
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
-	if (meta->table[index].size == PAGE_SIZE)
+	if (size == PAGE_SIZE)
 		memcpy(mem, cmem, PAGE_SIZE);
 	else
-		ret = lzo1x_decompress_safe(cmem, meta->table[index].size,
-						mem, &clen);
+		ret = zcomp_decompress(zram->comp, zstrm, cmem, size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
+	zram_unlock_entry(meta, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -183,18 +430,31 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	struct page *page;
 	unsigned char *user_mem, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long blk_idx;
 	page = bvec->bv_page;
 
+	zram_lock_entry(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		blk_idx = meta->table[index].handle;
+		zram_unlock_entry(meta, index);
+		return zram_bvec_read_bdev(zram, bvec, blk_idx, offset);
+	}
+
 	if (unlikely(!meta->table[index].handle) ||
 			zram_test_flag(meta, index, ZRAM_ZERO)) {
+		zram_unlock_entry(meta, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
+	zram_unlock_entry(meta, index);
 
 	if (is_partial_io(bvec))
 		/* Use  a temporary buffer to decompress the page */
 		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 
+	zstrm = zcomp_strm_get(zram->comp);
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
@@ -205,9 +465,9 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		goto out_cleanup;
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
+	ret = zram_decompress_page(zram, zstrm, uncmem, index, &blk_idx);
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK))
+	if (unlikely(ret))
 		goto out_cleanup;
 
 	if (is_partial_io(bvec))
@@ -218,8 +478,13 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	ret = 0;
 out_cleanup:
 	kunmap_atomic(user_mem);
+	zcomp_strm_put(zstrm);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
+
+	/* written back since we looked at the entry */
+	if (ret == -EAGAIN)
+		ret = zram_bvec_read_bdev(zram, bvec, blk_idx, offset);
 	return ret;
 }
 
@@ -227,14 +492,16 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
+	unsigned int clen;
 	unsigned long handle;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long blk_idx;
 
 	page = bvec->bv_page;
-	src = meta->compress_buffer;
+	zstrm = zcomp_strm_get(zram->comp);
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -246,72 +513,60 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_decompress_page(zram, uncmem, index);
+		ret = zram_decompress_page(zram, zstrm, uncmem, index,
+					   &blk_idx);
+		if (ret == -EAGAIN)
+			ret = zram_bdev_read_buf(zram, blk_idx, uncmem);
 		if (ret)
 			goto out;
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (meta->table[index].handle ||
-	    zram_test_flag(meta, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-		kunmap_atomic(user_mem);
-		user_mem = NULL;
-	} else {
+	else
 		uncmem = user_mem;
-	}
 
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem);
-		zram->stats.pages_zero++;
+		/* Free memory associated with this sector now. */
+		zram_lock_entry(meta, index);
+		zram_free_page(zram, index);
 		zram_set_flag(meta, index, ZRAM_ZERO);
+		zram_unlock_entry(meta, index);
+
+		atomic_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	/*
-	 * zram_slot_free_notify could miss free so that let's
-	 * double check.
-	 */
-	if (unlikely(meta->table[index].handle ||
-			zram_test_flag(meta, index, ZRAM_ZERO)))
-		zram_free_page(zram, index);
-
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       meta->compress_workmem);
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
-	if (!is_partial_io(bvec)) {
-		kunmap_atomic(user_mem);
-		user_mem = NULL;
+	kunmap_atomic(user_mem);
+	if (!is_partial_io(bvec))
 		uncmem = NULL;
-	}
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	src = zstrm->buffer;
 	if (unlikely(clen > max_zpage_size)) {
-		zram->stats.bad_compress++;
+		atomic_inc(&zram->stats.bad_compress);
 		clen = PAGE_SIZE;
 		src = NULL;
 		if (is_partial_io(bvec))
 			src = uncmem;
 	}
 
+	/* may sleep, so the entry cannot be locked yet */
 	handle = zs_malloc(meta->mem_pool, clen);
 	if (!handle) {
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
@@ -325,16 +580,33 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	zs_unmap_object(meta->mem_pool, handle);
 
+	zcomp_strm_put(zstrm);
+	zstrm = NULL;
+
+	/*
+	 * Free memory associated with this sector now and publish the
+	 * new object, atomically with respect to readers of the entry.
+	 */
+	zram_lock_entry(meta, index);
+	zram_free_page(zram, index);
 	meta->table[index].handle = handle;
-	meta->table[index].size = clen;
+	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE)
+		zram_set_flag(meta, index, ZRAM_HUGE);
+	zram_unlock_entry(meta, index);
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram->stats.pages_stored++;
+	atomic_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		zram->stats.good_compress++;
+		atomic_inc(&zram->stats.good_compress);
+
+	if (clen == PAGE_SIZE)
+		zram_wb_kick_huge(zram);
 
 out:
+	if (zstrm)
+		zcomp_strm_put(zstrm);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
 
@@ -343,40 +615,193 @@ out:
 	return ret;
 }
 
-static void handle_pending_slot_free(struct zram *zram)
-{
-	struct zram_slot_free *free_rq;
-
-	spin_lock(&zram->slot_free_lock);
-	while (zram->slot_free_rq) {
-		free_rq = zram->slot_free_rq;
-		zram->slot_free_rq = free_rq->next;
-		zram_free_page(zram, free_rq->index);
-		kfree(free_rq);
-	}
-	spin_unlock(&zram->slot_free_lock);
-}
-
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		handle_pending_slot_free(zram);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		handle_pending_slot_free(zram);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Marks every page currently held in memory as idle */
+void zram_mark_idle(struct zram *zram)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long index, nr_pages = zram->disksize >> PAGE_SHIFT;
+
+	for (index = 0; index < nr_pages; index++) {
+		zram_lock_entry(meta, index);
+		if (meta->table[index].handle &&
+		    !zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_unlock_entry(meta, index);
+		cond_resched();
+	}
+}
+
+/*
+ * Writes the pages selected by @mode to the backing device and frees
+ * their memory. Called with init_lock held for read on an initialized
+ * device. A page that is freed, rewritten or, for idle writeback, read
+ * while its copy is in flight stays in memory.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long index, nr_pages = zram->disksize >> PAGE_SHIFT;
+	enum zram_pageflags flag;
+	struct zcomp_strm *zstrm;
+	unsigned long blk_idx, unused;
+	struct page *page;
+	void *mem;
+	int ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	flag = mode == ZRAM_WB_IDLE ? ZRAM_IDLE : ZRAM_HUGE;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	mutex_lock(&zram->wb_lock);
+	for (index = 0; index < nr_pages; index++) {
+		cond_resched();
+
+		zram_lock_entry(meta, index);
+		if (!meta->table[index].handle ||
+		    zram_test_flag(meta, index, ZRAM_WB) ||
+		    !zram_test_flag(meta, index, flag)) {
+			zram_unlock_entry(meta, index);
+			continue;
+		}
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		zram_unlock_entry(meta, index);
+
+		blk_idx = zram_alloc_block(zram);
+		if (!blk_idx) {
+			ret = -ENOSPC;
+			goto abort;
+		}
+
+		zstrm = zcomp_strm_get(zram->comp);
+		mem = kmap_atomic(page);
+		ret = zram_decompress_page(zram, zstrm, mem, index, &unused);
+		kunmap_atomic(mem);
+		zcomp_strm_put(zstrm);
+
+		if (!ret)
+			ret = zram_bdev_rw(zram, WRITE, page, blk_idx);
+		if (ret) {
+			clear_bit(blk_idx, zram->bitmap);
+			goto abort;
+		}
+
+		zram_lock_entry(meta, index);
+		if (!zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+		    !zram_test_flag(meta, index, flag)) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			zram_unlock_entry(meta, index);
+			clear_bit(blk_idx, zram->bitmap);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].handle = blk_idx;
+		zram_unlock_entry(meta, index);
+
+		zram_stat64_inc(zram, &zram->stats.bd_count);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
 	}
+	goto out;
+
+abort:
+	zram_lock_entry(meta, index);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_unlock_entry(meta, index);
+out:
+	mutex_unlock(&zram->wb_lock);
+	__free_page(page);
 
 	return ret;
 }
 
+/* (Re)arms periodic idle writeback, if configured */
+void zram_wb_schedule(struct zram *zram)
+{
+	unsigned int interval = ACCESS_ONCE(zram->wb_interval);
+
+	if (interval && zram->bdev && zram->init_done)
+		mod_delayed_work(zram_wb_wq, &zram->wb_idle_work,
+				 interval * HZ);
+}
+
+/*
+ * The writeback works back off if init_lock is held for write: a reset
+ * in progress cancels them with the lock held.
+ */
+static void zram_wb_huge_fn(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work), struct zram,
+					 wb_huge_work);
+
+	/* the next huge store re-arms the work, even if this one backs off */
+	atomic_set(&zram->wb_huge_pending, 0);
+	if (!down_read_trylock(&zram->init_lock))
+		return;
+
+	if (zram->init_done)
+		zram_writeback(zram, ZRAM_WB_HUGE);
+	up_read(&zram->init_lock);
+}
+
+/*
+ * Each period writes back what has stayed idle since the previous one,
+ * then starts a new idle window.
+ */
+static void zram_wb_idle_fn(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work), struct zram,
+					 wb_idle_work);
+
+	if (down_read_trylock(&zram->init_lock)) {
+		if (zram->init_done) {
+			zram_writeback(zram, ZRAM_WB_IDLE);
+			zram_mark_idle(zram);
+		}
+		up_read(&zram->init_lock);
+	}
+
+	zram_wb_schedule(zram);
+}
+
+/* Called with init_lock held for write */
+void zram_reset_bdev(struct zram *zram)
+{
+	cancel_delayed_work_sync(&zram->wb_huge_work);
+	cancel_delayed_work_sync(&zram->wb_idle_work);
+	atomic_set(&zram->wb_huge_pending, 0);
+
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	kfree(zram->backing_dev_path);
+	zram->backing_dev_path = NULL;
+}
+#endif
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -494,6 +919,9 @@ static void __zram_reset_device(struct zram *zram)
 	size_t index;
 	struct zram_meta *meta;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_reset_bdev(zram);
+#endif
 	if (!zram->init_done)
 		return;
 
@@ -503,12 +931,14 @@ static void __zram_reset_device(struct zram *zram)
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = meta->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
 		zs_free(meta->mem_pool, handle);
 	}
 
+	zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 	zram_meta_free(zram->meta);
 	zram->meta = NULL;
 	/* Reset stats */
@@ -528,38 +958,26 @@ void zram_reset_device(struct zram *zram)
 void zram_meta_free(struct zram_meta *meta)
 {
 	zs_destroy_pool(meta->mem_pool);
-	kfree(meta->compress_workmem);
-	free_pages((unsigned long)meta->compress_buffer, 1);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-struct zram_meta *zram_meta_alloc(u64 disksize)
+struct zram_meta *zram_meta_alloc(const char *pool_name, u64 disksize)
 {
 	size_t num_pages;
 	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
 	if (!meta)
 		goto out;
 
-	meta->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!meta->compress_workmem)
-		goto free_meta;
-
-	meta->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!meta->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		goto free_workmem;
-	}
-
 	num_pages = disksize >> PAGE_SHIFT;
 	meta->table = vzalloc(num_pages * sizeof(*meta->table));
 	if (!meta->table) {
 		pr_err("Error allocating zram address table\n");
-		goto free_buffer;
+		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	meta->mem_pool = zs_create_pool(pool_name,
+					 GFP_NOIO | __GFP_HIGHMEM);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
@@ -569,10 +987,6 @@ struct zram_meta *zram_meta_alloc(u64 disksize)
 
 free_table:
 	vfree(meta->table);
-free_buffer:
-	free_pages((unsigned long)meta->compress_buffer, 1);
-free_workmem:
-	kfree(meta->compress_workmem);
 free_meta:
 	kfree(meta);
 	meta = NULL;
@@ -580,7 +994,8 @@ out:
 	return meta;
 }
 
-void zram_init_device(struct zram *zram, struct zram_meta *meta)
+void zram_init_device(struct zram *zram, struct zram_meta *meta,
+		      struct zcomp *comp)
 {
 	if (zram->disksize > 2 * (totalram_pages << PAGE_SHIFT)) {
 		pr_info(
@@ -600,45 +1015,26 @@ void zram_init_device(struct zram *zram, struct zram_meta *meta)
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
 	zram->meta = meta;
+	zram->comp = comp;
 	zram->init_done = 1;
 
 	pr_debug("Initialization done!\n");
 }
 
-static void zram_slot_free(struct work_struct *work)
-{
-	struct zram *zram;
-
-	zram = container_of(work, struct zram, free_work);
-	down_write(&zram->lock);
-	handle_pending_slot_free(zram);
-	up_write(&zram->lock);
-}
-
-static void add_slot_free(struct zram *zram, struct zram_slot_free *free_rq)
-{
-	spin_lock(&zram->slot_free_lock);
-	free_rq->next = zram->slot_free_rq;
-	zram->slot_free_rq = free_rq;
-	spin_unlock(&zram->slot_free_lock);
-}
-
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
-	struct zram_slot_free *free_rq;
+	struct zram_meta *meta;
 
 	zram = bdev->bd_disk->private_data;
-	zram_stat64_inc(zram, &zram->stats.notify_free);
-
-	free_rq = kmalloc(sizeof(struct zram_slot_free), GFP_ATOMIC);
-	if (!free_rq)
-		return;
+	meta = zram->meta;
 
-	free_rq->index = index;
-	add_slot_free(zram, free_rq);
-	schedule_work(&zram->free_work);
+	/* called with the swap_info lock held, the entry lock never sleeps */
+	zram_lock_entry(meta, index);
+	zram_free_page(zram, index);
+	zram_unlock_entry(meta, index);
+	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -650,19 +1046,24 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	zram->comp_backend = ZCOMP_LZO;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	mutex_init(&zram->wb_lock);
+	INIT_DELAYED_WORK(&zram->wb_huge_work, zram_wb_huge_fn);
+	INIT_DELAYED_WORK(&zram->wb_idle_work, zram_wb_idle_fn);
+#endif
 
-	INIT_WORK(&zram->free_work, zram_slot_free);
-	spin_lock_init(&zram->slot_free_lock);
-	zram->slot_free_rq = NULL;
+	zram->comp_stats = alloc_percpu(struct zcomp_stats_set);
+	if (!zram->comp_stats)
+		goto out;
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
 			device_id);
-		goto out;
+		goto out_free_stats;
 	}
 
 	blk_queue_make_request(zram->queue, zram_make_request);
@@ -713,6 +1114,8 @@ out_free_disk:
 	put_disk(zram->disk);
 out_free_queue:
 	blk_cleanup_queue(zram->queue);
+out_free_stats:
+	free_percpu(zram->comp_stats);
 out:
 	return ret;
 }
@@ -729,6 +1132,8 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	free_percpu(zram->comp_stats);
 }
 
 unsigned int zram_get_num_devices(void)
@@ -747,11 +1152,19 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+#endif
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -777,6 +1190,10 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_wb_wq);
+#endif
 out:
 	return ret;
 }
@@ -798,6 +1215,9 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_wb_wq);
+#endif
 	pr_debug("Cleanup done!\n");
 }
 
@@ -19,6 +19,7 @@
 #include <linux/mutex.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,10 +52,26 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/* Batching of the incompressible page writeback, see zram_wb_kick_huge() */
+#define ZRAM_WB_HUGE_BATCH	32
+#define ZRAM_WB_HUGE_DELAY	HZ
+#define ZRAM_WB_HUGE_FLUSH	(10 * HZ)
+
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the higher bits hold the zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT 24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	ZRAM_ZERO = ZRAM_FLAG_SHIFT + 1,
+	ZRAM_ACCESS,	/* bit spinlock for the entry */
+	ZRAM_HUGE,	/* stored uncompressed */
+	ZRAM_IDLE,	/* not accessed since the last idle marking */
+	ZRAM_WB,	/* on the backing device, handle is the block index */
+	ZRAM_UNDER_WB,	/* being written to the backing device */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -64,10 +81,8 @@ enum zram_pageflags {
 /* Allocated for each disk page */
 struct table {
 	unsigned long handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __aligned(4);
+	unsigned long value;
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -77,33 +92,33 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 bad_compress;	/* % of pages with compression ratio>=75% */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t bad_compress;	/* % of pages with compression ratio>=75% */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u64 bd_count;		/* pages currently on the backing device */
+	u64 bd_reads;		/* pages read back from it */
+	u64 bd_writes;		/* pages written back to it */
+#endif
 };
 
+/* zram_writeback() modes */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,
+	ZRAM_WB_HUGE,
+};
+
+/* Each table entry is protected by its own ZRAM_ACCESS bit spinlock */
 struct zram_meta {
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	struct zs_pool *mem_pool;
 };
 
-struct zram_slot_free {
-	unsigned long index;
-	struct zram_slot_free *next;
-};
-
 struct zram {
 	struct zram_meta *meta;
+	struct zcomp *comp;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers, table,
-				   * 32bit stat counters against concurrent
-				   * notifications, reads and writes */
-
-	struct work_struct free_work;  /* handle pending free request */
-	struct zram_slot_free *slot_free_rq; /* list head of free request */
 
 	struct request_queue *queue;
 	struct gendisk *disk;
@@ -115,9 +130,25 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
-	spinlock_t slot_free_lock;
+	/* compressor to use on the next init, see comp_algorithm */
+	enum zcomp_backend comp_backend;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* backing device, set through sysfs before init */
+	struct block_device *bdev;
+	char *backing_dev_path;
+	unsigned long *bitmap;		/* allocated backing device blocks */
+	unsigned long nr_blocks;
+	struct mutex wb_lock;		/* serializes writeback passes */
+	struct delayed_work wb_huge_work;
+	atomic_t wb_huge_pending;	/* huge stores since the last pass */
+	struct delayed_work wb_idle_work;
+	unsigned int wb_interval;	/* seconds, 0 disables */
+#endif
 
 	struct zram_stats stats;
+	/* per-algorithm compressor stats, survive device reset */
+	struct zcomp_stats_set __percpu *comp_stats;
 };
 
 extern struct zram *zram_devices;
@@ -127,8 +158,16 @@ extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern void zram_reset_device(struct zram *zram);
-extern struct zram_meta *zram_meta_alloc(u64 disksize);
+extern struct zram_meta *zram_meta_alloc(const char *pool_name,
+					  u64 disksize);
 extern void zram_meta_free(struct zram_meta *meta);
-extern void zram_init_device(struct zram *zram, struct zram_meta *meta);
+extern void zram_init_device(struct zram *zram, struct zram_meta *meta,
+			     struct zcomp *comp);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern void zram_reset_bdev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+extern void zram_wb_schedule(struct zram *zram);
+#endif
 
 #endif
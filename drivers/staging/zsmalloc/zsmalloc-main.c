@@ -43,6 +43,8 @@
  *
  *	page->private (union with page->first_page): refers to the
  *		component page after the first page
+ *	page->private: for zspages of the huge class, which hold a
+ *		single object and no extra page, the object's handle
  *	page->freelist: points to the first free object in zspage.
  *		Free objects are linked together using in-place
  *		metadata.
@@ -56,6 +58,12 @@
  *	PG_private: identifies the first component page
  *	PG_private2: identifies the last component page
  *
+ * Handles returned by zs_malloc() point to a small slab allocated word
+ * holding the current object location, and every allocated object
+ * starts with a header holding its handle. This lets compaction move
+ * objects out of sparsely used zspages into fuller ones of the same
+ * class and then free the emptied zspages. A mapped object is pinned
+ * through a bit lock in its handle word so it is not moved meanwhile.
  */
 
 #ifdef CONFIG_ZSMALLOC_DEBUG
@@ -78,6 +86,11 @@
 #include <linux/hardirq.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/bit_spinlock.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "zsmalloc.h"
 
@@ -96,6 +109,9 @@
 #define ZS_MAX_ZSPAGE_ORDER 2
 #define ZS_MAX_PAGES_PER_ZSPAGE (_AC(1, UL) << ZS_MAX_ZSPAGE_ORDER)
 
+/* header of an allocated object, holds its handle */
+#define ZS_HANDLE_SIZE (sizeof(unsigned long))
+
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
  * as single (void *) handle value.
@@ -105,6 +121,10 @@
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * The encoded location is shifted left by OBJ_TAG_BITS. The freed low
+ * bit is OBJ_ALLOCATED_TAG in object headers, telling a handle apart
+ * from a free list link, and HANDLE_PIN_BIT in handle words.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -119,7 +139,10 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT	0
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
@@ -173,6 +196,16 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * A class is compacted in the background, and by the shrinker, once
+ * this percentage of its allocated object slots is unused and at least
+ * one zspage worth of them could be freed.
+ */
+static unsigned int compact_threshold = 25;
+module_param(compact_threshold, uint, 0644);
+MODULE_PARM_DESC(compact_threshold,
+		 "Unused object percentage that triggers compaction");
+
 struct size_class {
 	/*
 	 * Size of objects stored in this class. Must be multiple
@@ -183,11 +216,16 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	/* objects are a whole page and carry no header */
+	bool huge;
 
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_allocated;	/* object slots in all zspages */
+	unsigned long objs_used;
+	unsigned long zspages[_ZS_NR_FULLNESS_GROUPS];
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -199,16 +237,49 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of an allocated object, OBJ_ALLOCATED_TAG set */
+		unsigned long handle;
+	};
+};
+
+struct zs_compact_stats {
+	u64 runs;		/* compaction passes */
+	u64 pages_freed;	/* pages released by compaction */
+	u64 objs_migrated;
+	u64 objs_pinned;	/* objects skipped because they were mapped */
 };
 
 struct zs_pool {
 	struct size_class size_class[ZS_SIZE_CLASSES];
 
 	gfp_t flags;	/* allocation flags used when growing pool */
+	const char *name;
+
+	struct shrinker shrinker;
+	struct work_struct compact_work;
+	/* protected by compact_lock, one compaction at a time */
+	struct mutex compact_lock;
+	struct zs_compact_stats compact_stats;
+	struct dentry *debugfs_dir;
+};
+
+/*
+ * State of a compaction pass over one source zspage: the next object
+ * to look at and the zspage objects are moved to.
+ */
+struct zs_compact_control {
+	struct page *s_page;	/* component page of the next object */
+	int s_off;		/* its offset in s_page */
+	int s_idx;		/* its index in the zspage */
+	struct page *d_first;	/* destination zspage */
 };
 
+static struct kmem_cache *zs_handle_cachep;
+static struct dentry *zs_debugfs_root;
+
 /*
  * A zspage's class index and fullness group
  * are encoded in its (first)page->mapping
@@ -283,7 +354,8 @@ static int get_size_class_index(int size)
 		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
 				ZS_SIZE_CLASS_DELTA);
 
-	return idx;
+	/* objects that do not fit with a header go to the huge class */
+	return min(idx, ZS_SIZE_CLASSES - 1);
 }
 
 static enum fullness_group get_fullness_group(struct page *page)
@@ -322,6 +394,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->zspages[fullness]++;
 }
 
 static void remove_zspage(struct page *page, struct size_class *class,
@@ -343,6 +416,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->zspages[fullness]--;
 }
 
 static enum fullness_group fix_fullness_group(struct zs_pool *pool,
@@ -438,29 +512,70 @@ static struct page *get_next_page(struct page *page)
  */
 static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= ((obj_idx + 1) & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= ((obj_idx + 1) & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
 /*
- * Decode <page, obj_idx> pair from the given object handle. We adjust the
- * decoded obj_idx back to its original value since it was adjusted in
- * obj_location_to_handle().
+ * Decode <page, obj_idx> pair from the given object location. We adjust
+ * the decoded obj_idx back to its original value since it was adjusted
+ * in obj_location_to_handle(). The tag bit, which may be a set pin bit,
+ * is dropped.
  */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
+static void obj_handle_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = (handle & OBJ_INDEX_MASK) - 1;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = (obj & OBJ_INDEX_MASK) - 1;
+}
+
+static unsigned long alloc_handle(struct zs_pool *pool)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+					       pool->flags & ~__GFP_HIGHMEM);
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+}
+
+/* current location of the object, with the pin bit if it is mapped */
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return ACCESS_ONCE(*(unsigned long *)handle);
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	/* a single store: mappers may be spinning on the pin bit */
+	ACCESS_ONCE(*(unsigned long *)handle) = obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -654,7 +769,8 @@ static inline void __zs_cpu_down(struct mapping_area *area)
 }
 
 static inline void *__zs_map_object(struct mapping_area *area,
-				struct page *pages[2], int off, int size)
+				struct page *pages[2], int off, int size,
+				bool huge)
 {
 	BUG_ON(map_vm_area(area->vm, PAGE_KERNEL, &pages));
 	area->vm_addr = area->vm->addr;
@@ -662,7 +778,8 @@ static inline void *__zs_map_object(struct mapping_area *area,
 }
 
 static inline void __zs_unmap_object(struct mapping_area *area,
-				struct page *pages[2], int off, int size)
+				struct page *pages[2], int off, int size,
+				bool huge)
 {
 	unsigned long addr = (unsigned long)area->vm_addr;
 
@@ -693,7 +810,7 @@ static inline void __zs_cpu_down(struct mapping_area *area)
 }
 
 static void *__zs_map_object(struct mapping_area *area,
-			struct page *pages[2], int off, int size)
+			struct page *pages[2], int off, int size, bool huge)
 {
 	int sizes[2];
 	void *addr;
@@ -706,6 +823,13 @@ static void *__zs_map_object(struct mapping_area *area,
 	if (area->vm_mm == ZS_MM_WO)
 		goto out;
 
+	/* the handle header is not the caller's, leave it out of the copy */
+	if (!huge) {
+		buf += ZS_HANDLE_SIZE;
+		size -= ZS_HANDLE_SIZE;
+		off += ZS_HANDLE_SIZE;
+	}
+
 	sizes[0] = PAGE_SIZE - off;
 	sizes[1] = size - sizes[0];
 
@@ -721,7 +845,7 @@ out:
 }
 
 static void __zs_unmap_object(struct mapping_area *area,
-			struct page *pages[2], int off, int size)
+			struct page *pages[2], int off, int size, bool huge)
 {
 	int sizes[2];
 	void *addr;
@@ -731,6 +855,16 @@ static void __zs_unmap_object(struct mapping_area *area,
 	if (area->vm_mm == ZS_MM_RO)
 		goto out;
 
+	/*
+	 * A ZS_MM_WO mapping never filled the header in vm_buf, so writing
+	 * it back would clobber the object's handle.
+	 */
+	if (!huge) {
+		buf += ZS_HANDLE_SIZE;
+		size -= ZS_HANDLE_SIZE;
+		off += ZS_HANDLE_SIZE;
+	}
+
 	sizes[0] = PAGE_SIZE - off;
 	sizes[1] = size - sizes[0];
 
@@ -783,12 +917,24 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	debugfs_remove_recursive(zs_debugfs_root);
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					     0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	/* per-pool stats live below, pools just go without if this fails */
+	zs_debugfs_root = debugfs_create_dir("zsmalloc", NULL);
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -801,8 +947,522 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+static unsigned long obj_malloc(struct page *first_page,
+		struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_handle_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	if (!class->huge)
+		link->handle = handle | OBJ_ALLOCATED_TAG;
+	else
+		set_page_private(first_page, handle | OBJ_ALLOCATED_TAG);
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->objs_used++;
+
+	return obj;
+}
+
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj &= ~BIT(HANDLE_PIN_BIT);
+	obj_handle_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	/* Insert this object in containing zspage's freelist */
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = first_page->freelist;
+	if (class->huge)
+		set_page_private(first_page, 0);
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_used--;
+}
+
+static int get_maxobj_per_zspage(struct size_class *class)
+{
+	return class->pages_per_zspage * PAGE_SIZE / class->size;
+}
+
+/* Pages that moving objects around could free. Class lock held. */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->objs_allocated - class->objs_used;
+	obj_wasted /= get_maxobj_per_zspage(class);
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+/* Whether @class is fragmented enough to compact. Class lock held. */
+static bool zs_should_compact(struct size_class *class)
+{
+	unsigned long unused = class->objs_allocated - class->objs_used;
+
+	return zs_can_compact(class) &&
+		unused * 100 >= (unsigned long)compact_threshold *
+				class->objs_allocated;
+}
+
+/*
+ * Copies an object between two zspages of @class, either of which may
+ * span two component pages.
+ */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_handle_to_location(src, &s_page, &s_objidx);
+	obj_handle_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be released in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Finds the next allocated object of the source zspage, starting at
+ * the one cc points to, and pins it. Objects that are mapped, and so
+ * already pinned, are skipped. Returns the handle, or 0 at the end of
+ * the zspage.
+ */
+static unsigned long find_alloced_obj(struct zs_pool *pool,
+		struct size_class *class, struct page *first_page,
+		struct zs_compact_control *cc)
+{
+	unsigned long head;
+	void *addr;
+
+	for (; cc->s_idx < first_page->objects;
+	     cc->s_idx++, cc->s_off += class->size) {
+		if (cc->s_off >= PAGE_SIZE) {
+			cc->s_off -= PAGE_SIZE;
+			cc->s_page = get_next_page(cc->s_page);
+		}
+
+		/* the header never spans pages, see ZS_ALIGN */
+		addr = kmap_atomic(cc->s_page);
+		head = *(unsigned long *)(addr + cc->s_off);
+		kunmap_atomic(addr);
+
+		if (!(head & OBJ_ALLOCATED_TAG))
+			continue;
+
+		head &= ~OBJ_ALLOCATED_TAG;
+		if (trypin_tag(head))
+			return head;
+		pool->compact_stats.objs_pinned++;
+	}
+
+	return 0;
+}
+
+/*
+ * Moves objects from the source zspage in cc to cc->d_first until one
+ * runs out. Returns -ENOMEM if the destination filled up first.
+ */
+static int migrate_zspage(struct zs_pool *pool, struct size_class *class,
+			struct page *s_first, struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj;
+	unsigned long handle;
+
+	while ((handle = find_alloced_obj(pool, class, s_first, cc))) {
+		if (cc->d_first->inuse == cc->d_first->objects) {
+			unpin_tag(handle);
+			return -ENOMEM;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(cc->d_first, class, handle);
+		zs_object_copy(free_obj, used_obj, class);
+
+		/* record_obj() would clear the pin bit, keep it until unpin */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+
+		pool->compact_stats.objs_migrated++;
+		cc->s_idx++;
+		cc->s_off += class->size;
+	}
+
+	return 0;
+}
+
+/* Takes a zspage of @fg off its fullness list */
+static struct page *isolate_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	struct page *page = class->fullness_list[fg];
+
+	if (page)
+		remove_zspage(page, class, fg);
+
+	return page;
+}
+
+static struct page *isolate_target_page(struct size_class *class)
+{
+	struct page *page;
+
+	page = isolate_zspage(class, ZS_ALMOST_FULL);
+	if (!page)
+		page = isolate_zspage(class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+/* Puts an isolated zspage back on the list for its current fullness */
+static enum fullness_group putback_zspage(struct size_class *class,
+					struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page;
+	struct page *dst_page = NULL;
+	unsigned long freed = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) &&
+	       (src_page = isolate_zspage(class, ZS_ALMOST_EMPTY))) {
+		cc.s_page = src_page;
+		cc.s_off = 0;
+		cc.s_idx = 0;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_first = dst_page;
+			/* the source emptied, or only pinned objects left */
+			if (!migrate_zspage(pool, class, src_page, &cc))
+				break;
+
+			putback_zspage(class, dst_page);
+		}
+
+		/* Stop if we couldn't find a destination */
+		if (!dst_page) {
+			putback_zspage(class, src_page);
+			break;
+		}
+
+		putback_zspage(class, dst_page);
+		if (putback_zspage(class, src_page) != ZS_EMPTY) {
+			/*
+			 * Whatever is left is pinned by a reader; the
+			 * next pass after it unmaps will get it.
+			 */
+			break;
+		}
+
+		class->pages_allocated -= class->pages_per_zspage;
+		class->objs_allocated -= src_page->objects;
+		freed += class->pages_per_zspage;
+		spin_unlock(&class->lock);
+		free_zspage(src_page);
+
+		/* let zs_malloc(), zs_free() and the scheduler in */
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+static unsigned long zs_compact_classes(struct zs_pool *pool, bool all)
+{
+	unsigned long freed = 0;
+	bool compact;
+	int i;
+
+	mutex_lock(&pool->compact_lock);
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->huge)
+			continue;
+
+		spin_lock(&class->lock);
+		compact = all ? zs_can_compact(class) :
+				zs_should_compact(class);
+		spin_unlock(&class->lock);
+
+		if (compact)
+			freed += __zs_compact(pool, class);
+	}
+	pool->compact_stats.runs++;
+	pool->compact_stats.pages_freed += freed;
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - move objects to free partially used zspages
+ * @pool: pool to compact
+ *
+ * Compacts every size class that has at least a zspage worth of unused
+ * objects, regardless of compact_threshold. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return zs_compact_classes(pool, true);
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static void zs_compact_work(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool,
+					    compact_work);
+
+	zs_compact_classes(pool, false);
+}
+
+static unsigned long zs_shrinker_count(struct zs_pool *pool)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->huge)
+			continue;
+
+		spin_lock(&class->lock);
+		if (zs_should_compact(class))
+			pages += zs_can_compact(class);
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+/* Reports and frees the pages compaction of fragmented classes gives */
+static int zs_shrinker(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					    shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact_classes(pool, false);
+
+	return min_t(unsigned long, zs_shrinker_count(pool), INT_MAX);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int zs_stats_classes_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, allocated, used, freeable;
+	unsigned long total_allocated = 0, total_used = 0;
+	unsigned long total_freeable = 0;
+	u64 pages, total_pages = 0;
+	int i;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %8s\n",
+		   "class", "size", "almost_full", "almost_empty",
+		   "obj_allocated", "obj_used", "pages_used",
+		   "pages_per_zspage", "freeable");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class->zspages[ZS_ALMOST_FULL];
+		almost_empty = class->zspages[ZS_ALMOST_EMPTY];
+		allocated = class->objs_allocated;
+		used = class->objs_used;
+		pages = class->pages_allocated;
+		freeable = zs_can_compact(class);
+		spin_unlock(&class->lock);
+
+		if (!allocated)
+			continue;
+
+		seq_printf(s, " %5u %5d %11lu %12lu %13lu %10lu %10llu %16d %8lu\n",
+			   i, class->size, almost_full, almost_empty,
+			   allocated, used, pages, class->pages_per_zspage,
+			   freeable);
+
+		total_allocated += allocated;
+		total_used += used;
+		total_pages += pages;
+		total_freeable += freeable;
+	}
+
+	seq_printf(s, " %5s %5s %11s %12s %13lu %10lu %10llu %16s %8lu\n",
+		   "Total", "", "", "", total_allocated, total_used,
+		   total_pages, "", total_freeable);
+
+	return 0;
+}
+
+static int zs_stats_classes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_classes_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_classes_fops = {
+	.open		= zs_stats_classes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int zs_stats_compact_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	struct zs_compact_stats st;
+
+	mutex_lock(&pool->compact_lock);
+	st = pool->compact_stats;
+	mutex_unlock(&pool->compact_lock);
+
+	seq_printf(s, "threshold:     %u%%\n", compact_threshold);
+	seq_printf(s, "runs:          %llu\n", st.runs);
+	seq_printf(s, "pages_freed:   %llu\n", st.pages_freed);
+	seq_printf(s, "objs_migrated: %llu\n", st.objs_migrated);
+	seq_printf(s, "objs_pinned:   %llu\n", st.objs_pinned);
+
+	return 0;
+}
+
+static int zs_stats_compact_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_compact_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_compact_fops = {
+	.open		= zs_stats_compact_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_debugfs_root)
+		return;
+
+	pool->debugfs_dir = debugfs_create_dir(pool->name, zs_debugfs_root);
+	if (!pool->debugfs_dir) {
+		pr_warn("debugfs dir <%s> creation failed\n", pool->name);
+		return;
+	}
+
+	debugfs_create_file("classes", S_IRUGO, pool->debugfs_dir, pool,
+			    &zs_stats_classes_fops);
+	debugfs_create_file("compaction", S_IRUGO, pool->debugfs_dir, pool,
+			    &zs_stats_compact_fops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->debugfs_dir);
+}
+#else
+static inline void zs_pool_stat_create(struct zs_pool *pool)
+{
+}
+
+static inline void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+}
+#endif
+
 /**
  * zs_create_pool - Creates an allocation pool to work from.
+ * @name: pool name, used for its debugfs directory
  * @flags: allocation flags used to allocate pool metadata
  *
  * This function must be called before anything when using
@@ -811,7 +1471,7 @@ fail:
  * On success, a pointer to the newly created pool is returned,
  * otherwise NULL.
  */
-struct zs_pool *zs_create_pool(gfp_t flags)
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
 	int i, ovhd_size;
 	struct zs_pool *pool;
@@ -821,6 +1481,12 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name) {
+		kfree(pool);
+		return NULL;
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int size;
 		struct size_class *class;
@@ -834,11 +1500,20 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
+		class->huge = size == ZS_MAX_ALLOC_SIZE;
 
 	}
 
 	pool->flags = flags;
 
+	mutex_init(&pool->compact_lock);
+	INIT_WORK(&pool->compact_work, zs_compact_work);
+	pool->shrinker.shrink = zs_shrinker;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_pool_stat_create(pool);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -847,6 +1522,10 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->compact_work);
+	zs_pool_stat_destroy(pool);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -859,6 +1538,7 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	kfree(pool->name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -874,20 +1554,20 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  */
 unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 {
-	unsigned long obj;
-	struct link_free *link;
-	int class_idx;
+	unsigned long handle, obj;
 	struct size_class *class;
-
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	struct page *first_page;
 
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	class_idx = get_size_class_index(size);
-	class = &pool->size_class[class_idx];
-	BUG_ON(class_idx != class->index);
+	handle = alloc_handle(pool);
+	if (!handle)
+		return 0;
+
+	/* extra space in chunk to keep the handle */
+	size += ZS_HANDLE_SIZE;
+	class = &pool->size_class[get_size_class_index(size)];
 
 	spin_lock(&class->lock);
 	first_page = find_get_zspage(class);
@@ -895,72 +1575,68 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return 0;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->pages_per_zspage;
+		class->objs_allocated += first_page->objects;
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(first_page, class, handle);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+void zs_free(struct zs_pool *pool, unsigned long handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
-
+	unsigned long obj, f_objidx;
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
+	bool compact = false;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
+	/* keep compaction from moving the object under us */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
 	obj_handle_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
-	if (fullness == ZS_EMPTY)
+	if (fullness == ZS_EMPTY) {
 		class->pages_allocated -= class->pages_per_zspage;
+		class->objs_allocated -= first_page->objects;
+	} else if (fullness == ZS_ALMOST_EMPTY && !class->huge) {
+		compact = zs_should_compact(class);
+	}
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
+	free_handle(handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
+
+	if (compact)
+		schedule_work(&pool->compact_work);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
@@ -976,19 +1652,23 @@ EXPORT_SYMBOL_GPL(zs_free);
  * Only one object can be mapped per cpu at a time. There is no protection
  * against nested mappings.
  *
+ * The object is pinned while mapped, so compaction leaves it in place;
+ * compaction holds the pin only while copying a single object.
+ *
  * This function returns with preemption and page faults disabled.
 */
 void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 	struct page *pages[2];
+	void *ret;
 
 	BUG_ON(!handle);
 
@@ -999,7 +1679,11 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	 */
 	BUG_ON(in_interrupt());
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* From now on, migration cannot move the object */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_handle_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -1009,7 +1693,8 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		ret = area->vm_addr + off;
+		goto out;
 	}
 
 	/* this object spans two pages */
@@ -1017,14 +1702,19 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	pages[1] = get_next_page(page);
 	BUG_ON(!pages[1]);
 
-	return __zs_map_object(area, pages, off, class->size);
+	ret = __zs_map_object(area, pages, off, class->size, class->huge);
+out:
+	if (!class->huge)
+		ret += ZS_HANDLE_SIZE;
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -1033,7 +1723,8 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_handle_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -1048,9 +1739,11 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 		pages[1] = get_next_page(page);
 		BUG_ON(!pages[1]);
 
-		__zs_unmap_object(area, pages, off, class->size);
+		__zs_unmap_object(area, pages, off, class->size,
+				  class->huge);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -27,13 +27,20 @@
 #include <linux/dma-mapping.h>
 #include <linux/dmapool.h>
 #include <linux/err.h>
+#include <linux/hrtimer.h>
 #include <linux/io.h>
 #include <linux/irq.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/pagemap.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/serial.h>
 #include <linux/serial_8250.h>
 #include <linux/serial_core.h>
@@ -43,14 +50,20 @@
 #include <linux/termios.h>
 #include <linux/tty.h>
 #include <linux/tty_flip.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 #include <linux/platform_data/serial-tegra.h>
+#include <linux/serial_tegra.h>
 #include <linux/clk/tegra.h>
 
 #define TEGRA_UART_TYPE				"SERIAL_TEGRA"
 #define TX_EMPTY_STATUS				(UART_LSR_TEMT | UART_LSR_THRE)
 #define BYTES_TO_ALIGN(x)			((unsigned long)(x) & 0x3)
 
-#define TEGRA_UART_RX_DMA_BUFFER_SIZE		4096
+/* Rx DMA runs cyclically over a ring of power of two size */
+#define TEGRA_UART_RX_DMA_BUFFER_SIZE		(16 * 1024)
+#define TEGRA_UART_RX_DMA_PERIOD_SIZE		1024
+#define TEGRA_UART_RX_BURSTS			64
 #define TEGRA_UART_LSR_TXFIFO_FULL		0x100
 #define TEGRA_UART_IER_EORD			0x20
 #define TEGRA_UART_MCR_RTS_EN			0x40
@@ -64,6 +77,8 @@
 #define TEGRA_UART_TX_DMA			2
 #define TEGRA_UART_MIN_DMA			16
 #define TEGRA_UART_FIFO_SIZE			32
+/* time for an APB DMA burst in flight to land after a channel pause */
+#define TEGRA_UART_DMA_BURST_US			20
 
 /*
  * Tx fifo trigger level setting in tegra uart is in
@@ -84,6 +99,15 @@
 #define TEGRA_TX_PIO				1
 #define TEGRA_TX_DMA				2
 
+/*
+ * Interval of the Rx ring position poll, in addition to the DMA period and
+ * end-of-data interrupts. Lowers the latency and improves the timestamps
+ * of data that is still streaming in.
+ */
+static unsigned int rx_poll_us;
+module_param(rx_poll_us, uint, 0644);
+MODULE_PARM_DESC(rx_poll_us, "Rx DMA ring poll interval in us, 0 to disable");
+
 /**
  * tegra_uart_chip_data: SOC specific data.
  *
@@ -98,6 +122,51 @@ struct tegra_uart_chip_data {
 	bool	support_clk_src_div;
 };
 
+/**
+ * tegra_uart_rx_burst: characters received back to back, queued for the
+ * raw reader.
+ *
+ * @start: ring offset of the first unread byte.
+ * @len: number of unread bytes in the ring.
+ * @tail: bytes drained by PIO when the line went idle, which follow the
+ *	ring data.
+ * @tail_pos: first unread byte of @tail.
+ * @tail_len: number of valid bytes in @tail.
+ * @timestamp: arrival time of the first byte.
+ * @closed: the line went idle, nothing more is appended.
+ * @started: part of the burst has been read already.
+ */
+struct tegra_uart_rx_burst {
+	unsigned int	start;
+	unsigned int	len;
+	u8		tail[TEGRA_UART_FIFO_SIZE];
+	unsigned int	tail_pos;
+	unsigned int	tail_len;
+	ktime_t		timestamp;
+	bool		closed;
+	bool		started;
+};
+
+/*
+ * tegra_uart_stats: Rx path counters, protected by the port lock and
+ * cleared by writing to the debugfs stats file.
+ */
+struct tegra_uart_stats {
+	u64	since_ns;
+	u64	dma_bytes;
+	u64	pio_bytes;
+	u64	bursts;
+	u32	burst_max;
+	u32	ring_max;
+	u64	period_irqs;
+	u64	eord_irqs;
+	u64	polls;
+	u64	fifo_overruns;
+	u64	tty_dropped;
+	u64	raw_bytes;
+	u64	raw_dropped;
+};
+
 struct tegra_uart_port {
 	struct uart_port			uport;
 	const struct tegra_uart_chip_data	*cdata;
@@ -133,7 +202,34 @@ struct tegra_uart_port {
 	dma_cookie_t				tx_cookie;
 	dma_cookie_t				rx_cookie;
 	int					tx_bytes_requested;
-	int					rx_bytes_requested;
+
+	/* Rx ring consumer, under the port lock */
+	unsigned int				rx_tail;
+	bool					rx_idle;
+	unsigned int				rx_burst_len;
+	ktime_t					rx_burst_ts;
+	unsigned int				rx_char_ns;
+	struct hrtimer				rx_poll_timer;
+	u64					rx_poll_ns;
+	struct hrtimer				rx_drain_timer;
+	bool					rx_draining;
+
+	/* Raw reader, records under the port lock */
+	struct miscdevice			rx_raw_dev;
+	char					rx_raw_name[16];
+	unsigned long				rx_raw_busy;
+	struct mutex				rx_raw_mutex;
+	wait_queue_head_t			rx_raw_wait;
+	bool					rx_raw;
+	bool					rx_raw_lost;
+	struct tegra_uart_rx_burst		*rx_bursts;
+	unsigned int				rx_burst_head;
+	unsigned int				rx_burst_count;
+	unsigned int				rx_raw_used;
+	unsigned long				rx_raw_seq;
+
+	struct tegra_uart_stats			stats;
+	struct dentry				*debugfs;
 };
 
 static void tegra_uart_start_next_tx(struct tegra_uart_port *tup);
@@ -322,6 +418,7 @@ static char tegra_uart_decode_rx_error(struct tegra_uart_port *tup,
 			/* Overrrun error */
 			flag |= TTY_OVERRUN;
 			tup->uport.icount.overrun++;
+			tup->stats.fifo_overruns++;
 			//dev_err(tup->uport.dev, "Got overrun errors\n");
 		} else if (lsr & UART_LSR_PE) {
 			/* Parity error */
@@ -507,123 +604,331 @@ static void tegra_uart_handle_tx_pio(struct tegra_uart_port *tup)
 	return;
 }
 
-static void tegra_uart_handle_rx_pio(struct tegra_uart_port *tup,
-		struct tty_port *tty)
+static unsigned int tegra_uart_read_rx_fifo(struct tegra_uart_port *tup,
+		u8 *buf, char *flags, unsigned int max)
 {
-	do {
-		char flag = TTY_NORMAL;
-		unsigned long lsr = 0;
-		unsigned char ch;
+	unsigned int count = 0;
+	unsigned long lsr;
 
+	while (count < max) {
 		lsr = tegra_uart_read(tup, UART_LSR);
 		if (!(lsr & UART_LSR_DR))
 			break;
 
-		flag = tegra_uart_decode_rx_error(tup, lsr);
-		ch = (unsigned char) tegra_uart_read(tup, UART_RX);
-		tup->uport.icount.rx++;
-
-		if (!uart_handle_sysrq_char(&tup->uport, ch) && tty)
-			tty_insert_flip_char(tty, ch, flag);
-	} while (1);
-
-	return;
+		flags[count] = tegra_uart_decode_rx_error(tup, lsr);
+		buf[count++] = (unsigned char) tegra_uart_read(tup, UART_RX);
+	}
+	return count;
 }
 
 static void tegra_uart_copy_rx_to_tty(struct tegra_uart_port *tup,
-		struct tty_port *tty, int count)
+		struct tty_port *port, unsigned int start, unsigned int count)
 {
+	unsigned int first = min_t(unsigned int, count,
+				TEGRA_UART_RX_DMA_BUFFER_SIZE - start);
 	int copied;
 
-	tup->uport.icount.rx += count;
-	if (!tty) {
-		dev_err(tup->uport.dev, "No tty port\n");
-		return;
-	}
-	dma_sync_single_for_cpu(tup->uport.dev, tup->rx_dma_buf_phys,
-				TEGRA_UART_RX_DMA_BUFFER_SIZE, DMA_FROM_DEVICE);
-	copied = tty_insert_flip_string(tty,
-			((unsigned char *)(tup->rx_dma_buf_virt)), count);
+	copied = tty_insert_flip_string(port, tup->rx_dma_buf_virt + start,
+					first);
+	if (count > first)
+		copied += tty_insert_flip_string(port, tup->rx_dma_buf_virt,
+						 count - first);
 	if (copied != count) {
-		WARN_ON(1);
-		dev_err(tup->uport.dev, "RxData copy to tty layer failed\n");
+		tup->uport.icount.buf_overrun++;
+		tup->stats.tty_dropped += count - copied;
 	}
-	dma_sync_single_for_device(tup->uport.dev, tup->rx_dma_buf_phys,
-				TEGRA_UART_RX_DMA_BUFFER_SIZE, DMA_TO_DEVICE);
 }
 
-static void tegra_uart_rx_dma_complete(void *args)
+static void tegra_uart_rx_to_tty(struct tegra_uart_port *tup,
+		unsigned int count, const u8 *tail, const char *flags,
+		unsigned int tail_len)
 {
-	struct tegra_uart_port *tup = args;
-	struct uart_port *u = &tup->uport;
-	int count = tup->rx_bytes_requested;
-	struct tty_struct *tty = tty_port_tty_get(&tup->uport.state->port);
-	struct tty_port *port = &u->state->port;
-	unsigned long flags;
-
-	async_tx_ack(tup->rx_dma_desc);
-	spin_lock_irqsave(&u->lock, flags);
-
-	/* Deactivate flow control to stop sender */
-	if (tup->rts_active)
-		set_rts(tup, false);
+	unsigned int limit = TEGRA_UART_RX_DMA_BUFFER_SIZE -
+				TEGRA_UART_RX_DMA_PERIOD_SIZE;
+	struct tty_port *port = &tup->uport.state->port;
+	struct tty_struct *tty = tty_port_tty_get(port);
+	unsigned int start = tup->rx_tail;
+	unsigned int i;
+
+	/* the DMA went round the ring since the last update */
+	if (count > limit) {
+		start = (start + count - limit) % TEGRA_UART_RX_DMA_BUFFER_SIZE;
+		tup->uport.icount.overrun++;
+		tup->stats.tty_dropped += count - limit;
+		tty_insert_flip_char(port, 0, TTY_OVERRUN);
+		count = limit;
+	}
 
-	/* If we are here, DMA is stopped */
 	if (count)
-		tegra_uart_copy_rx_to_tty(tup, port, count);
+		tegra_uart_copy_rx_to_tty(tup, port, start, count);
+
+	for (i = 0; i < tail_len; i++)
+		if (!uart_handle_sysrq_char(&tup->uport, tail[i]))
+			tty_insert_flip_char(port, tail[i], flags[i]);
 
-	tegra_uart_handle_rx_pio(tup, port);
 	if (tty) {
 		tty_flip_buffer_push(port);
 		tty_kref_put(tty);
 	}
-	tegra_uart_start_rx_dma(tup);
+}
 
-	/* Activate flow control to start transfer */
-	if (tup->rts_active)
-		set_rts(tup, true);
+static struct tegra_uart_rx_burst *tegra_uart_raw_burst(
+		struct tegra_uart_port *tup, unsigned int i)
+{
+	return &tup->rx_bursts[(tup->rx_burst_head + i) % TEGRA_UART_RX_BURSTS];
+}
 
-	spin_unlock_irqrestore(&u->lock, flags);
+/* Retire the oldest record, anything still unread in it is lost */
+static void tegra_uart_raw_pop(struct tegra_uart_port *tup)
+{
+	struct tegra_uart_rx_burst *b = tegra_uart_raw_burst(tup, 0);
+	unsigned int unread = b->len + b->tail_len - b->tail_pos;
+
+	if (unread) {
+		tup->rx_raw_used -= b->len;
+		tup->stats.raw_dropped += unread;
+		tup->rx_raw_lost = true;
+		tup->rx_raw_seq++;
+	}
+	tup->rx_burst_head = (tup->rx_burst_head + 1) % TEGRA_UART_RX_BURSTS;
+	tup->rx_burst_count--;
 }
 
-static void tegra_uart_handle_rx_dma(struct tegra_uart_port *tup)
+static void tegra_uart_raw_flush(struct tegra_uart_port *tup)
+{
+	while (tup->rx_burst_count)
+		tegra_uart_raw_pop(tup);
+}
+
+/*
+ * The DMA does not wait for the reader. Before @count more bytes are
+ * queued, drop the oldest unread ones so that a period of the ring stays
+ * free for the DMA to run ahead into.
+ */
+static void tegra_uart_raw_make_room(struct tegra_uart_port *tup,
+		unsigned int count)
+{
+	unsigned int limit = TEGRA_UART_RX_DMA_BUFFER_SIZE -
+				TEGRA_UART_RX_DMA_PERIOD_SIZE;
+	struct tegra_uart_rx_burst *b;
+	unsigned int n;
+
+	while (tup->rx_raw_used + count > limit) {
+		b = tegra_uart_raw_burst(tup, 0);
+		n = min(b->len, tup->rx_raw_used + count - limit);
+		b->start = (b->start + n) % TEGRA_UART_RX_DMA_BUFFER_SIZE;
+		b->len -= n;
+		tup->rx_raw_used -= n;
+		tup->stats.raw_dropped += n;
+		tup->rx_raw_lost = true;
+		tup->rx_raw_seq++;
+		if (!b->len && tup->rx_burst_count > 1)
+			tegra_uart_raw_pop(tup);
+	}
+}
+
+static void tegra_uart_rx_to_raw(struct tegra_uart_port *tup,
+		unsigned int count, const u8 *tail, const char *flags,
+		unsigned int tail_len)
+{
+	unsigned int limit = TEGRA_UART_RX_DMA_BUFFER_SIZE -
+				TEGRA_UART_RX_DMA_PERIOD_SIZE;
+	unsigned int start = tup->rx_tail;
+	struct tegra_uart_rx_burst *b = NULL;
+	unsigned int i;
+
+	/* the DMA went round the ring since the last update */
+	if (count > limit) {
+		start = (start + count - limit) % TEGRA_UART_RX_DMA_BUFFER_SIZE;
+		tup->stats.raw_dropped += count - limit;
+		tup->rx_raw_lost = true;
+		count = limit;
+	}
+	tegra_uart_raw_make_room(tup, count);
+
+	if (tup->rx_burst_count)
+		b = tegra_uart_raw_burst(tup, tup->rx_burst_count - 1);
+	if (!b || b->closed) {
+		if (tup->rx_burst_count == TEGRA_UART_RX_BURSTS)
+			tegra_uart_raw_pop(tup);
+		b = tegra_uart_raw_burst(tup, tup->rx_burst_count++);
+		memset(b, 0, sizeof(*b));
+		b->start = start;
+		b->timestamp = tup->rx_burst_ts;
+	}
+	if (!b->len)
+		b->start = start;
+	b->len += count;
+	tup->rx_raw_used += count;
+
+	for (i = 0; i < tail_len; i++)
+		if (flags[i] == TTY_OVERRUN)
+			tup->rx_raw_lost = true;
+	memcpy(b->tail, tail, tail_len);
+	b->tail_len = tail_len;
+
+	wake_up_interruptible(&tup->rx_raw_wait);
+}
+
+static void tegra_uart_raw_close(struct tegra_uart_port *tup)
+{
+	struct tegra_uart_rx_burst *b;
+
+	if (!tup->rx_burst_count)
+		return;
+
+	b = tegra_uart_raw_burst(tup, tup->rx_burst_count - 1);
+	b->closed = true;
+	/* read up while it was still open */
+	if (!b->len && b->tail_pos == b->tail_len)
+		tegra_uart_raw_pop(tup);
+}
+
+/*
+ * Collect what the Rx DMA has written to the ring since the last update
+ * and pass it on to the tty or to the raw reader. With @burst_end the line
+ * has gone idle: the bytes left in the FIFO, less than a DMA word, are
+ * drained by PIO and the burst is closed. Called with the port lock held
+ * and, for @burst_end, the DMA paused or about to be stopped.
+ */
+static void tegra_uart_rx_update(struct tegra_uart_port *tup, bool burst_end)
 {
 	struct dma_tx_state state;
-	struct tty_struct *tty = tty_port_tty_get(&tup->uport.state->port);
-	struct tty_port *port = &tup->uport.state->port;
-	int count;
+	u8 tail[TEGRA_UART_FIFO_SIZE];
+	char flags[TEGRA_UART_FIFO_SIZE];
+	unsigned int pos, count, tail_len = 0;
+
+	if (!tup->rx_dma_chan || !tup->rx_in_progress)
+		return;
+
+	dmaengine_tx_status(tup->rx_dma_chan, tup->rx_cookie, &state);
+	pos = (TEGRA_UART_RX_DMA_BUFFER_SIZE - state.residue) &
+			(TEGRA_UART_RX_DMA_BUFFER_SIZE - 1);
+	count = (pos - tup->rx_tail) & (TEGRA_UART_RX_DMA_BUFFER_SIZE - 1);
+	if (burst_end)
+		tail_len = tegra_uart_read_rx_fifo(tup, tail, flags,
+						   TEGRA_UART_FIFO_SIZE);
+
+	if (count || tail_len) {
+		if (tup->rx_idle) {
+			/* back-date to the first byte by its successors */
+			tup->rx_burst_ts = ktime_sub_ns(ktime_get(),
+					(u64)(count + tail_len - 1) *
+						tup->rx_char_ns);
+			tup->rx_burst_len = 0;
+			tup->rx_idle = false;
+			tup->stats.bursts++;
+		}
+		tup->rx_burst_len += count + tail_len;
+		tup->uport.icount.rx += count + tail_len;
+		tup->stats.dma_bytes += count;
+		tup->stats.pio_bytes += tail_len;
+		tup->stats.ring_max = max(tup->stats.ring_max, count);
+
+		if (tup->rx_raw)
+			tegra_uart_rx_to_raw(tup, count, tail, flags, tail_len);
+		else
+			tegra_uart_rx_to_tty(tup, count, tail, flags, tail_len);
+		tup->rx_tail = pos;
+	}
+
+	if (burst_end && !tup->rx_idle) {
+		tup->stats.burst_max = max(tup->stats.burst_max,
+					   tup->rx_burst_len);
+		tup->rx_idle = true;
+		if (tup->rx_raw)
+			tegra_uart_raw_close(tup);
+	}
+}
+
+/* Called at the end of every period of the Rx ring */
+static void tegra_uart_rx_dma_complete(void *args)
+{
+	struct tegra_uart_port *tup = args;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	tup->stats.period_irqs++;
+	tegra_uart_rx_update(tup, false);
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+}
 
+static void tegra_uart_handle_rx_dma(struct tegra_uart_port *tup)
+{
 	/* Deactivate flow control to stop sender */
 	if (tup->rts_active)
 		set_rts(tup, false);
 
-	dmaengine_terminate_all(tup->rx_dma_chan);
-	dmaengine_tx_status(tup->rx_dma_chan,  tup->rx_cookie, &state);
-	async_tx_ack(tup->rx_dma_desc);
-	count = tup->rx_bytes_requested - state.residue;
+	tup->stats.eord_irqs++;
+	if (tup->rx_draining)
+		return;
 
-	/* If we are here, DMA is stopped */
-	if (count)
-		tegra_uart_copy_rx_to_tty(tup, port, count);
+	/*
+	 * Keep the DMA from taking more words while the FIFO is drained so
+	 * that the PIO bytes cannot get ahead of DMA'd ones. Without a
+	 * per-channel pause the ring has to be stopped and restarted.
+	 */
+	if (dmaengine_pause(tup->rx_dma_chan)) {
+		dmaengine_terminate_all(tup->rx_dma_chan);
+		tegra_uart_rx_update(tup, true);
+		tegra_uart_start_rx_dma(tup);
+		if (tup->rts_active)
+			set_rts(tup, true);
+		return;
+	}
 
-	tegra_uart_handle_rx_pio(tup, port);
-	if (tty) {
-		tty_flip_buffer_push(port);
-		tty_kref_put(tty);
+	/* drain once the burst in flight has landed, not by spinning here */
+	tup->rx_draining = true;
+	hrtimer_start(&tup->rx_drain_timer,
+		      ns_to_ktime(TEGRA_UART_DMA_BURST_US * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart tegra_uart_rx_drain(struct hrtimer *timer)
+{
+	struct tegra_uart_port *tup = container_of(timer,
+					struct tegra_uart_port, rx_drain_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	if (tup->rx_draining) {
+		tup->rx_draining = false;
+		tegra_uart_rx_update(tup, true);
+		dmaengine_resume(tup->rx_dma_chan);
+		if (tup->rts_active)
+			set_rts(tup, true);
 	}
-	tegra_uart_start_rx_dma(tup);
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
 
-	if (tup->rts_active)
-		set_rts(tup, true);
+	return HRTIMER_NORESTART;
 }
 
-static int tegra_uart_start_rx_dma(struct tegra_uart_port *tup)
+static enum hrtimer_restart tegra_uart_rx_poll(struct hrtimer *timer)
 {
-	unsigned int count = TEGRA_UART_RX_DMA_BUFFER_SIZE;
+	struct tegra_uart_port *tup = container_of(timer,
+					struct tegra_uart_port, rx_poll_timer);
+	unsigned long flags;
 
-	tup->rx_dma_desc = dmaengine_prep_slave_single(tup->rx_dma_chan,
-				tup->rx_dma_buf_phys, count, DMA_DEV_TO_MEM,
-				DMA_PREP_INTERRUPT);
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	if (!tup->rx_in_progress) {
+		spin_unlock_irqrestore(&tup->uport.lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	tup->stats.polls++;
+	tegra_uart_rx_update(tup, false);
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+
+	hrtimer_forward_now(timer, ns_to_ktime(tup->rx_poll_ns));
+	return HRTIMER_RESTART;
+}
+
+static int tegra_uart_start_rx_dma(struct tegra_uart_port *tup)
+{
+	tup->rx_dma_desc = dmaengine_prep_dma_cyclic(tup->rx_dma_chan,
+				tup->rx_dma_buf_phys,
+				TEGRA_UART_RX_DMA_BUFFER_SIZE,
+				TEGRA_UART_RX_DMA_PERIOD_SIZE, DMA_DEV_TO_MEM,
+				DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
 	if (!tup->rx_dma_desc) {
 		dev_err(tup->uport.dev, "Not able to get desc for Rx\n");
 		return -EIO;
@@ -631,9 +936,8 @@ static int tegra_uart_start_rx_dma(struct tegra_uart_port *tup)
 
 	tup->rx_dma_desc->callback = tegra_uart_rx_dma_complete;
 	tup->rx_dma_desc->callback_param = tup;
-	dma_sync_single_for_device(tup->uport.dev, tup->rx_dma_buf_phys,
-				count, DMA_TO_DEVICE);
-	tup->rx_bytes_requested = count;
+	tup->rx_tail = 0;
+	tup->rx_idle = true;
 	tup->rx_cookie = dmaengine_submit(tup->rx_dma_desc);
 	dma_async_issue_pending(tup->rx_dma_chan);
 	return 0;
@@ -730,11 +1034,7 @@ static irqreturn_t tegra_uart_isr(int irq, void *data)
 static void tegra_uart_stop_rx(struct uart_port *u)
 {
 	struct tegra_uart_port *tup = to_tegra_uport(u);
-	struct tty_struct *tty;
-	struct tty_port *port = &u->state->port;
-	struct dma_tx_state state;
 	unsigned long ier;
-	int count;
 
 	if (tup->rts_active)
 		set_rts(tup, false);
@@ -742,8 +1042,6 @@ static void tegra_uart_stop_rx(struct uart_port *u)
 	if (!tup->rx_in_progress)
 		return;
 
-	tty = tty_port_tty_get(&tup->uport.state->port);
-
 	tegra_uart_wait_sym_time(tup, 1); /* wait a character interval */
 
 	ier = tup->ier_shadow;
@@ -751,21 +1049,19 @@ static void tegra_uart_stop_rx(struct uart_port *u)
 					TEGRA_UART_IER_EORD);
 	tup->ier_shadow = ier;
 	tegra_uart_write(tup, ier, UART_IER);
-	tup->rx_in_progress = 0;
-	if (tup->rx_dma_chan) {
+
+	/* the drain timer takes the port lock, so it cannot be waited for */
+	tup->rx_draining = false;
+	hrtimer_try_to_cancel(&tup->rx_drain_timer);
+
+	/* Take the ring position before the terminate forgets it */
+	if (dmaengine_pause(tup->rx_dma_chan))
 		dmaengine_terminate_all(tup->rx_dma_chan);
-		dmaengine_tx_status(tup->rx_dma_chan, tup->rx_cookie, &state);
-		async_tx_ack(tup->rx_dma_desc);
-		count = tup->rx_bytes_requested - state.residue;
-		tegra_uart_copy_rx_to_tty(tup, port, count);
-		tegra_uart_handle_rx_pio(tup, port);
-	} else {
-		tegra_uart_handle_rx_pio(tup, port);
-	}
-	if (tty) {
-		tty_flip_buffer_push(port);
-		tty_kref_put(tty);
-	}
+	else
+		udelay(TEGRA_UART_DMA_BURST_US);
+	tegra_uart_rx_update(tup, true);
+	dmaengine_terminate_all(tup->rx_dma_chan);
+	tup->rx_in_progress = 0;
 	return;
 }
 
@@ -876,6 +1172,7 @@ static int tegra_uart_hw_init(struct tegra_uart_port *tup)
 		return ret;
 	}
 	tup->rx_in_progress = 1;
+	tup->rx_char_ns = NSEC_PER_SEC / TEGRA_UART_DEFAULT_BAUD * 10;
 
 	/*
 	 * Enable IE_RXS for the receive status interrupts like line errros.
@@ -897,6 +1194,11 @@ static int tegra_uart_hw_init(struct tegra_uart_port *tup)
 	 */
 	tup->ier_shadow = UART_IER_RLSI | UART_IER_RTOIE | TEGRA_UART_IER_EORD;
 	tegra_uart_write(tup, tup->ier_shadow, UART_IER);
+
+	tup->rx_poll_ns = (u64)rx_poll_us * NSEC_PER_USEC;
+	if (tup->rx_poll_ns)
+		hrtimer_start(&tup->rx_poll_timer, ns_to_ktime(tup->rx_poll_ns),
+			      HRTIMER_MODE_REL);
 	return 0;
 }
 
@@ -983,14 +1285,21 @@ static void tegra_uart_dma_channel_free(struct tegra_uart_port *tup,
 		bool dma_to_memory)
 {
 	struct dma_chan *dma_chan;
+	unsigned long flags;
 
 	if (dma_to_memory) {
+		/* The raw reader copies out of the ring under the mutex */
+		mutex_lock(&tup->rx_raw_mutex);
+		spin_lock_irqsave(&tup->uport.lock, flags);
+		tegra_uart_raw_flush(tup);
+		spin_unlock_irqrestore(&tup->uport.lock, flags);
 		dma_free_coherent(tup->uport.dev, TEGRA_UART_RX_DMA_BUFFER_SIZE,
 				tup->rx_dma_buf_virt, tup->rx_dma_buf_phys);
 		dma_chan = tup->rx_dma_chan;
 		tup->rx_dma_chan = NULL;
 		tup->rx_dma_buf_phys = 0;
 		tup->rx_dma_buf_virt = NULL;
+		mutex_unlock(&tup->rx_raw_mutex);
 	} else {
 		dma_unmap_single(tup->uport.dev, tup->tx_dma_buf_phys,
 			UART_XMIT_SIZE, DMA_TO_DEVICE);
@@ -1029,6 +1338,7 @@ static int tegra_uart_startup(struct uart_port *u)
 				dev_name(u->dev), tup);
 	if (ret < 0) {
 		dev_err(u->dev, "Failed to register ISR for IRQ %d\n", u->irq);
+		hrtimer_cancel(&tup->rx_poll_timer);
 		goto fail_hw_init;
 	}
 	return 0;
@@ -1044,6 +1354,8 @@ static void tegra_uart_shutdown(struct uart_port *u)
 {
 	struct tegra_uart_port *tup = to_tegra_uport(u);
 
+	hrtimer_cancel(&tup->rx_poll_timer);
+	hrtimer_cancel(&tup->rx_drain_timer);
 	tegra_uart_hw_deinit(tup);
 
 	tup->rx_in_progress = 0;
@@ -1151,6 +1463,7 @@ static void tegra_uart_set_termios(struct uart_port *u,
 	if (tty_termios_baud_rate(termios))
 		tty_termios_encode_baud_rate(termios, baud, baud);
 	spin_lock_irqsave(&u->lock, flags);
+	tup->rx_char_ns = div_u64((u64)symb_bit * NSEC_PER_SEC, baud);
 
 	/* Flow control */
 	if (termios->c_cflag & CRTSCTS)	{
@@ -1225,6 +1538,259 @@ static struct uart_driver tegra_uart_driver = {
 	.nr		= TEGRA_UART_MAXIMUM,
 };
 
+static bool __tegra_uart_raw_ready(struct tegra_uart_port *tup)
+{
+	struct tegra_uart_rx_burst *b;
+
+	if (!tup->rx_burst_count)
+		return false;
+
+	b = tegra_uart_raw_burst(tup, 0);
+	return b->len || b->tail_pos < b->tail_len;
+}
+
+static bool tegra_uart_raw_ready(struct tegra_uart_port *tup)
+{
+	unsigned long flags;
+	bool ready;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	ready = __tegra_uart_raw_ready(tup);
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+	return ready;
+}
+
+static int tegra_uart_raw_open(struct inode *inode, struct file *file)
+{
+	struct tegra_uart_port *tup = container_of(file->private_data,
+					struct tegra_uart_port, rx_raw_dev);
+	struct tegra_uart_rx_burst *bursts;
+	unsigned long flags;
+
+	if (test_and_set_bit(0, &tup->rx_raw_busy))
+		return -EBUSY;
+
+	bursts = kcalloc(TEGRA_UART_RX_BURSTS, sizeof(*bursts), GFP_KERNEL);
+	if (!bursts) {
+		clear_bit(0, &tup->rx_raw_busy);
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	tup->rx_bursts = bursts;
+	tup->rx_burst_head = 0;
+	tup->rx_burst_count = 0;
+	tup->rx_raw_used = 0;
+	tup->rx_raw_lost = false;
+	tup->rx_raw = true;
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+
+	file->private_data = tup;
+	return nonseekable_open(inode, file);
+}
+
+static int tegra_uart_raw_release(struct inode *inode, struct file *file)
+{
+	struct tegra_uart_port *tup = file->private_data;
+	struct tegra_uart_rx_burst *bursts;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	tup->rx_raw = false;
+	tegra_uart_raw_flush(tup);
+	bursts = tup->rx_bursts;
+	tup->rx_bursts = NULL;
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+
+	kfree(bursts);
+	clear_bit(0, &tup->rx_raw_busy);
+	return 0;
+}
+
+/*
+ * Return the oldest unread data as one record, copied straight from the
+ * DMA ring. The copy is made without the port lock, so the position is
+ * brought up to date afterwards: if the DMA has overwritten the data in
+ * the meantime it was dropped, and the read starts over.
+ */
+static ssize_t tegra_uart_raw_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct tegra_uart_port *tup = file->private_data;
+	struct uart_port *u = &tup->uport;
+	char __user *data = buf + sizeof(struct tegra_uart_rx_hdr);
+	u8 tail[TEGRA_UART_FIFO_SIZE];
+	struct tegra_uart_rx_hdr hdr;
+	struct tegra_uart_rx_burst *b;
+	unsigned int start, len, first, tail_len;
+	unsigned long flags, seq;
+	int ret;
+
+	if (count <= sizeof(hdr))
+		return -EINVAL;
+	count -= sizeof(hdr);
+
+	mutex_lock(&tup->rx_raw_mutex);
+retry:
+	spin_lock_irqsave(&u->lock, flags);
+	while (!__tegra_uart_raw_ready(tup)) {
+		spin_unlock_irqrestore(&u->lock, flags);
+		mutex_unlock(&tup->rx_raw_mutex);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(tup->rx_raw_wait,
+					       tegra_uart_raw_ready(tup));
+		if (ret < 0)
+			return ret;
+
+		mutex_lock(&tup->rx_raw_mutex);
+		spin_lock_irqsave(&u->lock, flags);
+	}
+
+	b = tegra_uart_raw_burst(tup, 0);
+	hdr.timestamp_ns = ktime_to_ns(b->timestamp);
+	hdr.flags = b->started ? TEGRA_UART_RX_CONT : 0;
+	start = b->start;
+	len = min_t(size_t, b->len, count);
+	tail_len = min_t(size_t, b->tail_len - b->tail_pos, count - len);
+	memcpy(tail, b->tail + b->tail_pos, tail_len);
+	seq = tup->rx_raw_seq;
+	spin_unlock_irqrestore(&u->lock, flags);
+
+	first = min_t(unsigned int, len, TEGRA_UART_RX_DMA_BUFFER_SIZE - start);
+	if (copy_to_user(data, tup->rx_dma_buf_virt + start, first) ||
+	    copy_to_user(data + first, tup->rx_dma_buf_virt, len - first) ||
+	    copy_to_user(data + len, tail, tail_len)) {
+		mutex_unlock(&tup->rx_raw_mutex);
+		return -EFAULT;
+	}
+
+	spin_lock_irqsave(&u->lock, flags);
+	tegra_uart_rx_update(tup, false);
+	if (seq != tup->rx_raw_seq) {
+		spin_unlock_irqrestore(&u->lock, flags);
+		goto retry;
+	}
+
+	b->start = (b->start + len) % TEGRA_UART_RX_DMA_BUFFER_SIZE;
+	b->len -= len;
+	b->tail_pos += tail_len;
+	b->started = true;
+	tup->rx_raw_used -= len;
+	tup->stats.raw_bytes += len + tail_len;
+	if (tup->rx_raw_lost) {
+		hdr.flags |= TEGRA_UART_RX_LOST;
+		tup->rx_raw_lost = false;
+	}
+	if (b->closed && !b->len && b->tail_pos == b->tail_len) {
+		hdr.flags |= TEGRA_UART_RX_END;
+		tegra_uart_raw_pop(tup);
+	}
+	spin_unlock_irqrestore(&u->lock, flags);
+	mutex_unlock(&tup->rx_raw_mutex);
+
+	hdr.len = len + tail_len;
+	if (copy_to_user(buf, &hdr, sizeof(hdr)))
+		return -EFAULT;
+	return sizeof(hdr) + hdr.len;
+}
+
+static unsigned int tegra_uart_raw_poll(struct file *file, poll_table *wait)
+{
+	struct tegra_uart_port *tup = file->private_data;
+
+	poll_wait(file, &tup->rx_raw_wait, wait);
+	return tegra_uart_raw_ready(tup) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations tegra_uart_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tegra_uart_raw_open,
+	.release	= tegra_uart_raw_release,
+	.read		= tegra_uart_raw_read,
+	.poll		= tegra_uart_raw_poll,
+	.llseek		= no_llseek,
+};
+
+#ifdef CONFIG_DEBUG_FS
+static int tegra_uart_stats_show(struct seq_file *s, void *data)
+{
+	struct tegra_uart_port *tup = s->private;
+	struct tegra_uart_stats st;
+	unsigned long flags;
+	u64 elapsed, bytes;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	st = tup->stats;
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+
+	elapsed = ktime_to_ns(ktime_get()) - st.since_ns ? : 1;
+	bytes = st.dma_bytes + st.pio_bytes;
+
+	seq_printf(s, "rx_bytes_per_s  %llu\n",
+		   div64_u64(bytes * NSEC_PER_SEC, elapsed));
+	seq_printf(s, "dma_bytes       %llu\n", st.dma_bytes);
+	seq_printf(s, "pio_bytes       %llu\n", st.pio_bytes);
+	seq_printf(s, "bursts          %llu\n", st.bursts);
+	seq_printf(s, "burst_avg       %llu (max %u)\n",
+		   st.bursts ? div64_u64(bytes, st.bursts) : 0, st.burst_max);
+	seq_printf(s, "ring_max        %u/%u\n", st.ring_max,
+		   TEGRA_UART_RX_DMA_BUFFER_SIZE);
+	seq_printf(s, "period_irqs     %llu\n", st.period_irqs);
+	seq_printf(s, "eord_irqs       %llu\n", st.eord_irqs);
+	seq_printf(s, "polls           %llu\n", st.polls);
+	seq_printf(s, "fifo_overruns   %llu\n", st.fifo_overruns);
+	seq_printf(s, "tty_dropped     %llu\n", st.tty_dropped);
+	seq_printf(s, "raw_bytes       %llu\n", st.raw_bytes);
+	seq_printf(s, "raw_dropped     %llu\n", st.raw_dropped);
+	return 0;
+}
+
+static int tegra_uart_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_uart_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t tegra_uart_stats_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct tegra_uart_port *tup = s->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tup->uport.lock, flags);
+	memset(&tup->stats, 0, sizeof(tup->stats));
+	tup->stats.since_ns = ktime_to_ns(ktime_get());
+	spin_unlock_irqrestore(&tup->uport.lock, flags);
+	return count;
+}
+
+static const struct file_operations tegra_uart_stats_fops = {
+	.open		= tegra_uart_stats_open,
+	.read		= seq_read,
+	.write		= tegra_uart_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_uart_debugfs_init(struct tegra_uart_port *tup)
+{
+	tup->debugfs = debugfs_create_dir(dev_name(tup->uport.dev), NULL);
+	if (IS_ERR_OR_NULL(tup->debugfs))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, tup->debugfs,
+			    tup, &tegra_uart_stats_fops);
+}
+#else
+static inline void tegra_uart_debugfs_init(struct tegra_uart_port *tup)
+{
+}
+#endif
+
 static int tegra_uart_parse_dt(struct platform_device *pdev,
 	struct tegra_uart_port *tup)
 {
@@ -1323,6 +1889,14 @@ board_file:
 		tup->dma_req_sel = pdata->dma_req_selector;
 	}
 
+	mutex_init(&tup->rx_raw_mutex);
+	init_waitqueue_head(&tup->rx_raw_wait);
+	hrtimer_init(&tup->rx_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tup->rx_poll_timer.function = tegra_uart_rx_poll;
+	hrtimer_init(&tup->rx_drain_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tup->rx_drain_timer.function = tegra_uart_rx_drain;
+	tup->stats.since_ns = ktime_to_ns(ktime_get());
+
 	u = &tup->uport;
 	u->dev = &pdev->dev;
 	u->ops = &tegra_uart_ops;
@@ -1356,6 +1930,22 @@ board_file:
 		dev_err(&pdev->dev, "Failed to add uart port, err %d\n", ret);
 		return ret;
 	}
+
+	snprintf(tup->rx_raw_name, sizeof(tup->rx_raw_name), "%s%d_rx",
+		 tegra_uart_driver.dev_name, u->line);
+	tup->rx_raw_dev.minor = MISC_DYNAMIC_MINOR;
+	tup->rx_raw_dev.name = tup->rx_raw_name;
+	tup->rx_raw_dev.fops = &tegra_uart_raw_fops;
+	tup->rx_raw_dev.parent = &pdev->dev;
+	ret = misc_register(&tup->rx_raw_dev);
+	if (ret < 0) {
+		dev_err(&pdev->dev, "Failed to add raw Rx device, err %d\n",
+			ret);
+		uart_remove_one_port(&tegra_uart_driver, u);
+		return ret;
+	}
+	tegra_uart_debugfs_init(tup);
+
 	u->state->port.low_latency = 1;
         printk(KERN_ERR "***dji latency 1\n");
 	return ret;
@@ -1366,6 +1956,8 @@ static int tegra_uart_remove(struct platform_device *pdev)
 	struct tegra_uart_port *tup = platform_get_drvdata(pdev);
 	struct uart_port *u = &tup->uport;
 
+	debugfs_remove_recursive(tup->debugfs);
+	misc_deregister(&tup->rx_raw_dev);
 	uart_remove_one_port(&tegra_uart_driver, u);
 	return 0;
 }
@@ -24,6 +24,9 @@
 #include <linux/pagemap.h>
 #include <linux/export.h>
 #include <linux/hid.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/ktime.h>
 #include <asm/unaligned.h>
 
 #include <linux/usb/composite.h>
@@ -327,6 +330,39 @@ struct ffs_epfile {
 	unsigned char			isoc;	/* P: ffs->eps_lock */
 
 	unsigned char			_pad;
+
+	/*
+	 * Protects dmabufs, queued and stats.  Nests inside
+	 * ffs->eps_lock.
+	 */
+	spinlock_t			lock;
+	struct list_head		dmabufs;
+	wait_queue_head_t		dmabuf_wait;
+	/* transfers queued on the endpoint through this file */
+	unsigned			queued;
+	struct usb_ffs_ep_stats		stats;
+	u64				stats_since_ns;
+};
+
+/* A dma-buf attached to an endpoint file for zero-copy transfers */
+struct ffs_dmabuf {
+	struct list_head		list;	/* P: epfile->lock */
+	struct ffs_epfile		*epfile;
+	/* the file it was attached through, detached on its release */
+	struct file			*file;
+
+	struct dma_buf			*dmabuf;
+	struct dma_buf_attachment	*attach;
+	struct sg_table			*sgt;
+	/* pages of sgt for scatter-gather controllers, which map it again */
+	struct sg_table			req_sgt;
+
+	/* allocated on first transfer, for the endpoint then in use */
+	struct usb_ep			*ep;
+	struct usb_request		*req;
+
+	bool				busy;	/* P: epfile->lock */
+	int				status;	/* P: epfile->lock */
 };
 
 static int  __must_check ffs_epfiles_create(struct ffs_data *ffs);
@@ -754,6 +790,30 @@ static void ffs_epfile_io_complete(struct usb_ep *_ep, struct usb_request *req)
 	}
 }
 
+/* A transfer queued through epfile has finished with status */
+static void __ffs_epfile_account(struct ffs_epfile *epfile, int status)
+{
+	struct usb_ffs_ep_stats *st = &epfile->stats;
+
+	epfile->queued--;
+	if (status < 0) {
+		st->errors++;
+		return;
+	}
+
+	st->transfers++;
+	st->bytes += status;
+	if (!epfile->queued)
+		st->underruns++;
+}
+
+static void ffs_epfile_account(struct ffs_epfile *epfile, int status)
+{
+	spin_lock_irq(&epfile->lock);
+	__ffs_epfile_account(epfile, status);
+	spin_unlock_irq(&epfile->lock);
+}
+
 static ssize_t ffs_epfile_io(struct file *file,
 			     char __user *buf, size_t len, int read)
 {
@@ -845,6 +905,11 @@ first_try:
 		req->length   = len;
 
 		ret = usb_ep_queue(ep->ep, req, GFP_ATOMIC);
+		if (likely(ret >= 0)) {
+			spin_lock(&epfile->lock);
+			epfile->queued++;
+			spin_unlock(&epfile->lock);
+		}
 
 		spin_unlock_irq(&epfile->ffs->eps_lock);
 
@@ -853,8 +918,10 @@ first_try:
 		} else if (unlikely(wait_for_completion_interruptible(&done))) {
 			ret = -EINTR;
 			usb_ep_dequeue(ep->ep, req);
+			ffs_epfile_account(epfile, ret);
 		} else {
 			ret = ep->status;
+			ffs_epfile_account(epfile, ret);
 			if (read && ret > 0 &&
 			    unlikely(copy_to_user(buf, data, ret)))
 				ret = -EFAULT;
@@ -900,13 +967,397 @@ ffs_epfile_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* dma-buf zero-copy transfers *********************************************/
+
+static void ffs_dmabuf_complete(struct usb_ep *_ep, struct usb_request *req)
+{
+	struct ffs_dmabuf *priv = req->context;
+	struct ffs_epfile *epfile = priv->epfile;
+	unsigned long flags;
+
+	spin_lock_irqsave(&epfile->lock, flags);
+	priv->status = req->status ? req->status : req->actual;
+	priv->busy = false;
+	__ffs_epfile_account(epfile, priv->status);
+	spin_unlock_irqrestore(&epfile->lock, flags);
+
+	wake_up_all(&epfile->dmabuf_wait);
+}
+
+/* Called with epfile->lock held */
+static struct ffs_dmabuf *ffs_dmabuf_find(struct ffs_epfile *epfile,
+					  struct file *file,
+					  struct dma_buf *dmabuf)
+{
+	struct ffs_dmabuf *priv;
+
+	list_for_each_entry(priv, &epfile->dmabufs, list)
+		if (priv->file == file && priv->dmabuf == dmabuf)
+			return priv;
+	return NULL;
+}
+
+/*
+ * The exporter's table already holds the addresses mapped for the
+ * attachment; mapping it again for a request would overwrite them.
+ */
+static int ffs_dmabuf_copy_sgt(struct ffs_dmabuf *priv)
+{
+	struct scatterlist *src, *dst;
+	unsigned i;
+	int ret;
+
+	ret = sg_alloc_table(&priv->req_sgt, priv->sgt->orig_nents,
+			     GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	dst = priv->req_sgt.sgl;
+	for_each_sg(priv->sgt->sgl, src, priv->sgt->orig_nents, i) {
+		sg_set_page(dst, sg_page(src), src->length, src->offset);
+		dst = sg_next(dst);
+	}
+	return 0;
+}
+
+static int ffs_dmabuf_attach(struct file *file, int fd)
+{
+	struct ffs_epfile *epfile = file->private_data;
+	struct usb_gadget *gadget = epfile->ffs->gadget;
+	struct ffs_dmabuf *priv;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	if (!gadget)
+		return -ENODEV;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+
+	/* the controller maps requests against its parent device */
+	priv->attach = dma_buf_attach(dmabuf, gadget->dev.parent);
+	if (IS_ERR(priv->attach)) {
+		ret = PTR_ERR(priv->attach);
+		goto err_free;
+	}
+
+	priv->sgt = dma_buf_map_attachment(priv->attach, DMA_BIDIRECTIONAL);
+	if (IS_ERR(priv->sgt)) {
+		ret = PTR_ERR(priv->sgt);
+		goto err_detach;
+	}
+
+	ret = ffs_dmabuf_copy_sgt(priv);
+	if (ret)
+		goto err_unmap;
+
+	priv->epfile = epfile;
+	priv->file = file;
+	priv->dmabuf = dmabuf;
+
+	spin_lock_irq(&epfile->lock);
+	if (ffs_dmabuf_find(epfile, file, dmabuf)) {
+		spin_unlock_irq(&epfile->lock);
+		ret = -EEXIST;
+		goto err_unmap;
+	}
+	list_add_tail(&priv->list, &epfile->dmabufs);
+	spin_unlock_irq(&epfile->lock);
+
+	return 0;
+
+err_unmap:
+	sg_free_table(&priv->req_sgt);
+	dma_buf_unmap_attachment(priv->attach, priv->sgt, DMA_BIDIRECTIONAL);
+err_detach:
+	dma_buf_detach(dmabuf, priv->attach);
+err_free:
+	kfree(priv);
+err_put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+/* Cancel any transfer in flight and drop the buffer */
+static void ffs_dmabuf_release(struct ffs_dmabuf *priv)
+{
+	struct ffs_epfile *epfile = priv->epfile;
+	struct ffs_data *ffs = epfile->ffs;
+
+	spin_lock_irq(&ffs->eps_lock);
+	if (priv->busy && epfile->ep && epfile->ep->ep == priv->ep)
+		usb_ep_dequeue(priv->ep, priv->req);
+	spin_unlock_irq(&ffs->eps_lock);
+
+	wait_event(epfile->dmabuf_wait, !ACCESS_ONCE(priv->busy));
+
+	if (priv->req)
+		usb_ep_free_request(priv->ep, priv->req);
+	sg_free_table(&priv->req_sgt);
+	dma_buf_unmap_attachment(priv->attach, priv->sgt, DMA_BIDIRECTIONAL);
+	dma_buf_detach(priv->dmabuf, priv->attach);
+	dma_buf_put(priv->dmabuf);
+	kfree(priv);
+}
+
+static int ffs_dmabuf_detach(struct file *file, int fd)
+{
+	struct ffs_epfile *epfile = file->private_data;
+	struct ffs_dmabuf *priv;
+	struct dma_buf *dmabuf;
+	int ret = 0;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	spin_lock_irq(&epfile->lock);
+	priv = ffs_dmabuf_find(epfile, file, dmabuf);
+	if (!priv)
+		ret = -ENOENT;
+	else if (priv->busy)
+		ret = -EBUSY;
+	else
+		list_del(&priv->list);
+	spin_unlock_irq(&epfile->lock);
+
+	if (!ret)
+		ffs_dmabuf_release(priv);
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+/*
+ * Point req at the buffer.  Scatter-gather controllers map their own copy
+ * of the table, see ffs_dmabuf_copy_sgt().  The others get the DMA address
+ * directly, which only works if the buffer is mapped to a single range.
+ */
+static int ffs_dmabuf_prep_request(struct ffs_dmabuf *priv,
+				   struct usb_gadget *gadget, size_t len)
+{
+	struct usb_request *req = priv->req;
+	struct scatterlist *sg;
+	dma_addr_t next;
+	unsigned i;
+
+	req->length = len;
+	if (gadget->sg_supported) {
+		req->sg = priv->req_sgt.sgl;
+		req->num_sgs = priv->req_sgt.nents;
+		return 0;
+	}
+
+	next = sg_dma_address(priv->sgt->sgl);
+	for_each_sg(priv->sgt->sgl, sg, priv->sgt->nents, i) {
+		if (next >= sg_dma_address(priv->sgt->sgl) + len)
+			break;
+		if (sg_dma_address(sg) != next)
+			return -EINVAL;
+		next += sg_dma_len(sg);
+	}
+
+	req->buf = NULL;
+	req->dma = sg_dma_address(priv->sgt->sgl);
+	return 0;
+}
+
+static int ffs_dmabuf_transfer(struct file *file,
+			       const struct usb_ffs_dmabuf_transfer_req *xfer)
+{
+	struct ffs_epfile *epfile = file->private_data;
+	struct ffs_data *ffs = epfile->ffs;
+	struct ffs_dmabuf *priv;
+	struct dma_buf *dmabuf;
+	struct ffs_ep *ep;
+	int ret = 0;
+
+	if (xfer->flags || !xfer->length)
+		return -EINVAL;
+
+	dmabuf = dma_buf_get(xfer->fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	if (xfer->length > dmabuf->size) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	spin_lock_irq(&ffs->eps_lock);
+	ep = epfile->ep;
+	if (!ep || !ffs->gadget) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* Claim the buffer; being busy also keeps it from being detached */
+	spin_lock(&epfile->lock);
+	priv = ffs_dmabuf_find(epfile, file, dmabuf);
+	if (!priv)
+		ret = -ENOENT;
+	else if (priv->busy)
+		ret = -EBUSY;
+	else
+		priv->busy = true;
+	spin_unlock(&epfile->lock);
+	if (ret)
+		goto out;
+
+	/* Requests belong to an endpoint, reallocate if it has changed */
+	if (priv->ep != ep->ep) {
+		if (priv->req)
+			usb_ep_free_request(priv->ep, priv->req);
+		priv->ep = ep->ep;
+		priv->req = usb_ep_alloc_request(ep->ep, GFP_ATOMIC);
+		if (priv->req) {
+			priv->req->complete = ffs_dmabuf_complete;
+			priv->req->context = priv;
+		}
+	}
+
+	if (!priv->req)
+		ret = -ENOMEM;
+	else
+		ret = ffs_dmabuf_prep_request(priv, ffs->gadget,
+					      xfer->length);
+
+	if (!ret) {
+		spin_lock(&epfile->lock);
+		epfile->queued++;
+		spin_unlock(&epfile->lock);
+
+		ret = usb_ep_queue(ep->ep, priv->req, GFP_ATOMIC);
+		if (ret) {
+			spin_lock(&epfile->lock);
+			epfile->queued--;
+			spin_unlock(&epfile->lock);
+		}
+	}
+
+	if (ret) {
+		spin_lock(&epfile->lock);
+		priv->busy = false;
+		spin_unlock(&epfile->lock);
+	}
+out:
+	spin_unlock_irq(&ffs->eps_lock);
+out_put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+/* Has the buffer's transfer finished?  Fills in its result if so. */
+static bool ffs_dmabuf_done(struct ffs_epfile *epfile, struct file *file,
+			    struct dma_buf *dmabuf, int *status)
+{
+	struct ffs_dmabuf *priv;
+	bool done = true;
+
+	spin_lock_irq(&epfile->lock);
+	priv = ffs_dmabuf_find(epfile, file, dmabuf);
+	if (!priv)
+		*status = -ENOENT;
+	else if (priv->busy)
+		done = false;
+	else
+		*status = priv->status;
+	spin_unlock_irq(&epfile->lock);
+
+	return done;
+}
+
+static int ffs_dmabuf_wait(struct file *file, int fd)
+{
+	struct ffs_epfile *epfile = file->private_data;
+	struct dma_buf *dmabuf;
+	int status, ret;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	if (file->f_flags & O_NONBLOCK)
+		ret = ffs_dmabuf_done(epfile, file, dmabuf, &status) ?
+			0 : -EAGAIN;
+	else
+		ret = wait_event_interruptible(epfile->dmabuf_wait,
+				ffs_dmabuf_done(epfile, file, dmabuf, &status));
+
+	dma_buf_put(dmabuf);
+	return ret ? ret : status;
+}
+
+static int ffs_epfile_stats(struct ffs_epfile *epfile, void __user *arg)
+{
+	struct usb_ffs_ep_stats st;
+	u64 now = ktime_to_ns(ktime_get());
+
+	spin_lock_irq(&epfile->lock);
+	st = epfile->stats;
+	st.elapsed_ns = now - epfile->stats_since_ns;
+	memset(&epfile->stats, 0, sizeof(epfile->stats));
+	epfile->stats_since_ns = now;
+	spin_unlock_irq(&epfile->lock);
+
+	return copy_to_user(arg, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+static long ffs_epfile_dmabuf_ioctl(struct file *file, unsigned code,
+				    unsigned long value)
+{
+	struct usb_ffs_dmabuf_transfer_req xfer;
+	void __user *arg = (void __user *)value;
+	int fd;
+
+	switch (code) {
+	case FUNCTIONFS_DMABUF_TRANSFER:
+		if (copy_from_user(&xfer, arg, sizeof(xfer)))
+			return -EFAULT;
+		return ffs_dmabuf_transfer(file, &xfer);
+	case FUNCTIONFS_ENDPOINT_STATS:
+		return ffs_epfile_stats(file->private_data, arg);
+	}
+
+	if (get_user(fd, (int __user *)arg))
+		return -EFAULT;
+
+	switch (code) {
+	case FUNCTIONFS_DMABUF_ATTACH:
+		return ffs_dmabuf_attach(file, fd);
+	case FUNCTIONFS_DMABUF_DETACH:
+		return ffs_dmabuf_detach(file, fd);
+	case FUNCTIONFS_DMABUF_WAIT:
+		return ffs_dmabuf_wait(file, fd);
+	}
+
+	return -ENOTTY;
+}
+
 static int
 ffs_epfile_release(struct inode *inode, struct file *file)
 {
 	struct ffs_epfile *epfile = inode->i_private;
+	struct ffs_dmabuf *priv, *tmp;
+	LIST_HEAD(dmabufs);
 
 	ENTER();
 
+	spin_lock_irq(&epfile->lock);
+	list_for_each_entry_safe(priv, tmp, &epfile->dmabufs, list)
+		if (priv->file == file)
+			list_move_tail(&priv->list, &dmabufs);
+	spin_unlock_irq(&epfile->lock);
+
+	list_for_each_entry_safe(priv, tmp, &dmabufs, list)
+		ffs_dmabuf_release(priv);
+
 	ffs_data_closed(epfile->ffs);
 
 	return 0;
@@ -923,6 +1374,15 @@ static long ffs_epfile_ioctl(struct file *file, unsigned code,
 	if (WARN_ON(epfile->ffs->state != FFS_ACTIVE))
 		return -ENODEV;
 
+	switch (code) {
+	case FUNCTIONFS_DMABUF_ATTACH:
+	case FUNCTIONFS_DMABUF_DETACH:
+	case FUNCTIONFS_DMABUF_TRANSFER:
+	case FUNCTIONFS_DMABUF_WAIT:
+	case FUNCTIONFS_ENDPOINT_STATS:
+		return ffs_epfile_dmabuf_ioctl(file, code, value);
+	}
+
 	spin_lock_irq(&epfile->ffs->eps_lock);
 	if (likely(epfile->ep)) {
 		switch (code) {
@@ -1439,6 +1899,10 @@ static int ffs_epfiles_create(struct ffs_data *ffs)
 		epfile->ffs = ffs;
 		mutex_init(&epfile->mutex);
 		init_waitqueue_head(&epfile->wait);
+		spin_lock_init(&epfile->lock);
+		INIT_LIST_HEAD(&epfile->dmabufs);
+		init_waitqueue_head(&epfile->dmabuf_wait);
+		epfile->stats_since_ns = ktime_to_ns(ktime_get());
 		sprintf(epfiles->name, "ep%u",  i);
 		if (!unlikely(ffs_sb_create_file(ffs->sb, epfiles->name, epfile,
 						 &ffs_epfile_operations,
@@ -11,11 +11,13 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/seq_file.h>
 #include <linux/string.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
@@ -45,6 +47,10 @@ static unsigned int streaming_maxburst;
 module_param(streaming_maxburst, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(streaming_maxburst, "0 - 15 (ss only)");
 
+static unsigned int streaming_requests = UVC_NUM_REQUESTS;
+module_param(streaming_requests, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(streaming_requests, "2 - 32 USB requests kept in flight");
+
 /* --------------------------------------------------------------------------
  * Function descriptors
  */
@@ -561,6 +567,91 @@ uvc_copy_descriptors(struct uvc_device *uvc, enum usb_device_speed speed)
 	return hdr;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int uvc_stats_show(struct seq_file *s, void *unused)
+{
+	struct uvc_video *video = s->private;
+	struct uvc_video_stats st;
+	unsigned long flags;
+	u64 elapsed, bw;
+
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	st = video->stats;
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+
+	elapsed = ktime_to_ns(ktime_get()) - st.since_ns ? : 1;
+	bw = div64_u64(st.bytes * NSEC_PER_MSEC, elapsed);	/* kB/s */
+
+	seq_printf(s, "scatter_gather  %u\n", video->queue.use_sg);
+	seq_printf(s, "num_requests    %u\n", video->num_requests);
+	seq_printf(s, "req_size        %u\n", video->req_size);
+	seq_printf(s, "requests        %llu\n", st.requests);
+	seq_printf(s, "bytes           %llu\n", st.bytes);
+	seq_printf(s, "frames          %llu\n", st.frames);
+	seq_printf(s, "underruns       %llu\n", st.underruns);
+	seq_printf(s, "errors          %llu\n", st.errors);
+	seq_printf(s, "bandwidth_kBps  %llu\n", bw);
+	return 0;
+}
+
+static int uvc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uvc_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t uvc_stats_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct uvc_video *video = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	memset(&video->stats, 0, sizeof(video->stats));
+	video->stats.since_ns = ktime_to_ns(ktime_get());
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+	return count;
+}
+
+static const struct file_operations uvc_stats_fops = {
+	.open		= uvc_stats_open,
+	.read		= seq_read,
+	.write		= uvc_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void uvc_debugfs_init(struct uvc_device *uvc)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "uvc-%s",
+		 video_device_node_name(uvc->vdev));
+	uvc->debugfs_dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(uvc->debugfs_dir)) {
+		uvc->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, uvc->debugfs_dir,
+			    &uvc->video, &uvc_stats_fops);
+}
+
+static void uvc_debugfs_exit(struct uvc_device *uvc)
+{
+	debugfs_remove_recursive(uvc->debugfs_dir);
+}
+#else
+static inline void uvc_debugfs_init(struct uvc_device *uvc)
+{
+}
+
+static inline void uvc_debugfs_exit(struct uvc_device *uvc)
+{
+}
+#endif
+
 static void
 uvc_function_unbind(struct usb_configuration *c, struct usb_function *f)
 {
@@ -569,7 +660,9 @@ uvc_function_unbind(struct usb_configuration *c, struct usb_function *f)
 
 	INFO(cdev, "uvc_function_unbind\n");
 
+	uvc_debugfs_exit(uvc);
 	video_unregister_device(uvc->vdev);
+	uvc_video_free_requests(&uvc->video);
 	uvc->control_ep->driver_data = NULL;
 	uvc->video.ep->driver_data = NULL;
 
@@ -697,10 +790,14 @@ uvc_function_bind(struct usb_configuration *c, struct usb_function *f)
 	if ((ret = usb_function_deactivate(f)) < 0)
 		goto error;
 
-	/* Initialise video. */
-	ret = uvc_video_init(&uvc->video);
+	/* Initialise video, pointing requests at the video buffers
+	 * directly if the controller can gather them.
+	 */
+	ret = uvc_video_init(&uvc->video, cdev->gadget->sg_supported);
 	if (ret < 0)
 		goto error;
+	uvc->video.num_requests = clamp(streaming_requests, 2U,
+					(unsigned int)UVC_MAX_NUM_REQUESTS);
 
 	/* Register a V4L2 device. */
 	ret = uvc_register_video(uvc);
@@ -709,6 +806,7 @@ uvc_function_bind(struct usb_configuration *c, struct usb_function *f)
 		goto error;
 	}
 
+	uvc_debugfs_init(uvc);
 	return 0;
 
 error:
@@ -99,13 +99,40 @@ extern unsigned int uvc_gadget_trace_param;
 #define DRIVER_VERSION_NUMBER			KERNEL_VERSION(0, 1, 0)
 
 #define UVC_NUM_REQUESTS			4
+#define UVC_MAX_NUM_REQUESTS			32
 #define UVC_MAX_REQUEST_SIZE			64
+#define UVC_MAX_HEADER_SIZE			12
 #define UVC_MAX_EVENTS				4
 
 /* ------------------------------------------------------------------------
  * Structures
  */
 
+struct uvc_video;
+
+struct uvc_request
+{
+	struct usb_request *req;
+	__u8 *req_buffer;
+	struct uvc_video *video;
+
+	/* Header and payload pages, for controllers doing scatter-gather */
+	struct scatterlist *sgl;
+	/* Video buffer still referenced by sgl, returned on completion */
+	struct uvc_buffer *last_buf;
+};
+
+/* Streaming counters, protected by the video queue irqlock */
+struct uvc_video_stats
+{
+	u64 since_ns;
+	u64 requests;
+	u64 bytes;
+	u64 frames;
+	u64 underruns;
+	u64 errors;
+};
+
 struct uvc_video
 {
 	struct usb_ep *ep;
@@ -117,14 +144,15 @@ struct uvc_video
 	unsigned int height;
 	unsigned int imagesize;
 
-	/* Requests */
+	/* Requests, allocated on first use and kept while their size fits */
 	unsigned int req_size;
-	struct usb_request *req[UVC_NUM_REQUESTS];
-	__u8 *req_buffer[UVC_NUM_REQUESTS];
+	unsigned int num_requests;
+	unsigned int req_sg_entries;
+	struct uvc_request ureq[UVC_MAX_NUM_REQUESTS];
 	struct list_head req_free;
 	spinlock_t req_lock;
 
-	void (*encode) (struct usb_request *req, struct uvc_video *video,
+	void (*encode) (struct uvc_request *ureq, struct uvc_video *video,
 			struct uvc_buffer *buf);
 
 	/* Context data used by the completion handler */
@@ -133,6 +161,8 @@ struct uvc_video
 
 	struct uvc_video_queue queue;
 	unsigned int fid;
+
+	struct uvc_video_stats stats;
 };
 
 enum uvc_state
@@ -168,6 +198,10 @@ struct uvc_device
 	/* Events */
 	unsigned int event_length;
 	unsigned int event_setup_out : 1;
+
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debugfs_dir;
+#endif
 };
 
 static inline struct uvc_device *to_uvc(struct usb_function *f)
@@ -20,6 +20,7 @@
 #include <linux/vmalloc.h>
 #include <linux/wait.h>
 
+#include <media/videobuf2-dma-sg.h>
 #include <media/videobuf2-vmalloc.h>
 
 #include "uvc.h"
@@ -73,6 +74,8 @@ static int uvc_buffer_prepare(struct vb2_buffer *vb)
 
 	buf->state = UVC_BUF_STATE_QUEUED;
 	buf->mem = vb2_plane_vaddr(vb, 0);
+	if (queue->use_sg)
+		buf->sgl = vb2_dma_sg_plane_desc(vb, 0)->sglist;
 	buf->length = vb2_plane_size(vb, 0);
 	if (vb->v4l2_buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		buf->bytesused = 0;
@@ -109,8 +112,12 @@ static struct vb2_ops uvc_queue_qops = {
 	.buf_queue = uvc_buffer_queue,
 };
 
+/*
+ * With use_sg the buffers are made of pages the USB requests can point to
+ * directly, instead of vmalloc memory their data has to be copied out of.
+ */
 static int uvc_queue_init(struct uvc_video_queue *queue,
-			  enum v4l2_buf_type type)
+			  enum v4l2_buf_type type, bool use_sg)
 {
 	int ret;
 
@@ -119,7 +126,9 @@ static int uvc_queue_init(struct uvc_video_queue *queue,
 	queue->queue.drv_priv = queue;
 	queue->queue.buf_struct_size = sizeof(struct uvc_buffer);
 	queue->queue.ops = &uvc_queue_qops;
-	queue->queue.mem_ops = &vb2_vmalloc_memops;
+	queue->queue.mem_ops = use_sg ? &vb2_dma_sg_memops
+				      : &vb2_vmalloc_memops;
+	queue->use_sg = use_sg;
 	ret = vb2_queue_init(&queue->queue);
 	if (ret)
 		return ret;
@@ -343,6 +352,27 @@ done:
 	return ret;
 }
 
+/*
+ * Return a buffer already removed from the irq queue to userspace.
+ * Called with &queue_irqlock held.
+ */
+static void uvc_queue_buffer_done(struct uvc_video_queue *queue,
+				  struct uvc_buffer *buf,
+				  enum vb2_buffer_state state)
+{
+	/*
+	 * FIXME: with videobuf2, the sequence number or timestamp fields
+	 * are valid only for video capture devices and the UVC gadget usually
+	 * is a video output device. Keeping these until the specs are clear on
+	 * this aspect.
+	 */
+	buf->buf.v4l2_buf.sequence = queue->sequence++;
+	do_gettimeofday(&buf->buf.v4l2_buf.timestamp);
+
+	vb2_set_plane_payload(&buf->buf, 0, buf->bytesused);
+	vb2_buffer_done(&buf->buf, state);
+}
+
 /* called with &queue_irqlock held.. */
 static struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 						struct uvc_buffer *buf)
@@ -363,17 +393,7 @@ static struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 	else
 		nextbuf = NULL;
 
-	/*
-	 * FIXME: with videobuf2, the sequence number or timestamp fields
-	 * are valid only for video capture devices and the UVC gadget usually
-	 * is a video output device. Keeping these until the specs are clear on
-	 * this aspect.
-	 */
-	buf->buf.v4l2_buf.sequence = queue->sequence++;
-	do_gettimeofday(&buf->buf.v4l2_buf.timestamp);
-
-	vb2_set_plane_payload(&buf->buf, 0, buf->bytesused);
-	vb2_buffer_done(&buf->buf, VB2_BUF_STATE_DONE);
+	uvc_queue_buffer_done(queue, buf, VB2_BUF_STATE_DONE);
 
 	return nextbuf;
 }
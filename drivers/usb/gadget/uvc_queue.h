@@ -31,6 +31,7 @@ struct uvc_buffer {
 
 	enum uvc_buffer_state state;
 	void *mem;
+	struct scatterlist *sgl;
 	unsigned int length;
 	unsigned int bytesused;
 };
@@ -47,6 +48,10 @@ struct uvc_video_queue {
 	__u32 sequence;
 
 	unsigned int buf_used;
+	/* Position of buf_used in the buffer pages, for use_sg */
+	struct scatterlist *buf_sg;
+	unsigned int buf_sg_offset;
+	bool use_sg;
 
 	spinlock_t irqlock;	/* Protects flags and irqqueue */
 	struct list_head irqqueue;
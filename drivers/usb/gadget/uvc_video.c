@@ -13,6 +13,9 @@
 #include <linux/kernel.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
 
@@ -38,17 +41,67 @@ uvc_video_encode_header(struct uvc_video *video, struct uvc_buffer *buf,
 	return 2;
 }
 
+/*
+ * Point the request at the next nbytes of video data, after the header
+ * already written to the request buffer up to data.
+ */
+static void
+uvc_video_encode_data_sg(struct uvc_video *video, struct uvc_request *ureq,
+		struct uvc_buffer *buf, u8 *data, unsigned int nbytes)
+{
+	struct uvc_video_queue *queue = &video->queue;
+	struct usb_request *req = ureq->req;
+	struct scatterlist *sg = ureq->sgl;
+	unsigned int nents = 0;
+	unsigned int part;
+
+	sg_init_table(sg, video->req_sg_entries);
+	if (data != ureq->req_buffer)
+		sg_set_buf(&sg[nents++], ureq->req_buffer,
+			   data - ureq->req_buffer);
+
+	if (queue->buf_used == 0) {
+		queue->buf_sg = buf->sgl;
+		queue->buf_sg_offset = 0;
+	}
+
+	while (nbytes) {
+		part = min(nbytes, queue->buf_sg->length -
+				   queue->buf_sg_offset);
+		sg_set_page(&sg[nents++], sg_page(queue->buf_sg), part,
+			    queue->buf_sg->offset + queue->buf_sg_offset);
+
+		nbytes -= part;
+		queue->buf_used += part;
+		queue->buf_sg_offset += part;
+		if (queue->buf_sg_offset == queue->buf_sg->length) {
+			queue->buf_sg = sg_next(queue->buf_sg);
+			queue->buf_sg_offset = 0;
+		}
+	}
+
+	if (nents)
+		sg_mark_end(&sg[nents - 1]);
+	req->sg = sg;
+	req->num_sgs = nents;
+}
+
 static int
-uvc_video_encode_data(struct uvc_video *video, struct uvc_buffer *buf,
-		u8 *data, int len)
+uvc_video_encode_data(struct uvc_video *video, struct uvc_request *ureq,
+		struct uvc_buffer *buf, u8 *data, int len)
 {
 	struct uvc_video_queue *queue = &video->queue;
 	unsigned int nbytes;
 	void *mem;
 
+	nbytes = min((unsigned int)len, buf->bytesused - queue->buf_used);
+	if (queue->use_sg) {
+		uvc_video_encode_data_sg(video, ureq, buf, data, nbytes);
+		return nbytes;
+	}
+
 	/* Copy video data to the USB buffer. */
 	mem = buf->mem + queue->buf_used;
-	nbytes = min((unsigned int)len, buf->bytesused - queue->buf_used);
 
 	memcpy(data, mem, nbytes);
 	queue->buf_used += nbytes;
@@ -56,11 +109,31 @@ uvc_video_encode_data(struct uvc_video *video, struct uvc_buffer *buf,
 	return nbytes;
 }
 
+/*
+ * The buffer has been fully encoded.  Copied data lets it go back to
+ * userspace at once; with scatter-gather the request still points into it,
+ * so it is returned when the request completes.
+ */
 static void
-uvc_video_encode_bulk(struct usb_request *req, struct uvc_video *video,
+uvc_video_buffer_encoded(struct uvc_video *video, struct uvc_request *ureq,
 		struct uvc_buffer *buf)
 {
-	void *mem = req->buf;
+	video->stats.frames++;
+	if (!video->queue.use_sg) {
+		uvc_queue_next_buffer(&video->queue, buf);
+		return;
+	}
+
+	list_del(&buf->queue);
+	ureq->last_buf = buf;
+}
+
+static void
+uvc_video_encode_bulk(struct uvc_request *ureq, struct uvc_video *video,
+		struct uvc_buffer *buf)
+{
+	struct usb_request *req = ureq->req;
+	void *mem = ureq->req_buffer;
 	int len = video->req_size;
 	int ret;
 
@@ -74,7 +147,7 @@ uvc_video_encode_bulk(struct usb_request *req, struct uvc_video *video,
 
 	/* Process video data. */
 	len = min((int)(video->max_payload_size - video->payload_size), len);
-	ret = uvc_video_encode_data(video, buf, mem, len);
+	ret = uvc_video_encode_data(video, ureq, buf, mem, len);
 
 	video->payload_size += ret;
 	len -= ret;
@@ -85,7 +158,7 @@ uvc_video_encode_bulk(struct usb_request *req, struct uvc_video *video,
 	if (buf->bytesused == video->queue.buf_used) {
 		video->queue.buf_used = 0;
 		buf->state = UVC_BUF_STATE_DONE;
-		uvc_queue_next_buffer(&video->queue, buf);
+		uvc_video_buffer_encoded(video, ureq, buf);
 		video->fid ^= UVC_STREAM_FID;
 
 		video->payload_size = 0;
@@ -97,10 +170,11 @@ uvc_video_encode_bulk(struct usb_request *req, struct uvc_video *video,
 }
 
 static void
-uvc_video_encode_isoc(struct usb_request *req, struct uvc_video *video,
+uvc_video_encode_isoc(struct uvc_request *ureq, struct uvc_video *video,
 		struct uvc_buffer *buf)
 {
-	void *mem = req->buf;
+	struct usb_request *req = ureq->req;
+	void *mem = ureq->req_buffer;
 	int len = video->req_size;
 	int ret;
 
@@ -110,7 +184,7 @@ uvc_video_encode_isoc(struct usb_request *req, struct uvc_video *video,
 	len -= ret;
 
 	/* Process video data. */
-	ret = uvc_video_encode_data(video, buf, mem, len);
+	ret = uvc_video_encode_data(video, ureq, buf, mem, len);
 	len -= ret;
 
 	req->length = video->req_size - len;
@@ -118,7 +192,7 @@ uvc_video_encode_isoc(struct usb_request *req, struct uvc_video *video,
 	if (buf->bytesused == video->queue.buf_used) {
 		video->queue.buf_used = 0;
 		buf->state = UVC_BUF_STATE_DONE;
-		uvc_queue_next_buffer(&video->queue, buf);
+		uvc_video_buffer_encoded(video, ureq, buf);
 		video->fid ^= UVC_STREAM_FID;
 	}
 }
@@ -156,16 +230,34 @@ uvc_video_encode_isoc(struct usb_request *req, struct uvc_video *video,
  * paused flag will be set. Right after releasing the spinlock a userspace
  * application can queue a buffer. The flag will then cleared, and the ioctl
  * handler will restart the video stream.
+ *
+ * A request completing with no video buffer to refill it counts as an
+ * underrun: the endpoint has one request less to keep the host busy with.
  */
 static void
 uvc_video_complete(struct usb_ep *ep, struct usb_request *req)
 {
-	struct uvc_video *video = req->context;
+	struct uvc_request *ureq = req->context;
+	struct uvc_video *video = ureq->video;
 	struct uvc_video_queue *queue = &video->queue;
 	struct uvc_buffer *buf;
 	unsigned long flags;
 	int ret;
 
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (req->status == 0) {
+		video->stats.requests++;
+		video->stats.bytes += req->actual;
+	} else {
+		video->stats.errors++;
+	}
+	if (ureq->last_buf) {
+		uvc_queue_buffer_done(queue, ureq->last_buf, req->status ?
+				      VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+		ureq->last_buf = NULL;
+	}
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
 	switch (req->status) {
 	case 0:
 		break;
@@ -185,11 +277,12 @@ uvc_video_complete(struct usb_ep *ep, struct usb_request *req)
 	spin_lock_irqsave(&video->queue.irqlock, flags);
 	buf = uvc_queue_head(&video->queue);
 	if (buf == NULL) {
+		video->stats.underruns++;
 		spin_unlock_irqrestore(&video->queue.irqlock, flags);
 		goto requeue;
 	}
 
-	video->encode(req, video, buf);
+	video->encode(ureq, video, buf);
 
 	if ((ret = usb_ep_queue(ep, req, GFP_ATOMIC)) < 0) {
 		printk(KERN_INFO "Failed to queue request (%d).\n", ret);
@@ -210,18 +303,20 @@ requeue:
 static int
 uvc_video_free_requests(struct uvc_video *video)
 {
+	struct uvc_request *ureq;
 	unsigned int i;
 
-	for (i = 0; i < UVC_NUM_REQUESTS; ++i) {
-		if (video->req[i]) {
-			usb_ep_free_request(video->ep, video->req[i]);
-			video->req[i] = NULL;
+	for (i = 0; i < UVC_MAX_NUM_REQUESTS; ++i) {
+		ureq = &video->ureq[i];
+		if (ureq->req) {
+			usb_ep_free_request(video->ep, ureq->req);
+			ureq->req = NULL;
 		}
 
-		if (video->req_buffer[i]) {
-			kfree(video->req_buffer[i]);
-			video->req_buffer[i] = NULL;
-		}
+		kfree(ureq->req_buffer);
+		ureq->req_buffer = NULL;
+		kfree(ureq->sgl);
+		ureq->sgl = NULL;
 	}
 
 	INIT_LIST_HEAD(&video->req_free);
@@ -229,34 +324,60 @@ uvc_video_free_requests(struct uvc_video *video)
 	return 0;
 }
 
+static unsigned int
+uvc_video_req_size(struct uvc_video *video)
+{
+	return video->ep->maxpacket
+	     * max_t(unsigned int, video->ep->maxburst, 1)
+	     * (video->ep->mult + 1);
+}
+
 static int
 uvc_video_alloc_requests(struct uvc_video *video)
 {
+	struct uvc_request *ureq;
 	unsigned int req_size;
 	unsigned int i;
 	int ret = -ENOMEM;
 
 	BUG_ON(video->req_size);
 
-	req_size = video->ep->maxpacket
-		 * max_t(unsigned int, video->ep->maxburst, 1)
-		 * (video->ep->mult + 1);
+	req_size = uvc_video_req_size(video);
+
+	/*
+	 * A request's payload spans at most one page more than its size,
+	 * plus an entry for the header.
+	 */
+	video->req_sg_entries = DIV_ROUND_UP(req_size, PAGE_SIZE) + 2;
+
+	for (i = 0; i < video->num_requests; ++i) {
+		ureq = &video->ureq[i];
 
-	for (i = 0; i < UVC_NUM_REQUESTS; ++i) {
-		video->req_buffer[i] = kmalloc(req_size, GFP_KERNEL);
-		if (video->req_buffer[i] == NULL)
+		/* With scatter-gather this only holds the header */
+		ureq->req_buffer = kmalloc(video->queue.use_sg ?
+				UVC_MAX_HEADER_SIZE : req_size, GFP_KERNEL);
+		if (ureq->req_buffer == NULL)
 			goto error;
 
-		video->req[i] = usb_ep_alloc_request(video->ep, GFP_KERNEL);
-		if (video->req[i] == NULL)
+		if (video->queue.use_sg) {
+			ureq->sgl = kmalloc(video->req_sg_entries *
+					sizeof(*ureq->sgl), GFP_KERNEL);
+			if (ureq->sgl == NULL)
+				goto error;
+		}
+
+		ureq->req = usb_ep_alloc_request(video->ep, GFP_KERNEL);
+		if (ureq->req == NULL)
 			goto error;
 
-		video->req[i]->buf = video->req_buffer[i];
-		video->req[i]->length = 0;
-		video->req[i]->complete = uvc_video_complete;
-		video->req[i]->context = video;
+		ureq->video = video;
+		ureq->last_buf = NULL;
+		ureq->req->buf = ureq->req_buffer;
+		ureq->req->length = 0;
+		ureq->req->complete = uvc_video_complete;
+		ureq->req->context = ureq;
 
-		list_add_tail(&video->req[i]->list, &video->req_free);
+		list_add_tail(&ureq->req->list, &video->req_free);
 	}
 
 	video->req_size = req_size;
@@ -314,7 +435,7 @@ uvc_video_pump(struct uvc_video *video)
 			break;
 		}
 
-		video->encode(req, video, buf);
+		video->encode(req->context, video, buf);
 
 		/* Queue the USB request */
 		ret = usb_ep_queue(video->ep, req, GFP_ATOMIC);
@@ -348,11 +469,15 @@ uvc_video_enable(struct uvc_video *video, int enable)
 		return -ENODEV;
 	}
 
+	/*
+	 * The requests are kept when streaming stops, and only reallocated
+	 * if the endpoint configuration changed their size.
+	 */
 	if (!enable) {
-		for (i = 0; i < UVC_NUM_REQUESTS; ++i)
-			usb_ep_dequeue(video->ep, video->req[i]);
+		for (i = 0; i < UVC_MAX_NUM_REQUESTS; ++i)
+			if (video->ureq[i].req)
+				usb_ep_dequeue(video->ep, video->ureq[i].req);
 
-		uvc_video_free_requests(video);
 		uvc_queue_enable(&video->queue, 0);
 		return 0;
 	}
@@ -360,8 +485,11 @@ uvc_video_enable(struct uvc_video *video, int enable)
 	if ((ret = uvc_queue_enable(&video->queue, 1)) < 0)
 		return ret;
 
-	if ((ret = uvc_video_alloc_requests(video)) < 0)
-		return ret;
+	if (video->req_size != uvc_video_req_size(video)) {
+		uvc_video_free_requests(video);
+		if ((ret = uvc_video_alloc_requests(video)) < 0)
+			return ret;
+	}
 
 	if (video->max_payload_size) {
 		video->encode = uvc_video_encode_bulk;
@@ -376,10 +504,12 @@ uvc_video_enable(struct uvc_video *video, int enable)
  * Initialize the UVC video stream.
  */
 static int
-uvc_video_init(struct uvc_video *video)
+uvc_video_init(struct uvc_video *video, bool use_sg)
 {
 	INIT_LIST_HEAD(&video->req_free);
 	spin_lock_init(&video->req_lock);
+	video->num_requests = UVC_NUM_REQUESTS;
+	video->stats.since_ns = ktime_to_ns(ktime_get());
 
 	video->fcc = V4L2_PIX_FMT_YUYV;
 	video->bpp = 16;
@@ -388,7 +518,7 @@ uvc_video_init(struct uvc_video *video)
 	video->imagesize = 320 * 240 * 2;
 
 	/* Initialize the video buffers queue. */
-	uvc_queue_init(&video->queue, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	uvc_queue_init(&video->queue, V4L2_BUF_TYPE_VIDEO_OUTPUT, use_sg);
 	return 0;
 }
 
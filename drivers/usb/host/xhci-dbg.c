@@ -20,6 +20,8 @@
  * Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include "xhci.h"
 
 #define XHCI_INIT_VALUE 0x0
@@ -572,3 +574,97 @@ void xhci_dbg_ctx(struct xhci_hcd *xhci,
 	xhci_dbg_slot_ctx(xhci, ctx);
 	xhci_dbg_ep_ctx(xhci, ctx, last_ep);
 }
+
+/*
+ * Event handling and per-endpoint completion statistics since the last
+ * xhci_reset_stats().  Endpoints that haven't completed an URB are left out;
+ * kB/s is bytes per millisecond of the sampling window.
+ */
+int xhci_dbg_stats(struct xhci_hcd *xhci, struct seq_file *s)
+{
+	struct xhci_virt_device *dev;
+	struct xhci_irq_stats is;
+	struct xhci_ep_stats *eps, *st;
+	unsigned long flags;
+	u32 imod_interval;
+	u64 elapsed_ms, epi;
+	int slot, i, addr;
+
+	eps = kmalloc(sizeof(*eps) * ARRAY_SIZE(dev->eps), GFP_KERNEL);
+	if (!eps)
+		return -ENOMEM;
+
+	/* snapshot under the lock, format with interrupts back on */
+	spin_lock_irqsave(&xhci->lock, flags);
+	is = xhci->irq_stats;
+	imod_interval = xhci->imod_interval;
+	spin_unlock_irqrestore(&xhci->lock, flags);
+
+	elapsed_ms = div_u64(ktime_to_ns(ktime_get()) - is.since_ns,
+			NSEC_PER_MSEC) ? : 1;
+	epi = is.irqs ? div64_u64(is.events * 100, is.irqs) : 0;
+
+	seq_printf(s, "imod_interval   %u ns\n", imod_interval);
+	seq_printf(s, "elapsed         %llu ms\n", elapsed_ms);
+	seq_printf(s, "irqs            %llu\n", is.irqs);
+	seq_printf(s, "events          %llu\n", is.events);
+	seq_printf(s, "events_per_irq  %llu.%02llu\n", div_u64(epi, 100),
+			epi % 100);
+	seq_printf(s, "events_max      %u\n", is.events_max);
+	seq_printf(s, "giveback_flush  %llu\n", is.giveback_flushes);
+
+	seq_puts(s, "\nslot ep     urbs       kB/s   avg_us   max_us"
+			"   errors     dbs  db_coal\n");
+	for (slot = 1; slot < MAX_HC_SLOTS; slot++) {
+		spin_lock_irqsave(&xhci->lock, flags);
+		dev = xhci->devs[slot];
+		if (dev)
+			for (i = 0; i < ARRAY_SIZE(dev->eps); i++)
+				eps[i] = dev->eps[i].stats;
+		spin_unlock_irqrestore(&xhci->lock, flags);
+		if (!dev)
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(dev->eps); i++) {
+			st = &eps[i];
+			if (!st->urbs)
+				continue;
+			/* ep index 0 is ep0, then 1 OUT, 1 IN, 2 OUT, ... */
+			addr = (i + 1) / 2;
+			if (i && !(i & 1))
+				addr |= USB_DIR_IN;
+			seq_printf(s, "%4d %02x %8llu %10llu %8llu %8llu"
+					" %8llu %7llu %8llu\n", slot, addr,
+					st->urbs,
+					div64_u64(st->bytes, elapsed_ms),
+					div64_u64(st->latency_ns,
+						st->urbs * NSEC_PER_USEC),
+					div_u64(st->latency_max_ns,
+						NSEC_PER_USEC),
+					st->errors, st->doorbells,
+					st->db_coalesced);
+		}
+	}
+	kfree(eps);
+	return 0;
+}
+
+void xhci_reset_stats(struct xhci_hcd *xhci)
+{
+	struct xhci_virt_device *dev;
+	unsigned long flags;
+	int slot, i;
+
+	spin_lock_irqsave(&xhci->lock, flags);
+	memset(&xhci->irq_stats, 0, sizeof(xhci->irq_stats));
+	xhci->irq_stats.since_ns = ktime_to_ns(ktime_get());
+	for (slot = 1; slot < MAX_HC_SLOTS; slot++) {
+		dev = xhci->devs[slot];
+		if (!dev)
+			continue;
+		for (i = 0; i < ARRAY_SIZE(dev->eps); i++)
+			memset(&dev->eps[i].stats, 0,
+					sizeof(dev->eps[i].stats));
+	}
+	spin_unlock_irqrestore(&xhci->lock, flags);
+}
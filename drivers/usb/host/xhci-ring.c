@@ -64,10 +64,16 @@
  *   endpoint rings; it generates events on the event ring for these.
  */
 
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include "xhci.h"
 
+/* Let bulk TDs queued behind busy rings share the next doorbell */
+static bool db_coalesce = true;
+module_param(db_coalesce, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(db_coalesce, "Coalesce doorbells for queued bulk TDs");
+
 static int handle_cmd_in_cmd_wait_list(struct xhci_hcd *xhci,
 		struct xhci_virt_device *virt_dev,
 		struct xhci_event_cmd *event);
@@ -2332,8 +2338,52 @@ static int process_bulk_intr_td(struct xhci_hcd *xhci, struct xhci_td *td,
  * event with a corrupted Slot ID, Endpoint ID, or TRB DMA address.
  * At this point, the host controller is probably hosed and should be reset.
  */
+static void xhci_giveback_urbs(struct xhci_giveback_batch *batch)
+{
+	struct urb *urb;
+	unsigned int i;
+
+	for (i = 0; i < batch->num; i++) {
+		urb = batch->urbs[i].urb;
+		usb_hcd_giveback_urb(bus_to_hcd(urb->dev->bus), urb,
+				batch->urbs[i].status);
+	}
+	batch->num = 0;
+}
+
+/* Give back the URBs collected so far; drops xhci->lock meanwhile. */
+static void xhci_giveback_flush(struct xhci_hcd *xhci,
+		struct xhci_giveback_batch *batch)
+	__releases(&xhci->lock)
+	__acquires(&xhci->lock)
+{
+	if (!batch->num)
+		return;
+	xhci->irq_stats.giveback_flushes++;
+	spin_unlock(&xhci->lock);
+	xhci_giveback_urbs(batch);
+	spin_lock(&xhci->lock);
+}
+
+static void xhci_ep_account_urb(struct xhci_virt_ep *ep, struct urb *urb,
+		struct urb_priv *urb_priv, int status)
+{
+	struct xhci_ep_stats *st = &ep->stats;
+	u64 lat;
+
+	lat = ktime_to_ns(ktime_sub(ktime_get(), urb_priv->submitted));
+	st->urbs++;
+	st->bytes += urb->actual_length;
+	st->latency_ns += lat;
+	if (lat > st->latency_max_ns)
+		st->latency_max_ns = lat;
+	if (status)
+		st->errors++;
+}
+
 static int handle_tx_event(struct xhci_hcd *xhci,
-		struct xhci_transfer_event *event)
+		struct xhci_transfer_event *event,
+		struct xhci_giveback_batch *batch)
 	__releases(&xhci->lock)
 	__acquires(&xhci->lock)
 {
@@ -2403,6 +2453,19 @@ static int handle_tx_event(struct xhci_hcd *xhci,
 
 	event_dma = le64_to_cpu(event->buffer);
 	trb_comp_code = GET_COMP_CODE(le32_to_cpu(event->transfer_len));
+
+	/*
+	 * TDs queued behind this one were left for us to kick off; a halted
+	 * endpoint gets its doorbell back once it has been reset.
+	 */
+	if (ep_ring->db_pending && (trb_comp_code == COMP_SUCCESS ||
+				    trb_comp_code == COMP_SHORT_TX)) {
+		ep_ring->db_pending = false;
+		ep->stats.doorbells++;
+		xhci_ring_ep_doorbell(xhci, slot_id, ep_index,
+				ep_ring->stream_id);
+	}
+
 	/* Look for common error cases */
 	switch (trb_comp_code) {
 	/* Skip codes that require special handling depending on
@@ -2628,6 +2691,7 @@ cleanup:
 		if (ret) {
 			urb = td->urb;
 			urb_priv = urb->hcpriv;
+			xhci_ep_account_urb(ep, urb, urb_priv, status);
 			/* Leave the TD around for the reset endpoint function
 			 * to use(but only if it's not a control endpoint,
 			 * since we already queued the Set TR dequeue pointer
@@ -2651,14 +2715,20 @@ cleanup:
 						urb, urb->actual_length,
 						urb->transfer_buffer_length,
 						status);
-			spin_unlock(&xhci->lock);
 			/* EHCI, UHCI, and OHCI always unconditionally set the
 			 * urb->status of an isochronous endpoint to 0.
 			 */
 			if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS)
 				status = 0;
-			usb_hcd_giveback_urb(bus_to_hcd(urb->dev->bus), urb, status);
-			spin_lock(&xhci->lock);
+			/*
+			 * The URB is off the endpoint already; hand it to the
+			 * core with the others once the lock is dropped.
+			 */
+			if (batch->num == XHCI_GIVEBACK_BATCH)
+				xhci_giveback_flush(xhci, batch);
+			batch->urbs[batch->num].urb = urb;
+			batch->urbs[batch->num].status = status;
+			batch->num++;
 		}
 
 	/*
@@ -2677,10 +2747,15 @@ cleanup:
  * xhci->lock between event processing (e.g. to pass up port status changes).
  * Returns >0 for "possibly more events to process" (caller should call again),
  * otherwise 0 if done.  In future, <0 returns should indicate error code.
+ *
+ * URBs completed by transfer events are collected in @batch; it is flushed
+ * before any other event is handled so that givebacks stay in order.
  */
-static int xhci_handle_event(struct xhci_hcd *xhci)
+static int xhci_handle_event(struct xhci_hcd *xhci,
+		struct xhci_giveback_batch *batch)
 {
 	union xhci_trb *event;
+	u32 type;
 	int update_ptrs = 1;
 	int ret;
 
@@ -2702,8 +2777,12 @@ static int xhci_handle_event(struct xhci_hcd *xhci)
 	 * speculative reads of the event's flags/data below.
 	 */
 	rmb();
+	type = le32_to_cpu(event->event_cmd.flags) & TRB_TYPE_BITMASK;
+	if (type != TRB_TYPE(TRB_TRANSFER))
+		xhci_giveback_flush(xhci, batch);
+
 	/* FIXME: Handle more event types. */
-	switch ((le32_to_cpu(event->event_cmd.flags) & TRB_TYPE_BITMASK)) {
+	switch (type) {
 	case TRB_TYPE(TRB_COMPLETION):
 		handle_cmd_completion(xhci, &event->event_cmd);
 		break;
@@ -2712,7 +2791,7 @@ static int xhci_handle_event(struct xhci_hcd *xhci)
 		update_ptrs = 0;
 		break;
 	case TRB_TYPE(TRB_TRANSFER):
-		ret = handle_tx_event(xhci, &event->trans_event);
+		ret = handle_tx_event(xhci, &event->trans_event, batch);
 		if (ret < 0)
 			xhci->error_bitmask |= 1 << 9;
 		else
@@ -2722,8 +2801,7 @@ static int xhci_handle_event(struct xhci_hcd *xhci)
 		handle_device_notification(xhci, event);
 		break;
 	default:
-		if ((le32_to_cpu(event->event_cmd.flags) & TRB_TYPE_BITMASK) >=
-		    TRB_TYPE(48))
+		if (type >= TRB_TYPE(48))
 			handle_vendor_event(xhci, event);
 		else
 			xhci->error_bitmask |= 1 << 3;
@@ -2755,10 +2833,12 @@ static int xhci_handle_event(struct xhci_hcd *xhci)
 irqreturn_t xhci_irq(struct usb_hcd *hcd)
 {
 	struct xhci_hcd *xhci = hcd_to_xhci(hcd);
+	struct xhci_giveback_batch batch;
 	u32 status;
 	u64 temp_64;
 	union xhci_trb *event_ring_deq;
 	dma_addr_t deq;
+	u32 events = 0;
 
 	spin_lock(&xhci->lock);
 	/* Check if the xHC generated the interrupt, or the irq is shared */
@@ -2814,7 +2894,16 @@ hw_died:
 	/* FIXME this should be a delayed service routine
 	 * that clears the EHB.
 	 */
-	while (xhci_handle_event(xhci) > 0) {}
+	batch.num = 0;
+	while (xhci_handle_event(xhci, &batch) > 0)
+		events++;
+
+	xhci->irq_stats.irqs++;
+	xhci->irq_stats.events += events;
+	if (events > xhci->irq_stats.events_max)
+		xhci->irq_stats.events_max = events;
+	if (batch.num)
+		xhci->irq_stats.giveback_flushes++;
 
 	temp_64 = xhci_read_64(xhci, &xhci->ir_set->erst_dequeue);
 	/* If necessary, update the HW's version of the event ring deq ptr. */
@@ -2834,6 +2923,7 @@ hw_died:
 	xhci_write_64(xhci, temp_64, &xhci->ir_set->erst_dequeue);
 
 	spin_unlock(&xhci->lock);
+	xhci_giveback_urbs(&batch);
 
 	return IRQ_HANDLED;
 }
@@ -3057,8 +3147,10 @@ static void check_trb_math(struct urb *urb, int num_trbs, int running_total)
 
 static void giveback_first_trb(struct xhci_hcd *xhci, int slot_id,
 		unsigned int ep_index, unsigned int stream_id, int start_cycle,
-		struct xhci_generic_trb *start_trb)
+		struct xhci_generic_trb *start_trb, bool defer_db)
 {
+	struct xhci_ep_stats *st = &xhci->devs[slot_id]->eps[ep_index].stats;
+
 	/*
 	 * Pass all the TRBs to the hardware at once and make sure this write
 	 * isn't reordered.
@@ -3068,9 +3160,33 @@ static void giveback_first_trb(struct xhci_hcd *xhci, int slot_id,
 		start_trb->field[3] |= cpu_to_le32(start_cycle);
 	else
 		start_trb->field[3] &= cpu_to_le32(~TRB_CYCLE);
+	if (defer_db) {
+		st->db_coalesced++;
+		return;
+	}
+	st->doorbells++;
 	xhci_ring_ep_doorbell(xhci, slot_id, ep_index, stream_id);
 }
 
+/*
+ * A bulk TD queued behind two or more TDs the driver hasn't seen complete
+ * can go without a doorbell of its own: handle_tx_event() rings the ring
+ * again on the next completion, picking up everything queued meanwhile,
+ * while the xHC still has the other TD to work on.
+ */
+static bool xhci_defer_doorbell(struct xhci_ring *ep_ring, struct urb *urb,
+		struct xhci_td *td)
+{
+	struct list_head *prev = td->td_list.prev;
+
+	if (!db_coalesce || !usb_endpoint_xfer_bulk(&urb->ep->desc))
+		return false;
+	if (prev == &ep_ring->td_list || prev->prev == &ep_ring->td_list)
+		return false;
+	ep_ring->db_pending = true;
+	return true;
+}
+
 /*
  * xHCI uses normal TRBs for both bulk and interrupt.  When the interrupt
  * endpoint is to be serviced, the xHC will consume (at most) one TD.  A TD
@@ -3314,7 +3430,8 @@ static int queue_bulk_sg_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 
 	check_trb_math(urb, num_trbs, running_total);
 	giveback_first_trb(xhci, slot_id, ep_index, urb->stream_id,
-			start_cycle, start_trb);
+			start_cycle, start_trb,
+			xhci_defer_doorbell(ep_ring, urb, td));
 	return 0;
 }
 
@@ -3453,7 +3570,8 @@ int xhci_queue_bulk_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 
 	check_trb_math(urb, num_trbs, running_total);
 	giveback_first_trb(xhci, slot_id, ep_index, urb->stream_id,
-			start_cycle, start_trb);
+			start_cycle, start_trb,
+			xhci_defer_doorbell(ep_ring, urb, td));
 	return 0;
 }
 
@@ -3570,7 +3688,7 @@ int xhci_queue_ctrl_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 			field | TRB_IOC | TRB_TYPE(TRB_STATUS) | ep_ring->cycle_state);
 
 	giveback_first_trb(xhci, slot_id, ep_index, 0,
-			start_cycle, start_trb);
+			start_cycle, start_trb, false);
 	return 0;
 }
 
@@ -3804,7 +3922,7 @@ static int xhci_queue_isoc_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 	xhci_to_hcd(xhci)->self.bandwidth_isoc_reqs++;
 
 	giveback_first_trb(xhci, slot_id, ep_index, urb->stream_id,
-			start_cycle, start_trb);
+			start_cycle, start_trb, false);
 	return 0;
 cleanup:
 	/* Clean up a partially enqueued isoc transfer. */
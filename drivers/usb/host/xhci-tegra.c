@@ -30,6 +30,7 @@
 #include <linux/circ_buf.h>
 #include <linux/vmalloc.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/kthread.h>
 #include <linux/gpio.h>
 #include <linux/usb/otg.h>
@@ -426,6 +427,9 @@ struct tegra_xhci_hcd {
 
 	struct tegra_xhci_firmware_log log;
 	struct device_attribute hsic_power_attr[XUSB_HSIC_COUNT];
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debugfs_dir;
+#endif
 
 	bool init_done;
 };
@@ -4292,6 +4296,95 @@ static int hsic_power_create_file(struct tegra_xhci_hcd *tegra)
 	return 0;
 }
 
+/*
+ * Interrupter moderation interval in ns, rounded down to the 250ns IMOD
+ * unit.  Lower values cut completion latency at the cost of more interrupts.
+ */
+static ssize_t imod_interval_ns_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tegra_xhci_hcd *tegra = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", tegra->xhci->imod_interval);
+}
+
+static ssize_t imod_interval_ns_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t n)
+{
+	struct tegra_xhci_hcd *tegra = dev_get_drvdata(dev);
+	unsigned int ns;
+	int ret;
+
+	if (kstrtouint(buf, 0, &ns))
+		return -EINVAL;
+
+	ret = xhci_set_imod(tegra->xhci, ns);
+	return ret ? ret : n;
+}
+
+static DEVICE_ATTR(imod_interval_ns, S_IRUGO | S_IWUSR,
+		imod_interval_ns_show, imod_interval_ns_store);
+
+#ifdef CONFIG_DEBUG_FS
+static int tegra_xhci_stats_show(struct seq_file *s, void *unused)
+{
+	struct tegra_xhci_hcd *tegra = s->private;
+
+	return xhci_dbg_stats(tegra->xhci, s);
+}
+
+static int tegra_xhci_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_xhci_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t tegra_xhci_stats_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct tegra_xhci_hcd *tegra =
+		((struct seq_file *)file->private_data)->private;
+
+	xhci_reset_stats(tegra->xhci);
+	return count;
+}
+
+static const struct file_operations tegra_xhci_stats_fops = {
+	.open		= tegra_xhci_stats_open,
+	.read		= seq_read,
+	.write		= tegra_xhci_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_xhci_debugfs_init(struct tegra_xhci_hcd *tegra)
+{
+	tegra->debugfs_dir = debugfs_create_dir(dev_name(&tegra->pdev->dev),
+			NULL);
+	if (IS_ERR_OR_NULL(tegra->debugfs_dir)) {
+		tegra->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, tegra->debugfs_dir,
+			tegra, &tegra_xhci_stats_fops);
+}
+
+static void tegra_xhci_debugfs_exit(struct tegra_xhci_hcd *tegra)
+{
+	debugfs_remove_recursive(tegra->debugfs_dir);
+	tegra->debugfs_dir = NULL;
+}
+#else
+static inline void tegra_xhci_debugfs_init(struct tegra_xhci_hcd *tegra)
+{
+}
+
+static inline void tegra_xhci_debugfs_exit(struct tegra_xhci_hcd *tegra)
+{
+}
+#endif
+
 /* TODO: we have to refine error handling in tegra_xhci_probe() */
 static int tegra_xhci_probe(struct platform_device *pdev)
 {
@@ -4659,6 +4752,9 @@ static int tegra_xhci_probe2(struct tegra_xhci_hcd *tegra)
 	pm_runtime_enable(&pdev->dev);
 
 	hsic_power_create_file(tegra);
+	if (device_create_file(&pdev->dev, &dev_attr_imod_interval_ns))
+		dev_warn(&pdev->dev, "failed to create imod_interval_ns\n");
+	tegra_xhci_debugfs_init(tegra);
 	tegra->init_done = true;
 
 	return 0;
@@ -4707,6 +4803,9 @@ static int tegra_xhci_remove(struct platform_device *pdev)
 		xhci = tegra->xhci;
 		hcd = xhci_to_hcd(xhci);
 
+		tegra_xhci_debugfs_exit(tegra);
+		device_remove_file(&pdev->dev, &dev_attr_imod_interval_ns);
+
 		devm_free_irq(&pdev->dev, tegra->usb3_irq, tegra);
 		devm_free_irq(&pdev->dev, tegra->padctl_irq, tegra);
 		devm_free_irq(&pdev->dev, tegra->smi_irq, tegra);
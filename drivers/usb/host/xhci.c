@@ -664,7 +664,7 @@ int xhci_run(struct usb_hcd *hcd)
 	xhci_dbg(xhci, "// Set the interrupt modulation register\n");
 	temp = xhci_readl(xhci, &xhci->ir_set->irq_control);
 	temp &= ~ER_IRQ_INTERVAL_MASK;
-	temp |= (u32) 160;
+	temp |= xhci->imod_interval / XHCI_IMOD_UNIT_NS;
 	xhci_writel(xhci, temp, &xhci->ir_set->irq_control);
 
 	/* Set the HCD state before we enable the irqs */
@@ -814,9 +814,38 @@ static void xhci_restore_registers(struct xhci_hcd *xhci)
 	xhci_write_64(xhci, xhci->s3.erst_base, &xhci->ir_set->erst_base);
 	xhci_write_64(xhci, xhci->s3.erst_dequeue, &xhci->ir_set->erst_dequeue);
 	xhci_writel(xhci, xhci->s3.irq_pending, &xhci->ir_set->irq_pending);
+	/* the interval may have been changed while the registers were off */
+	xhci->s3.irq_control &= ~ER_IRQ_INTERVAL_MASK;
+	xhci->s3.irq_control |= xhci->imod_interval / XHCI_IMOD_UNIT_NS;
 	xhci_writel(xhci, xhci->s3.irq_control, &xhci->ir_set->irq_control);
 }
 
+/*
+ * Set the interrupter moderation interval, the least time between two
+ * interrupts.  A longer interval lets more events collect on the event
+ * ring for each interrupt.  Applied at once if the controller is running,
+ * and kept across resets and resume.
+ */
+int xhci_set_imod(struct xhci_hcd *xhci, u32 interval_ns)
+{
+	unsigned long flags;
+	u32 temp;
+
+	if (interval_ns / XHCI_IMOD_UNIT_NS > ER_IRQ_INTERVAL_MASK)
+		return -EINVAL;
+
+	spin_lock_irqsave(&xhci->lock, flags);
+	xhci->imod_interval = interval_ns;
+	if (xhci->ir_set && HCD_HW_ACCESSIBLE(xhci_to_hcd(xhci))) {
+		temp = xhci_readl(xhci, &xhci->ir_set->irq_control);
+		temp &= ~ER_IRQ_INTERVAL_MASK;
+		temp |= interval_ns / XHCI_IMOD_UNIT_NS;
+		xhci_writel(xhci, temp, &xhci->ir_set->irq_control);
+	}
+	spin_unlock_irqrestore(&xhci->lock, flags);
+	return 0;
+}
+
 static void xhci_set_cmd_ring_deq(struct xhci_hcd *xhci)
 {
 	u64	val_64;
@@ -1317,6 +1346,7 @@ int xhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
 	urb_priv->length = size;
 	urb_priv->td_cnt = 0;
 	urb_priv->finishing_short_td = false;
+	urb_priv->submitted = ktime_get();
 	urb->hcpriv = urb_priv;
 
 	if (usb_endpoint_xfer_control(&urb->ep->desc)) {
@@ -4701,6 +4731,8 @@ int xhci_gen_setup(struct usb_hcd *hcd, xhci_get_quirks_t get_quirks)
 			return -ENOMEM;
 		*((struct xhci_hcd **) hcd->hcd_priv) = xhci;
 		xhci->main_hcd = hcd;
+		xhci->imod_interval = XHCI_IMOD_DEFAULT_NS;
+		xhci->irq_stats.since_ns = ktime_to_ns(ktime_get());
 		/* Mark the first roothub as being USB 2.0.
 		 * The xHCI driver will register the USB 3.0 roothub.
 		 */
@@ -26,6 +26,7 @@
 #include <linux/usb.h>
 #include <linux/timer.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/usb/hcd.h>
 
 /* Code sharing between pci-quirks and xhci hcd */
@@ -818,6 +819,21 @@ struct xhci_bw_info {
 #define HS_BW_RESERVED		20
 #define SS_BW_RESERVED		10
 
+/*
+ * Per-endpoint URB completion counters, under xhci->lock.  Latency runs
+ * from xhci_urb_enqueue() to the completion event.  @doorbells counts the
+ * doorbells rung for new TDs, @db_coalesced the TDs that went without one.
+ */
+struct xhci_ep_stats {
+	u64	urbs;
+	u64	bytes;
+	u64	errors;
+	u64	latency_ns;
+	u64	latency_max_ns;
+	u64	doorbells;
+	u64	db_coalesced;
+};
+
 struct xhci_virt_ep {
 	struct xhci_ring		*ring;
 	/* Related to endpoints that are configured to use stream IDs only */
@@ -862,6 +878,7 @@ struct xhci_virt_ep {
 	/* Bandwidth checking storage */
 	struct xhci_bw_info	bw_info;
 	struct list_head	bw_endpoint_list;
+	struct xhci_ep_stats	stats;
 };
 
 enum xhci_overhead_type {
@@ -1308,6 +1325,8 @@ struct xhci_ring {
 	unsigned int		num_trbs_free_temp;
 	enum xhci_ring_type	type;
 	bool			last_td_was_short;
+	/* new TDs were queued without ringing the doorbell */
+	bool			db_pending;
 };
 
 struct xhci_erst_entry {
@@ -1338,9 +1357,37 @@ struct urb_priv {
 	int	length;
 	int	td_cnt;
 	bool	finishing_short_td;
+	ktime_t	submitted;
 	struct	xhci_td	*td[0];
 };
 
+/*
+ * URBs completed while the event handler holds xhci->lock, given back
+ * together once it has dropped the lock.
+ */
+#define XHCI_GIVEBACK_BATCH	16
+
+struct xhci_giveback_batch {
+	unsigned int	num;
+	struct {
+		struct urb	*urb;
+		int		status;
+	} urbs[XHCI_GIVEBACK_BATCH];
+};
+
+/* Event handling counters, under xhci->lock */
+struct xhci_irq_stats {
+	u64	since_ns;
+	u64	irqs;
+	u64	events;
+	u32	events_max;
+	u64	giveback_flushes;
+};
+
+/* Default interrupt moderation interval, in IMOD units of 250ns */
+#define XHCI_IMOD_DEFAULT_NS	40000
+#define XHCI_IMOD_UNIT_NS	250
+
 /*
  * Each segment table entry is 4*32bits long.  1K seems like an ok size:
  * (1K bytes * 8bytes/bit) / (4*32 bits) = 64 segment entries in the table,
@@ -1475,6 +1522,9 @@ struct xhci_hcd {
 
 	u32			command;
 	struct s3_save		s3;
+	/* Interrupter moderation interval in ns, see xhci_set_imod() */
+	u32			imod_interval;
+	struct xhci_irq_stats	irq_stats;
 /* Host controller is dying - not responding to commands. "I'm not dead yet!"
  *
  * xHC interrupts have been disabled and a watchdog timer will (or has already)
@@ -1616,9 +1666,13 @@ static inline int xhci_link_trb_quirk(struct xhci_hcd *xhci)
 }
 
 /* xHCI debugging */
+struct seq_file;
+
 void xhci_print_ir_set(struct xhci_hcd *xhci, int set_num);
 void xhci_print_registers(struct xhci_hcd *xhci);
 void xhci_dbg_regs(struct xhci_hcd *xhci);
+int xhci_dbg_stats(struct xhci_hcd *xhci, struct seq_file *s);
+void xhci_reset_stats(struct xhci_hcd *xhci);
 void xhci_print_run_regs(struct xhci_hcd *xhci);
 void xhci_print_trb_offsets(struct xhci_hcd *xhci, union xhci_trb *trb);
 void xhci_debug_trb(struct xhci_hcd *xhci, union xhci_trb *trb);
@@ -1736,6 +1790,7 @@ int xhci_run(struct usb_hcd *hcd);
 void xhci_stop(struct usb_hcd *hcd);
 void xhci_shutdown(struct usb_hcd *hcd);
 int xhci_gen_setup(struct usb_hcd *hcd, xhci_get_quirks_t get_quirks);
+int xhci_set_imod(struct xhci_hcd *xhci, u32 interval_ns);
 
 #ifdef	CONFIG_PM
 int xhci_suspend(struct xhci_hcd *xhci);
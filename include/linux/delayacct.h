@@ -19,6 +19,7 @@
 
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/psi.h>
 
 /*
  * Per-task flags relevant to delay accounting
@@ -28,6 +29,12 @@
 #define DELAYACCT_PF_SWAPIN	0x00000001	/* I am doing a swapin */
 #define DELAYACCT_PF_BLKIO	0x00000002	/* I am waiting on IO */
 
+/*
+ * Direct reclaim and swap-in are also memory stalls for pressure stall
+ * accounting, which hooks in here so that it covers exactly the paths
+ * delay accounting instruments, whether or not that is enabled.
+ */
+
 #ifdef CONFIG_TASK_DELAY_ACCT
 
 extern int delayacct_on;	/* Delay accounting turned on/off */
@@ -52,6 +59,8 @@ static inline int delayacct_is_task_waiting_on_io(struct task_struct *p)
 
 static inline void delayacct_set_flag(int flag)
 {
+	if (flag & DELAYACCT_PF_SWAPIN)
+		psi_memstall_enter();
 	if (current->delays)
 		current->delays->flags |= flag;
 }
@@ -60,6 +69,8 @@ static inline void delayacct_clear_flag(int flag)
 {
 	if (current->delays)
 		current->delays->flags &= ~flag;
+	if (flag & DELAYACCT_PF_SWAPIN)
+		psi_memstall_leave();
 }
 
 static inline void delayacct_tsk_init(struct task_struct *tsk)
@@ -111,6 +122,7 @@ static inline __u64 delayacct_blkio_ticks(struct task_struct *tsk)
 
 static inline void delayacct_freepages_start(void)
 {
+	psi_memstall_enter();
 	if (current->delays)
 		__delayacct_freepages_start();
 }
@@ -119,13 +131,20 @@ static inline void delayacct_freepages_end(void)
 {
 	if (current->delays)
 		__delayacct_freepages_end();
+	psi_memstall_leave();
 }
 
 #else
 static inline void delayacct_set_flag(int flag)
-{}
+{
+	if (flag & DELAYACCT_PF_SWAPIN)
+		psi_memstall_enter();
+}
 static inline void delayacct_clear_flag(int flag)
-{}
+{
+	if (flag & DELAYACCT_PF_SWAPIN)
+		psi_memstall_leave();
+}
 static inline void delayacct_init(void)
 {}
 static inline void delayacct_tsk_init(struct task_struct *tsk)
@@ -144,9 +163,13 @@ static inline __u64 delayacct_blkio_ticks(struct task_struct *tsk)
 static inline int delayacct_is_task_waiting_on_io(struct task_struct *p)
 { return 0; }
 static inline void delayacct_freepages_start(void)
-{}
+{
+	psi_memstall_enter();
+}
 static inline void delayacct_freepages_end(void)
-{}
+{
+	psi_memstall_leave();
+}
 
 #endif /* CONFIG_TASK_DELAY_ACCT */
 
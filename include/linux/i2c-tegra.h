@@ -20,6 +20,14 @@
 #ifndef _LINUX_I2C_TEGRA_H
 #define _LINUX_I2C_TEGRA_H
 
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+
+struct i2c_adapter;
+struct i2c_msg;
+
 struct tegra_i2c_platform_data {
 	unsigned long bus_clk_rate;
 	bool is_dvc;
@@ -44,4 +52,73 @@ struct tegra_i2c_slave_platform_data {
 	int max_tx_buffer_size;
 };
 
+/**
+ * struct tegra_i2c_async_req - asynchronous transfer on a Tegra I2C bus
+ * @msgs: messages of the transfer, handled like one i2c_transfer() call
+ * @num: number of messages in @msgs
+ * @complete: called from the adapter's queue thread when the transfer is
+ *	done; it may resubmit the request but must not sleep for long
+ * @context: owner data for @complete
+ * @status: number of messages transferred, or a negative errno
+ *
+ * The request, its messages and their buffers must stay valid until
+ * @complete has been called.  Requests queued back to back are chained into
+ * one packet mode transfer which is finished with a single interrupt.
+ */
+struct tegra_i2c_async_req {
+	struct i2c_msg *msgs;
+	int num;
+	void (*complete)(struct tegra_i2c_async_req *req);
+	void *context;
+	int status;
+
+	/* private: */
+	struct list_head node;
+	unsigned long flags;
+	ktime_t queued;
+};
+
+/**
+ * struct tegra_i2c_periodic_job - transfer submitted at a fixed rate
+ * @req: request queued every period, @req.complete sees each result
+ * @period: interval between two submissions
+ * @overruns: periods skipped because the previous run was still pending
+ *
+ * Jobs with the same period expire together so that their transfers end
+ * up in the same batch.
+ */
+struct tegra_i2c_periodic_job {
+	struct tegra_i2c_async_req req;
+	ktime_t period;
+	unsigned long overruns;
+
+	/* private: */
+	struct i2c_adapter *adap;
+	struct hrtimer timer;
+};
+
+#if IS_ENABLED(CONFIG_I2C_TEGRA)
+int tegra_i2c_async_submit(struct i2c_adapter *adap,
+			   struct tegra_i2c_async_req *req);
+int tegra_i2c_periodic_start(struct i2c_adapter *adap,
+			     struct tegra_i2c_periodic_job *job);
+void tegra_i2c_periodic_stop(struct tegra_i2c_periodic_job *job);
+#else
+static inline int tegra_i2c_async_submit(struct i2c_adapter *adap,
+					 struct tegra_i2c_async_req *req)
+{
+	return -ENODEV;
+}
+
+static inline int tegra_i2c_periodic_start(struct i2c_adapter *adap,
+					   struct tegra_i2c_periodic_job *job)
+{
+	return -ENODEV;
+}
+
+static inline void tegra_i2c_periodic_stop(struct tegra_i2c_periodic_job *job)
+{
+}
+#endif
+
 #endif /* _LINUX_I2C_TEGRA_H */
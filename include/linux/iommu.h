@@ -41,6 +41,8 @@ struct notifier_block;
 
 typedef int (*iommu_fault_handler_t)(struct iommu_domain *,
 			struct device *, unsigned long, int, void *);
+typedef void (*iommu_iova_release_t)(void *data, unsigned long iova,
+				     size_t size);
 
 struct iommu_domain_geometry {
 	dma_addr_t aperture_start; /* First address that can be mapped    */
@@ -77,6 +79,9 @@ enum iommu_attr {
  * @map: map a physically contiguous memory region to an iommu domain
  * @unmap: unmap a physically contiguous memory region from an iommu domain
  * @iova_to_phys: translate iova to physical address
+ * @iotlb_sync: wait for the invalidations left pending by map and unmap
+ * @iotlb_defer: queue the invalidation of an unmapped range, calling
+ *	release once the range may be reused
  * @domain_has_cap: domain capabilities query
  * @add_device: add device to iommu grouping
  * @remove_device: remove device from iommu grouping
@@ -97,6 +102,10 @@ struct iommu_ops {
 		    struct scatterlist *sgl, int nents, unsigned long prot);
 	size_t (*unmap)(struct iommu_domain *domain, unsigned long iova,
 		     size_t size);
+	void (*iotlb_sync)(struct iommu_domain *domain);
+	void (*iotlb_defer)(struct iommu_domain *domain, unsigned long iova,
+			    size_t size, iommu_iova_release_t release,
+			    void *data);
 	phys_addr_t (*iova_to_phys)(struct iommu_domain *domain, dma_addr_t iova);
 	int (*domain_has_cap)(struct iommu_domain *domain,
 			      unsigned long cap);
@@ -144,6 +153,9 @@ extern int iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 			struct scatterlist *sgl, int nents, unsigned long prot);
 extern size_t iommu_unmap(struct iommu_domain *domain, unsigned long iova,
 		       size_t size);
+extern size_t iommu_unmap_deferred(struct iommu_domain *domain,
+				   unsigned long iova, size_t size,
+				   iommu_iova_release_t release, void *data);
 extern phys_addr_t iommu_iova_to_phys(struct iommu_domain *domain, dma_addr_t iova);
 extern int iommu_domain_has_cap(struct iommu_domain *domain,
 				unsigned long cap);
@@ -265,6 +277,17 @@ static inline int iommu_unmap(struct iommu_domain *domain, unsigned long iova,
 	return -ENODEV;
 }
 
+static inline size_t iommu_unmap_deferred(struct iommu_domain *domain,
+					  unsigned long iova, size_t size,
+					  iommu_iova_release_t release,
+					  void *data)
+{
+	/* nothing is ever mapped, so the range can go back right away */
+	if (release)
+		release(data, iova, size);
+	return 0;
+}
+
 static inline int iommu_domain_window_enable(struct iommu_domain *domain,
 					     u32 wnd_nr, phys_addr_t paddr,
 					     u64 size, int prot)
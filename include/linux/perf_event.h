@@ -513,6 +513,7 @@ struct perf_output_handle {
 	unsigned long			size;
 	void				*addr;
 	int				page;
+	unsigned long			offset;		/* of the record */
 };
 
 #ifdef CONFIG_PERF_EVENTS
@@ -574,6 +575,10 @@ struct perf_sample_data {
 	struct perf_regs_user		regs_user;
 	u64				stack_user_size;
 	u64				weight;
+	/* attr.stack_user_dedup, see perf_sample_ustack_dedup() */
+	void				*stack_user_buf;
+	u64				stack_user_dyn;
+	int				stack_user_dup;
 };
 
 static inline void perf_sample_data_init(struct perf_sample_data *data,
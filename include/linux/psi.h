@@ -0,0 +1,86 @@
+/*
+ * Pressure stall information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef _LINUX_PSI_H
+#define _LINUX_PSI_H
+
+#include <linux/psi_types.h>
+#include <linux/errno.h>
+#include <linux/sched.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+struct psi_trigger;
+
+/*
+ * Fires when at least @threshold ns of stall accumulated within the
+ * last @window ns, at most once per window. Userspace triggers are set
+ * up by writing "some <threshold us> <window us>" to /proc/pressure/*
+ * and then polled for POLLPRI; in-kernel users pass a @notify callback,
+ * which runs in process context with the stall seen in the window.
+ */
+struct psi_trigger {
+	enum psi_res res;
+	u64 threshold;
+	u64 window;
+	void (*notify)(struct psi_trigger *t, u64 growth);
+
+	/* private */
+	struct list_head node;
+	u64 win_start;
+	u64 win_start_total;
+	u64 last_event;
+	int event;
+	wait_queue_head_t event_wait;
+};
+
+#ifdef CONFIG_PSI
+
+extern void psi_stall_enter(enum psi_res res);
+extern void psi_stall_leave(enum psi_res res);
+extern u64 psi_stall_total(enum psi_res res);
+
+extern int psi_trigger_register(struct psi_trigger *t);
+extern void psi_trigger_unregister(struct psi_trigger *t);
+
+/*
+ * Stall sections nest (reclaim can wait for I/O, a swap-in can enter
+ * reclaim); only the outermost one of each resource is accounted.
+ */
+static inline void psi_task_stall_enter(enum psi_res res)
+{
+	if (current->psi_nest[res]++ == 0)
+		psi_stall_enter(res);
+}
+
+static inline void psi_task_stall_leave(enum psi_res res)
+{
+	if (--current->psi_nest[res] == 0)
+		psi_stall_leave(res);
+}
+
+#else
+
+static inline u64 psi_stall_total(enum psi_res res) { return 0; }
+static inline int psi_trigger_register(struct psi_trigger *t)
+{
+	return -ENOSYS;
+}
+static inline void psi_trigger_unregister(struct psi_trigger *t) {}
+static inline void psi_task_stall_enter(enum psi_res res) {}
+static inline void psi_task_stall_leave(enum psi_res res) {}
+
+#endif /* CONFIG_PSI */
+
+#define psi_memstall_enter()	psi_task_stall_enter(PSI_MEM)
+#define psi_memstall_leave()	psi_task_stall_leave(PSI_MEM)
+#define psi_iostall_enter()	psi_task_stall_enter(PSI_IO)
+#define psi_iostall_leave()	psi_task_stall_leave(PSI_IO)
+
+#endif /* _LINUX_PSI_H */
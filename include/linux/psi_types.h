@@ -0,0 +1,11 @@
+#ifndef _LINUX_PSI_TYPES_H
+#define _LINUX_PSI_TYPES_H
+
+/* Resources whose stalls are accounted, see kernel/sched/psi.c */
+enum psi_res {
+	PSI_IO,
+	PSI_MEM,
+	NR_PSI_RESOURCES,
+};
+
+#endif /* _LINUX_PSI_TYPES_H */
@@ -68,6 +68,7 @@ struct sched_param {
 #include <linux/llist.h>
 #include <linux/uidgid.h>
 #include <linux/gfp.h>
+#include <linux/psi_types.h>
 
 #include <asm/processor.h>
 
@@ -1378,6 +1379,10 @@ struct task_struct {
 #ifdef	CONFIG_TASK_DELAY_ACCT
 	struct task_delay_info *delays;
 #endif
+#ifdef CONFIG_PSI
+	/* nesting depth of stall sections, see <linux/psi.h> */
+	unsigned char psi_nest[NR_PSI_RESOURCES];
+#endif
 #ifdef CONFIG_FAULT_INJECTION
 	int make_it_fail;
 #endif
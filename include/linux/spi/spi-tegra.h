@@ -25,6 +25,8 @@ struct tegra_spi_platform_data {
 	int dma_req_sel;
 	unsigned int spi_max_frequency;
 	bool is_clkon_always;
+	/* run the SPI core message pump as a SCHED_FIFO thread */
+	bool rt_message_pump;
 };
 
 /*
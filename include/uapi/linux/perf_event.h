@@ -272,8 +272,10 @@ struct perf_event_attr {
 
 				exclude_callchain_kernel : 1, /* exclude kernel callchains */
 				exclude_callchain_user   : 1, /* exclude user callchains */
+				flight_recorder : 1, /* overwrite, no wakeups, compact */
+				stack_user_dedup : 1, /* dedup STACK_USER dumps */
 
-				__reserved_1   : 41;
+				__reserved_1   : 39;
 
 	union {
 		__u32		wakeup_events;	  /* wakeup every n events */
@@ -318,6 +320,7 @@ struct perf_event_attr {
 #define PERF_EVENT_IOC_PERIOD		_IOW('$', 4, __u64)
 #define PERF_EVENT_IOC_SET_OUTPUT	_IO ('$', 5)
 #define PERF_EVENT_IOC_SET_FILTER	_IOW('$', 6, char *)
+#define PERF_EVENT_IOC_PAUSE_OUTPUT	_IOW('$', 9, __u32)
 
 enum perf_event_ioc_flags {
 	PERF_IOC_FLAG_GROUP		= 1U << 0,
@@ -420,7 +423,22 @@ struct perf_event_mmap_page {
 		 * Hole for extension of the self monitor capabilities
 		 */
 
-	__u64	__reserved[120];	/* align to 1k */
+	__u64	__reserved[118];	/* align to 1k */
+
+	/*
+	 * Flight recorder mode (attr.flight_recorder). These fields are
+	 * taken from the top of the hole, which upstream extends from the
+	 * bottom. They are valid only if fr_version is non-zero; it is set
+	 * to PERF_FR_VERSION for flight recorder buffers.
+	 *
+	 * data_fr_key: while output is paused with PERF_EVENT_IOC_PAUSE_OUTPUT,
+	 * the offset in the data section of the oldest record still in the
+	 * buffer from which samples can be decoded, see
+	 * PERF_RECORD_SAMPLE_COMPACT.
+	 */
+	__u32	fr_version;
+	__u32	__reserved_fr;
+	__u64	data_fr_key;
 
 	/*
 	 * Control data for the mmap() data buffer.
@@ -439,6 +457,8 @@ struct perf_event_mmap_page {
 	__u64	data_tail;		/* user-space written tail */
 };
 
+#define PERF_FR_VERSION				1
+
 #define PERF_RECORD_MISC_CPUMODE_MASK		(7 << 0)
 #define PERF_RECORD_MISC_CPUMODE_UNKNOWN	(0 << 0)
 #define PERF_RECORD_MISC_KERNEL			(1 << 0)
@@ -447,6 +467,17 @@ struct perf_event_mmap_page {
 #define PERF_RECORD_MISC_GUEST_KERNEL		(4 << 0)
 #define PERF_RECORD_MISC_GUEST_USER		(5 << 0)
 
+/*
+ * The PERF_SAMPLE_STACK_USER dump of this sample was left out (size 0)
+ * because it is identical to the last dump in the buffer, attr.stack_user_dedup.
+ */
+#define PERF_RECORD_MISC_STACK_DUP		(1 << 11)
+/*
+ * Flight recorder key sample: a full PERF_RECORD_SAMPLE whose ip and
+ * time are the base for the PERF_RECORD_SAMPLE_COMPACT records after it.
+ * Bits 3-11 are the ones upstream leaves unassigned.
+ */
+#define PERF_RECORD_MISC_FR_KEY			(1 << 10)
 #define PERF_RECORD_MISC_MMAP_DATA		(1 << 13)
 /*
  * Indicates that the content of PERF_SAMPLE_IP points to
@@ -600,6 +631,25 @@ enum perf_event_type {
 	 */
 	PERF_RECORD_SAMPLE			= 9,
 
+	/*
+	 * Flight recorder sample, only generated for attr.flight_recorder
+	 * events whose sample_type has no bits other than IP, TID and TIME.
+	 * ip and time are deltas against the previous PERF_RECORD_SAMPLE
+	 * with PERF_RECORD_MISC_FR_KEY set, or the previous compact sample:
+	 *
+	 * struct {
+	 *	struct perf_event_header	header;
+	 *
+	 *	s32				ip_delta;
+	 *	u32				time_delta;
+	 *	{ u32			pid, tid; } && PERF_SAMPLE_TID
+	 * };
+	 *
+	 * Upstream allocates record types upwards from 10 and perf tools
+	 * use 64 and above, so this one takes the top of the kernel range.
+	 */
+	PERF_RECORD_SAMPLE_COMPACT		= 63,
+
 	PERF_RECORD_MAX,			/* non-ABI */
 };
 
@@ -0,0 +1,46 @@
+/*
+ * Raw receive interface of the Tegra high-speed UART driver.
+ *
+ * While ttyTHS<n>_rx is open, data received on ttyTHS<n> bypasses the
+ * line discipline. Every read() returns one record: a struct
+ * tegra_uart_rx_hdr followed by hdr.len bytes of data, all from one burst
+ * of back-to-back characters. A burst longer than the read buffer is
+ * returned across several records.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef _UAPI_LINUX_SERIAL_TEGRA_H
+#define _UAPI_LINUX_SERIAL_TEGRA_H
+
+#include <linux/types.h>
+
+/* the data continues a burst begun in an earlier record */
+#define TEGRA_UART_RX_CONT	(1 << 0)
+/* the data ends its burst: the line went idle after the last byte */
+#define TEGRA_UART_RX_END	(1 << 1)
+/* data was dropped before this record, by the driver or the FIFO */
+#define TEGRA_UART_RX_LOST	(1 << 2)
+
+/**
+ * struct tegra_uart_rx_hdr - header of a raw receive record
+ * @timestamp_ns: CLOCK_MONOTONIC time the first byte of the burst
+ *		  finished arriving, in nanoseconds. The same for all
+ *		  records of a burst.
+ * @len: number of data bytes following the header
+ * @flags: TEGRA_UART_RX_* flags
+ */
+struct tegra_uart_rx_hdr {
+	__u64	timestamp_ns;
+	__u32	len;
+	__u32	flags;
+};
+
+#endif /* _UAPI_LINUX_SERIAL_TEGRA_H */
@@ -164,6 +164,51 @@ struct usb_functionfs_event {
  */
 #define	FUNCTIONFS_ENDPOINT_REVMAP	_IO('g', 129)
 
+/*
+ * Zero-copy transfers from and to dma-buf memory.  Called on an endpoint
+ * file.
+ *
+ * FUNCTIONFS_DMABUF_ATTACH maps the dma-buf whose fd is passed for the
+ * USB device controller; FUNCTIONFS_DMABUF_DETACH undoes it.  Buffers are
+ * detached when the file they were attached through is closed.
+ *
+ * FUNCTIONFS_DMABUF_TRANSFER queues one transfer of the first length bytes
+ * of an attached buffer and returns at once; the direction is that of the
+ * endpoint.  A buffer can have one transfer in flight, but any number of
+ * buffers can be queued on an endpoint.  Controllers without scatter-gather
+ * support need the buffer to be contiguous in their DMA address space.
+ *
+ * FUNCTIONFS_DMABUF_WAIT waits for the transfer of a buffer to finish and
+ * returns the number of bytes transferred or a negative error.  With
+ * O_NONBLOCK it fails with EAGAIN while the transfer is in flight.
+ */
+struct usb_ffs_dmabuf_transfer_req {
+	int	fd;
+	__u32	flags;		/* must be zero */
+	__u64	length;
+} __attribute__((packed));
+
+#define FUNCTIONFS_DMABUF_ATTACH	_IOW('g', 131, int)
+#define FUNCTIONFS_DMABUF_DETACH	_IOW('g', 132, int)
+#define FUNCTIONFS_DMABUF_TRANSFER	_IOW('g', 133, \
+					     struct usb_ffs_dmabuf_transfer_req)
+#define FUNCTIONFS_DMABUF_WAIT		_IOW('g', 134, int)
+
+/*
+ * Endpoint counters, read and cleared by FUNCTIONFS_ENDPOINT_STATS.
+ * An underrun is a transfer finishing with no other transfer queued
+ * behind it, leaving the endpoint idle until the next one comes.
+ */
+struct usb_ffs_ep_stats {
+	__u64	elapsed_ns;	/* since the counters were last cleared */
+	__u64	transfers;
+	__u64	bytes;
+	__u64	underruns;
+	__u64	errors;
+};
+
+#define FUNCTIONFS_ENDPOINT_STATS	_IOR('g', 135, struct usb_ffs_ep_stats)
+
 
 
 #endif /* _UAPI__LINUX_FUNCTIONFS_H__ */
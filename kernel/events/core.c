@@ -3331,6 +3331,7 @@ static inline int perf_fget_light(int fd, struct fd *p)
 static int perf_event_set_output(struct perf_event *event,
 				 struct perf_event *output_event);
 static int perf_event_set_filter(struct perf_event *event, void __user *arg);
+static struct ring_buffer *ring_buffer_get(struct perf_event *event);
 
 static long perf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
@@ -3376,6 +3377,18 @@ static long perf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case PERF_EVENT_IOC_SET_FILTER:
 		return perf_event_set_filter(event, (void __user *)arg);
 
+	case PERF_EVENT_IOC_PAUSE_OUTPUT:
+	{
+		struct ring_buffer *rb;
+
+		rb = ring_buffer_get(event);
+		if (!rb)
+			return -EINVAL;
+		rb_toggle_paused(rb, !!arg);
+		ring_buffer_put(rb);
+		return 0;
+	}
+
 	default:
 		return -ENOTTY;
 	}
@@ -3801,6 +3814,9 @@ again:
 	if (vma->vm_flags & VM_WRITE)
 		flags |= RING_BUFFER_WRITABLE;
 
+	if (event->attr.flight_recorder)
+		flags |= RING_BUFFER_FLIGHT_RECORDER;
+
 	rb = rb_alloc(nr_pages, 
 		event->attr.watermark ? event->attr.wakeup_watermark : 0,
 		event->cpu, flags);
@@ -3810,6 +3826,13 @@ again:
 		goto unlock;
 	}
 
+	if (event->attr.stack_user_dedup &&
+	    rb_alloc_ustack(rb, event->attr.sample_stack_user)) {
+		rb_free(rb);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
 	atomic_set(&rb->mmap_count, 1);
 	rb->mmap_locked = extra;
 	rb->mmap_user = get_current_user();
@@ -4044,6 +4067,88 @@ perf_output_sample_ustack(struct perf_output_handle *handle, u64 dump_size,
 	}
 }
 
+/*
+ * User stack dedup (attr.stack_user_dedup).
+ *
+ * Consecutive samples from a thread blocked or spinning in the same
+ * place carry identical stack dumps. Copy the stack into the buffer's
+ * scratch area first; if it matches the last dump written into the
+ * buffer, emit an empty dump flagged PERF_RECORD_MISC_STACK_DUP. A
+ * match only counts within the same wakeup batch and the newer half of
+ * the buffer, so the reader still has the dump it refers to.
+ *
+ * Runs with IRQs disabled, see perf_event_output().
+ */
+static void perf_sample_ustack_dedup(struct perf_event_header *header,
+				     struct perf_sample_data *data,
+				     struct perf_event *event)
+{
+	u64 size = data->stack_user_size;
+	struct ring_buffer *rb;
+	unsigned long sp;
+	unsigned int rem;
+	void *buf;
+
+	if (!size || in_nmi())
+		return;
+
+	if (event->parent)
+		rb = rcu_dereference(event->parent->rb);
+	else
+		rb = rcu_dereference(event->rb);
+	if (!rb || size > rb->ustack_buf_size)
+		return;
+
+	buf = rb->ustack_buf[!rb->ustack_cur];
+	sp = perf_user_stack_pointer(data->regs_user.regs);
+	rem = arch_perf_out_copy_user(buf, (void __user *)sp, size);
+
+	if (rb->ustack_valid && rb->ustack_sp == sp &&
+	    rb->ustack_dyn == size - rem &&
+	    rb->ustack_wakeup == local_read(&rb->wakeup) &&
+	    local_read(&rb->head) - rb->ustack_offset <=
+			perf_data_size(rb) / 2 &&
+	    !memcmp(buf, rb->ustack_buf[rb->ustack_cur], size - rem)) {
+		data->stack_user_dup = 1;
+		header->misc |= PERF_RECORD_MISC_STACK_DUP;
+		/* only the zero static size is left */
+		header->size -= size + sizeof(u64);
+		return;
+	}
+
+	data->stack_user_buf = buf;
+	data->stack_user_dyn = size - rem;
+}
+
+/*
+ * Write a dump prepared by perf_sample_ustack_dedup() and make it the
+ * one later samples are compared against.
+ */
+static void
+perf_output_sample_ustack_buf(struct perf_output_handle *handle,
+			      struct perf_sample_data *data)
+{
+	struct ring_buffer *rb = handle->rb;
+	u64 dump_size = data->stack_user_size;
+	u64 dyn_size = data->stack_user_dyn;
+
+	perf_output_put(handle, dump_size);
+	__output_copy(handle, data->stack_user_buf, dyn_size);
+	perf_output_skip(handle, dump_size - dyn_size);
+	perf_output_put(handle, dyn_size);
+
+	/* the buffer was swapped under us, don't trust its state */
+	if (rb->ustack_buf[!rb->ustack_cur] != data->stack_user_buf)
+		return;
+
+	rb->ustack_cur = !rb->ustack_cur;
+	rb->ustack_sp = perf_user_stack_pointer(data->regs_user.regs);
+	rb->ustack_dyn = dyn_size;
+	rb->ustack_offset = handle->offset;
+	rb->ustack_wakeup = local_read(&rb->wakeup);
+	rb->ustack_valid = 1;
+}
+
 static void __perf_event_header__init_id(struct perf_event_header *header,
 					 struct perf_sample_data *data,
 					 struct perf_event *event)
@@ -4273,7 +4378,7 @@ void perf_output_sample(struct perf_output_handle *handle,
 		}
 	}
 
-	if (!event->attr.watermark) {
+	if (!event->attr.watermark && !event->attr.flight_recorder) {
 		int wakeup_events = event->attr.wakeup_events;
 
 		if (wakeup_events) {
@@ -4322,10 +4427,18 @@ void perf_output_sample(struct perf_output_handle *handle,
 		}
 	}
 
-	if (sample_type & PERF_SAMPLE_STACK_USER)
-		perf_output_sample_ustack(handle,
-					  data->stack_user_size,
-					  data->regs_user.regs);
+	if (sample_type & PERF_SAMPLE_STACK_USER) {
+		if (data->stack_user_dup) {
+			u64 size = 0;
+			perf_output_put(handle, size);
+		} else if (data->stack_user_buf) {
+			perf_output_sample_ustack_buf(handle, data);
+		} else {
+			perf_output_sample_ustack(handle,
+						  data->stack_user_size,
+						  data->regs_user.regs);
+		}
+	}
 
 	if (sample_type & PERF_SAMPLE_WEIGHT)
 		perf_output_put(handle, data->weight);
@@ -4425,21 +4538,136 @@ void perf_prepare_sample(struct perf_event_header *header,
 
 		data->stack_user_size = stack_size;
 		header->size += size;
+
+		data->stack_user_buf = NULL;
+		data->stack_user_dup = 0;
+		if (event->attr.stack_user_dedup)
+			perf_sample_ustack_dedup(header, data, event);
 	}
 }
 
+#define PERF_FR_COMPACT_MASK \
+	(PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME)
+
+/*
+ * Flight recorder output (attr.flight_recorder).
+ *
+ * Samples whose sample_type fits in PERF_FR_COMPACT_MASK are written as
+ * PERF_RECORD_SAMPLE_COMPACT, with ip and time as deltas against the
+ * previous sample. A full sample tagged PERF_RECORD_MISC_FR_KEY resets
+ * the base; one is forced when a delta does not fit, after the buffer
+ * was paused and for the first sample starting in each page, so that
+ * decoding can start at the page rb_toggle_paused() reports.
+ *
+ * IRQs are disabled so that only an NMI can get between reading the
+ * base and reserving the record; NMI samples are written in full,
+ * untagged, and leave the base alone. The caller holds rcu_read_lock(),
+ * which keeps event->rb alive.
+ */
+static void perf_event_output_fr(struct perf_event *event,
+				 struct perf_event_header *header,
+				 struct perf_sample_data *data)
+{
+	struct perf_output_handle handle;
+	struct {
+		s32	ip;
+		u32	time;
+	} delta;
+	struct ring_buffer *rb;
+	unsigned long flags;
+	bool compact = false, key = false;
+	s64 ip_delta = 0, time_delta = 0;
+
+	local_irq_save(flags);
+
+	/* inherited events write into the parent's buffer */
+	if (event->parent)
+		rb = rcu_dereference(event->parent->rb);
+	else
+		rb = rcu_dereference(event->rb);
+	if (!rb)
+		goto out;
+
+	if (!in_nmi()) {
+		ip_delta = data->ip - rb->fr_ip;
+		time_delta = data->time - rb->fr_time;
+
+		if (!rb->fr_need_key &&
+		    !(event->attr.sample_type & ~PERF_FR_COMPACT_MASK) &&
+		    (local_read(&rb->head) >> PAGE_SHIFT) == rb->fr_key_page &&
+		    ip_delta == (s32)ip_delta &&
+		    time_delta >= 0 && time_delta <= UINT_MAX)
+			compact = true;
+		else
+			key = true;
+	}
+
+	if (compact) {
+		header->type = PERF_RECORD_SAMPLE_COMPACT;
+		header->size = sizeof(*header) + sizeof(delta);
+		if (event->attr.sample_type & PERF_SAMPLE_TID)
+			header->size += sizeof(data->tid_entry);
+	} else if (key) {
+		header->misc |= PERF_RECORD_MISC_FR_KEY;
+	}
+
+	if (perf_output_begin(&handle, event, header->size))
+		goto out;
+
+	if (compact) {
+		delta.ip = ip_delta;
+		delta.time = time_delta;
+		perf_output_put(&handle, *header);
+		perf_output_put(&handle, delta);
+		if (event->attr.sample_type & PERF_SAMPLE_TID)
+			perf_output_put(&handle, data->tid_entry);
+	} else {
+		perf_output_sample(&handle, header, data, event);
+	}
+
+	if (compact || key) {
+		rb = handle.rb;
+		rb->fr_ip = data->ip;
+		rb->fr_time = data->time;
+	}
+
+	if (key) {
+		rb->fr_need_key = 0;
+		rb->fr_key_page = handle.offset >> PAGE_SHIFT;
+		rb->fr_keys[rb->fr_key_page & (rb->fr_nr_keys - 1)] =
+			handle.offset;
+	}
+
+	perf_output_end(&handle);
+out:
+	local_irq_restore(flags);
+}
+
 static void perf_event_output(struct perf_event *event,
 				struct perf_sample_data *data,
 				struct pt_regs *regs)
 {
 	struct perf_output_handle handle;
 	struct perf_event_header header;
+	unsigned long flags;
 
 	/* protect the callchain buffers */
 	rcu_read_lock();
 
+	/*
+	 * Stack dedup state lives in the buffer between preparing and
+	 * writing the sample; keep other writers on this CPU out.
+	 */
+	if (event->attr.stack_user_dedup)
+		local_irq_save(flags);
+
 	perf_prepare_sample(&header, data, event, regs);
 
+	if (event->attr.flight_recorder) {
+		perf_event_output_fr(event, &header, data);
+		goto exit;
+	}
+
 	if (perf_output_begin(&handle, event, header.size))
 		goto exit;
 
@@ -4448,6 +4676,8 @@ static void perf_event_output(struct perf_event *event,
 	perf_output_end(&handle);
 
 exit:
+	if (event->attr.stack_user_dedup)
+		local_irq_restore(flags);
 	rcu_read_unlock();
 }
 
@@ -6469,6 +6699,22 @@ static int perf_copy_attr(struct perf_event_attr __user *uattr,
 			ret = -EINVAL;
 	}
 
+	if (attr->stack_user_dedup &&
+	    !(attr->sample_type & PERF_SAMPLE_STACK_USER))
+		ret = -EINVAL;
+
+	/*
+	 * The flight recorder delta-encodes against ip and time, so it
+	 * needs both in every sample.
+	 */
+	if (attr->flight_recorder) {
+		u64 needed = PERF_SAMPLE_IP | PERF_SAMPLE_TIME;
+
+		if (!attr->sample_period ||
+		    (attr->sample_type & needed) != needed)
+			ret = -EINVAL;
+	}
+
 out:
 	return ret;
 
@@ -6497,6 +6743,12 @@ perf_event_set_output(struct perf_event *event, struct perf_event *output_event)
 	if (output_event->cpu != event->cpu)
 		goto out;
 
+	/*
+	 * Don't mix flight recorder and regular output in one buffer.
+	 */
+	if (output_event->attr.flight_recorder != event->attr.flight_recorder)
+		goto out;
+
 	/*
 	 * If its not a per-cpu rb, it must be the same task.
 	 */
@@ -7,6 +7,7 @@
 /* Buffer handling */
 
 #define RING_BUFFER_WRITABLE		0x01
+#define RING_BUFFER_FLIGHT_RECORDER	0x02
 
 struct ring_buffer {
 	atomic_t			refcount;
@@ -17,6 +18,7 @@ struct ring_buffer {
 #endif
 	int				nr_pages;	/* nr of data pages  */
 	int				overwrite;	/* can overwrite itself */
+	int				paused;		/* drop all output */
 
 	atomic_t			poll;		/* POLL_ for wakeups */
 
@@ -27,6 +29,26 @@ struct ring_buffer {
 	local_t				lost;		/* nr records lost   */
 
 	long				watermark;	/* wakeup watermark  */
+
+	/* flight recorder, see perf_event_output_fr() */
+	int				flight_recorder;
+	int				fr_need_key;
+	u64				fr_ip;		/* delta base */
+	u64				fr_time;
+	unsigned long			fr_key_page;	/* page of last key */
+	int				fr_nr_keys;
+	unsigned long			*fr_keys;	/* key offset per page */
+
+	/* user stack dedup, see perf_sample_ustack_dedup() */
+	void				*ustack_buf[2];
+	u32				ustack_buf_size;
+	int				ustack_cur;	/* holds last dump */
+	int				ustack_valid;
+	unsigned long			ustack_sp;
+	u64				ustack_dyn;
+	unsigned long			ustack_offset;	/* of last dump */
+	unsigned long			ustack_wakeup;
+
 	/* poll crap */
 	spinlock_t			event_lock;
 	struct list_head		event_list;
@@ -43,6 +65,8 @@ extern void rb_free(struct ring_buffer *rb);
 extern struct ring_buffer *
 rb_alloc(int nr_pages, long watermark, int cpu, int flags);
 extern void perf_event_wakeup(struct perf_event *event);
+extern void rb_toggle_paused(struct ring_buffer *rb, bool pause);
+extern int rb_alloc_ustack(struct ring_buffer *rb, u32 size);
 
 extern void
 perf_event_header__init_id(struct perf_event_header *header,
@@ -170,6 +170,13 @@ int perf_output_begin(struct perf_output_handle *handle,
 
 	perf_output_get_handle(handle);
 
+	/*
+	 * Checked with preemption disabled so that rb_toggle_paused() can
+	 * wait for writers that still saw the buffer running.
+	 */
+	if (unlikely(rb->paused))
+		goto fail;
+
 	do {
 		/*
 		 * Userspace could choose to issue a mb() before updating the
@@ -186,9 +193,12 @@ int perf_output_begin(struct perf_output_handle *handle,
 			goto fail;
 	} while (local_cmpxchg(&rb->head, offset, head) != offset);
 
-	if (head - local_read(&rb->wakeup) > rb->watermark)
+	if (!rb->flight_recorder &&
+	    head - local_read(&rb->wakeup) > rb->watermark)
 		local_add(rb->watermark, &rb->wakeup);
 
+	handle->offset = offset;
+
 	handle->page = offset >> (PAGE_SHIFT + page_order(rb));
 	handle->page &= rb->nr_pages - 1;
 	handle->size = offset & ((PAGE_SIZE << page_order(rb)) - 1);
@@ -204,6 +214,7 @@ int perf_output_begin(struct perf_output_handle *handle,
 
 		perf_output_put(handle, lost_event);
 		perf_event__output_id_sample(event, handle, &sample_data);
+		handle->offset += lost_event.header.size;
 	}
 
 	return 0;
@@ -235,7 +246,77 @@ void perf_output_end(struct perf_output_handle *handle)
 	rcu_read_unlock();
 }
 
-static void
+/*
+ * Offset of the oldest flight recorder key sample that has not been
+ * overwritten yet. Every page that a sample starts in also has a key
+ * sample starting in it, so only the first candidate page can miss.
+ */
+static unsigned long rb_fr_oldest_key(struct ring_buffer *rb)
+{
+	unsigned long size = perf_data_size(rb);
+	unsigned long head = local_read(&rb->head);
+	unsigned long page, key;
+
+	if (head <= size)
+		return 0;
+
+	for (page = (head - size) >> PAGE_SHIFT;
+	     page <= head >> PAGE_SHIFT; page++) {
+		key = rb->fr_keys[page & (rb->fr_nr_keys - 1)];
+		if ((key >> PAGE_SHIFT) == page && key >= head - size)
+			return key;
+	}
+
+	return head;
+}
+
+/*
+ * Stop or restart all output into @rb. Pausing is the flight recorder's
+ * snapshot trigger: once it returns, the buffer contents are stable and
+ * user_page->data_fr_key tells userspace where to start decoding.
+ *
+ * Sleeps, the caller must hold a reference on @rb.
+ */
+void rb_toggle_paused(struct ring_buffer *rb, bool pause)
+{
+	if (!pause) {
+		rb->fr_need_key = 1;
+		smp_wmb();
+		rb->paused = 0;
+		return;
+	}
+
+	rb->paused = 1;
+
+	/* writers run with preemption disabled, see perf_output_begin() */
+	synchronize_sched();
+
+	if (rb->flight_recorder)
+		rb->user_page->data_fr_key = rb_fr_oldest_key(rb);
+	smp_wmb();
+	rb->user_page->data_head = local_read(&rb->head);
+}
+
+/*
+ * Two copies of the user stack, the last one dumped into the buffer and
+ * a scratch one for the sample being prepared.
+ */
+int rb_alloc_ustack(struct ring_buffer *rb, u32 size)
+{
+	void *buf;
+
+	buf = kmalloc(2 * size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	rb->ustack_buf[0] = buf;
+	rb->ustack_buf[1] = buf + size;
+	rb->ustack_buf_size = size;
+
+	return 0;
+}
+
+static int
 ring_buffer_init(struct ring_buffer *rb, long watermark, int flags)
 {
 	long max_size = perf_data_size(rb);
@@ -246,15 +327,29 @@ ring_buffer_init(struct ring_buffer *rb, long watermark, int flags)
 	if (!rb->watermark)
 		rb->watermark = max_size / 2;
 
-	if (flags & RING_BUFFER_WRITABLE)
+	if ((flags & RING_BUFFER_WRITABLE) &&
+	    !(flags & RING_BUFFER_FLIGHT_RECORDER))
 		rb->overwrite = 0;
 	else
 		rb->overwrite = 1;
 
+	if (flags & RING_BUFFER_FLIGHT_RECORDER) {
+		rb->fr_nr_keys = max_size >> PAGE_SHIFT;
+		rb->fr_keys = kcalloc(rb->fr_nr_keys, sizeof(unsigned long),
+				      GFP_KERNEL);
+		if (!rb->fr_keys)
+			return -ENOMEM;
+		rb->flight_recorder = 1;
+		rb->fr_need_key = 1;
+		rb->user_page->fr_version = PERF_FR_VERSION;
+	}
+
 	atomic_set(&rb->refcount, 1);
 
 	INIT_LIST_HEAD(&rb->event_list);
 	spin_lock_init(&rb->event_lock);
+
+	return 0;
 }
 
 #ifndef CONFIG_PERF_USE_VMALLOC
@@ -313,7 +408,8 @@ struct ring_buffer *rb_alloc(int nr_pages, long watermark, int cpu, int flags)
 
 	rb->nr_pages = nr_pages;
 
-	ring_buffer_init(rb, watermark, flags);
+	if (ring_buffer_init(rb, watermark, flags))
+		goto fail_data_pages;
 
 	return rb;
 
@@ -345,6 +441,8 @@ void rb_free(struct ring_buffer *rb)
 	perf_mmap_free_page((unsigned long)rb->user_page);
 	for (i = 0; i < rb->nr_pages; i++)
 		perf_mmap_free_page((unsigned long)rb->data_pages[i]);
+	kfree(rb->ustack_buf[0]);
+	kfree(rb->fr_keys);
 	kfree(rb);
 }
 
@@ -386,6 +484,8 @@ static void rb_free_work(struct work_struct *work)
 		perf_mmap_unmark_page(base + (i * PAGE_SIZE));
 
 	vfree(base);
+	kfree(rb->ustack_buf[0]);
+	kfree(rb->fr_keys);
 	kfree(rb);
 }
 
@@ -418,10 +518,14 @@ struct ring_buffer *rb_alloc(int nr_pages, long watermark, int cpu, int flags)
 	rb->page_order = ilog2(nr_pages);
 	rb->nr_pages = !!nr_pages;
 
-	ring_buffer_init(rb, watermark, flags);
+	if (ring_buffer_init(rb, watermark, flags))
+		goto fail_init;
 
 	return rb;
 
+fail_init:
+	vfree(all_buf);
+
 fail_all_buf:
 	kfree(rb);
 
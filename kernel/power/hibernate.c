@@ -28,11 +28,13 @@
 #include <linux/syscore_ops.h>
 #include <linux/ctype.h>
 #include <linux/genhd.h>
+#include <linux/sched.h>
 
 #include "power.h"
 
 
 static int nocompress;
+static int compress_lz4;
 static int noresume;
 static int resume_wait;
 static int resume_delay;
@@ -256,6 +258,7 @@ void swsusp_show_speed(struct timeval *start, struct timeval *stop,
  */
 static int create_image(int platform_mode)
 {
+	u64 start;
 	int error;
 
 	error = dpm_suspend_end(PMSG_FREEZE);
@@ -287,7 +290,11 @@ static int create_image(int platform_mode)
 
 	in_suspend = 1;
 	save_processor_state();
+	start = local_clock();
 	error = swsusp_arch_suspend();
+	if (in_suspend)
+		hib_timing.snapshot_us = div_u64(local_clock() - start,
+						 NSEC_PER_USEC);
 	if (error)
 		printk(KERN_ERR "PM: Error %d creating hibernation image\n",
 			error);
@@ -670,6 +677,8 @@ int hibernate(void)
 			flags |= SF_NOCOMPRESS_MODE;
 		else
 		        flags |= SF_CRC32_MODE;
+		if (!nocompress && compress_lz4)
+			flags |= SF_LZ4_MODE;
 
 		pr_debug("PM: writing image.\n");
 		error = swsusp_write(flags);
@@ -1038,11 +1047,73 @@ static ssize_t reserved_size_store(struct kobject *kobj,
 
 power_attr(reserved_size);
 
+/*
+ * image_compressor - Compressor used for the next hibernation image.
+ *
+ * Show the available compressors with the selected one in brackets;
+ * write "lzo" or "lz4" to select one.
+ */
+static ssize_t image_compressor_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, compress_lz4 ? "lzo [lz4]\n" : "[lzo] lz4\n");
+}
+
+static ssize_t image_compressor_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t n)
+{
+	if (sysfs_streq(buf, "lzo"))
+		compress_lz4 = 0;
+	else if (sysfs_streq(buf, "lz4"))
+		compress_lz4 = 1;
+	else
+		return -EINVAL;
+
+	return n;
+}
+
+power_attr(image_compressor);
+
+/*
+ * hibernate_timing - Where the time of the last hibernation cycle went.
+ *
+ * The save side figures are carried in the image header, so after a
+ * resume they describe the image that was just restored.
+ */
+static ssize_t hibernate_timing_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	struct hib_timing *t = &hib_timing;
+
+	return sprintf(buf,
+		       "compressor %s\n"
+		       "snapshot_us %u\n"
+		       "save_ms %u\n"
+		       "save_cmp_wait_ms %u\n"
+		       "save_io_wait_ms %u\n"
+		       "save_pages %u\n"
+		       "save_disk_pages %u\n"
+		       "load_ms %u\n"
+		       "load_dec_wait_ms %u\n"
+		       "load_io_wait_ms %u\n",
+		       (t->flags & SF_NOCOMPRESS_MODE) ? "none" :
+		       (t->flags & SF_LZ4_MODE) ? "lz4" : "lzo",
+		       t->snapshot_us, t->save_ms, t->save_cmp_wait_ms,
+		       t->save_io_wait_ms, t->save_pages, t->save_disk_pages,
+		       t->load_ms, t->load_dec_wait_ms, t->load_io_wait_ms);
+}
+
+static struct kobj_attribute hibernate_timing_attr =
+	__ATTR_RO(hibernate_timing);
+
 static struct attribute * g[] = {
 	&disk_attr.attr,
 	&resume_attr.attr,
 	&image_size_attr.attr,
 	&reserved_size_attr.attr,
+	&image_compressor_attr.attr,
+	&hibernate_timing_attr.attr,
 	NULL,
 };
 
@@ -1088,6 +1159,8 @@ static int __init hibernate_setup(char *str)
 		noresume = 1;
 	else if (!strncmp(str, "nocompress", 10))
 		nocompress = 1;
+	else if (!strncmp(str, "lz4", 3))
+		compress_lz4 = 1;
 	return 1;
 }
 
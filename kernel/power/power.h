@@ -120,6 +120,10 @@ struct snapshot_handle {
 					 * snapshot_write_next() that it may
 					 * need to call wait_on_bio_chain()
 					 */
+	int		stable;		/* Set by snapshot_read_next() if the
+					 * buffer stays valid after the next
+					 * call, so it may be copied later
+					 */
 };
 
 /* This macro returns the address from/to which the caller of
@@ -149,6 +153,27 @@ extern int swsusp_swap_in_use(void);
 #define SF_PLATFORM_MODE	1
 #define SF_NOCOMPRESS_MODE	2
 #define SF_CRC32_MODE	        4
+#define SF_LZ4_MODE		8
+
+/*
+ * Timing of the last hibernation cycle, reported in /sys/power/hibernate_timing.
+ * The save side is carried to the boot kernel in the swap header and the
+ * whole structure lives in nosave memory, so it survives the restore.
+ */
+struct hib_timing {
+	u32	snapshot_us;		/* atomic copy of memory */
+	u32	save_ms;		/* writing the image */
+	u32	save_cmp_wait_ms;	/* of which waiting for compression */
+	u32	save_io_wait_ms;	/* of which waiting for I/O */
+	u32	save_pages;		/* image pages */
+	u32	save_disk_pages;	/* pages written after compression */
+	u32	load_ms;		/* reading the image */
+	u32	load_dec_wait_ms;	/* of which waiting for decompression */
+	u32	load_io_wait_ms;	/* of which waiting for I/O */
+	u32	flags;			/* SF_* flags of the image */
+};
+
+extern struct hib_timing hib_timing;
 
 /* kernel/power/hibernate.c */
 extern int swsusp_check(void);
@@ -1710,6 +1710,7 @@ int snapshot_read_next(struct snapshot_handle *handle)
 		if (!buffer)
 			return -ENOMEM;
 	}
+	handle->stable = 0;
 	if (!handle->cur) {
 		int error;
 
@@ -1738,7 +1739,9 @@ int snapshot_read_next(struct snapshot_handle *handle)
 			kunmap_atomic(kaddr);
 			handle->buffer = buffer;
 		} else {
+			/* the copy stays put until the image is freed */
 			handle->buffer = page_address(page);
+			handle->stable = 1;
 		}
 	}
 	handle->cur++;
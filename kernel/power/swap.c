@@ -25,11 +25,13 @@
 #include <linux/pm.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
+#include <linux/lz4.h>
 #include <linux/vmalloc.h>
 #include <linux/cpumask.h>
 #include <linux/atomic.h>
 #include <linux/kthread.h>
 #include <linux/crc32.h>
+#include <linux/ktime.h>
 
 #include "power.h"
 
@@ -91,11 +93,13 @@ struct swap_map_handle {
 	unsigned int k;
 	unsigned long reqd_free_pages;
 	u32 crc32;
+	u64 io_wait_ns;
 };
 
 struct swsusp_header {
 	char reserved[PAGE_SIZE - 20 - sizeof(sector_t) - sizeof(int) -
-	              sizeof(u32)];
+	              sizeof(u32) - sizeof(struct hib_timing)];
+	struct hib_timing timing;
 	u32	crc32;
 	sector_t image;
 	unsigned int flags;	/* Flags to pass to the "boot" kernel */
@@ -105,6 +109,24 @@ struct swsusp_header {
 
 static struct swsusp_header *swsusp_header;
 
+struct hib_timing hib_timing __nosavedata;
+
+static inline u32 hib_ns_to_ms(u64 ns)
+{
+	return div_u64(ns, NSEC_PER_MSEC);
+}
+
+/* Wait for @bio_chain, accounting the time spent to @wait_ns. */
+static int hib_wait_io(struct bio **bio_chain, u64 *wait_ns)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = hib_wait_on_bio_chain(bio_chain);
+	*wait_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	return ret;
+}
+
 /**
  *	The following functions are used for tracing the allocated
  *	swap pages, so that they can be freed in case of an error.
@@ -230,6 +252,7 @@ static int mark_swapfiles(struct swap_map_handle *handle, unsigned int flags)
 		swsusp_header->flags = flags;
 		if (flags & SF_CRC32_MODE)
 			swsusp_header->crc32 = handle->crc32;
+		swsusp_header->timing = hib_timing;
 		error = hib_bio_write_page(swsusp_resume_block,
 					swsusp_header, NULL);
 	} else {
@@ -338,6 +361,7 @@ static int get_swap_writer(struct swap_map_handle *handle)
 	handle->k = 0;
 	handle->reqd_free_pages = reqd_free_pages();
 	handle->first_sector = handle->cur_swap;
+	handle->io_wait_ns = 0;
 	return 0;
 err_rel:
 	release_swap_writer(handle);
@@ -372,7 +396,7 @@ static int swap_write_page(struct swap_map_handle *handle, void *buf,
 		handle->k = 0;
 
 		if (bio_chain && low_free_pages() <= handle->reqd_free_pages) {
-			error = hib_wait_on_bio_chain(bio_chain);
+			error = hib_wait_io(bio_chain, &handle->io_wait_ns);
 			if (error)
 				goto out;
 			/*
@@ -427,6 +451,51 @@ static int swap_writer_finish(struct swap_map_handle *handle,
 /* Maximum number of threads for compression/decompression. */
 #define LZO_THREADS	3
 
+/*
+ * The image is written in LZO_UNC_SIZE blocks by either compressor; the
+ * buffers are sized for LZO, whose worst case is the larger one.
+ */
+struct hib_compressor {
+	const char *name;
+	size_t (*worst)(size_t len);
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrk);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			  unsigned char *dst, size_t *dst_len);
+};
+
+static size_t hib_lzo_worst(size_t len)
+{
+	return lzo1x_worst_compress(len);
+}
+
+static size_t hib_lz4_worst(size_t len)
+{
+	return lz4_compressbound(len);
+}
+
+static const struct hib_compressor hib_lzo = {
+	.name		= "LZO",
+	.worst		= hib_lzo_worst,
+	.compress	= lzo1x_1_compress,
+	.decompress	= lzo1x_decompress_safe,
+};
+
+static const struct hib_compressor hib_lz4 = {
+	.name		= "LZ4",
+	.worst		= hib_lz4_worst,
+	.compress	= lz4_compress,
+	.decompress	= lz4_decompress_unknownoutputsize,
+};
+
+static const struct hib_compressor *hib_compressor(unsigned int flags)
+{
+	return (flags & SF_LZ4_MODE) ? &hib_lz4 : &hib_lzo;
+}
+
+#define CMP_WRK_SIZE	(LZO1X_1_MEM_COMPRESS > LZ4_MEM_COMPRESS ? \
+			 LZO1X_1_MEM_COMPRESS : LZ4_MEM_COMPRESS)
+
 /* Minimum/maximum number of pages for read buffering. */
 #define LZO_MIN_RD_PAGES	1024
 #define LZO_MAX_RD_PAGES	8192
@@ -445,6 +514,7 @@ static int save_image(struct swap_map_handle *handle,
 	int nr_pages;
 	int err2;
 	struct bio *bio;
+	struct blk_plug plug;
 	struct timeval start;
 	struct timeval stop;
 
@@ -456,6 +526,7 @@ static int save_image(struct swap_map_handle *handle,
 	nr_pages = 0;
 	bio = NULL;
 	do_gettimeofday(&start);
+	blk_start_plug(&plug);
 	while (1) {
 		ret = snapshot_read_next(snapshot);
 		if (ret <= 0)
@@ -468,13 +539,18 @@ static int save_image(struct swap_map_handle *handle,
 			       nr_pages / m * 10);
 		nr_pages++;
 	}
-	err2 = hib_wait_on_bio_chain(&bio);
+	blk_finish_plug(&plug);
+	err2 = hib_wait_io(&bio, &handle->io_wait_ns);
 	do_gettimeofday(&stop);
 	if (!ret)
 		ret = err2;
 	if (!ret)
 		printk(KERN_INFO "PM: Image saving done.\n");
 	swsusp_show_speed(&start, &stop, nr_to_write, "Wrote");
+	hib_timing.save_ms = hib_ns_to_ms(timeval_to_ns(&stop) -
+					  timeval_to_ns(&start));
+	hib_timing.save_io_wait_ms = hib_ns_to_ms(handle->io_wait_ns);
+	hib_timing.save_disk_pages = nr_pages;
 	return ret;
 }
 
@@ -521,7 +597,7 @@ static int crc32_threadfn(void *data)
 	return 0;
 }
 /**
- * Structure used for LZO data compression.
+ * Structure used for LZO/LZ4 data compression.
  */
 struct cmp_data {
 	struct task_struct *thr;                  /* thread */
@@ -530,19 +606,26 @@ struct cmp_data {
 	int ret;                                  /* return code */
 	wait_queue_head_t go;                     /* start compression */
 	wait_queue_head_t done;                   /* compression done */
+	const struct hib_compressor *alg;         /* compressor */
 	size_t unc_len;                           /* uncompressed length */
 	size_t cmp_len;                           /* compressed length */
+	const void *src[LZO_UNC_PAGES];           /* pages still to copy */
 	unsigned char unc[LZO_UNC_SIZE];          /* uncompressed buffer */
 	unsigned char cmp[LZO_CMP_SIZE];          /* compressed buffer */
-	unsigned char wrk[LZO1X_1_MEM_COMPRESS];  /* compression workspace */
+	unsigned char wrk[CMP_WRK_SIZE];          /* compression workspace */
 };
 
 /**
  * Compression function that runs in its own thread.
+ *
+ * Image pages that stay in place are only recorded in @src by the main
+ * thread and copied here, so gathering the image is spread over all
+ * compression threads.
  */
-static int lzo_compress_threadfn(void *data)
+static int compress_threadfn(void *data)
 {
 	struct cmp_data *d = data;
+	size_t off;
 
 	while (1) {
 		wait_event(d->go, atomic_read(&d->ready) ||
@@ -556,7 +639,12 @@ static int lzo_compress_threadfn(void *data)
 		}
 		atomic_set(&d->ready, 0);
 
-		d->ret = lzo1x_1_compress(d->unc, d->unc_len,
+		for (off = 0; off < d->unc_len; off += PAGE_SIZE)
+			if (d->src[off / PAGE_SIZE])
+				memcpy(d->unc + off, d->src[off / PAGE_SIZE],
+				       PAGE_SIZE);
+
+		d->ret = d->alg->compress(d->unc, d->unc_len,
 		                          d->cmp + LZO_HEADER, &d->cmp_len,
 		                          d->wrk);
 		atomic_set(&d->stop, 1);
@@ -566,15 +654,21 @@ static int lzo_compress_threadfn(void *data)
 }
 
 /**
- * save_image_lzo - Save the suspend image data compressed with LZO.
+ * save_image_lzo - Save the suspend image data compressed with LZO or LZ4.
  * @handle: Swap mam handle to use for saving the image.
  * @snapshot: Image to read data from.
  * @nr_to_write: Number of pages to save.
+ * @flags: Image flags, selecting the compressor.
  */
 static int save_image_lzo(struct swap_map_handle *handle,
                           struct snapshot_handle *snapshot,
-                          unsigned int nr_to_write)
+                          unsigned int nr_to_write, unsigned int flags)
 {
+	const struct hib_compressor *alg = hib_compressor(flags);
+	u64 cmp_wait_ns = 0;
+	unsigned int disk_pages = 0;
+	struct blk_plug plug;
+	ktime_t wait_start;
 	unsigned int m;
 	int ret = 0;
 	int nr_pages;
@@ -625,8 +719,9 @@ static int save_image_lzo(struct swap_map_handle *handle,
 	for (thr = 0; thr < nr_threads; thr++) {
 		init_waitqueue_head(&data[thr].go);
 		init_waitqueue_head(&data[thr].done);
+		data[thr].alg = alg;
 
-		data[thr].thr = kthread_run(lzo_compress_threadfn,
+		data[thr].thr = kthread_run(compress_threadfn,
 		                            &data[thr],
 		                            "image_compress/%u", thr);
 		if (IS_ERR(data[thr].thr)) {
@@ -666,15 +761,16 @@ static int save_image_lzo(struct swap_map_handle *handle,
 	handle->reqd_free_pages = reqd_free_pages();
 
 	printk(KERN_INFO
-		"PM: Using %u thread(s) for compression.\n"
+		"PM: Using %u thread(s) for %s compression.\n"
 		"PM: Compressing and saving image data (%u pages)...\n",
-		nr_threads, nr_to_write);
+		nr_threads, alg->name, nr_to_write);
 	m = nr_to_write / 10;
 	if (!m)
 		m = 1;
 	nr_pages = 0;
 	bio = NULL;
 	do_gettimeofday(&start);
+	blk_start_plug(&plug);
 	for (;;) {
 		for (thr = 0; thr < nr_threads; thr++) {
 			for (off = 0; off < LZO_UNC_SIZE; off += PAGE_SIZE) {
@@ -685,8 +781,14 @@ static int save_image_lzo(struct swap_map_handle *handle,
 				if (!ret)
 					break;
 
-				memcpy(data[thr].unc + off,
-				       data_of(*snapshot), PAGE_SIZE);
+				if (snapshot->stable) {
+					data[thr].src[off / PAGE_SIZE] =
+						data_of(*snapshot);
+				} else {
+					data[thr].src[off / PAGE_SIZE] = NULL;
+					memcpy(data[thr].unc + off,
+					       data_of(*snapshot), PAGE_SIZE);
+				}
 
 				if (!(nr_pages % m))
 					printk(KERN_INFO
@@ -707,27 +809,37 @@ static int save_image_lzo(struct swap_map_handle *handle,
 		if (!thr)
 			break;
 
-		crc->run_threads = thr;
-		atomic_set(&crc->ready, 1);
-		wake_up(&crc->go);
-
+		/*
+		 * The uncompressed buffers are complete only once the threads
+		 * have copied their pages in, so the CRC has to wait for them.
+		 */
+		wait_start = ktime_get();
 		for (run_threads = thr, thr = 0; thr < run_threads; thr++) {
 			wait_event(data[thr].done,
 			           atomic_read(&data[thr].stop));
 			atomic_set(&data[thr].stop, 0);
+		}
+		cmp_wait_ns += ktime_to_ns(ktime_sub(ktime_get(), wait_start));
+
+		crc->run_threads = run_threads;
+		atomic_set(&crc->ready, 1);
+		wake_up(&crc->go);
 
+		for (thr = 0; thr < run_threads; thr++) {
 			ret = data[thr].ret;
 
 			if (ret < 0) {
-				printk(KERN_ERR "PM: LZO compression failed\n");
+				printk(KERN_ERR "PM: %s compression failed\n",
+				       alg->name);
 				goto out_finish;
 			}
 
 			if (unlikely(!data[thr].cmp_len ||
 			             data[thr].cmp_len >
-			             lzo1x_worst_compress(data[thr].unc_len))) {
+			             alg->worst(data[thr].unc_len))) {
 				printk(KERN_ERR
-				       "PM: Invalid LZO compressed length\n");
+				       "PM: Invalid %s compressed length\n",
+				       alg->name);
 				ret = -1;
 				goto out_finish;
 			}
@@ -750,6 +862,7 @@ static int save_image_lzo(struct swap_map_handle *handle,
 				ret = swap_write_page(handle, page, &bio);
 				if (ret)
 					goto out_finish;
+				disk_pages++;
 			}
 		}
 
@@ -758,13 +871,19 @@ static int save_image_lzo(struct swap_map_handle *handle,
 	}
 
 out_finish:
-	err2 = hib_wait_on_bio_chain(&bio);
+	blk_finish_plug(&plug);
+	err2 = hib_wait_io(&bio, &handle->io_wait_ns);
 	do_gettimeofday(&stop);
 	if (!ret)
 		ret = err2;
 	if (!ret)
 		printk(KERN_INFO "PM: Image saving done.\n");
 	swsusp_show_speed(&start, &stop, nr_to_write, "Wrote");
+	hib_timing.save_ms = hib_ns_to_ms(timeval_to_ns(&stop) -
+					  timeval_to_ns(&start));
+	hib_timing.save_cmp_wait_ms = hib_ns_to_ms(cmp_wait_ns);
+	hib_timing.save_io_wait_ms = hib_ns_to_ms(handle->io_wait_ns);
+	hib_timing.save_disk_pages = disk_pages;
 out_clean:
 	if (crc) {
 		if (crc->thr)
@@ -842,9 +961,11 @@ int swsusp_write(unsigned int flags)
 	header = (struct swsusp_info *)data_of(snapshot);
 	error = swap_write_page(&handle, header, NULL);
 	if (!error) {
+		hib_timing.flags = flags;
+		hib_timing.save_pages = pages;
 		error = (flags & SF_NOCOMPRESS_MODE) ?
 			save_image(&handle, &snapshot, pages - 1) :
-			save_image_lzo(&handle, &snapshot, pages - 1);
+			save_image_lzo(&handle, &snapshot, pages - 1, flags);
 	}
 out_finish:
 	error = swap_writer_finish(&handle, flags, error);
@@ -968,8 +1089,10 @@ static int load_image(struct swap_map_handle *handle,
 	struct timeval start;
 	struct timeval stop;
 	struct bio *bio;
+	struct blk_plug plug;
 	int err2;
 	unsigned nr_pages;
+	u64 io_wait_ns = 0;
 
 	printk(KERN_INFO "PM: Loading image data pages (%u pages)...\n",
 		nr_to_read);
@@ -979,6 +1102,7 @@ static int load_image(struct swap_map_handle *handle,
 	nr_pages = 0;
 	bio = NULL;
 	do_gettimeofday(&start);
+	blk_start_plug(&plug);
 	for ( ; ; ) {
 		ret = snapshot_write_next(snapshot);
 		if (ret <= 0)
@@ -987,7 +1111,7 @@ static int load_image(struct swap_map_handle *handle,
 		if (ret)
 			break;
 		if (snapshot->sync_read)
-			ret = hib_wait_on_bio_chain(&bio);
+			ret = hib_wait_io(&bio, &io_wait_ns);
 		if (ret)
 			break;
 		if (!(nr_pages % m))
@@ -995,8 +1119,12 @@ static int load_image(struct swap_map_handle *handle,
 			       nr_pages / m * 10);
 		nr_pages++;
 	}
-	err2 = hib_wait_on_bio_chain(&bio);
+	blk_finish_plug(&plug);
+	err2 = hib_wait_io(&bio, &io_wait_ns);
 	do_gettimeofday(&stop);
+	hib_timing.load_ms = hib_ns_to_ms(timeval_to_ns(&stop) -
+					  timeval_to_ns(&start));
+	hib_timing.load_io_wait_ms = hib_ns_to_ms(io_wait_ns);
 	if (!ret)
 		ret = err2;
 	if (!ret) {
@@ -1010,7 +1138,7 @@ static int load_image(struct swap_map_handle *handle,
 }
 
 /**
- * Structure used for LZO data decompression.
+ * Structure used for LZO/LZ4 data decompression.
  */
 struct dec_data {
 	struct task_struct *thr;                  /* thread */
@@ -1019,6 +1147,7 @@ struct dec_data {
 	int ret;                                  /* return code */
 	wait_queue_head_t go;                     /* start decompression */
 	wait_queue_head_t done;                   /* decompression done */
+	const struct hib_compressor *alg;         /* decompressor */
 	size_t unc_len;                           /* uncompressed length */
 	size_t cmp_len;                           /* compressed length */
 	unsigned char unc[LZO_UNC_SIZE];          /* uncompressed buffer */
@@ -1028,7 +1157,7 @@ struct dec_data {
 /**
  * Deompression function that runs in its own thread.
  */
-static int lzo_decompress_threadfn(void *data)
+static int decompress_threadfn(void *data)
 {
 	struct dec_data *d = data;
 
@@ -1045,8 +1174,8 @@ static int lzo_decompress_threadfn(void *data)
 		atomic_set(&d->ready, 0);
 
 		d->unc_len = LZO_UNC_SIZE;
-		d->ret = lzo1x_decompress_safe(d->cmp + LZO_HEADER, d->cmp_len,
-		                               d->unc, &d->unc_len);
+		d->ret = d->alg->decompress(d->cmp + LZO_HEADER, d->cmp_len,
+		                            d->unc, &d->unc_len);
 		atomic_set(&d->stop, 1);
 		wake_up(&d->done);
 	}
@@ -1054,15 +1183,21 @@ static int lzo_decompress_threadfn(void *data)
 }
 
 /**
- * load_image_lzo - Load compressed image data and decompress them with LZO.
+ * load_image_lzo - Load compressed image data and decompress them with LZO
+ * or LZ4.
  * @handle: Swap map handle to use for loading data.
  * @snapshot: Image to copy uncompressed data into.
  * @nr_to_read: Number of pages to load.
+ * @flags: Image flags, selecting the decompressor.
  */
 static int load_image_lzo(struct swap_map_handle *handle,
                           struct snapshot_handle *snapshot,
-                          unsigned int nr_to_read)
+                          unsigned int nr_to_read, unsigned int flags)
 {
+	const struct hib_compressor *alg = hib_compressor(flags);
+	u64 io_wait_ns = 0, dec_wait_ns = 0;
+	struct blk_plug plug;
+	ktime_t wait_start;
 	unsigned int m;
 	int ret = 0;
 	int eof = 0;
@@ -1117,7 +1252,8 @@ static int load_image_lzo(struct swap_map_handle *handle,
 		init_waitqueue_head(&data[thr].go);
 		init_waitqueue_head(&data[thr].done);
 
-		data[thr].thr = kthread_run(lzo_decompress_threadfn,
+		data[thr].alg = alg;
+		data[thr].thr = kthread_run(decompress_threadfn,
 		                            &data[thr],
 		                            "image_decompress/%u", thr);
 		if (IS_ERR(data[thr].thr)) {
@@ -1182,9 +1318,9 @@ static int load_image_lzo(struct swap_map_handle *handle,
 	want = ring_size = i;
 
 	printk(KERN_INFO
-		"PM: Using %u thread(s) for decompression.\n"
+		"PM: Using %u thread(s) for %s decompression.\n"
 		"PM: Loading and decompressing image data (%u pages)...\n",
-		nr_threads, nr_to_read);
+		nr_threads, alg->name, nr_to_read);
 	m = nr_to_read / 10;
 	if (!m)
 		m = 1;
@@ -1197,6 +1333,8 @@ static int load_image_lzo(struct swap_map_handle *handle,
 		goto out_finish;
 
 	for(;;) {
+		/* let the block layer merge the whole batch of reads */
+		blk_start_plug(&plug);
 		for (i = 0; !eof && i < want; i++) {
 			ret = swap_read_page(handle, page[ring], &bio);
 			if (ret) {
@@ -1206,6 +1344,7 @@ static int load_image_lzo(struct swap_map_handle *handle,
 				 */
 				if (handle->cur &&
 				    handle->cur->entries[handle->k]) {
+					blk_finish_plug(&plug);
 					goto out_finish;
 				} else {
 					eof = 1;
@@ -1215,6 +1354,7 @@ static int load_image_lzo(struct swap_map_handle *handle,
 			if (++ring >= ring_size)
 				ring = 0;
 		}
+		blk_finish_plug(&plug);
 		asked += i;
 		want -= i;
 
@@ -1225,7 +1365,7 @@ static int load_image_lzo(struct swap_map_handle *handle,
 			if (!asked)
 				break;
 
-			ret = hib_wait_on_bio_chain(&bio);
+			ret = hib_wait_io(&bio, &io_wait_ns);
 			if (ret)
 				goto out_finish;
 			have += asked;
@@ -1244,9 +1384,10 @@ static int load_image_lzo(struct swap_map_handle *handle,
 			data[thr].cmp_len = *(size_t *)page[pg];
 			if (unlikely(!data[thr].cmp_len ||
 			             data[thr].cmp_len >
-			             lzo1x_worst_compress(LZO_UNC_SIZE))) {
+			             alg->worst(LZO_UNC_SIZE))) {
 				printk(KERN_ERR
-				       "PM: Invalid LZO compressed length\n");
+				       "PM: Invalid %s compressed length\n",
+				       alg->name);
 				ret = -1;
 				goto out_finish;
 			}
@@ -1280,7 +1421,7 @@ static int load_image_lzo(struct swap_map_handle *handle,
 		 * Wait for more data while we are decompressing.
 		 */
 		if (have < LZO_CMP_PAGES && asked) {
-			ret = hib_wait_on_bio_chain(&bio);
+			ret = hib_wait_io(&bio, &io_wait_ns);
 			if (ret)
 				goto out_finish;
 			have += asked;
@@ -1290,15 +1431,19 @@ static int load_image_lzo(struct swap_map_handle *handle,
 		}
 
 		for (run_threads = thr, thr = 0; thr < run_threads; thr++) {
+			wait_start = ktime_get();
 			wait_event(data[thr].done,
 			           atomic_read(&data[thr].stop));
+			dec_wait_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							     wait_start));
 			atomic_set(&data[thr].stop, 0);
 
 			ret = data[thr].ret;
 
 			if (ret < 0) {
 				printk(KERN_ERR
-				       "PM: LZO decompression failed\n");
+				       "PM: %s decompression failed\n",
+				       alg->name);
 				goto out_finish;
 			}
 
@@ -1306,7 +1451,8 @@ static int load_image_lzo(struct swap_map_handle *handle,
 			             data[thr].unc_len > LZO_UNC_SIZE ||
 			             data[thr].unc_len & (PAGE_SIZE - 1))) {
 				printk(KERN_ERR
-				       "PM: Invalid LZO uncompressed length\n");
+				       "PM: Invalid %s uncompressed length\n",
+				       alg->name);
 				ret = -1;
 				goto out_finish;
 			}
@@ -1344,6 +1490,10 @@ out_finish:
 		atomic_set(&crc->stop, 0);
 	}
 	do_gettimeofday(&stop);
+	hib_timing.load_ms = hib_ns_to_ms(timeval_to_ns(&stop) -
+					  timeval_to_ns(&start));
+	hib_timing.load_dec_wait_ms = hib_ns_to_ms(dec_wait_ns);
+	hib_timing.load_io_wait_ms = hib_ns_to_ms(io_wait_ns);
 	if (!ret) {
 		printk(KERN_INFO "PM: Image loading done.\n");
 		snapshot_write_finalize(snapshot);
@@ -1405,7 +1555,8 @@ int swsusp_read(unsigned int *flags_p)
 	if (!error) {
 		error = (*flags_p & SF_NOCOMPRESS_MODE) ?
 			load_image(&handle, &snapshot, header->pages - 1) :
-			load_image_lzo(&handle, &snapshot, header->pages - 1);
+			load_image_lzo(&handle, &snapshot, header->pages - 1,
+				       *flags_p);
 	}
 	swap_reader_finish(&handle);
 end:
@@ -1435,6 +1586,8 @@ int swsusp_check(void)
 			goto put;
 
 		if (!memcmp(HIBERNATE_SIG, swsusp_header->sig, 10)) {
+			/* the save side timing of the image being resumed */
+			hib_timing = swsusp_header->timing;
 			memcpy(swsusp_header->sig, swsusp_header->orig_sig, 10);
 			/* Reset swap signature now */
 			error = hib_bio_write_page(swsusp_resume_block,
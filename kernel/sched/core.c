@@ -64,6 +64,7 @@
 #include <linux/tsacct_kern.h>
 #include <linux/kprobes.h>
 #include <linux/delayacct.h>
+#include <linux/psi.h>
 #include <linux/unistd.h>
 #include <linux/pagemap.h>
 #include <linux/hrtimer.h>
@@ -1747,6 +1748,10 @@ void sched_fork(struct task_struct *p)
 	if (likely(sched_info_on()))
 		memset(&p->sched_info, 0, sizeof(p->sched_info));
 #endif
+#ifdef CONFIG_PSI
+	/* a fork from inside a stall section must not nest the child */
+	memset(p->psi_nest, 0, sizeof(p->psi_nest));
+#endif
 #if defined(CONFIG_SMP)
 	p->on_cpu = 0;
 #endif
@@ -4598,12 +4603,14 @@ void __sched io_schedule(void)
 	struct rq *rq = raw_rq();
 
 	delayacct_blkio_start();
+	psi_iostall_enter();
 	atomic_inc(&rq->nr_iowait);
 	blk_flush_plug(current);
 	current->in_iowait = 1;
 	schedule();
 	current->in_iowait = 0;
 	atomic_dec(&rq->nr_iowait);
+	psi_iostall_leave();
 	delayacct_blkio_end();
 }
 EXPORT_SYMBOL(io_schedule);
@@ -4614,12 +4621,14 @@ long __sched io_schedule_timeout(long timeout)
 	long ret;
 
 	delayacct_blkio_start();
+	psi_iostall_enter();
 	atomic_inc(&rq->nr_iowait);
 	blk_flush_plug(current);
 	current->in_iowait = 1;
 	ret = schedule_timeout(timeout);
 	current->in_iowait = 0;
 	atomic_dec(&rq->nr_iowait);
+	psi_iostall_leave();
 	delayacct_blkio_end();
 	return ret;
 }
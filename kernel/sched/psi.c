@@ -0,0 +1,405 @@
+/*
+ * kernel/sched/psi.c
+ *
+ * Pressure stall information: how much of the time tasks are stalled
+ * waiting on memory (direct reclaim, swap-in) and on block I/O.
+ *
+ * For each resource we track the number of tasks currently inside a
+ * stall section and accumulate the wall time during which that number
+ * was non-zero ("some" in the upstream terminology). A deferrable work
+ * item turns the accumulated time into 10s/60s/300s running averages,
+ * reported in /proc/pressure/{io,memory} as
+ *
+ *	some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *
+ * with total in microseconds. Stall sections are entered from sleeping
+ * paths only, so a spinlock per resource is cheap compared to the wait
+ * it brackets.
+ *
+ * Triggers watch for a minimum amount of stall within a time window,
+ * see struct psi_trigger. While any are registered, a second work item
+ * samples the totals every PSI_POLL_INTERVAL.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include <linux/psi.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/init.h>
+
+#define PSI_FREQ		(2 * HZ)	/* averages update interval */
+#define PSI_POLL_INTERVAL	(HZ / 10)	/* trigger sampling interval */
+
+/* decay factors for 2s updates, 1/exp(2s/window) in FSHIFT fixed point */
+#define EXP_10s			1677
+#define EXP_60s			1981
+#define EXP_300s		2034
+
+#define PSI_WINDOW_MIN_US	(500ULL * USEC_PER_MSEC)
+#define PSI_WINDOW_MAX_US	(10ULL * USEC_PER_SEC)
+
+#define LOAD_INT(x) ((x) >> FSHIFT)
+#define LOAD_FRAC(x) LOAD_INT(((x) & (FIXED_1-1)) * 100)
+
+struct psi_resource {
+	spinlock_t lock;
+	unsigned int nr_stalled;	/* tasks in a stall section */
+	u64 stall_start;		/* when nr_stalled became non-zero */
+	u64 total;			/* ns during which nr_stalled > 0 */
+
+	/* updated by psi_avgs_work only */
+	u64 avg_total;
+	unsigned long avg[3];
+};
+
+static struct psi_resource psi_resources[NR_PSI_RESOURCES] = {
+	[PSI_IO] = {
+		.lock = __SPIN_LOCK_UNLOCKED(psi_resources[PSI_IO].lock),
+	},
+	[PSI_MEM] = {
+		.lock = __SPIN_LOCK_UNLOCKED(psi_resources[PSI_MEM].lock),
+	},
+};
+
+static u64 psi_avg_last_update;
+
+static DEFINE_MUTEX(psi_trigger_lock);
+static LIST_HEAD(psi_triggers);
+
+static void psi_avgs_work(struct work_struct *work);
+static DECLARE_DEFERRABLE_WORK(psi_avgs_dwork, psi_avgs_work);
+static void psi_poll_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(psi_poll_dwork, psi_poll_work);
+
+static inline u64 psi_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+void psi_stall_enter(enum psi_res res)
+{
+	struct psi_resource *r = &psi_resources[res];
+	u64 now = psi_now();
+
+	spin_lock(&r->lock);
+	if (r->nr_stalled++ == 0)
+		r->stall_start = now;
+	spin_unlock(&r->lock);
+}
+
+void psi_stall_leave(enum psi_res res)
+{
+	struct psi_resource *r = &psi_resources[res];
+	u64 now = psi_now();
+
+	spin_lock(&r->lock);
+	WARN_ON_ONCE(!r->nr_stalled);
+	if (--r->nr_stalled == 0)
+		r->total += now - r->stall_start;
+	spin_unlock(&r->lock);
+}
+
+/**
+ * psi_stall_total() - time spent with at least one task stalled
+ * @res: resource to report
+ *
+ * Returns nanoseconds since boot, including a stall in progress.
+ */
+u64 psi_stall_total(enum psi_res res)
+{
+	struct psi_resource *r = &psi_resources[res];
+	u64 now = psi_now();
+	u64 total;
+
+	spin_lock(&r->lock);
+	total = r->total;
+	if (r->nr_stalled)
+		total += now - r->stall_start;
+	spin_unlock(&r->lock);
+
+	return total;
+}
+EXPORT_SYMBOL_GPL(psi_stall_total);
+
+static unsigned long psi_calc_avg(unsigned long avg, unsigned long exp,
+				  unsigned long sample)
+{
+	avg *= exp;
+	avg += sample * (FIXED_1 - exp);
+	avg += 1UL << (FSHIFT - 1);
+	return avg >> FSHIFT;
+}
+
+static void psi_avgs_work(struct work_struct *work)
+{
+	u64 now = psi_now();
+	u64 period = now - psi_avg_last_update;
+	int res;
+
+	psi_avg_last_update = now;
+	for (res = 0; res < NR_PSI_RESOURCES; res++) {
+		struct psi_resource *r = &psi_resources[res];
+		u64 total = psi_stall_total(res);
+		u64 delta = total - r->avg_total;
+		unsigned long pct;
+
+		r->avg_total = total;
+		if (delta > period)
+			delta = period;
+		/* percentage of the period, in FIXED_1 fixed point */
+		pct = div64_u64(delta * 100 * FIXED_1, period ? period : 1);
+		r->avg[0] = psi_calc_avg(r->avg[0], EXP_10s, pct);
+		r->avg[1] = psi_calc_avg(r->avg[1], EXP_60s, pct);
+		r->avg[2] = psi_calc_avg(r->avg[2], EXP_300s, pct);
+	}
+
+	schedule_delayed_work(&psi_avgs_dwork, PSI_FREQ);
+}
+
+static void psi_trigger_check(struct psi_trigger *t, u64 now)
+{
+	u64 total = psi_stall_total(t->res);
+	u64 growth;
+
+	/* restart the window once it has fully elapsed */
+	if (now - t->win_start >= t->window) {
+		t->win_start = now;
+		t->win_start_total = total;
+		return;
+	}
+
+	growth = total - t->win_start_total;
+	if (growth < t->threshold)
+		return;
+
+	/* at most one event per window */
+	if (now - t->last_event < t->window)
+		return;
+	t->last_event = now;
+
+	if (t->notify) {
+		t->notify(t, growth);
+	} else {
+		t->event = 1;
+		wake_up_interruptible(&t->event_wait);
+	}
+}
+
+static void psi_poll_work(struct work_struct *work)
+{
+	struct psi_trigger *t;
+	u64 now = psi_now();
+
+	mutex_lock(&psi_trigger_lock);
+	list_for_each_entry(t, &psi_triggers, node)
+		psi_trigger_check(t, now);
+	if (!list_empty(&psi_triggers))
+		schedule_delayed_work(&psi_poll_dwork, PSI_POLL_INTERVAL);
+	mutex_unlock(&psi_trigger_lock);
+}
+
+/**
+ * psi_trigger_register() - start watching for a stall threshold
+ * @t: trigger with res, threshold, window and optionally notify set;
+ *     threshold and window are in nanoseconds
+ *
+ * Returns 0 or -EINVAL if the window is outside 500ms..10s or the
+ * threshold does not fit in it.
+ */
+int psi_trigger_register(struct psi_trigger *t)
+{
+	u64 now = psi_now();
+
+	if (t->res >= NR_PSI_RESOURCES)
+		return -EINVAL;
+	if (t->window < PSI_WINDOW_MIN_US * NSEC_PER_USEC ||
+	    t->window > PSI_WINDOW_MAX_US * NSEC_PER_USEC)
+		return -EINVAL;
+	if (!t->threshold || t->threshold > t->window)
+		return -EINVAL;
+
+	t->win_start = now;
+	t->win_start_total = psi_stall_total(t->res);
+	t->last_event = now - t->window;
+	t->event = 0;
+	init_waitqueue_head(&t->event_wait);
+
+	mutex_lock(&psi_trigger_lock);
+	if (list_empty(&psi_triggers))
+		schedule_delayed_work(&psi_poll_dwork, PSI_POLL_INTERVAL);
+	list_add(&t->node, &psi_triggers);
+	mutex_unlock(&psi_trigger_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(psi_trigger_register);
+
+/**
+ * psi_trigger_unregister() - stop watching
+ * @t: registered trigger
+ *
+ * The notify callback is not running and will not run once this returns.
+ */
+void psi_trigger_unregister(struct psi_trigger *t)
+{
+	mutex_lock(&psi_trigger_lock);
+	list_del(&t->node);
+	mutex_unlock(&psi_trigger_lock);
+	/*
+	 * The poll work rechecks the list under the mutex and stops
+	 * rescheduling itself once it is empty.
+	 */
+}
+EXPORT_SYMBOL_GPL(psi_trigger_unregister);
+
+/* /proc/pressure/{io,memory} */
+
+struct psi_file {
+	enum psi_res res;
+	struct psi_trigger *trigger;	/* at most one per open file */
+};
+
+static int psi_show(struct seq_file *m, void *v)
+{
+	struct psi_file *pf = m->private;
+	struct psi_resource *r = &psi_resources[pf->res];
+	u64 total = psi_stall_total(pf->res);
+
+	seq_printf(m, "some avg10=%lu.%02lu avg60=%lu.%02lu avg300=%lu.%02lu total=%llu\n",
+		   LOAD_INT(r->avg[0]), LOAD_FRAC(r->avg[0]),
+		   LOAD_INT(r->avg[1]), LOAD_FRAC(r->avg[1]),
+		   LOAD_INT(r->avg[2]), LOAD_FRAC(r->avg[2]),
+		   div_u64(total, NSEC_PER_USEC));
+	return 0;
+}
+
+static int psi_open(struct inode *inode, struct file *file)
+{
+	struct psi_file *pf;
+	int ret;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	pf->res = (enum psi_res)(unsigned long)PDE_DATA(inode);
+
+	ret = single_open(file, psi_show, pf);
+	if (ret)
+		kfree(pf);
+	return ret;
+}
+
+static ssize_t psi_write(struct file *file, const char __user *user_buf,
+			 size_t nbytes, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct psi_file *pf = seq->private;
+	struct psi_trigger *t;
+	char buf[32];
+	u32 threshold_us, window_us;
+	int ret;
+
+	if (!nbytes)
+		return -EINVAL;
+	nbytes = min(nbytes, sizeof(buf) - 1);
+	if (copy_from_user(buf, user_buf, nbytes))
+		return -EFAULT;
+	buf[nbytes] = '\0';
+
+	if (sscanf(buf, "some %u %u", &threshold_us, &window_us) != 2)
+		return -EINVAL;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	t->res = pf->res;
+	t->threshold = (u64)threshold_us * NSEC_PER_USEC;
+	t->window = (u64)window_us * NSEC_PER_USEC;
+
+	mutex_lock(&seq->lock);
+	if (pf->trigger) {
+		ret = -EBUSY;
+		goto err;
+	}
+	ret = psi_trigger_register(t);
+	if (ret)
+		goto err;
+	pf->trigger = t;
+	mutex_unlock(&seq->lock);
+
+	return nbytes;
+
+err:
+	mutex_unlock(&seq->lock);
+	kfree(t);
+	return ret;
+}
+
+static unsigned int psi_poll(struct file *file, poll_table *wait)
+{
+	struct seq_file *seq = file->private_data;
+	struct psi_file *pf = seq->private;
+	struct psi_trigger *t = ACCESS_ONCE(pf->trigger);
+	unsigned int ret = DEFAULT_POLLMASK;
+
+	if (!t)
+		return ret;
+
+	poll_wait(file, &t->event_wait, wait);
+	if (xchg(&t->event, 0))
+		ret |= POLLPRI;
+	return ret;
+}
+
+static int psi_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+	struct psi_file *pf = seq->private;
+
+	if (pf->trigger) {
+		psi_trigger_unregister(pf->trigger);
+		kfree(pf->trigger);
+	}
+	kfree(pf);
+	return single_release(inode, file);
+}
+
+static const struct file_operations psi_fops = {
+	.open		= psi_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= psi_write,
+	.poll		= psi_poll,
+	.release	= psi_release,
+};
+
+static int __init psi_proc_init(void)
+{
+	struct proc_dir_entry *dir;
+
+	psi_avg_last_update = psi_now();
+	schedule_delayed_work(&psi_avgs_dwork, PSI_FREQ);
+
+	dir = proc_mkdir("pressure", NULL);
+	if (!dir)
+		return -ENOMEM;
+	proc_create_data("io", S_IRUGO | S_IWUSR, dir, &psi_fops,
+			 (void *)(unsigned long)PSI_IO);
+	proc_create_data("memory", S_IRUGO | S_IWUSR, dir, &psi_fops,
+			 (void *)(unsigned long)PSI_MEM);
+	return 0;
+}
+module_init(psi_proc_init);
@@ -469,6 +469,7 @@ struct ring_buffer_per_cpu {
 	struct buffer_page		*tail_page;	/* write to tail */
 	struct buffer_page		*commit_page;	/* committed pages */
 	struct buffer_page		*reader_page;
+	void				*free_page;	/* spare read page */
 	unsigned long			lost_events;
 	unsigned long			last_overrun;
 	local_t				entries_bytes;
@@ -1249,6 +1250,8 @@ static void rb_free_cpu_buffer(struct ring_buffer_per_cpu *cpu_buffer)
 		free_buffer_page(bpage);
 	}
 
+	free_page((unsigned long)cpu_buffer->free_page);
+
 	kfree(cpu_buffer);
 }
 
@@ -4350,9 +4353,25 @@ out:
 EXPORT_SYMBOL_GPL(ring_buffer_swap_cpu);
 #endif /* CONFIG_RING_BUFFER_ALLOW_SWAP */
 
+/*
+ * The cpu buffer that caches the spare read page for @cpu, if any.
+ * Readers that are not bound to a cpu buffer pass cpu numbers such
+ * as RING_BUFFER_ALL_CPUS here; they simply bypass the cache.
+ */
+static struct ring_buffer_per_cpu *
+rb_read_page_cpu_buffer(struct ring_buffer *buffer, int cpu)
+{
+	if (cpu < 0 || cpu >= nr_cpu_ids ||
+	    !cpumask_test_cpu(cpu, buffer->cpumask))
+		return NULL;
+
+	return buffer->buffers[cpu];
+}
+
 /**
  * ring_buffer_alloc_read_page - allocate a page to read from buffer
  * @buffer: the buffer to allocate for.
+ * @cpu: the cpu buffer to allocate.
  *
  * This function is used in conjunction with ring_buffer_read_page.
  * When reading a full page from the ring buffer, these functions
@@ -4362,14 +4381,33 @@ EXPORT_SYMBOL_GPL(ring_buffer_swap_cpu);
  * of this function into ring_buffer_read_page, which will swap
  * the page that was allocated, with the read page of the buffer.
  *
+ * Each cpu buffer caches one page handed back by
+ * ring_buffer_free_read_page, so a reader that allocates and frees
+ * a page per read does not go to the page allocator every time.
+ *
  * Returns:
  *  The page allocated, or NULL on error.
  */
 void *ring_buffer_alloc_read_page(struct ring_buffer *buffer, int cpu)
 {
-	struct buffer_data_page *bpage;
+	struct ring_buffer_per_cpu *cpu_buffer;
+	struct buffer_data_page *bpage = NULL;
+	unsigned long flags;
 	struct page *page;
 
+	cpu_buffer = rb_read_page_cpu_buffer(buffer, cpu);
+	if (cpu_buffer) {
+		local_irq_save(flags);
+		arch_spin_lock(&cpu_buffer->lock);
+		bpage = cpu_buffer->free_page;
+		cpu_buffer->free_page = NULL;
+		arch_spin_unlock(&cpu_buffer->lock);
+		local_irq_restore(flags);
+	}
+
+	if (bpage)
+		goto out;
+
 	page = alloc_pages_node(cpu_to_node(cpu),
 				GFP_KERNEL | __GFP_NORETRY, 0);
 	if (!page)
@@ -4377,6 +4415,7 @@ void *ring_buffer_alloc_read_page(struct ring_buffer *buffer, int cpu)
 
 	bpage = page_address(page);
 
+ out:
 	rb_init_page(bpage);
 
 	return bpage;
@@ -4386,13 +4425,38 @@ EXPORT_SYMBOL_GPL(ring_buffer_alloc_read_page);
 /**
  * ring_buffer_free_read_page - free an allocated read page
  * @buffer: the buffer the page was allocate for
+ * @cpu: the cpu buffer the page came from
  * @data: the page to free
  *
- * Free a page allocated from ring_buffer_alloc_read_page.
+ * Free a page allocated from ring_buffer_alloc_read_page. If the
+ * cpu buffer has no spare page cached yet, the page is kept for the
+ * next ring_buffer_alloc_read_page on @cpu instead of being freed.
  */
-void ring_buffer_free_read_page(struct ring_buffer *buffer, void *data)
+void ring_buffer_free_read_page(struct ring_buffer *buffer, int cpu, void *data)
 {
-	free_page((unsigned long)data);
+	struct ring_buffer_per_cpu *cpu_buffer;
+	struct buffer_data_page *bpage = data;
+	unsigned long flags;
+
+	/* If the page is still in use someplace else, we can't reuse it */
+	if (page_count(virt_to_page(bpage)) > 1)
+		goto out;
+
+	cpu_buffer = rb_read_page_cpu_buffer(buffer, cpu);
+	if (!cpu_buffer)
+		goto out;
+
+	local_irq_save(flags);
+	arch_spin_lock(&cpu_buffer->lock);
+	if (!cpu_buffer->free_page) {
+		cpu_buffer->free_page = bpage;
+		bpage = NULL;
+	}
+	arch_spin_unlock(&cpu_buffer->lock);
+	local_irq_restore(flags);
+
+ out:
+	free_page((unsigned long)bpage);
 }
 EXPORT_SYMBOL_GPL(ring_buffer_free_read_page);
 
@@ -4410,7 +4474,7 @@ EXPORT_SYMBOL_GPL(ring_buffer_free_read_page);
  * to swap with a page in the ring buffer.
  *
  * for example:
- *	rpage = ring_buffer_alloc_read_page(buffer);
+ *	rpage = ring_buffer_alloc_read_page(buffer, cpu);
  *	if (!rpage)
  *		return error;
  *	ret = ring_buffer_read_page(buffer, &rpage, len, cpu, 0);
@@ -40,6 +40,23 @@ static int write_iteration = 50;
 module_param(write_iteration, uint, 0644);
 MODULE_PARM_DESC(write_iteration, "# of writes between timestamp readings");
 
+/*
+ * Each event size is a separate configuration: the producer hammers
+ * the buffer with events of that size for RUN_TIME seconds, and the
+ * ns/entry of every configuration is printed once all have run.
+ * Sizes up to RB_MAX_SMALL_DATA fit the compact event header, larger
+ * ones carry their length in array[0].
+ */
+#define RB_BENCH_MAX_SIZES	8
+
+static int event_size[RB_BENCH_MAX_SIZES] = { 10, 32, 128, 512 };
+static int nr_event_sizes = 4;
+module_param_array(event_size, int, &nr_event_sizes, 0444);
+MODULE_PARM_DESC(event_size, "event payload sizes to benchmark, in bytes");
+
+static int cur_size;
+static unsigned long size_avg[RB_BENCH_MAX_SIZES];
+
 static int producer_nice = 19;
 static int consumer_nice = 19;
 
@@ -165,7 +182,7 @@ static enum event_status read_page(int cpu)
 			}
 		}
 	}
-	ring_buffer_free_read_page(buffer, bpage);
+	ring_buffer_free_read_page(buffer, cpu, bpage);
 
 	if (ret < 0)
 		return EVENT_DROPPED;
@@ -221,13 +238,14 @@ static void ring_buffer_producer(void)
 	unsigned long missed = 0;
 	unsigned long hit = 0;
 	unsigned long avg;
+	int len = event_size[cur_size];
 	int cnt = 0;
 
 	/*
 	 * Hammer the buffer for 10 secs (this may
 	 * make the system stall)
 	 */
-	trace_printk("Starting ring buffer hammer\n");
+	trace_printk("Starting ring buffer hammer (%d byte events)\n", len);
 	do_gettimeofday(&start_tv);
 	do {
 		struct ring_buffer_event *event;
@@ -235,7 +253,7 @@ static void ring_buffer_producer(void)
 		int i;
 
 		for (i = 0; i < write_iteration; i++) {
-			event = ring_buffer_lock_reserve(buffer, 10);
+			event = ring_buffer_lock_reserve(buffer, len);
 			if (!event) {
 				missed++;
 			} else {
@@ -311,6 +329,7 @@ static void ring_buffer_producer(void)
 	    producer_nice == 19 && consumer_nice == 19)
 		trace_printk("WARNING!!! This test is running at lowest priority.\n");
 
+	trace_printk("Size:     %d (bytes)\n", len);
 	trace_printk("Time:     %lld (usecs)\n", time);
 	trace_printk("Overruns: %lld\n", overruns);
 	if (disable_reader)
@@ -332,10 +351,12 @@ static void ring_buffer_producer(void)
 
 	trace_printk("Entries per millisec: %ld\n", hit);
 
+	size_avg[cur_size] = 0;
 	if (hit) {
 		/* Calculate the average time in nanosecs */
 		avg = NSEC_PER_MSEC / hit;
 		trace_printk("%ld ns per entry\n", avg);
+		size_avg[cur_size] = avg;
 	}
 
 	if (missed) {
@@ -357,6 +378,17 @@ static void ring_buffer_producer(void)
 	}
 }
 
+static void ring_buffer_print_summary(void)
+{
+	int i;
+
+	trace_printk("Summary (%s):\n", disable_reader ?
+		     "reader disabled" : "with reader");
+	for (i = 0; i < nr_event_sizes; i++)
+		trace_printk("  %4d byte events: %ld ns per entry\n",
+			     event_size[i], size_avg[i]);
+}
+
 static void wait_to_die(void)
 {
 	set_current_state(TASK_INTERRUPTIBLE);
@@ -394,15 +426,21 @@ static int ring_buffer_producer_thread(void *arg)
 	init_completion(&read_start);
 
 	while (!kthread_should_stop() && !kill_test) {
-		ring_buffer_reset(buffer);
+		for (cur_size = 0; cur_size < nr_event_sizes && !kill_test;
+		     cur_size++) {
+			ring_buffer_reset(buffer);
+
+			if (consumer) {
+				smp_wmb();
+				wake_up_process(consumer);
+				wait_for_completion(&read_start);
+			}
 
-		if (consumer) {
-			smp_wmb();
-			wake_up_process(consumer);
-			wait_for_completion(&read_start);
+			ring_buffer_producer();
 		}
 
-		ring_buffer_producer();
+		if (!kill_test)
+			ring_buffer_print_summary();
 
 		trace_printk("Sleeping for 10 secs\n");
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -419,6 +457,13 @@ static int ring_buffer_producer_thread(void *arg)
 static int __init ring_buffer_benchmark_init(void)
 {
 	int ret;
+	int i;
+
+	/* the reader checks the cpu id stored in each event */
+	for (i = 0; i < nr_event_sizes; i++)
+		if (event_size[i] < sizeof(int) ||
+		    event_size[i] > PAGE_SIZE / 2)
+			return -EINVAL;
 
 	/* make a one meg buffer in overwite mode */
 	buffer = ring_buffer_alloc(1000000, RB_FL_OVERWRITE);
@@ -38,6 +38,7 @@
 #include <linux/poll.h>
 #include <linux/nmi.h>
 #include <linux/fs.h>
+#include <linux/lzo.h>
 #include <linux/sched/rt.h>
 
 #include "trace.h"
@@ -4763,6 +4764,11 @@ struct ftrace_buffer_info {
 	struct trace_iterator	iter;
 	void			*spare;
 	unsigned int		read;
+#ifdef CONFIG_TRACE_PIPE_LZO
+	void			*lzo_wrkmem;
+	unsigned char		*lzo_buf;
+	unsigned int		lzo_len;
+#endif
 };
 
 #ifdef CONFIG_TRACER_SNAPSHOT
@@ -5056,6 +5062,44 @@ tracing_buffers_poll(struct file *filp, poll_table *poll_table)
 	return trace_poll(iter, filp, poll_table);
 }
 
+/*
+ * Swap the next page of the cpu buffer into info->spare, waiting for
+ * data unless the file is non-blocking. Called with trace_types_lock
+ * held. Returns 1 if a page was read, 0 at the end of the buffer, or
+ * a negative error.
+ */
+static int tracing_buffers_get_page(struct file *filp, size_t len)
+{
+	struct ftrace_buffer_info *info = filp->private_data;
+	struct trace_iterator *iter = &info->iter;
+	int ret;
+
+ again:
+	trace_access_lock(iter->cpu_file);
+	ret = ring_buffer_read_page(iter->trace_buffer->buffer,
+				    &info->spare,
+				    len,
+				    iter->cpu_file, 0);
+	trace_access_unlock(iter->cpu_file);
+
+	if (ret >= 0)
+		return 1;
+
+	if (!trace_empty(iter))
+		return 0;
+
+	if ((filp->f_flags & O_NONBLOCK))
+		return -EAGAIN;
+
+	mutex_unlock(&trace_types_lock);
+	iter->trace->wait_pipe(iter);
+	mutex_lock(&trace_types_lock);
+	if (signal_pending(current))
+		return -EINTR;
+
+	goto again;
+}
+
 static ssize_t
 tracing_buffers_read(struct file *filp, char __user *ubuf,
 		     size_t count, loff_t *ppos)
@@ -5088,30 +5132,9 @@ tracing_buffers_read(struct file *filp, char __user *ubuf,
 	if (info->read < PAGE_SIZE)
 		goto read;
 
- again:
-	trace_access_lock(iter->cpu_file);
-	ret = ring_buffer_read_page(iter->trace_buffer->buffer,
-				    &info->spare,
-				    count,
-				    iter->cpu_file, 0);
-	trace_access_unlock(iter->cpu_file);
-
-	if (ret < 0) {
-		if (trace_empty(iter)) {
-			if ((filp->f_flags & O_NONBLOCK)) {
-				size = -EAGAIN;
-				goto out_unlock;
-			}
-			mutex_unlock(&trace_types_lock);
-			iter->trace->wait_pipe(iter);
-			mutex_lock(&trace_types_lock);
-			if (signal_pending(current)) {
-				size = -EINTR;
-				goto out_unlock;
-			}
-			goto again;
-		}
-		size = 0;
+	ret = tracing_buffers_get_page(filp, count);
+	if (ret <= 0) {
+		size = ret;
 		goto out_unlock;
 	}
 
@@ -5147,7 +5170,12 @@ static int tracing_buffers_release(struct inode *inode, struct file *file)
 	__trace_array_put(iter->tr);
 
 	if (info->spare)
-		ring_buffer_free_read_page(iter->trace_buffer->buffer, info->spare);
+		ring_buffer_free_read_page(iter->trace_buffer->buffer,
+					   iter->cpu_file, info->spare);
+#ifdef CONFIG_TRACE_PIPE_LZO
+	kfree(info->lzo_wrkmem);
+	kfree(info->lzo_buf);
+#endif
 	kfree(info);
 
 	mutex_unlock(&trace_types_lock);
@@ -5158,6 +5186,7 @@ static int tracing_buffers_release(struct inode *inode, struct file *file)
 struct buffer_ref {
 	struct ring_buffer	*buffer;
 	void			*page;
+	int			cpu;
 	int			ref;
 };
 
@@ -5169,7 +5198,7 @@ static void buffer_pipe_buf_release(struct pipe_inode_info *pipe,
 	if (--ref->ref)
 		return;
 
-	ring_buffer_free_read_page(ref->buffer, ref->page);
+	ring_buffer_free_read_page(ref->buffer, ref->cpu, ref->page);
 	kfree(ref);
 	buf->private = 0;
 }
@@ -5205,7 +5234,7 @@ static void buffer_spd_release(struct splice_pipe_desc *spd, unsigned int i)
 	if (--ref->ref)
 		return;
 
-	ring_buffer_free_read_page(ref->buffer, ref->page);
+	ring_buffer_free_read_page(ref->buffer, ref->cpu, ref->page);
 	kfree(ref);
 	spd->partial[i].private = 0;
 }
@@ -5272,7 +5301,8 @@ tracing_buffers_splice_read(struct file *file, loff_t *ppos,
 
 		ref->ref = 1;
 		ref->buffer = iter->trace_buffer->buffer;
-		ref->page = ring_buffer_alloc_read_page(ref->buffer, iter->cpu_file);
+		ref->cpu = iter->cpu_file;
+		ref->page = ring_buffer_alloc_read_page(ref->buffer, ref->cpu);
 		if (!ref->page) {
 			kfree(ref);
 			break;
@@ -5281,7 +5311,7 @@ tracing_buffers_splice_read(struct file *file, loff_t *ppos,
 		r = ring_buffer_read_page(ref->buffer, &ref->page,
 					  len, iter->cpu_file, 1);
 		if (r < 0) {
-			ring_buffer_free_read_page(ref->buffer, ref->page);
+			ring_buffer_free_read_page(ref->buffer, ref->cpu, ref->page);
 			kfree(ref);
 			break;
 		}
@@ -5333,6 +5363,108 @@ out:
 	return ret;
 }
 
+#ifdef CONFIG_TRACE_PIPE_LZO
+/*
+ * trace_pipe_lzo hands out the same sub-buffers as trace_pipe_raw,
+ * each one LZO compressed and prefixed by a struct trace_lzo_header.
+ * Long captures streamed to flash are dominated by the write
+ * bandwidth, and the event data compresses well.
+ */
+struct trace_lzo_header {
+	u32	raw_len;	/* bytes of the sub-buffer that were used */
+	u32	lzo_len;	/* bytes of compressed data that follow */
+};
+
+#define TRACE_LZO_BUF_SIZE	\
+	(sizeof(struct trace_lzo_header) + lzo1x_worst_compress(PAGE_SIZE))
+
+static int tracing_buffers_lzo_open(struct inode *inode, struct file *filp)
+{
+	struct ftrace_buffer_info *info;
+	int ret;
+
+	ret = tracing_buffers_open(inode, filp);
+	if (ret < 0)
+		return ret;
+
+	info = filp->private_data;
+	info->lzo_wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+	info->lzo_buf = kmalloc(TRACE_LZO_BUF_SIZE, GFP_KERNEL);
+	if (!info->lzo_wrkmem || !info->lzo_buf) {
+		tracing_buffers_release(inode, filp);
+		return -ENOMEM;
+	}
+	info->lzo_len = 0;
+
+	return 0;
+}
+
+static ssize_t
+tracing_buffers_lzo_read(struct file *filp, char __user *ubuf,
+			 size_t count, loff_t *ppos)
+{
+	struct ftrace_buffer_info *info = filp->private_data;
+	struct trace_iterator *iter = &info->iter;
+	struct trace_lzo_header *hdr;
+	size_t lzo_len;
+	ssize_t size;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	mutex_lock(&trace_types_lock);
+
+	if (!info->spare)
+		info->spare = ring_buffer_alloc_read_page(iter->trace_buffer->buffer,
+							  iter->cpu_file);
+	size = -ENOMEM;
+	if (!info->spare)
+		goto out_unlock;
+
+	/* Do we have previous compressed data to read? */
+	if (info->read < info->lzo_len)
+		goto read;
+
+	ret = tracing_buffers_get_page(filp, PAGE_SIZE);
+	if (ret <= 0) {
+		size = ret;
+		goto out_unlock;
+	}
+
+	hdr = (struct trace_lzo_header *)info->lzo_buf;
+	hdr->raw_len = min_t(size_t, ring_buffer_page_len(info->spare),
+			     PAGE_SIZE);
+	ret = lzo1x_1_compress(info->spare, hdr->raw_len,
+			       info->lzo_buf + sizeof(*hdr), &lzo_len,
+			       info->lzo_wrkmem);
+	if (WARN_ON_ONCE(ret != LZO_E_OK)) {
+		size = -EIO;
+		goto out_unlock;
+	}
+	hdr->lzo_len = lzo_len;
+	info->lzo_len = sizeof(*hdr) + lzo_len;
+	info->read = 0;
+ read:
+	size = info->lzo_len - info->read;
+	if (size > count)
+		size = count;
+
+	if (copy_to_user(ubuf, info->lzo_buf + info->read, size)) {
+		size = -EFAULT;
+		goto out_unlock;
+	}
+
+	*ppos += size;
+	info->read += size;
+
+ out_unlock:
+	mutex_unlock(&trace_types_lock);
+
+	return size;
+}
+#endif /* CONFIG_TRACE_PIPE_LZO */
+
 static const struct file_operations tracing_buffers_fops = {
 	.open		= tracing_buffers_open,
 	.read		= tracing_buffers_read,
@@ -5342,6 +5474,16 @@ static const struct file_operations tracing_buffers_fops = {
 	.llseek		= no_llseek,
 };
 
+#ifdef CONFIG_TRACE_PIPE_LZO
+static const struct file_operations tracing_buffers_lzo_fops = {
+	.open		= tracing_buffers_lzo_open,
+	.read		= tracing_buffers_lzo_read,
+	.poll		= tracing_buffers_poll,
+	.release	= tracing_buffers_release,
+	.llseek		= no_llseek,
+};
+#endif
+
 static ssize_t
 tracing_stats_read(struct file *filp, char __user *ubuf,
 		   size_t count, loff_t *ppos)
@@ -5637,6 +5779,11 @@ tracing_init_debugfs_percpu(struct trace_array *tr, long cpu)
 	trace_create_cpu_file("trace_pipe_raw", 0444, d_cpu,
 				tr, cpu, &tracing_buffers_fops);
 
+#ifdef CONFIG_TRACE_PIPE_LZO
+	trace_create_cpu_file("trace_pipe_lzo", 0444, d_cpu,
+				tr, cpu, &tracing_buffers_lzo_fops);
+#endif
+
 	trace_create_cpu_file("stats", 0444, d_cpu,
 				tr, cpu, &tracing_stats_fops);
 
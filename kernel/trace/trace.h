@@ -928,6 +928,10 @@ struct event_filter {
 	struct filter_pred	*preds;
 	struct filter_pred	*root;
 	char			*filter_string;
+#ifdef CONFIG_EVENT_FILTER_BPF
+	struct sk_filter __rcu	*prog;		/* compiled preds, or NULL */
+	unsigned int		prog_len;	/* record bytes prog reads */
+#endif
 };
 
 struct event_subsystem {
@@ -22,6 +22,8 @@
 #include <linux/ctype.h>
 #include <linux/mutex.h>
 #include <linux/perf_event.h>
+#include <linux/skbuff.h>
+#include <linux/filter.h>
 #include <linux/slab.h>
 
 #include "trace.h"
@@ -529,6 +531,24 @@ static int filter_match_preds_cb(enum move_type move, struct filter_pred *pred,
 	return WALK_PRED_DEFAULT;
 }
 
+#ifdef CONFIG_EVENT_FILTER_BPF
+static int filter_run_prog(struct sk_filter *prog, unsigned int len,
+			   void *rec)
+{
+	/*
+	 * The program only does BPF_ABS loads within the first @len bytes
+	 * of the record, so a linear skb around the record is all the JIT
+	 * or sk_run_filter() look at. The rest is zeroed all the same.
+	 */
+	struct sk_buff skb = {
+		.data	= rec,
+		.len	= len,
+	};
+
+	return SK_RUN_FILTER(prog, &skb);
+}
+#endif
+
 /* return 1 if event matches, 0 otherwise (discard) */
 int filter_match_preds(struct event_filter *filter, void *rec)
 {
@@ -539,6 +559,9 @@ int filter_match_preds(struct event_filter *filter, void *rec)
 		.match = -1,
 		.rec   = rec,
 	};
+#ifdef CONFIG_EVENT_FILTER_BPF
+	struct sk_filter *prog;
+#endif
 	int n_preds, ret;
 
 	/* no filter is considered a match */
@@ -556,6 +579,12 @@ int filter_match_preds(struct event_filter *filter, void *rec)
 	if (!root)
 		return 1;
 
+#ifdef CONFIG_EVENT_FILTER_BPF
+	prog = rcu_dereference_sched(filter->prog);
+	if (prog)
+		return filter_run_prog(prog, filter->prog_len, rec);
+#endif
+
 	data.preds = preds = rcu_dereference_sched(filter->preds);
 	ret = walk_pred_tree(preds, root, filter_match_preds_cb, &data);
 	WARN_ON(ret);
@@ -748,8 +777,24 @@ static int filter_set_pred(struct event_filter *filter,
 
 static void __free_preds(struct event_filter *filter)
 {
+#ifdef CONFIG_EVENT_FILTER_BPF
+	struct sk_filter *prog;
+#endif
 	int i;
 
+#ifdef CONFIG_EVENT_FILTER_BPF
+	/*
+	 * Like the preds, the prog of a filter that was ever published is
+	 * only freed after the synchronize_sched() that follows unhooking
+	 * the filter from its event.
+	 */
+	prog = rcu_dereference_protected(filter->prog, 1);
+	if (prog) {
+		RCU_INIT_POINTER(filter->prog, NULL);
+		sk_unattached_filter_destroy(prog);
+	}
+#endif
+
 	if (filter->preds) {
 		for (i = 0; i < filter->n_preds; i++)
 			kfree(filter->preds[i].ops);
@@ -1508,6 +1553,280 @@ static int fold_pred_tree(struct event_filter *filter,
 			      filter->preds);
 }
 
+#ifdef CONFIG_EVENT_FILTER_BPF
+/*
+ * Filters that only test integer fields of up to 32 bits are also
+ * compiled into a classic BPF program, so that matching is a straight
+ * run of loads and forward jumps instead of a walk of the predicate
+ * tree. With CONFIG_BPF_JIT the program is turned into native code by
+ * the architecture's BPF JIT. Filters on strings, 64 bit fields or
+ * ip keep using the tree walk.
+ *
+ * Each leaf jumps to the label of its true or false outcome. An AND
+ * sends a true left side into its right side and a false one to its
+ * own false label; an OR does the opposite. The two outermost labels
+ * are the final RET #1 and RET #0.
+ */
+#define FILTER_BPF_MATCH	0
+#define FILTER_BPF_NO_MATCH	1
+
+/* worst case per leaf: four byte loads to assemble a u32, sign bias, jump */
+#define FILTER_BPF_LEAF_INSNS	16
+
+struct filter_bpf_label {
+	unsigned short		t;
+	unsigned short		f;
+};
+
+struct filter_bpf_state {
+	struct filter_pred	*preds;
+	struct sock_filter	*insns;
+	struct filter_bpf_label	*jumps;		/* per insn, for fixup */
+	struct filter_bpf_label	*branch;	/* per pred */
+	unsigned short		*right;		/* per pred, label of right child */
+	int			*label_pc;
+	int			n_labels;
+	int			len;
+	int			max;
+	unsigned int		rec_len;
+};
+
+static int filter_bpf_emit(struct filter_bpf_state *s, u16 code, u32 k,
+			   unsigned short t, unsigned short f)
+{
+	struct sock_filter insn = BPF_STMT(code, k);
+
+	if (s->len == s->max)
+		return -E2BIG;
+
+	s->jumps[s->len].t = t;
+	s->jumps[s->len].f = f;
+	s->insns[s->len++] = insn;
+	return 0;
+}
+
+/* A = the field, in the byte order of the field */
+static int filter_bpf_load_host(struct filter_bpf_state *s, int offset,
+				int size)
+{
+	int err;
+	int i;
+
+#ifdef __LITTLE_ENDIAN
+	if (size > 1) {
+		err = filter_bpf_emit(s, BPF_LD | BPF_B | BPF_ABS,
+				      offset + size - 1, 0, 0);
+		for (i = size - 2; !err && i >= 0; i--) {
+			err = filter_bpf_emit(s, BPF_ALU | BPF_LSH | BPF_K,
+					      8, 0, 0) ?:
+			      filter_bpf_emit(s, BPF_MISC | BPF_TAX, 0, 0, 0) ?:
+			      filter_bpf_emit(s, BPF_LD | BPF_B | BPF_ABS,
+					      offset + i, 0, 0) ?:
+			      filter_bpf_emit(s, BPF_ALU | BPF_OR | BPF_X,
+					      0, 0, 0);
+		}
+		return err;
+	}
+#endif
+	return filter_bpf_emit(s, BPF_LD | BPF_ABS |
+			       (size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B),
+			       offset, 0, 0);
+}
+
+static int filter_bpf_leaf(struct filter_bpf_state *s, struct filter_pred *pred,
+			   unsigned short t, unsigned short f)
+{
+	struct ftrace_event_field *field = pred->field;
+	int size = field ? field->size : 0;
+	u32 mask, bias, val;
+	u16 code;
+	int err;
+
+	if (!field || field->filter_type != FILTER_OTHER ||
+	    (size != 1 && size != 2 && size != 4))
+		return -EINVAL;
+
+	s->rec_len = max_t(unsigned int, s->rec_len, pred->offset + size);
+	mask = size == 4 ? ~0U : (1U << (size * 8)) - 1;
+	val = (u32)pred->val & mask;
+
+	if (pred->op == OP_EQ || pred->op == OP_NE) {
+		/* BPF_ABS loads are big endian, swap the constant instead */
+		if (size == 4)
+			val = ntohl(val);
+		else if (size == 2)
+			val = ntohs(val);
+
+		err = filter_bpf_emit(s, BPF_LD | BPF_ABS |
+				      (size == 4 ? BPF_W :
+				       size == 2 ? BPF_H : BPF_B),
+				      pred->offset, 0, 0);
+		if (err)
+			return err;
+
+		if (pred->not)
+			swap(t, f);
+		return filter_bpf_emit(s, BPF_JMP | BPF_JEQ | BPF_K, val, t, f);
+	}
+
+	err = filter_bpf_load_host(s, pred->offset, size);
+	if (err)
+		return err;
+
+	/* BPF jumps compare unsigned; bias signed values into that order */
+	if (field->is_signed) {
+		bias = 1U << (size * 8 - 1);
+		val = (val + bias) & mask;
+		err = filter_bpf_emit(s, BPF_ALU | BPF_ADD | BPF_K,
+				      bias, 0, 0);
+		if (!err && size != 4)
+			err = filter_bpf_emit(s, BPF_ALU | BPF_AND | BPF_K,
+					      mask, 0, 0);
+		if (err)
+			return err;
+	}
+
+	switch (pred->op) {
+	case OP_LT:
+		code = BPF_JGE;
+		swap(t, f);
+		break;
+	case OP_LE:
+		code = BPF_JGT;
+		swap(t, f);
+		break;
+	case OP_GT:
+		code = BPF_JGT;
+		break;
+	case OP_GE:
+		code = BPF_JGE;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return filter_bpf_emit(s, BPF_JMP | code | BPF_K, val, t, f);
+}
+
+static int filter_bpf_cb(enum move_type move, struct filter_pred *pred,
+			 int *err, void *data)
+{
+	struct filter_bpf_state *s = data;
+	struct filter_bpf_label *b = &s->branch[pred - s->preds];
+	unsigned short right;
+
+	switch (move) {
+	case MOVE_DOWN:
+		if (pred->left == FILTER_PRED_INVALID) {
+			*err = filter_bpf_leaf(s, pred, b->t, b->f);
+			return *err ? WALK_PRED_ABORT : WALK_PRED_PARENT;
+		}
+
+		right = s->n_labels++;
+		s->right[pred - s->preds] = right;
+		s->branch[pred->left].t = pred->op == OP_AND ? right : b->t;
+		s->branch[pred->left].f = pred->op == OP_OR ? right : b->f;
+		s->branch[pred->right] = *b;
+		break;
+	case MOVE_UP_FROM_LEFT:
+		s->label_pc[s->right[pred - s->preds]] = s->len;
+		break;
+	case MOVE_UP_FROM_RIGHT:
+		break;
+	}
+
+	return WALK_PRED_DEFAULT;
+}
+
+static int filter_bpf_fixup(struct filter_bpf_state *s)
+{
+	int pc, jt, jf;
+
+	for (pc = 0; pc < s->len; pc++) {
+		if (BPF_CLASS(s->insns[pc].code) != BPF_JMP)
+			continue;
+
+		jt = s->label_pc[s->jumps[pc].t] - pc - 1;
+		jf = s->label_pc[s->jumps[pc].f] - pc - 1;
+		if (WARN_ON_ONCE(jt < 0 || jf < 0))
+			return -EINVAL;
+		/* conditional jumps only reach 255 insns ahead */
+		if (jt > 255 || jf > 255)
+			return -E2BIG;
+
+		s->insns[pc].jt = jt;
+		s->insns[pc].jf = jf;
+	}
+
+	return 0;
+}
+
+/*
+ * Compile the predicate tree of @filter. Failing to compile is not an
+ * error, the filter just keeps being matched by walking the tree.
+ */
+static void filter_compile_bpf(struct event_filter *filter,
+			       struct filter_pred *root)
+{
+	struct filter_bpf_state s = {
+		.preds	  = filter->preds,
+		.n_labels = 2,
+	};
+	struct sock_fprog fprog;
+	struct sk_filter *prog;
+	int n = filter->n_preds;
+	int err = -ENOMEM;
+
+	s.max = min(n * FILTER_BPF_LEAF_INSNS + 2, BPF_MAXINSNS);
+	s.insns = kcalloc(s.max, sizeof(*s.insns), GFP_KERNEL);
+	s.jumps = kcalloc(s.max, sizeof(*s.jumps), GFP_KERNEL);
+	s.branch = kcalloc(n, sizeof(*s.branch), GFP_KERNEL);
+	s.right = kcalloc(n, sizeof(*s.right), GFP_KERNEL);
+	s.label_pc = kcalloc(n + 2, sizeof(*s.label_pc), GFP_KERNEL);
+	if (!s.insns || !s.jumps || !s.branch || !s.right || !s.label_pc)
+		goto out;
+
+	s.branch[root - s.preds].t = FILTER_BPF_MATCH;
+	s.branch[root - s.preds].f = FILTER_BPF_NO_MATCH;
+
+	err = walk_pred_tree(s.preds, root, filter_bpf_cb, &s);
+	if (err)
+		goto out;
+
+	s.label_pc[FILTER_BPF_MATCH] = s.len;
+	err = filter_bpf_emit(&s, BPF_RET | BPF_K, 1, 0, 0);
+	if (err)
+		goto out;
+	s.label_pc[FILTER_BPF_NO_MATCH] = s.len;
+	err = filter_bpf_emit(&s, BPF_RET | BPF_K, 0, 0, 0);
+	if (err)
+		goto out;
+
+	err = filter_bpf_fixup(&s);
+	if (err)
+		goto out;
+
+	fprog.len = s.len;
+	fprog.filter = s.insns;
+	err = sk_unattached_filter_create(&prog, &fprog);
+	if (!err) {
+		filter->prog_len = s.rec_len;
+		rcu_assign_pointer(filter->prog, prog);
+	}
+ out:
+	kfree(s.insns);
+	kfree(s.jumps);
+	kfree(s.branch);
+	kfree(s.right);
+	kfree(s.label_pc);
+}
+#else
+static inline void filter_compile_bpf(struct event_filter *filter,
+				      struct filter_pred *root)
+{
+}
+#endif /* CONFIG_EVENT_FILTER_BPF */
+
 static int replace_preds(struct ftrace_event_call *call,
 			 struct event_filter *filter,
 			 struct filter_parse_state *ps,
@@ -1600,6 +1919,8 @@ static int replace_preds(struct ftrace_event_call *call,
 		if (err)
 			goto fail;
 
+		filter_compile_bpf(filter, root);
+
 		/* We don't set root until we know it works */
 		barrier();
 		filter->root = root;
@@ -2228,6 +2549,157 @@ static int test_walk_pred_cb(enum move_type move, struct filter_pred *pred,
 	return WALK_PRED_DEFAULT;
 }
 
+#define BENCH_REC(m, vprio, vnice, vpid, vdelta, vflags) \
+{ \
+	.filter = FILTER, \
+	.rec    = { .prio = vprio, .nice = vnice, .pid = vpid, \
+		    .delta = vdelta, .flags = vflags }, \
+	.match  = m, \
+}
+#define YES 1
+#define NO  0
+
+static struct test_filter_bench_t {
+	char *filter;
+	struct ftrace_raw_ftrace_test_filter_bench rec;
+	int match;
+} test_filter_bench[] = {
+#define FILTER "pid == 1234"
+	BENCH_REC(YES, 120, 0, 1234, 0, 0),
+	BENCH_REC(NO,  120, 0, 1235, 0, 0),
+#undef FILTER
+#define FILTER "prio < 100 && nice <= -5"
+	BENCH_REC(YES, 99, -5, 1, 0, 0),
+	BENCH_REC(NO,  99, -4, 1, 0, 0),
+	BENCH_REC(NO,  100, -20, 1, 0, 0),
+#undef FILTER
+#define FILTER "delta > -1000 && delta < 1000 && flags != 0x8000"
+	BENCH_REC(YES, 0, 0, 0, -999, 0x7fff),
+	BENCH_REC(NO,  0, 0, 0, -1000, 0),
+	BENCH_REC(NO,  0, 0, 0, 5, 0x8000),
+#undef FILTER
+#define FILTER "(pid >= 3000000000 || prio > 139) && " \
+	       "(nice < 0 || delta >= 0) && flags == 3"
+	BENCH_REC(YES, 0, -1, 3000000000U, -1, 3),
+	BENCH_REC(YES, 140, 1, 1, 0, 3),
+	BENCH_REC(NO,  139, -1, 2999999999U, 0, 3),
+	BENCH_REC(NO,  140, 1, 1, -1, 3),
+#undef FILTER
+#define FILTER "pid == 1 || pid == 2 || pid == 3 || pid == 4 || " \
+	       "pid == 5 || pid == 6 || pid == 7 || pid == 8"
+	BENCH_REC(YES, 0, 0, 8, 0, 0),
+	BENCH_REC(NO,  0, 0, 9, 0, 0),
+};
+
+#undef BENCH_REC
+#undef FILTER
+#undef YES
+#undef NO
+
+#ifdef CONFIG_EVENT_FILTER_BPF
+/* Make filter_match_preds() walk the tree until the prog is put back */
+static __init struct sk_filter *test_filter_detach_prog(struct event_filter *filter)
+{
+	struct sk_filter *prog = rcu_dereference_protected(filter->prog, 1);
+
+	RCU_INIT_POINTER(filter->prog, NULL);
+	return prog;
+}
+
+static __init void test_filter_attach_prog(struct event_filter *filter,
+					   struct sk_filter *prog)
+{
+	rcu_assign_pointer(filter->prog, prog);
+}
+#else
+static inline struct sk_filter *test_filter_detach_prog(struct event_filter *filter)
+{
+	return NULL;
+}
+
+static inline void test_filter_attach_prog(struct event_filter *filter,
+					   struct sk_filter *prog)
+{
+}
+#endif
+
+#define BENCH_CNT ARRAY_SIZE(test_filter_bench)
+#define BENCH_LOOPS 10000
+
+/* average ns per filter_match_preds() call over BENCH_LOOPS calls */
+static __init u64 ftrace_test_filter_time(struct event_filter *filter,
+					  void *rec)
+{
+	u64 start, end;
+	int i;
+
+	preempt_disable();
+	start = local_clock();
+	for (i = 0; i < BENCH_LOOPS; i++)
+		filter_match_preds(filter, rec);
+	end = local_clock();
+	preempt_enable();
+
+	return div_u64(end - start, BENCH_LOOPS);
+}
+
+/*
+ * Check the compiled and the tree walking matcher against each other
+ * on events with mixed field widths, and report the throughput of
+ * both.
+ */
+static __init int ftrace_test_filter_bench(void)
+{
+	struct sk_filter *prog;
+	u64 compiled, walked;
+	int i;
+
+	printk(KERN_INFO "Testing ftrace filter throughput:\n");
+
+	for (i = 0; i < BENCH_CNT; i++) {
+		struct test_filter_bench_t *d = &test_filter_bench[i];
+		struct event_filter *filter = NULL;
+		int err, match;
+
+		err = create_filter(&event_ftrace_test_filter_bench, d->filter,
+				    false, &filter);
+		if (err) {
+			printk(KERN_INFO
+			       "Failed to get filter for '%s', err %d\n",
+			       d->filter, err);
+			__free_filter(filter);
+			return 0;
+		}
+
+		preempt_disable();
+		match = filter_match_preds(filter, &d->rec);
+		preempt_enable();
+		compiled = ftrace_test_filter_time(filter, &d->rec);
+
+		prog = test_filter_detach_prog(filter);
+		preempt_disable();
+		err = filter_match_preds(filter, &d->rec);
+		preempt_enable();
+		walked = ftrace_test_filter_time(filter, &d->rec);
+		test_filter_attach_prog(filter, prog);
+		__free_filter(filter);
+
+		if (match != d->match || err != d->match) {
+			printk(KERN_INFO
+			       "Failed to match filter '%s', expected %d, "
+			       "got %d compiled, %d walked\n",
+			       d->filter, d->match, match, err);
+			return 0;
+		}
+
+		printk(KERN_INFO "  %s: %llu ns %s, %llu ns walked\n",
+		       d->filter, compiled, prog ? "compiled" : "walked",
+		       walked);
+	}
+
+	return 0;
+}
+
 static __init int ftrace_test_event_filter(void)
 {
 	int i;
@@ -2237,6 +2709,7 @@ static __init int ftrace_test_event_filter(void)
 	for (i = 0; i < DATA_CNT; i++) {
 		struct event_filter *filter = NULL;
 		struct test_filter_data_t *d = &test_filter_data[i];
+		struct sk_filter *prog;
 		int err;
 
 		err = create_filter(&event_ftrace_test_filter, d->filter,
@@ -2254,6 +2727,20 @@ static __init int ftrace_test_event_filter(void)
 		 * tests, but the rcu dereference will complain without it.
 		 */
 		preempt_disable();
+		err = filter_match_preds(filter, &d->rec);
+		preempt_enable();
+
+		if (err != d->match) {
+			printk(KERN_INFO
+			       "Failed to match compiled filter '%s', expected %d\n",
+			       d->filter, d->match);
+			__free_filter(filter);
+			break;
+		}
+
+		/* the visit checks below hook the tree walk */
+		prog = test_filter_detach_prog(filter);
+		preempt_disable();
 		if (*d->not_visited)
 			walk_pred_tree(filter->preds, filter->root,
 				       test_walk_pred_cb,
@@ -2263,6 +2750,7 @@ static __init int ftrace_test_event_filter(void)
 		err = filter_match_preds(filter, &d->rec);
 		preempt_enable();
 
+		test_filter_attach_prog(filter, prog);
 		__free_filter(filter);
 
 		if (test_pred_visited) {
@@ -2280,8 +2768,10 @@ static __init int ftrace_test_event_filter(void)
 		}
 	}
 
-	if (i == DATA_CNT)
+	if (i == DATA_CNT) {
 		printk(KERN_CONT "OK\n");
+		ftrace_test_filter_bench();
+	}
 
 	return 0;
 }
@@ -39,6 +39,37 @@ TRACE_EVENT(ftrace_test_filter,
 		  __entry->e, __entry->f, __entry->g, __entry->h)
 );
 
+/*
+ * Mixed field widths and signedness, used to benchmark filter
+ * throughput and to check every load width of compiled filters.
+ */
+TRACE_EVENT(ftrace_test_filter_bench,
+
+	TP_PROTO(u8 prio, s16 nice, u32 pid, s32 delta, u16 flags),
+
+	TP_ARGS(prio, nice, pid, delta, flags),
+
+	TP_STRUCT__entry(
+		__field(u8, prio)
+		__field(s16, nice)
+		__field(u32, pid)
+		__field(s32, delta)
+		__field(u16, flags)
+	),
+
+	TP_fast_assign(
+		__entry->prio = prio;
+		__entry->nice = nice;
+		__entry->pid = pid;
+		__entry->delta = delta;
+		__entry->flags = flags;
+	),
+
+	TP_printk("prio %u, nice %d, pid %u, delta %d, flags %x",
+		  __entry->prio, __entry->nice, __entry->pid,
+		  __entry->delta, __entry->flags)
+);
+
 #endif /* _TRACE_TEST_H || TRACE_HEADER_MULTI_READ */
 
 #undef TRACE_INCLUDE_PATH
@@ -278,7 +278,8 @@ static int pager_deinit(void)
 {
 	int cpu;
 	if (pager.spare != NULL)
-		ring_buffer_free_read_page(pager.tr->buffer, pager.spare);
+		ring_buffer_free_read_page(pager.tr->buffer, pager.cpu,
+					   pager.spare);
 
 	for_each_tracing_cpu(cpu) {
 		atomic_dec(&iter.tr->data[cpu]->disabled);
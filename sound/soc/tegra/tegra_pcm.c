@@ -31,9 +31,15 @@
  */
 
 #include <asm/mach-types.h>
+#include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
@@ -42,27 +48,313 @@
 
 #include "tegra_pcm.h"
 
+/* The APB DMA word count limits one request to 64KB */
+#define TEGRA_PCM_MAX_DMA_SEGMENT	(64 * 1024)
+
+#define TEGRA_PCM_PLAYBACK_BUFFER_BYTES	(PAGE_SIZE * 8)
+
+static unsigned int capture_buffer_kb;
+module_param(capture_buffer_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_buffer_kb,
+		 "Deep capture buffer size in KB, 0 for the default size");
+
+static unsigned int period_timer_us;
+module_param(period_timer_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(period_timer_us,
+		 "Drive periods up to this long from a timer (0 = off)");
+
+struct tegra_pcm_stats {
+	u64 starts;
+	u64 polled_starts;
+	u64 timer_starts;
+	u64 xruns;
+	u64 dma_irqs;
+	u64 timer_ticks;
+	u64 position_reads;
+	u64 since_ns;
+};
+
+/* Per substream counters, kept across open/close */
+struct tegra_pcm_stats_node {
+	struct list_head node;
+	struct snd_pcm_substream *substream;
+	spinlock_t lock;
+	struct tegra_pcm_stats stats;
+	struct dentry *debugfs_dir;
+};
+
+static LIST_HEAD(tegra_pcm_stats_list);
+static DEFINE_MUTEX(tegra_pcm_stats_mutex);
+
+#define tegra_pcm_count(prtd, field)					\
+	do {								\
+		struct tegra_pcm_stats_node *__n = (prtd)->stats;	\
+		unsigned long __flags;					\
+									\
+		if (__n) {						\
+			spin_lock_irqsave(&__n->lock, __flags);		\
+			__n->stats.field++;				\
+			spin_unlock_irqrestore(&__n->lock, __flags);	\
+		}							\
+	} while (0)
+
+#ifdef CONFIG_DEBUG_FS
+static int tegra_pcm_stats_show(struct seq_file *s, void *unused)
+{
+	struct tegra_pcm_stats_node *n = s->private;
+	struct tegra_pcm_stats st;
+	unsigned long flags;
+	u64 elapsed;
+
+	spin_lock_irqsave(&n->lock, flags);
+	st = n->stats;
+	spin_unlock_irqrestore(&n->lock, flags);
+
+	elapsed = ktime_to_ns(ktime_get()) - st.since_ns ? : 1;
+
+	seq_printf(s, "starts          %llu\n", st.starts);
+	seq_printf(s, "polled_starts   %llu\n", st.polled_starts);
+	seq_printf(s, "timer_starts    %llu\n", st.timer_starts);
+	seq_printf(s, "xruns           %llu\n", st.xruns);
+	seq_printf(s, "dma_irqs        %llu\n", st.dma_irqs);
+	seq_printf(s, "timer_ticks     %llu\n", st.timer_ticks);
+	seq_printf(s, "position_reads  %llu\n", st.position_reads);
+	seq_printf(s, "dma_irqs_per_s  %llu\n",
+		   div64_u64(st.dma_irqs * NSEC_PER_SEC, elapsed));
+	return 0;
+}
+
+static int tegra_pcm_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_pcm_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t tegra_pcm_stats_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tegra_pcm_stats_node *n = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&n->lock, flags);
+	memset(&n->stats, 0, sizeof(n->stats));
+	n->stats.since_ns = ktime_to_ns(ktime_get());
+	spin_unlock_irqrestore(&n->lock, flags);
+	return count;
+}
+
+static const struct file_operations tegra_pcm_stats_fops = {
+	.open		= tegra_pcm_stats_open,
+	.read		= seq_read,
+	.write		= tegra_pcm_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_pcm_debugfs_init(struct tegra_pcm_stats_node *n)
+{
+	struct snd_pcm_substream *substream = n->substream;
+	char name[32];
+
+	snprintf(name, sizeof(name), "tegra_pcmC%dD%d%c",
+		 substream->pcm->card->number, substream->pcm->device,
+		 substream->stream == SNDRV_PCM_STREAM_PLAYBACK ? 'p' : 'c');
+	n->debugfs_dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(n->debugfs_dir)) {
+		n->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, n->debugfs_dir,
+			    n, &tegra_pcm_stats_fops);
+}
+
+static void tegra_pcm_debugfs_remove(struct tegra_pcm_stats_node *n)
+{
+	debugfs_remove_recursive(n->debugfs_dir);
+	n->debugfs_dir = NULL;
+}
+#else
+static inline void tegra_pcm_debugfs_init(struct tegra_pcm_stats_node *n)
+{
+}
+
+static inline void tegra_pcm_debugfs_remove(struct tegra_pcm_stats_node *n)
+{
+}
+#endif
+
+static void tegra_pcm_stats_add(struct snd_pcm_substream *substream)
+{
+	struct tegra_pcm_stats_node *n;
+
+	/* Statistics are optional, a failed allocation only loses them */
+	n = kzalloc(sizeof(*n), GFP_KERNEL);
+	if (!n)
+		return;
+
+	n->substream = substream;
+	spin_lock_init(&n->lock);
+	n->stats.since_ns = ktime_to_ns(ktime_get());
+	tegra_pcm_debugfs_init(n);
+
+	mutex_lock(&tegra_pcm_stats_mutex);
+	list_add_tail(&n->node, &tegra_pcm_stats_list);
+	mutex_unlock(&tegra_pcm_stats_mutex);
+}
+
+static void tegra_pcm_stats_del(struct snd_pcm_substream *substream)
+{
+	struct tegra_pcm_stats_node *n, *tmp;
+
+	mutex_lock(&tegra_pcm_stats_mutex);
+	list_for_each_entry_safe(n, tmp, &tegra_pcm_stats_list, node) {
+		if (n->substream != substream)
+			continue;
+		list_del(&n->node);
+		tegra_pcm_debugfs_remove(n);
+		kfree(n);
+	}
+	mutex_unlock(&tegra_pcm_stats_mutex);
+}
+
+static struct tegra_pcm_stats_node *
+tegra_pcm_stats_find(struct snd_pcm_substream *substream)
+{
+	struct tegra_pcm_stats_node *n, *found = NULL;
+
+	mutex_lock(&tegra_pcm_stats_mutex);
+	list_for_each_entry(n, &tegra_pcm_stats_list, node) {
+		if (n->substream == substream) {
+			found = n;
+			break;
+		}
+	}
+	mutex_unlock(&tegra_pcm_stats_mutex);
+	return found;
+}
+
 static const struct snd_pcm_hardware tegra_pcm_hardware = {
 	.info			= SNDRV_PCM_INFO_MMAP |
 				  SNDRV_PCM_INFO_MMAP_VALID |
 				  SNDRV_PCM_INFO_PAUSE |
 				  SNDRV_PCM_INFO_RESUME |
-				  SNDRV_PCM_INFO_INTERLEAVED,
+				  SNDRV_PCM_INFO_INTERLEAVED |
+				  SNDRV_PCM_INFO_NO_PERIOD_WAKEUP,
 	.formats		= SNDRV_PCM_FMTBIT_S8 |
 				  SNDRV_PCM_FMTBIT_S16_LE |
 				  SNDRV_PCM_FMTBIT_S24_LE |
 				  SNDRV_PCM_FMTBIT_S20_3LE |
 				  SNDRV_PCM_FMTBIT_S32_LE,
+	/* multi-slot I2S delivers several mics interleaved in one FIFO */
 	.channels_min		= 1,
-	.channels_max		= 2,
+	.channels_max		= 16,
 	.period_bytes_min	= 128,
-	.period_bytes_max	= PAGE_SIZE * 2,
+	.period_bytes_max	= TEGRA_PCM_MAX_DMA_SEGMENT,
 	.periods_min		= 1,
-	.periods_max		= 8,
-	.buffer_bytes_max	= PAGE_SIZE * 8,
+	.periods_max		= 1024,
+	/* further limited to the preallocated buffer on open */
+	.buffer_bytes_max	= 4 * 1024 * 1024,
 	.fifo_size		= 4,
 };
 
+/*
+ * Pick the largest DMA request that is a whole number of periods and
+ * divides the buffer evenly, so that the DMA interrupt rate no longer
+ * depends on the period size.
+ */
+static unsigned int tegra_pcm_dma_segment(struct snd_pcm_substream *substream)
+{
+	unsigned int buffer_bytes = snd_pcm_lib_buffer_bytes(substream);
+	unsigned int periods = substream->runtime->periods;
+	unsigned int n;
+
+	for (n = 1; n <= periods; n++) {
+		if (periods % n)
+			continue;
+		if (buffer_bytes / n <= TEGRA_PCM_MAX_DMA_SEGMENT)
+			return buffer_bytes / n;
+	}
+
+	return snd_pcm_lib_period_bytes(substream);
+}
+
+static void tegra_pcm_dma_complete(void *arg)
+{
+	struct tegra_runtime_data *prtd = arg;
+
+	tegra_pcm_count(prtd, dma_irqs);
+}
+
+static enum hrtimer_restart tegra_pcm_timer_fn(struct hrtimer *timer)
+{
+	struct tegra_runtime_data *prtd =
+		container_of(timer, struct tegra_runtime_data, timer);
+	struct snd_pcm_substream *substream = prtd->substream;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	tegra_pcm_count(prtd, timer_ticks);
+	snd_pcm_period_elapsed(substream);
+
+	/*
+	 * The trigger callback stops and restarts the timer under the
+	 * stream lock; only rearm if it has not been requeued meanwhile.
+	 */
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	if (prtd->timer_running && !hrtimer_is_queued(timer)) {
+		hrtimer_forward_now(timer, prtd->timer_period);
+		ret = HRTIMER_RESTART;
+	}
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+
+	return ret;
+}
+
+static int tegra_pcm_decoupled_start(struct snd_pcm_substream *substream,
+				     struct tegra_runtime_data *prtd)
+{
+	struct dma_chan *chan = snd_dmaengine_pcm_get_chan(substream);
+	struct dma_async_tx_descriptor *desc;
+
+	prtd->dma_seg_bytes = tegra_pcm_dma_segment(substream);
+	desc = dmaengine_prep_dma_cyclic(chan, substream->runtime->dma_addr,
+			snd_pcm_lib_buffer_bytes(substream),
+			prtd->dma_seg_bytes,
+			snd_pcm_substream_to_dma_direction(substream),
+			DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->callback = tegra_pcm_dma_complete;
+	desc->callback_param = prtd;
+	prtd->cookie = dmaengine_submit(desc);
+	dma_async_issue_pending(chan);
+
+	if (prtd->timed) {
+		prtd->timer_running = 1;
+		hrtimer_start(&prtd->timer, prtd->timer_period,
+			      HRTIMER_MODE_REL);
+		tegra_pcm_count(prtd, timer_starts);
+	} else {
+		tegra_pcm_count(prtd, polled_starts);
+	}
+
+	return 0;
+}
+
+static void tegra_pcm_decoupled_stop(struct snd_pcm_substream *substream,
+				     struct tegra_runtime_data *prtd)
+{
+	/* called under the stream lock, so the timer may not be waited on */
+	prtd->timer_running = 0;
+	hrtimer_try_to_cancel(&prtd->timer);
+
+	dmaengine_terminate_all(snd_dmaengine_pcm_get_chan(substream));
+}
+
 static int tegra_pcm_open(struct snd_pcm_substream *substream)
 {
 	struct snd_soc_pcm_runtime *rtd = substream->private_data;
@@ -80,6 +372,15 @@ static int tegra_pcm_open(struct snd_pcm_substream *substream)
 	/* Set HW params now that initialization is complete */
 	snd_soc_set_runtime_hwparams(substream, &tegra_pcm_hardware);
 
+	ret = snd_pcm_hw_constraint_minmax(substream->runtime,
+		SNDRV_PCM_HW_PARAM_BUFFER_BYTES, 0,
+		substream->dma_buffer.bytes);
+	if (ret < 0) {
+		dev_err(dev, "failed to set constraint %d\n", ret);
+		kfree(prtd);
+		return ret;
+	}
+
 	/* Ensure period size is multiple of 8 */
 	ret = snd_pcm_hw_constraint_step(substream->runtime, 0,
 		SNDRV_PCM_HW_PARAM_PERIOD_BYTES, 0x8);
@@ -96,6 +397,11 @@ static int tegra_pcm_open(struct snd_pcm_substream *substream)
 		return ret;
 	}
 
+	prtd->substream = substream;
+	hrtimer_init(&prtd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	prtd->timer.function = tegra_pcm_timer_fn;
+	prtd->stats = tegra_pcm_stats_find(substream);
+
 	snd_dmaengine_pcm_set_data(substream, prtd);
 
 	return 0;
@@ -112,6 +418,7 @@ static int tegra_pcm_close(struct snd_pcm_substream *substream)
 	tegra_prtd =
 		(struct tegra_runtime_data *)snd_dmaengine_pcm_get_data(
 						substream);
+	hrtimer_cancel(&tegra_prtd->timer);
 	kfree(tegra_prtd);
 
 	snd_dmaengine_pcm_set_data(substream, NULL);
@@ -128,6 +435,8 @@ int tegra_pcm_hw_params(struct snd_pcm_substream *substream,
 	struct dma_chan *chan;
 	struct tegra_pcm_dma_params *dmap;
 	struct dma_slave_config slave_config;
+	struct tegra_runtime_data *prtd;
+	u64 period_ns;
 	int ret;
 
 	if (rtd->dai_link->no_pcm)
@@ -162,6 +471,19 @@ int tegra_pcm_hw_params(struct snd_pcm_substream *substream,
 		return ret;
 	}
 
+	/*
+	 * Streams opened without period wakeups are polled through the
+	 * DMA position; short periods can be paced by a timer instead of
+	 * a DMA interrupt each.
+	 */
+	prtd = snd_dmaengine_pcm_get_data(substream);
+	period_ns = div_u64((u64)params_period_size(params) * NSEC_PER_SEC,
+			    params_rate(params));
+	prtd->polled = !!(params->flags & SNDRV_PCM_HW_PARAMS_NO_PERIOD_WAKEUP);
+	prtd->timed = !prtd->polled && period_timer_us &&
+		period_ns <= (u64)period_timer_us * NSEC_PER_USEC;
+	prtd->timer_period = ns_to_ktime(period_ns);
+
 	snd_pcm_set_runtime_buffer(substream, &substream->dma_buffer);
 	return 0;
 }
@@ -177,6 +499,22 @@ int tegra_pcm_hw_free(struct snd_pcm_substream *substream)
 	return 0;
 }
 
+static int tegra_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct tegra_runtime_data *prtd;
+
+	if (rtd->dai_link->no_pcm)
+		return 0;
+
+	/* Recovering from an overrun or underrun goes through prepare */
+	prtd = snd_dmaengine_pcm_get_data(substream);
+	if (substream->runtime->status->state == SNDRV_PCM_STATE_XRUN)
+		tegra_pcm_count(prtd, xruns);
+
+	return 0;
+}
+
 int tegra_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_soc_pcm_runtime *rtd = substream->private_data;
@@ -200,13 +538,19 @@ int tegra_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	case SNDRV_PCM_TRIGGER_RESUME:
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
 		prtd->running = 1;
+		tegra_pcm_count(prtd, starts);
 		if (prtd->disable_intr) {
 			substream->runtime->dma_addr = prtd->avp_dma_addr;
 			substream->runtime->no_period_wakeup = 1;
 		} else {
-			substream->runtime->no_period_wakeup = 0;
+			substream->runtime->no_period_wakeup = prtd->polled;
 		}
 
+		prtd->decoupled = !prtd->disable_intr &&
+				  (prtd->polled || prtd->timed);
+		if (prtd->decoupled)
+			return tegra_pcm_decoupled_start(substream, prtd);
+
 		return snd_dmaengine_pcm_trigger(substream,
 					SNDRV_PCM_TRIGGER_START);
 
@@ -214,6 +558,10 @@ int tegra_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	case SNDRV_PCM_TRIGGER_SUSPEND:
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
 		prtd->running = 0;
+		if (prtd->decoupled) {
+			tegra_pcm_decoupled_stop(substream, prtd);
+			return 0;
+		}
 
 		return snd_dmaengine_pcm_trigger(substream,
 					SNDRV_PCM_TRIGGER_STOP);
@@ -223,6 +571,32 @@ int tegra_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	return 0;
 }
 
+static snd_pcm_uframes_t tegra_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct tegra_runtime_data *prtd = snd_dmaengine_pcm_get_data(substream);
+	struct dma_tx_state state;
+	enum dma_status status;
+	unsigned int buf_size;
+	unsigned int pos = 0;
+
+	if (!prtd || !prtd->decoupled)
+		return snd_dmaengine_pcm_pointer(substream);
+
+	if (prtd->polled)
+		tegra_pcm_count(prtd, position_reads);
+
+	/* the residue is exact, whatever the DMA segment size */
+	status = dmaengine_tx_status(snd_dmaengine_pcm_get_chan(substream),
+				     prtd->cookie, &state);
+	if (status == DMA_IN_PROGRESS || status == DMA_PAUSED) {
+		buf_size = snd_pcm_lib_buffer_bytes(substream);
+		if (state.residue > 0 && state.residue <= buf_size)
+			pos = buf_size - state.residue;
+	}
+
+	return bytes_to_frames(substream->runtime, pos);
+}
+
 static int tegra_pcm_mmap(struct snd_pcm_substream *substream,
 				struct vm_area_struct *vma)
 {
@@ -244,8 +618,9 @@ static struct snd_pcm_ops tegra_pcm_ops = {
 	.ioctl		= snd_pcm_lib_ioctl,
 	.hw_params	= tegra_pcm_hw_params,
 	.hw_free	= tegra_pcm_hw_free,
+	.prepare	= tegra_pcm_prepare,
 	.trigger	= tegra_pcm_trigger,
-	.pointer	= snd_dmaengine_pcm_pointer,
+	.pointer	= tegra_pcm_pointer,
 	.mmap		= tegra_pcm_mmap,
 };
 
@@ -283,6 +658,8 @@ static int tegra_pcm_preallocate_dma_buffer(struct snd_pcm *pcm,
 	buf->dev.dev = pcm->card->dev;
 	buf->bytes = size;
 
+	tegra_pcm_stats_add(substream);
+
 	return 0;
 }
 
@@ -298,6 +675,8 @@ void tegra_pcm_deallocate_dma_buffer(struct snd_pcm *pcm, int stream)
 	if (!substream)
 		return;
 
+	tegra_pcm_stats_del(substream);
+
 	buf = &substream->dma_buffer;
 	if (!buf->area)
 		return;
@@ -324,6 +703,7 @@ int tegra_pcm_dma_allocate(struct snd_soc_pcm_runtime *rtd, size_t size)
 {
 	struct snd_card *card = rtd->card->snd_card;
 	struct snd_pcm *pcm = rtd->pcm;
+	size_t capture_size;
 	int ret = 0;
 
 	if (!card->dev->dma_mask)
@@ -340,9 +720,12 @@ int tegra_pcm_dma_allocate(struct snd_soc_pcm_runtime *rtd, size_t size)
 	}
 
 	if (pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream) {
+		/* deep-buffer capture users opt in with capture_buffer_kb */
+		capture_size = max_t(size_t, size,
+				     PAGE_ALIGN(capture_buffer_kb * 1024));
 		ret = tegra_pcm_preallocate_dma_buffer(pcm,
 						SNDRV_PCM_STREAM_CAPTURE,
-						size);
+						capture_size);
 		if (ret)
 			goto err_free_play;
 	}
@@ -358,7 +741,7 @@ err:
 int tegra_pcm_new(struct snd_soc_pcm_runtime *rtd)
 {
 	return tegra_pcm_dma_allocate(rtd ,
-					tegra_pcm_hardware.buffer_bytes_max);
+					TEGRA_PCM_PLAYBACK_BUFFER_BYTES);
 }
 
 void tegra_pcm_free(struct snd_pcm *pcm)
@@ -31,6 +31,8 @@
 #ifndef __TEGRA_PCM_H__
 #define __TEGRA_PCM_H__
 
+#include <linux/dmaengine.h>
+#include <linux/hrtimer.h>
 #include <linux/nvmap.h>
 
 #define MAX_DMA_REQ_COUNT 2
@@ -51,10 +53,26 @@ struct tegra_smmu_data {
 };
 #endif
 
+struct tegra_pcm_stats_node;
+
 struct tegra_runtime_data {
 	int running;
 	int disable_intr;
 	dma_addr_t avp_dma_addr;
+	/*
+	 * Period-less (polled) and timer driven streams run the DMA in
+	 * segments of several periods instead of one interrupt per period.
+	 */
+	struct snd_pcm_substream *substream;
+	int polled;
+	int timed;
+	int decoupled;
+	dma_cookie_t cookie;
+	unsigned int dma_seg_bytes;
+	struct hrtimer timer;
+	ktime_t timer_period;
+	int timer_running;
+	struct tegra_pcm_stats_node *stats;
 };
 
 int tegra_pcm_platform_register(struct device *dev);
@@ -0,0 +1,447 @@
+/*
+ * binder_bench: binder transaction throughput and latency benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * A server process registers itself as the context manager and answers
+ * every transaction sent to handle 0 from a pool of looper threads. A
+ * number of client processes then hammer it with transactions and report
+ * throughput and a latency histogram.
+ *
+ * Becoming the context manager fails if servicemanager is running, so
+ * run this on a system where it is stopped. Build with
+ * CFLAGS=-DBINDER_IPC_32BIT if the kernel uses the 32-bit binder ABI.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#include "binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(1024 * 1024)
+#define NR_BUCKETS	32	/* log2(ns) latency buckets */
+
+struct bench_result {
+	unsigned long count;
+	unsigned long errors;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	unsigned long hist[NR_BUCKETS];
+};
+
+struct binder_cmd_txn {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct binder_cmd_free_reply {
+	uint32_t free_cmd;
+	binder_uintptr_t buffer;
+	uint32_t reply_cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct binder_cmd_free {
+	uint32_t cmd;
+	binder_uintptr_t buffer;
+} __attribute__((packed));
+
+static int opt_clients = 1;
+static int opt_threads = 4;
+static unsigned long opt_iterations = 10000;
+static size_t opt_size = 64;
+static int opt_oneway;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int binder_open_dev(void)
+{
+	int fd;
+	void *map;
+
+	fd = open(BINDER_DEV, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open " BINDER_DEV);
+		exit(1);
+	}
+	map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return fd;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (binder_uintptr_t)(uintptr_t)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (binder_uintptr_t)(uintptr_t)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return ret;
+}
+
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	uint32_t cmd = BC_ENTER_LOOPER;
+	uint32_t rbuf[256];
+	struct binder_cmd_free_reply out;
+
+	if (binder_write_read(fd, &cmd, sizeof(cmd), NULL, 0, NULL) < 0) {
+		perror("BC_ENTER_LOOPER");
+		exit(1);
+	}
+
+	for (;;) {
+		size_t consumed;
+		char *ptr, *end;
+
+		if (binder_write_read(fd, NULL, 0, rbuf, sizeof(rbuf),
+				      &consumed) < 0) {
+			perror("server read");
+			exit(1);
+		}
+		ptr = (char *)rbuf;
+		end = ptr + consumed;
+		while (ptr < end) {
+			struct binder_transaction_data *tr;
+			size_t wsize;
+
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			if (cmd != BR_TRANSACTION) {
+				/* everything else is acknowledged by size */
+				ptr += _IOC_SIZE(cmd);
+				continue;
+			}
+			tr = (struct binder_transaction_data *)ptr;
+			ptr += sizeof(*tr);
+
+			memset(&out, 0, sizeof(out));
+			out.free_cmd = BC_FREE_BUFFER;
+			out.buffer = tr->data.ptr.buffer;
+			wsize = sizeof(out.free_cmd) + sizeof(out.buffer);
+			if (!(tr->flags & TF_ONE_WAY)) {
+				out.reply_cmd = BC_REPLY;
+				wsize = sizeof(out);
+			}
+			if (binder_write_read(fd, &out, wsize, NULL, 0,
+					      NULL) < 0) {
+				perror("server reply");
+				exit(1);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void run_server(int ready_fd)
+{
+	pthread_t thread;
+	int fd, i;
+	char c = 0;
+
+	fd = binder_open_dev();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+		exit(1);
+	}
+	for (i = 1; i < opt_threads; i++) {
+		if (pthread_create(&thread, NULL, server_thread,
+				   (void *)(long)fd)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (write(ready_fd, &c, 1) != 1)
+		exit(1);
+	close(ready_fd);
+	server_thread((void *)(long)fd);
+}
+
+static int bucket_of(uint64_t ns)
+{
+	int b = 0;
+
+	while (ns >>= 1)
+		b++;
+	return b < NR_BUCKETS ? b : NR_BUCKETS - 1;
+}
+
+static void run_client(int result_fd)
+{
+	struct binder_cmd_txn txn;
+	struct binder_cmd_free release;
+	struct bench_result res;
+	uint32_t rbuf[128];
+	char *payload;
+	unsigned long i;
+	int fd;
+
+	fd = binder_open_dev();
+	payload = calloc(1, opt_size ? opt_size : 1);
+	if (!payload)
+		exit(1);
+
+	memset(&res, 0, sizeof(res));
+	res.min_ns = UINT64_MAX;
+	memset(&txn, 0, sizeof(txn));
+	txn.cmd = BC_TRANSACTION;
+	txn.tr.target.handle = 0;
+	txn.tr.flags = opt_oneway ? TF_ONE_WAY : 0;
+	txn.tr.data_size = opt_size;
+	txn.tr.data.ptr.buffer = (binder_uintptr_t)(uintptr_t)payload;
+
+	for (i = 0; i < opt_iterations; i++) {
+		uint64_t start = now_ns(), delta;
+		int done = 0, failed = 0;
+		void *wbuf = &txn;
+		size_t wsize = sizeof(txn);
+
+		while (!done) {
+			size_t consumed;
+			char *ptr, *end;
+
+			if (binder_write_read(fd, wbuf, wsize, rbuf,
+					      sizeof(rbuf), &consumed) < 0) {
+				perror("client transaction");
+				exit(1);
+			}
+			wbuf = NULL;
+			wsize = 0;
+			ptr = (char *)rbuf;
+			end = ptr + consumed;
+			while (ptr < end) {
+				uint32_t cmd;
+
+				memcpy(&cmd, ptr, sizeof(cmd));
+				ptr += sizeof(cmd);
+				switch (cmd) {
+				case BR_TRANSACTION_COMPLETE:
+					if (opt_oneway)
+						done = 1;
+					break;
+				case BR_REPLY: {
+					struct binder_transaction_data *tr;
+
+					tr = (void *)ptr;
+					release.cmd = BC_FREE_BUFFER;
+					release.buffer = tr->data.ptr.buffer;
+					if (binder_write_read(fd, &release,
+							sizeof(release), NULL,
+							0, NULL) < 0) {
+						perror("client free");
+						exit(1);
+					}
+					done = 1;
+					break;
+				}
+				case BR_DEAD_REPLY:
+				case BR_FAILED_REPLY:
+				case BR_ERROR:
+					failed = 1;
+					done = 1;
+					break;
+				default:
+					break;
+				}
+				ptr += _IOC_SIZE(cmd);
+			}
+		}
+		delta = now_ns() - start;
+		if (failed) {
+			res.errors++;
+			continue;
+		}
+		res.count++;
+		res.total_ns += delta;
+		if (delta < res.min_ns)
+			res.min_ns = delta;
+		if (delta > res.max_ns)
+			res.max_ns = delta;
+		res.hist[bucket_of(delta)]++;
+	}
+
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+	exit(0);
+}
+
+static uint64_t percentile(struct bench_result *res, unsigned int pct)
+{
+	unsigned long want = (res->count * pct + 99) / 100;
+	unsigned long seen = 0;
+	int b;
+
+	for (b = 0; b < NR_BUCKETS; b++) {
+		seen += res->hist[b];
+		if (seen >= want)
+			return 1ULL << (b + 1);
+	}
+	return res->max_ns;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"Usage: %s [options]\n"
+"  -c N   client processes (default %d)\n"
+"  -t N   server looper threads (default %d)\n"
+"  -n N   transactions per client (default %lu)\n"
+"  -s N   payload bytes per transaction (default %zu)\n"
+"  -o     one-way transactions\n",
+		prog, opt_clients, opt_threads, opt_iterations, opt_size);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_result total;
+	int ready[2], results[2];
+	pid_t server;
+	uint64_t start, elapsed;
+	char c;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "c:t:n:s:oh")) != -1) {
+		switch (opt) {
+		case 'c':
+			opt_clients = atoi(optarg);
+			break;
+		case 't':
+			opt_threads = atoi(optarg);
+			break;
+		case 'n':
+			opt_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opt_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			opt_oneway = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opt_clients < 1 || opt_threads < 1)
+		usage(argv[0]);
+
+	if (pipe(ready) || pipe(results)) {
+		perror("pipe");
+		return 1;
+	}
+
+	server = fork();
+	if (server < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (server == 0) {
+		close(ready[0]);
+		run_server(ready[1]);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < opt_clients; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			kill(server, SIGKILL);
+			return 1;
+		}
+		if (pid == 0) {
+			close(results[0]);
+			run_client(results[1]);
+		}
+	}
+	close(results[1]);
+
+	memset(&total, 0, sizeof(total));
+	total.min_ns = UINT64_MAX;
+	for (i = 0; i < opt_clients; i++) {
+		struct bench_result res;
+		int b;
+
+		if (read(results[0], &res, sizeof(res)) != sizeof(res)) {
+			fprintf(stderr, "client %d died\n", i);
+			continue;
+		}
+		total.count += res.count;
+		total.errors += res.errors;
+		total.total_ns += res.total_ns;
+		if (res.count && res.min_ns < total.min_ns)
+			total.min_ns = res.min_ns;
+		if (res.max_ns > total.max_ns)
+			total.max_ns = res.max_ns;
+		for (b = 0; b < NR_BUCKETS; b++)
+			total.hist[b] += res.hist[b];
+	}
+	elapsed = now_ns() - start;
+	kill(server, SIGKILL);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	printf("%s transactions: %lu ok, %lu failed, %d clients, %d server threads, %zu bytes\n",
+	       opt_oneway ? "one-way" : "sync", total.count, total.errors,
+	       opt_clients, opt_threads, opt_size);
+	if (!total.count)
+		return 1;
+	printf("throughput: %.0f transactions/s\n",
+	       total.count * 1e9 / elapsed);
+	printf("latency ns: avg %llu min %llu max %llu p50 <%llu p99 <%llu\n",
+	       (unsigned long long)(total.total_ns / total.count),
+	       (unsigned long long)total.min_ns,
+	       (unsigned long long)total.max_ns,
+	       (unsigned long long)percentile(&total, 50),
+	       (unsigned long long)percentile(&total, 99));
+	return 0;
+}